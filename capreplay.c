@@ -0,0 +1,330 @@
+/**
+ * Sends a capture (see capture.h) to a server
+ * again, connection by connection and frame by
+ * frame, at the pace it was captured, a number
+ * of times faster, or as fast as the server
+ * takes it. Whatever the server sends back is
+ * read and thrown away, so that it never waits
+ * for the replay to read.
+ *
+ * A connection of the capture is opened when
+ * its first record comes (the capture may have
+ * started after it connected) and closed with
+ * its CP_CLOSE; those left are closed at the end.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "capture.h"
+
+#define LINGER_SECONDS 1.0 // reading what the server still sends, at the end
+#define MAX_EVENTS 64
+
+typedef struct {
+    char const* host;
+    unsigned short port;
+    double speed; // 0: as fast as possible
+} ReplayConfig;
+
+typedef struct {
+    uint64_t connectionId;
+    int fd; // -1: could not connect; its frames are skipped
+    bool used;
+} Connection;
+
+typedef struct {
+    unsigned long numConnections;
+    unsigned long numConnectFailures;
+    unsigned long numFrames;
+    unsigned long numFramesSkipped;
+    uint64_t numBytesSent;
+    uint64_t numBytesReceived;
+    double maxLateness; // seconds behind the capture's pace
+} ReplayStats;
+
+Connection* connections = NULL; // open addressing, by connection ID
+size_t connectionCapacity = 0;
+size_t numConnections = 0;
+int epollFd = -1;
+ReplayStats stats;
+
+double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+Connection* findConnection(uint64_t connectionId) {
+    if (connectionCapacity == 0) return NULL;
+    size_t i = (size_t)(connectionId * 0x9E3779B97F4A7C15ull) & (connectionCapacity - 1);
+    for (; connections[i].used; i = (i + 1) & (connectionCapacity - 1)) {
+        if (connections[i].connectionId == connectionId) return &connections[i];
+    }
+    return NULL;
+}
+
+/** Returns NULL if out of memory. */
+Connection* addConnection(uint64_t connectionId) {
+    if (2 * (numConnections + 1) > connectionCapacity) {
+        size_t oldCapacity = connectionCapacity;
+        Connection* old = connections;
+        size_t capacity = oldCapacity ? 2 * oldCapacity : 64;
+        connections = (Connection*)calloc(capacity, sizeof(Connection));
+        if (connections == NULL) {
+            connections = old;
+            return NULL;
+        }
+        connectionCapacity = capacity;
+        numConnections = 0;
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (old[i].used) *addConnection(old[i].connectionId) = old[i];
+        }
+        free((void*)old);
+    }
+    size_t i = (size_t)(connectionId * 0x9E3779B97F4A7C15ull) & (connectionCapacity - 1);
+    while (connections[i].used) i = (i + 1) & (connectionCapacity - 1);
+    connections[i].used = true;
+    connections[i].connectionId = connectionId;
+    connections[i].fd = -1;
+    ++numConnections;
+    return &connections[i];
+}
+
+/** Backward shift deletion, so that no lookup stops short. */
+void removeConnection(Connection* connection) {
+    size_t hole = (size_t)(connection - connections);
+    size_t i = hole;
+    connections[hole].used = false;
+    --numConnections;
+    for (;;) {
+        i = (i + 1) & (connectionCapacity - 1);
+        if (!connections[i].used) return;
+        size_t home = (size_t)(connections[i].connectionId * 0x9E3779B97F4A7C15ull) & (connectionCapacity - 1);
+        // Move it into the hole unless its home lies between the hole and it.
+        bool stays = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+            connections[hole] = connections[i];
+            connections[i].used = false;
+            hole = i;
+        }
+    }
+}
+
+void closeConnection(Connection* connection) {
+    if (connection->fd >= 0) close(connection->fd); // leaves the epoll set with it
+    removeConnection(connection);
+}
+
+int connectToServer(ReplayConfig const* config) {
+    struct sockaddr_in addr;
+    memset((void*)&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config->port);
+    if (inet_pton(AF_INET, config->host, &addr.sin_addr) != 1) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || fcntl(fd, F_SETFL, O_NONBLOCK) != 0
+    ) {
+        close(fd);
+        return -1;
+    }
+    struct epoll_event event = { EPOLLIN, { .fd = fd } };
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    return fd;
+}
+
+/** Reads and throws away what the server sent, waiting for it for up to `timeoutMs`. */
+void drainReplies(int timeoutMs) {
+    static char sink[64 * 1024];
+    struct epoll_event events[MAX_EVENTS];
+    int numEvents = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+    for (int i = 0; i < numEvents; ++i) {
+        ssize_t numRead;
+        while ((numRead = recv(events[i].data.fd, sink, sizeof(sink), 0)) > 0) {
+            stats.numBytesReceived += numRead;
+        }
+        if (numRead == 0) {
+            // Disconnected by the server: what is still to send to it fails.
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+            shutdown(events[i].data.fd, SHUT_RD);
+        }
+    }
+}
+
+/** Returns false if the connection is broken. */
+bool sendFrame(int fd, unsigned char const* bytes, size_t numBytes) {
+    while (numBytes > 0) {
+        ssize_t numSent = send(fd, bytes, numBytes, MSG_NOSIGNAL);
+        if (numSent < 0 && errno == EINTR) continue;
+        if (numSent < 0 && errno == EAGAIN) {
+            // The server is not reading; keep reading what it sends meanwhile.
+            drainReplies(0);
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            poll(&pfd, 1, 10);
+            continue;
+        }
+        if (numSent <= 0) return false;
+        stats.numBytesSent += numSent;
+        bytes += numSent;
+        numBytes -= numSent;
+    }
+    return true;
+}
+
+/** Returns false if out of memory. */
+bool replayRecord(CpReader const* reader, ReplayConfig const* config) {
+    Connection* connection = findConnection(reader->connectionId);
+    if (reader->kind == CP_CLOSE) {
+        if (connection != NULL) closeConnection(connection);
+        return true;
+    }
+    if (connection != NULL && reader->kind == CP_OPEN) {
+        closeConnection(connection); // its ID was given again
+        connection = NULL;
+    }
+    if (connection == NULL) {
+        connection = addConnection(reader->connectionId);
+        if (connection == NULL) return false;
+        connection->fd = connectToServer(config);
+        if (connection->fd >= 0) {
+            ++stats.numConnections;
+        } else {
+            ++stats.numConnectFailures;
+        }
+    }
+    if (reader->kind != CP_FRAME) return true;
+
+    if (connection->fd < 0) {
+        ++stats.numFramesSkipped;
+    } else if (!sendFrame(connection->fd, reader->frame, reader->numBytes)) {
+        ++stats.numFramesSkipped;
+        close(connection->fd);
+        connection->fd = -1;
+    } else {
+        ++stats.numFrames;
+    }
+    return true;
+}
+
+void printUsage(char const* programName) {
+    printf("Usage: %s [OPTION]... FILE\n", programName);
+    printf("Sends the frames captured in FILE (server --capture=FILE) to a server again.\n");
+    printf("\n");
+    printf("  --host=ADDRESS                  IPv4 address of the server (default: 127.0.0.1)\n");
+    printf("  --port=PORT                     (default: 12345)\n");
+    printf("  --speed=FACTOR                  1 for the pace captured, 2 for twice as fast...,\n");
+    printf("                                  0 for as fast as the server takes it (default: 1)\n");
+}
+
+bool parseCommandLine(int argc, char* argv[], ReplayConfig* config, char const** capturePath) {
+    config->host = "127.0.0.1";
+    config->port = 12345;
+    config->speed = 1;
+
+    static struct option const longOptions[] = {
+        { "host",  required_argument, NULL, 'a' },
+        { "port",  required_argument, NULL, 'p' },
+        { "speed", required_argument, NULL, 's' },
+        { "help",  no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'a': config->host = optarg; break;
+            case 'p': config->port = (unsigned short)atoi(optarg); break;
+            case 's': config->speed = atof(optarg); break;
+            default:
+                printUsage(argv[0]);
+                return false;
+        }
+    }
+    if (optind != argc - 1 || config->port == 0 || config->speed < 0) {
+        printUsage(argv[0]);
+        return false;
+    }
+    *capturePath = argv[optind];
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    ReplayConfig config;
+    char const* capturePath;
+    if (!parseCommandLine(argc, argv, &config, &capturePath)) {
+        return 1;
+    }
+    CpReader reader;
+    if (!cpOpen(&reader, capturePath)) {
+        printf("error: %s is not a capture\n", capturePath);
+        return 1;
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        printf("error: epoll_create1() failed: %s\n", strerror(errno));
+        cpClose(&reader);
+        return 1;
+    }
+
+    int retval = 0;
+    int readStatus;
+    double startedAt = monotonicSeconds();
+    while ((readStatus = cpNext(&reader)) == 1) {
+        if (config.speed > 0) {
+            double due = startedAt + (double)reader.time / 1e6 / config.speed;
+            double now;
+            while ((now = monotonicSeconds()) < due) {
+                drainReplies((int)((due - now) * 1000) + 1);
+            }
+            if (now - due > stats.maxLateness) stats.maxLateness = now - due;
+        } else {
+            drainReplies(0);
+        }
+        if (!replayRecord(&reader, &config)) {
+            printf("error: out of memory\n");
+            retval = 1;
+            break;
+        }
+    }
+    if (readStatus < 0) {
+        printf("warning: the capture is cut short or corrupt; replayed up to there\n");
+    }
+    double seconds = monotonicSeconds() - startedAt;
+
+    for (double lingerUntil = monotonicSeconds() + LINGER_SECONDS; monotonicSeconds() < lingerUntil; ) {
+        drainReplies(10);
+    }
+    for (size_t i = 0; i < connectionCapacity; ++i) {
+        if (connections[i].used && connections[i].fd >= 0) close(connections[i].fd);
+    }
+    free((void*)connections);
+    close(epollFd);
+    cpClose(&reader);
+
+    printf("%lu frame(s), %llu bytes, sent in %.3fs (%.0f frames/s) over %lu connection(s)\n",
+        stats.numFrames, (unsigned long long)stats.numBytesSent, seconds,
+        (seconds > 0) ? stats.numFrames / seconds : 0.0, stats.numConnections
+    );
+    printf("%lu connection(s) failed, %lu frame(s) not sent; %llu bytes received\n",
+        stats.numConnectFailures, stats.numFramesSkipped, (unsigned long long)stats.numBytesReceived
+    );
+    if (config.speed > 0) {
+        printf("at most %.3fs behind the pace captured\n", stats.maxLateness);
+    }
+    return retval;
+}
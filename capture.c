@@ -0,0 +1,276 @@
+/**
+ * A buffer that would put the writer too far
+ * behind is dropped whole; the time of the next
+ * record is then counted from the last record
+ * kept, so that the gap shows in the capture.
+ */
+
+#include "capture.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#define CP_MAX_VARINT 10 // bytes of a 64-bit varint
+#define CP_HAND_OVER_AFTER 1000000 // microseconds
+
+struct _CpBuffer {
+    CpBuffer* next;
+    uint64_t since;   // the time the first record is counted from
+    unsigned long numRecords;
+    size_t length;
+    unsigned char bytes[CP_BUFFER_BYTES];
+};
+
+static uint64_t cpMicroseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static size_t cpPutVarint(unsigned char* out, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (unsigned char)value;
+    return length;
+}
+
+static bool cpWriteAll(int fd, void const* bytes, size_t numBytes) {
+    char const* pos = (char const*)bytes;
+    while (numBytes > 0) {
+        ssize_t numWritten = write(fd, pos, numBytes);
+        if (numWritten < 0 && errno == EINTR) continue;
+        if (numWritten <= 0) return false;
+        pos += numWritten;
+        numBytes -= numWritten;
+    }
+    return true;
+}
+
+static void* cpWriterMain(void* arg) {
+    Capture* cap = (Capture*)arg;
+    bool failed = false;
+    for (;;) {
+        pthread_mutex_lock(&cap->mutex);
+        while (cap->queue == NULL && !cap->stopping) {
+            pthread_cond_wait(&cap->queued, &cap->mutex);
+        }
+        CpBuffer* batch = cap->queue;
+        cap->queue = cap->queueTail = NULL;
+        pthread_mutex_unlock(&cap->mutex);
+        if (batch == NULL) return NULL;
+
+        while (batch != NULL) {
+            CpBuffer* next = batch->next;
+            if (!failed && !cpWriteAll(cap->fd, batch->bytes, batch->length)) failed = true;
+            pthread_mutex_lock(&cap->mutex);
+            cap->numPending -= batch->length;
+            cap->stats.failed = failed;
+            pthread_mutex_unlock(&cap->mutex);
+            free((void*)batch);
+            batch = next;
+        }
+    }
+}
+
+/**
+ * The file is created: never written over, as
+ * it may be the capture of a server being taken
+ * over from. Returns false if it can not be, or
+ * if no thread could be started.
+ */
+bool cpInit(Capture* cap, char const* path) {
+    memset((void*)cap, 0, sizeof(*cap));
+    cap->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (cap->fd < 0) return false;
+    if (!cpWriteAll(cap->fd, CP_MAGIC, sizeof(CP_MAGIC) - 1)) {
+        close(cap->fd);
+        cap->fd = -1;
+        return false;
+    }
+    cap->lastRecordAt = cpMicroseconds();
+    pthread_mutex_init(&cap->mutex, NULL);
+    pthread_cond_init(&cap->queued, NULL);
+
+    // Signals are for the event loop: they must interrupt its poll().
+    sigset_t allSignals, callerSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &callerSignals);
+    bool started = (pthread_create(&cap->writer, NULL, cpWriterMain, (void*)cap) == 0);
+    pthread_sigmask(SIG_SETMASK, &callerSignals, NULL);
+    if (!started) {
+        pthread_mutex_destroy(&cap->mutex);
+        pthread_cond_destroy(&cap->queued);
+        close(cap->fd);
+        cap->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void cpHandOver(Capture* cap) {
+    CpBuffer* buffer = cap->filling;
+    cap->filling = NULL;
+    buffer->next = NULL;
+    pthread_mutex_lock(&cap->mutex);
+    if (cap->numPending + buffer->length > CP_MAX_PENDING || cap->stats.failed) {
+        pthread_mutex_unlock(&cap->mutex);
+        cap->stats.numRecords -= buffer->numRecords;
+        cap->stats.numBytes -= buffer->length;
+        cap->stats.numDropped += buffer->numRecords;
+        cap->lastRecordAt = buffer->since;
+        free((void*)buffer);
+        return;
+    }
+    cap->numPending += buffer->length;
+    if (cap->queueTail != NULL) {
+        cap->queueTail->next = buffer;
+    } else {
+        cap->queue = buffer;
+    }
+    cap->queueTail = buffer;
+    pthread_cond_signal(&cap->queued);
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+void cpDestroy(Capture* cap) {
+    if (cap->fd < 0) return;
+    if (cap->filling != NULL) cpHandOver(cap);
+    pthread_mutex_lock(&cap->mutex);
+    cap->stopping = true;
+    pthread_cond_signal(&cap->queued);
+    pthread_mutex_unlock(&cap->mutex);
+    pthread_join(cap->writer, NULL);
+    pthread_mutex_destroy(&cap->mutex);
+    pthread_cond_destroy(&cap->queued);
+    close(cap->fd);
+    cap->fd = -1;
+}
+
+/** `frame` and `numBytes` for CP_FRAME only; a frame longer than a buffer is dropped. */
+void cpRecord(Capture* cap, CpKind kind, uint64_t connectionId, void const* frame, size_t numBytes) {
+    if (cap->fd < 0) return;
+    uint64_t now = cpMicroseconds();
+    size_t maxRecordBytes = 1 + 3 * CP_MAX_VARINT + numBytes;
+    if (maxRecordBytes > CP_BUFFER_BYTES) {
+        ++cap->stats.numDropped;
+        return;
+    }
+    if (cap->filling != NULL
+        && (cap->filling->length + maxRecordBytes > CP_BUFFER_BYTES || now - cap->fillingSince >= CP_HAND_OVER_AFTER)
+    ) {
+        cpHandOver(cap);
+    }
+    if (cap->filling == NULL) {
+        cap->filling = (CpBuffer*)malloc(sizeof(CpBuffer));
+        if (cap->filling == NULL) {
+            ++cap->stats.numDropped;
+            return;
+        }
+        cap->filling->since = cap->lastRecordAt;
+        cap->filling->numRecords = 0;
+        cap->filling->length = 0;
+        cap->fillingSince = now;
+    }
+
+    CpBuffer* buffer = cap->filling;
+    unsigned char* out = buffer->bytes + buffer->length;
+    size_t length = 0;
+    out[length++] = (unsigned char)kind;
+    length += cpPutVarint(out + length, connectionId);
+    length += cpPutVarint(out + length, now - cap->lastRecordAt);
+    if (kind == CP_FRAME) {
+        length += cpPutVarint(out + length, numBytes);
+        memcpy((void*)(out + length), frame, numBytes);
+        length += numBytes;
+    }
+    buffer->length += length;
+    ++buffer->numRecords;
+    ++cap->stats.numRecords;
+    cap->stats.numBytes += length;
+    cap->lastRecordAt = now;
+}
+
+CpStats cpGetStats(Capture* cap) {
+    CpStats stats = cap->stats;
+    if (cap->fd < 0) return stats;
+    pthread_mutex_lock(&cap->mutex);
+    stats.failed = cap->stats.failed;
+    pthread_mutex_unlock(&cap->mutex);
+    return stats;
+}
+
+/////////////// READING ///////////////
+
+bool cpOpen(CpReader* reader, char const* path) {
+    memset((void*)reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) return false;
+    char magic[sizeof(CP_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), reader->file) != sizeof(magic) || memcmp(magic, CP_MAGIC, sizeof(magic)) != 0) {
+        fclose(reader->file);
+        reader->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+static bool cpGetVarint(FILE* file, uint64_t* valuePtr) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(file);
+        if (c == EOF) return false;
+        value |= (uint64_t)(c & 0x7F) << shift;
+        if ((c & 0x80) == 0) {
+            *valuePtr = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reads the next record into the reader.
+ * Returns 1 if there was one, 0 at the end of
+ * the capture, -1 if it is cut short or corrupt
+ * (or out of memory).
+ */
+int cpNext(CpReader* reader) {
+    int kind = getc(reader->file);
+    if (kind == EOF) return 0;
+    uint64_t delta;
+    if ((kind != CP_OPEN && kind != CP_FRAME && kind != CP_CLOSE)
+        || !cpGetVarint(reader->file, &reader->connectionId)
+        || !cpGetVarint(reader->file, &delta)
+    ) {
+        return -1;
+    }
+    reader->kind = (CpKind)kind;
+    reader->time += delta;
+    reader->numBytes = 0;
+    if (kind != CP_FRAME) return 1;
+
+    uint64_t numBytes;
+    if (!cpGetVarint(reader->file, &numBytes) || numBytes > CP_BUFFER_BYTES) return -1;
+    if (numBytes > reader->capacity) {
+        unsigned char* frame = (unsigned char*)realloc((void*)reader->frame, numBytes);
+        if (frame == NULL) return -1;
+        reader->frame = frame;
+        reader->capacity = numBytes;
+    }
+    if (fread(reader->frame, 1, numBytes, reader->file) != numBytes) return -1;
+    reader->numBytes = numBytes;
+    return 1;
+}
+
+void cpClose(CpReader* reader) {
+    if (reader->file != NULL) fclose(reader->file);
+    reader->file = NULL;
+    free((void*)reader->frame);
+    reader->frame = NULL;
+}
@@ -0,0 +1,92 @@
+#ifndef Capture_INCLUDED
+#define Capture_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+ * Traffic capture: every frame the clients send
+ * the server, as it came in (after TLS), with
+ * the connection it came on and when, so that
+ * capreplay can send it all again.
+ *
+ * The event loop appends records to a buffer in
+ * memory; once full, or once a record comes a
+ * second after it was started, the buffer is
+ * handed over to a thread of its own, which
+ * writes it out, so that the event loop never
+ * waits for the disk. Records that would
+ * put more than CP_MAX_PENDING bytes behind the
+ * writer are dropped, and counted.
+ *
+ * The file starts with CP_MAGIC, then come the
+ * records, each of them:
+ *   kind           1 byte, a CpKind
+ *   connection ID  varint
+ *   time           varint, in microseconds since
+ *                  the previous record (or since
+ *                  the capture started)
+ *   CP_FRAME only: length in bytes (varint), then
+ *                  the frame, "<len>:<payload>"
+ */
+#define CP_MAGIC "TCPCHAT-CAPTURE-1\n"
+#define CP_BUFFER_BYTES (512 * 1024) // more than any frame
+#define CP_MAX_PENDING (64 * 1024 * 1024)
+
+typedef enum {
+    CP_OPEN = 1,  // a client connected
+    CP_FRAME = 2, // it sent a frame
+    CP_CLOSE = 3  // it disconnected
+} CpKind;
+
+typedef struct {
+    unsigned long numRecords; // written out, or to be
+    uint64_t numBytes;
+    unsigned long numDropped;
+    bool failed;              // could not write: nothing more is
+} CpStats;
+
+typedef struct _CpBuffer CpBuffer;
+
+typedef struct {
+    int fd; // -1: no capture
+    uint64_t lastRecordAt; // microseconds, monotonic
+    CpBuffer* filling;   // by the event loop
+    uint64_t fillingSince;
+
+    // Handed over to the writer:
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    CpBuffer* queue;     // oldest first
+    CpBuffer* queueTail;
+    size_t numPending;   // bytes in the queue
+    bool stopping;
+    pthread_t writer;
+
+    CpStats stats; // by the event loop; `failed` under `mutex`
+} Capture;
+
+bool cpInit(Capture* cap, char const* path);
+void cpDestroy(Capture* cap);
+void cpRecord(Capture* cap, CpKind kind, uint64_t connectionId, void const* frame, size_t numBytes);
+CpStats cpGetStats(Capture* cap);
+
+/** Reads a capture back, one record at a time. */
+typedef struct {
+    FILE* file;
+    CpKind kind;
+    uint64_t connectionId;
+    uint64_t time;       // microseconds since the capture started
+    unsigned char* frame; // CP_FRAME only; valid until the next record
+    size_t numBytes;
+    size_t capacity;
+} CpReader;
+
+bool cpOpen(CpReader* reader, char const* path);
+int cpNext(CpReader* reader);
+void cpClose(CpReader* reader);
+
+#endif // Capture_INCLUDED
@@ -1,4 +1,5 @@
 // Common stuff and ncurses
+#define _GNU_SOURCE // wcwidth()
 #define NCURSES_WIDECHAR 1
 #include <locale.h>
 #include <wchar.h>
@@ -11,31 +12,51 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
 
 // Sockets
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 // Polling
 #include <poll.h>
 
 #include "protocol.h"
+#include "gapbuf.h"
+#include "scrollback.h"
+#include "lklist.h"
+#include "ktls.h"
+#include "shmring.h"
+#include "transfer.h"
 
 // DECLARATIONS
 
-int main();
+int main(int argc, char* argv[]);
 
+void parseCommandLine(int argc, char* argv[]);
 void setupApplication();
 void setupConnection(wchar_t const* const SERVER_IP, unsigned short SERVER_PORT);
+char const* connectToServer();
 void setupChatUI();
+void setupInputEditor(int rows, int cols);
 
 void teardownChatUI();
+void teardownInputEditor();
 void teardownConnection();
 void teardownApplication();
 
+void connectionLost(char const* reason);
+void reconnectIfDue();
+
 void runApplication();
 
 void fatalError(char const* errorMessage);
+void pushChatNotice(wchar_t const* notice);
+void dropTransfers();
+void forgetPendingMessages();
 
 typedef enum {
 	fRed_bBlack = 1, // f=foreground, b=background
@@ -53,33 +74,299 @@ int const NUM_COLOR_PAIRS = ColorPair_UPPER_LIMIT - 1;
 
 #define KEY_CTRL(x) ((x) & 0x1f)
 
-int main() {
+int main(int argc, char* argv[]) {
+	parseCommandLine(argc, argv);
 	setupApplication();
 	runApplication();
 	teardownApplication();
 	return 0;
 }
 
-void string_insert_char(wchar_t* s, size_t pos, wchar_t c) {
-	size_t size = wcslen(s);
-	for (size_t i = size + 1; i > pos; --i) {
-		s[i] = s[i - 1];
+WINDOW* chatHistoryWindow;
+WINDOW* messageInputWindow;
+int sockfd = -1; // -1 while disconnected
+KtContext* tlsContext = NULL; // NULL: plain text
+bool useRings = false; // shared memory rings, through the server's Unix socket
+bool useMulticast = false; // chat messages by multicast, if the server offers it
+wchar_t username[MAX_NAME_LENGTH + 1] = { 0 };
+bool chatUIStarted = false;
+char const* downloadsDirectory = NULL; // files received are only kept if given
+
+/////////////////////////
+////// RECONNECTING /////
+/////////////////////////
+
+/*
+ * When the connection is lost, the client keeps
+ * running and connects again on its own, then
+ * resumes the session: the server sends the
+ * chat messages missed in between. The attempts
+ * are spread out with exponential backoff and
+ * "full jitter" (a random delay between 0 and
+ * the backoff), so that the clients of a server
+ * that went down do not all come back at once.
+ */
+
+#define CONNECT_TIMEOUT_SECONDS 5
+#define RECONNECT_BASE_SECONDS 0.5
+#define RECONNECT_MAX_SECONDS 30
+
+wchar_t serverAddress[MAX_ADDRESS_LENGTH + 1] = { 0 };
+unsigned short serverPort = 0;
+int reconnectAttempts = 0; // since the session was last resumed
+double reconnectAt = 0;
+
+/////////////////////////
+///// CHAT HISTORY //////
+/////////////////////////
+
+/*
+ * Received messages are kept in a Scrollback with a
+ * fixed memory budget, and the history window only
+ * ever draws the rows that are visible. historyTop
+ * is the first visible row, given as a message
+ * sequence number plus a row within that message.
+ * While historyFollowing is set, the view sticks to
+ * the newest message, like a terminal would.
+ *
+ * Messages with an empty sender address are local
+ * notices and are shown without a sender header.
+ *
+ * This user's own chat messages are shown as soon
+ * as they are sent, dimmed until the server
+ * acknowledges them; the acks come in the order
+ * the messages were sent.
+ */
+
+#define CHAT_HISTORY_BUDGET_BYTES (16 * 1024 * 1024)
+
+typedef struct {
+	size_t seq;
+	int row;
+} HistoryPosition;
+
+typedef struct {
+	int row;          // row within the message being laid out
+	int col;
+	bool pendingWrap; // the previous character filled the last column
+	int firstRow;     // rows before this one are not drawn
+	int y;            // window row where firstRow is drawn
+	int maxRows;      // window rows available from y
+	bool draw;
+} HistoryLayout;
+
+Scrollback* chatHistory = NULL;
+HistoryPosition historyTop = { 0, 0 };
+bool historyFollowing = true;
+int historyRows = 0;
+int historyCols = 0;
+
+LK_WANT_VECTOR_TYPE(size_t, Seq_, )
+LkSeq_Vector pendingMessages; // sequence numbers in chatHistory, oldest first
+
+/////////////////////////
+/////// TRANSFERS ///////
+/////////////////////////
+
+/*
+ * A chat message too long for one frame, or a
+ * file sent with /send, goes out one piece at a
+ * time, whenever the connection can take one,
+ * so that the client stays responsive. Only one
+ * goes out at a time; any number come in, one
+ * per sender.
+ */
+
+TrOutgoing outgoing = { 0 };
+TrIncoming* incoming = NULL;
+size_t numIncoming = 0;
+size_t incomingCapacity = 0;
+
+/////////////////////////
+///// INPUT EDITOR //////
+/////////////////////////
+
+/*
+ * The message being typed lives in a gap buffer,
+ * so a keystroke at the cursor costs O(1) however
+ * long the message is. Rendering only ever looks
+ * at the part of the buffer that fits in the input
+ * window: inputViewTop is the buffer index of the
+ * first visible character, and inputShadow holds
+ * what is currently drawn in each cell so that only
+ * the cells that actually changed are redrawn.
+ */
+
+#define INPUT_MESSAGE_MAX_LENGTH 65535
+#define INPUT_CONTINUATION_CELL ((wchar_t)-1) // right half of a double-width character
+
+GapBuffer* inputBuffer = NULL;
+size_t inputViewTop = 0;
+int inputRows = 0;
+int inputCols = 0;
+wchar_t* inputShadow = NULL;
+wchar_t* inputFrame = NULL;
+size_t* inputRowStarts = NULL;
+
+void setupInputEditor(int rows, int cols) {
+	inputRows = rows;
+	inputCols = cols;
+	size_t numCells = (size_t)rows * cols;
+	inputBuffer = gbInit(INPUT_MESSAGE_MAX_LENGTH);
+	inputShadow = (wchar_t*)malloc(numCells * sizeof(inputShadow[0]));
+	inputFrame = (wchar_t*)malloc(numCells * sizeof(inputFrame[0]));
+	inputRowStarts = (size_t*)malloc((size_t)rows * sizeof(inputRowStarts[0]));
+	if (!inputBuffer || !inputShadow || !inputFrame || !inputRowStarts) {
+		fatalError("Not enough memory for the input editor");
+	}
+	for (size_t i = 0; i < numCells; ++i) {
+		inputShadow[i] = L' ';
+	}
+	inputViewTop = 0;
+}
+
+void teardownInputEditor() {
+	if (inputBuffer) gbDestroy(inputBuffer);
+	free((void*)inputShadow);
+	free((void*)inputFrame);
+	free((void*)inputRowStarts);
+	inputBuffer = NULL;
+	inputShadow = inputFrame = NULL;
+	inputRowStarts = NULL;
+}
+
+/**
+ * Number of cells a character takes in the input
+ * window. Non-printable characters are shown as
+ * a single '?' cell, zero-width ones take none.
+ */
+int inputCellWidth(wchar_t c) {
+	int w = wcwidth(c);
+	if (w < 0) return 1;
+	return w;
+}
+
+/**
+ * Moves inputViewTop so that the cursor is visible.
+ * Costs O(distance between the old top and the
+ * cursor), which is bounded by the window size
+ * while typing.
+ */
+void inputScrollToCursor() {
+	size_t cursor = gbCursor(inputBuffer);
+	if (cursor < inputViewTop) {
+		inputViewTop = gbLineStart(inputBuffer, cursor);
+	}
+
+	// Remember where the last inputRows rows started,
+	// so that the top can be moved down to the row that
+	// leaves the cursor on the last visible row.
+	size_t pos = inputViewTop;
+	int row = 0, col = 0;
+	inputRowStarts[0] = pos;
+	while (pos < cursor) {
+		wchar_t c = gbCharAt(inputBuffer, pos);
+		++pos;
+		if (c == L'\n') {
+			++row; col = 0;
+			inputRowStarts[row % inputRows] = pos;
+			continue;
+		}
+		int w = inputCellWidth(c);
+		if (col + w > inputCols) {
+			++row; col = 0;
+			inputRowStarts[row % inputRows] = pos - 1;
+		}
+		col += w;
+		if (col >= inputCols) {
+			++row; col = 0;
+			inputRowStarts[row % inputRows] = pos;
+		}
+	}
+
+	if (row >= inputRows) {
+		inputViewTop = inputRowStarts[(row - inputRows + 1) % inputRows];
 	}
-	s[pos] = c;
 }
 
-void string_delete_char(wchar_t* s, size_t pos) {
-	size_t size = wcslen(s);
-	for (size_t i = pos; i < size; ++i) {
-		s[i] = s[i + 1];
+void renderInput() {
+	inputScrollToCursor();
+
+	size_t numCells = (size_t)inputRows * inputCols;
+	for (size_t i = 0; i < numCells; ++i) {
+		inputFrame[i] = L' ';
 	}
+
+	size_t length = gbLength(inputBuffer);
+	size_t cursor = gbCursor(inputBuffer);
+	int cursorRow = 0, cursorCol = 0;
+	int row = 0, col = 0;
+	for (size_t pos = inputViewTop; row < inputRows && pos <= length; ++pos) {
+		if (pos == cursor) {
+			cursorRow = row;
+			cursorCol = col;
+		}
+		if (pos == length) break;
+
+		wchar_t c = gbCharAt(inputBuffer, pos);
+		if (c == L'\n') {
+			++row; col = 0;
+			continue;
+		}
+		int w = inputCellWidth(c);
+		if (w == 0) continue;
+		if (col + w > inputCols) {
+			++row; col = 0;
+			if (row >= inputRows) break;
+		}
+		wchar_t* cell = inputFrame + (size_t)row * inputCols + col;
+		if (wcwidth(c) < 0) {
+			cell[0] = L'?';
+		} else {
+			cell[0] = c;
+			for (int k = 1; k < w; ++k) {
+				cell[k] = INPUT_CONTINUATION_CELL;
+			}
+		}
+		col += w;
+		if (col >= inputCols) {
+			++row; col = 0;
+		}
+	}
+
+	for (size_t i = 0; i < numCells; ++i) {
+		if (inputFrame[i] == inputShadow[i]) continue;
+		inputShadow[i] = inputFrame[i];
+		if (inputFrame[i] == INPUT_CONTINUATION_CELL) continue;
+		mvwaddnwstr(messageInputWindow, (int)(i / inputCols), (int)(i % inputCols), inputFrame + i, 1);
+	}
+	wmove(messageInputWindow, cursorRow, cursorCol);
+	wrefresh(messageInputWindow);
 }
 
-WINDOW* chatHistoryWindow;
-WINDOW* messageInputWindow;
-int sockfd;
-wchar_t username[MAX_NAME_LENGTH + 1] = { 0 };
-bool chatUIStarted = false;
+void resetInput() {
+	gbClear(inputBuffer);
+	inputViewTop = 0;
+	renderInput();
+}
+
+void inputMoveVertically(bool up) {
+	size_t cursor = gbCursor(inputBuffer);
+	size_t lineStart = gbLineStart(inputBuffer, cursor);
+	size_t offset = cursor - lineStart;
+	if (up) {
+		if (lineStart == 0) return;
+		size_t previousStart = gbLineStart(inputBuffer, lineStart - 1);
+		size_t target = previousStart + offset;
+		gbMoveCursorTo(inputBuffer, target < lineStart - 1 ? target : lineStart - 1);
+	} else {
+		size_t lineEnd = gbLineEnd(inputBuffer, cursor);
+		if (lineEnd == gbLength(inputBuffer)) return;
+		size_t nextEnd = gbLineEnd(inputBuffer, lineEnd + 1);
+		size_t target = lineEnd + 1 + offset;
+		gbMoveCursorTo(inputBuffer, target < nextEnd ? target : nextEnd);
+	}
+}
 
 void setupChatUI() {
 	if (!chatUIStarted) {
@@ -106,10 +393,13 @@ void setupChatUI() {
 		int startY = 0;
 		int startX = 0;
 		chatHistoryWindow = newwin(height, width, startY, startX);
-		scrollok(chatHistoryWindow, true);
-
-		waddwstr(chatHistoryWindow, L"(Press Ctrl-C to exit.)\n");
-		wrefresh(chatHistoryWindow);
+		historyRows = height;
+		historyCols = width;
+		chatHistory = sbInit(CHAT_HISTORY_BUDGET_BYTES);
+		if (!chatHistory) {
+			fatalError("Not enough memory for the chat history");
+		}
+		lkSeq_Init(&pendingMessages);
 
 		height = 3;
 		width = COLS;
@@ -117,15 +407,24 @@ void setupChatUI() {
 		startX = 0;
 		messageInputWindow = newwin(height, width, startY, startX);
 		keypad(messageInputWindow, true);
-		scrollok(messageInputWindow, true);
+		// The editor positions every cell itself; writing
+		// the bottom-right cell must not scroll the window.
+		scrollok(messageInputWindow, false);
 		wtimeout(messageInputWindow, 0);
 		keypad(messageInputWindow, true);
+		setupInputEditor(height, width);
 		chatUIStarted = true;
+
+		pushChatNotice(L"(Press Ctrl-C to exit, Ctrl-N for a new line in your message, PgUp/PgDn to scroll. Type /who to list online users, /nick NAME to change your name, /msg NAME MESSAGE to message one user, /search WORDS to look for past messages, /send FILE to share a file.)");
 	}
 }
 
 void teardownChatUI() {
 	if (chatUIStarted) {
+		teardownInputEditor();
+		sbDestroy(chatHistory);
+		chatHistory = NULL;
+		lkSeq_Destroy(&pendingMessages);
 		delwin(chatHistoryWindow);
 		delwin(messageInputWindow);
 		endwin();
@@ -133,30 +432,150 @@ void teardownChatUI() {
 	}
 }
 
+double monotonicSeconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 void setupConnection(wchar_t const* const SERVER_IP, unsigned short SERVER_PORT) {
 	client_setup();
+	wcsncpy(serverAddress, SERVER_IP, MAX_ADDRESS_LENGTH);
+	serverPort = SERVER_PORT;
+	srand((unsigned)time(NULL) ^ (unsigned)getpid());
+
+	wprintf(L"Connecting to server at %ls:%hu...\n", SERVER_IP, SERVER_PORT);
+	char const* error = connectToServer();
+	if (error != NULL) {
+		fatalError(error);
+	}
+	wprintf(L"Connected.\n");
+	if (useRings) {
+		wprintf(L"Talking through shared memory.\n");
+	} else if (tlsContext != NULL) {
+		wprintf(L"Encrypted with TLS, %ls.\n", ktInUserSpace(sockfd) ? L"in user space" : L"by the kernel");
+	}
+
+	if (useMulticast) {
+		client_wantMulticast();
+	}
+	client_wantAcks();
+	if (client_login(sockfd, username) != SEND_SUCCESS) {
+		fatalError("Could not log in");
+	}
+}
 
-	char SERVER_IP_ASCII[MAX_ADDRESS_LENGTH + 1] = { 0 };
-	wcstombs(SERVER_IP_ASCII, SERVER_IP, MAX_ADDRESS_LENGTH);
+/**
+ * Connects to serverAddress:serverPort, or to
+ * the Unix socket at serverAddress if it is a
+ * path, then sets the shared memory rings up or
+ * does the TLS handshake if asked to, giving up
+ * after CONNECT_TIMEOUT_SECONDS at each step.
+ * Returns NULL, or what went wrong.
+ */
+char const* connectToServer() {
+	char addressAscii[MAX_ADDRESS_LENGTH + 1] = { 0 };
+	wcstombs(addressAscii, serverAddress, MAX_ADDRESS_LENGTH);
+	bool isUnixSocket = (addressAscii[0] == '/');
 
-	struct sockaddr_in addr;
+	union {
+		struct sockaddr any;
+		struct sockaddr_in v4;
+		struct sockaddr_un un;
+	} addr;
+	socklen_t addrLength;
 	memset((void*)&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(SERVER_PORT);
-	inet_pton(AF_INET, SERVER_IP_ASCII, &addr.sin_addr);
+	if (isUnixSocket) {
+		addr.un.sun_family = AF_UNIX;
+		strncpy(addr.un.sun_path, addressAscii, sizeof(addr.un.sun_path) - 1);
+		addrLength = sizeof(addr.un);
+	} else {
+		addr.v4.sin_family = AF_INET;
+		addr.v4.sin_port = htons(serverPort);
+		inet_pton(AF_INET, addressAscii, &addr.v4.sin_addr);
+		addrLength = sizeof(addr.v4);
+	}
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	wprintf(L"Connecting to server at %ls:%hu...\n", SERVER_IP, SERVER_PORT);
-	int connectResult = connect(sockfd, (struct sockaddr*)&addr, sizeof(addr));
+	sockfd = socket(addr.any.sa_family, SOCK_STREAM, 0);
+	// Bounds connect() and the handshake; after that, a
+	// send that takes this long means the connection is gone.
+	struct timeval timeout = { CONNECT_TIMEOUT_SECONDS, 0 };
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	char const* error = NULL;
+	if (connect(sockfd, &addr.any, addrLength) != 0) {
+		error = "Could not connect to server";
+	} else if (useRings) {
+		if (!isUnixSocket) {
+			error = "Shared memory is only offered on the server's Unix socket";
+		} else if (!srConnect(sockfd)) {
+			error = "Could not set shared memory up with the server";
+		}
+	} else if (tlsContext != NULL) {
+		if (!ktStart(tlsContext, sockfd, addressAscii)) {
+			error = "Not enough memory for TLS";
+		} else {
+			double deadline = monotonicSeconds() + CONNECT_TIMEOUT_SECONDS;
+			KtStatus status;
+			do {
+				status = ktHandshake(sockfd);
+			} while (status == KT_IN_PROGRESS && monotonicSeconds() < deadline);
+			if (status != KT_DONE) {
+				error = "TLS handshake failed (is the server's certificate trusted?)";
+			}
+		}
+	}
+	if (error != NULL) {
+		srEnd(sockfd);
+		ktEnd(sockfd);
+		close(sockfd);
+		sockfd = -1;
+	}
+	return error;
+}
 
-	if (connectResult != 0) {
-		fatalError("Could not connect to server");
+/**
+ * Closes the connection and schedules the next
+ * attempt to connect again.
+ */
+void connectionLost(char const* reason) {
+	srEnd(sockfd);
+	ktEnd(sockfd);
+	close(sockfd);
+	sockfd = -1;
+	client_connectionLost();
+	dropTransfers();
+	forgetPendingMessages();
+
+	double backoff = RECONNECT_BASE_SECONDS;
+	for (int i = 0; i < reconnectAttempts && backoff < RECONNECT_MAX_SECONDS; ++i) backoff *= 2;
+	if (backoff > RECONNECT_MAX_SECONDS) backoff = RECONNECT_MAX_SECONDS;
+	double delay = backoff * ((double)rand() / RAND_MAX);
+	++reconnectAttempts;
+	reconnectAt = monotonicSeconds() + delay;
+
+	wchar_t notice[128];
+	swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %s; reconnecting in %.1fs...", reason, delay);
+	pushChatNotice(notice);
+}
+
+void reconnectIfDue() {
+	if (sockfd >= 0 || monotonicSeconds() < reconnectAt) return;
+	char const* error = connectToServer();
+	if (error != NULL) {
+		connectionLost(error);
+	} else if (client_resume(sockfd, username) != SEND_SUCCESS) {
+		connectionLost("Could not log in again");
 	}
-	wprintf(L"Connected.\n");
 }
 
 void teardownConnection() {
-	close(sockfd);
+	if (sockfd >= 0) {
+		srEnd(sockfd);
+		ktEnd(sockfd);
+		close(sockfd);
+	}
+	ktFreeContext(tlsContext);
 
 	client_teardown();
 }
@@ -164,8 +583,7 @@ void teardownConnection() {
 void teardownApplication() {
 	werase(messageInputWindow);
 	wrefresh(messageInputWindow);
-	waddwstr(chatHistoryWindow, L"YOU: <Disconnecting...>");
-	wrefresh(chatHistoryWindow);
+	pushChatNotice(L"YOU: <Disconnecting...>");
 
 	teardownChatUI();
 	teardownConnection();
@@ -184,6 +602,51 @@ void fatalError(char const* errorMessage) {
 	exit(EXIT_FAILURE);
 }
 
+void parseCommandLine(int argc, char* argv[]) {
+	static struct option const longOptions[] = {
+		{ "tls",           no_argument,       NULL, 't' },
+		{ "tls-ca",        required_argument, NULL, 'c' },
+		{ "shared-memory", no_argument,       NULL, 's' },
+		{ "multicast",     no_argument,       NULL, 'm' },
+		{ "downloads",     required_argument, NULL, 'd' },
+		{ "help",          no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	bool useTls = false;
+	char const* caFile = NULL; // NULL: the system's CA certificates
+	int option;
+	while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+		switch (option) {
+			case 't': useTls = true; break;
+			case 'c': useTls = true; caFile = optarg; break;
+			case 's': useRings = true; break;
+			case 'm': useMulticast = true; break;
+			case 'd': downloadsDirectory = optarg; break;
+			default:
+				wprintf(L"Usage: %s [--tls] [--tls-ca=FILE] [--shared-memory] [--multicast] [--downloads=DIR]\n", argv[0]);
+				wprintf(L"  --tls            encrypt the connection, checking the server's certificate\n");
+				wprintf(L"  --tls-ca=FILE    the same, trusting the CA certificates in FILE (PEM)\n");
+				wprintf(L"  --shared-memory  talk through shared memory rather than the socket; for\n");
+				wprintf(L"                   a server on this host, given its Unix socket's path\n");
+				wprintf(L"                   as SERVER IP\n");
+				wprintf(L"  --multicast      get the chat messages by multicast, if the server\n");
+				wprintf(L"                   publishes them on this LAN\n");
+				wprintf(L"  --downloads=DIR  keep the files other users send in DIR\n");
+				exit(option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (useTls && useRings) {
+		fatalError("--shared-memory and TLS do not go together");
+	}
+	if (useTls) {
+		tlsContext = ktClientContext(caFile);
+		if (tlsContext == NULL) {
+			fatalError("Could not load the CA certificates");
+		}
+	}
+}
+
 void setupApplication() {
 	setlocale(LC_ALL, "");
 
@@ -238,147 +701,726 @@ ColorPair getSenderColorPair(wchar_t const* senderName, wchar_t const* senderAdd
 	return colorPair;
 }
 
-void pushChatHistory(wchar_t const* senderName, wchar_t const* senderAddress, unsigned short senderPort, wchar_t const* message) {
-	wattron(chatHistoryWindow, COLOR_PAIR(getSenderColorPair(senderName, senderAddress, senderPort)));
-	waddwstr(chatHistoryWindow, senderName);
-	waddwstr(chatHistoryWindow, L" <");
-	waddwstr(chatHistoryWindow, senderAddress);
-	waddwstr(chatHistoryWindow, L":");
+void layoutHistoryText(HistoryLayout* layout, wchar_t const* s, ColorPair colorPair) {
+	if (layout->draw) {
+		wattrset(chatHistoryWindow, COLOR_PAIR(colorPair));
+	}
+	for (; *s; ++s) {
+		wchar_t c = *s;
+		if (c == L'\n') {
+			++layout->row;
+			layout->col = 0;
+			layout->pendingWrap = false;
+			continue;
+		}
+		int w = wcwidth(c);
+		if (w < 0) {
+			c = L'?';
+			w = 1;
+		}
+		if (w == 0) continue;
+		if (layout->pendingWrap || layout->col + w > historyCols) {
+			++layout->row;
+			layout->col = 0;
+		}
+		layout->pendingWrap = false;
+
+		if (layout->draw) {
+			int y = layout->y + (layout->row - layout->firstRow);
+			if (y >= layout->y + layout->maxRows) return;
+			if (layout->row >= layout->firstRow) {
+				mvwaddnwstr(chatHistoryWindow, y, layout->col, &c, 1);
+			}
+		}
+
+		layout->col += w;
+		if (layout->col >= historyCols) {
+			layout->pendingWrap = true;
+		}
+	}
+}
+
+void layoutHistoryEntry(SbEntry const* entry, bool pending, HistoryLayout* layout) {
+	SbIdentity const* sender = entry->sender;
+	if (sender->address[0] != L'\0') {
+		ColorPair senderColorPair = getSenderColorPair(sender->name, sender->address, sender->port);
 #define MAX_NUM_DIGITS_OF_PORT 10
-	wchar_t senderPortString[MAX_NUM_DIGITS_OF_PORT + 2];
-	swprintf(senderPortString, MAX_NUM_DIGITS_OF_PORT + 1, L"%hu", senderPort);
-	waddwstr(chatHistoryWindow, senderPortString);
-	waddwstr(chatHistoryWindow, L"> ");
-
-	wattron(chatHistoryWindow, COLOR_PAIR(fWhite_bBlack));
-	waddwstr(chatHistoryWindow, message);
-	waddwstr(chatHistoryWindow, L"\n");
+		wchar_t senderPortString[MAX_NUM_DIGITS_OF_PORT + 2];
+		swprintf(senderPortString, MAX_NUM_DIGITS_OF_PORT + 1, L"%hu", sender->port);
+
+		layoutHistoryText(layout, sender->name, senderColorPair);
+		layoutHistoryText(layout, L" <", senderColorPair);
+		layoutHistoryText(layout, sender->address, senderColorPair);
+		layoutHistoryText(layout, L":", senderColorPair);
+		layoutHistoryText(layout, senderPortString, senderColorPair);
+		layoutHistoryText(layout, L"> ", senderColorPair);
+	}
+	layoutHistoryText(layout, entry->text, pending ? fBlue_bBlack : fWhite_bBlack);
+}
+
+bool isPending(size_t seq) {
+	LkSeq_Iter it = lkSeq_Begin(&pendingMessages);
+	for (size_t const* pending; (pending = lkSeq_Next(&it)) != NULL; ) {
+		if (*pending == seq) return true;
+	}
+	return false;
+}
+
+int historyRowsOf(size_t seq) {
+	SbEntry entry;
+	if (!sbGet(chatHistory, seq, &entry)) return 0;
+	HistoryLayout layout = { 0, 0, false, 0, 0, 0, false };
+	layoutHistoryEntry(&entry, false, &layout);
+	return layout.row + 1;
+}
+
+/**
+ * The top position that shows the newest
+ * messages on the last rows of the window.
+ */
+HistoryPosition historyBottomTop() {
+	HistoryPosition top = { sbFirst(chatHistory), 0 };
+	int remainingRows = historyRows;
+	for (size_t seq = sbEnd(chatHistory); seq > sbFirst(chatHistory); --seq) {
+		int n = historyRowsOf(seq - 1);
+		if (n >= remainingRows) {
+			top.seq = seq - 1;
+			top.row = n - remainingRows;
+			break;
+		}
+		remainingRows -= n;
+	}
+	return top;
+}
+
+void renderHistory() {
+	if (historyFollowing) {
+		historyTop = historyBottomTop();
+	} else if (historyTop.seq < sbFirst(chatHistory)) {
+		// The message at the top has been evicted.
+		historyTop.seq = sbFirst(chatHistory);
+		historyTop.row = 0;
+	}
+
+	werase(chatHistoryWindow);
+	int visibleRows = historyFollowing ? historyRows : historyRows - 1;
+	int y = 0;
+	int skipRows = historyTop.row;
+	for (size_t seq = historyTop.seq; y < visibleRows && seq < sbEnd(chatHistory); ++seq) {
+		SbEntry entry;
+		sbGet(chatHistory, seq, &entry);
+		HistoryLayout layout = { 0, 0, false, skipRows, y, visibleRows - y, true };
+		layoutHistoryEntry(&entry, isPending(seq), &layout);
+		y += layout.row + 1 - skipRows;
+		skipRows = 0;
+	}
+
+	if (!historyFollowing) {
+		wattrset(chatHistoryWindow, COLOR_PAIR(fYellow_bBlack) | A_REVERSE);
+		mvwaddnwstr(chatHistoryWindow, historyRows - 1, 0, L"-- PgUp/PgDn to scroll, Ctrl-G for the latest messages --", historyCols);
+	}
+	wattrset(chatHistoryWindow, COLOR_PAIR(fWhite_bBlack));
 	wrefresh(chatHistoryWindow);
 
 	wrefresh(messageInputWindow);
 }
 
-void readIncomingMessage() {
-	client_ReceivedMessage message;
-	MessageReadStatus readStatus = client_readMessageFromServer(sockfd, &message);
-	if (readStatus != READ_SUCCESS) {
+void scrollHistoryUp(int numRows) {
+	if (historyFollowing) {
+		historyTop = historyBottomTop();
+	}
+	historyFollowing = false;
+
+	while (numRows > 0) {
+		if (historyTop.row >= numRows) {
+			historyTop.row -= numRows;
+			break;
+		}
+		numRows -= historyTop.row;
+		historyTop.row = 0;
+		if (historyTop.seq <= sbFirst(chatHistory)) break;
+		--historyTop.seq;
+		historyTop.row = historyRowsOf(historyTop.seq);
+	}
+	renderHistory();
+}
+
+void scrollHistoryDown(int numRows) {
+	if (historyFollowing) return;
+
+	while (numRows > 0 && historyTop.seq < sbEnd(chatHistory)) {
+		int remainingRows = historyRowsOf(historyTop.seq) - historyTop.row;
+		if (remainingRows > numRows) {
+			historyTop.row += numRows;
+			break;
+		}
+		numRows -= remainingRows;
+		++historyTop.seq;
+		historyTop.row = 0;
+	}
+
+	// Follow the newest messages again once they are all in view.
+	int rowsBelowTop = -historyTop.row;
+	for (size_t seq = historyTop.seq; rowsBelowTop <= historyRows && seq < sbEnd(chatHistory); ++seq) {
+		rowsBelowTop += historyRowsOf(seq);
+	}
+	if (rowsBelowTop <= historyRows) {
+		historyFollowing = true;
+	}
+	renderHistory();
+}
+
+void jumpToLatestHistory() {
+	historyFollowing = true;
+	renderHistory();
+}
+
+void pushChatHistory(wchar_t const* senderName, wchar_t const* senderAddress, unsigned short senderPort, wchar_t const* message) {
+	if (!sbAppend(chatHistory, senderName, senderAddress, senderPort, message)) {
+		fatalError("Not enough memory for the chat history");
+	}
+	renderHistory();
+}
+
+void pushChatNotice(wchar_t const* notice) {
+	pushChatHistory(L"", L"", 0, notice);
+}
+
+/** Shows a chat message this user has just sent, as pending until the server acknowledges it. */
+void pushOwnMessage(wchar_t const* text) {
+	SenderIdentity const* yourself = client_yourself();
+	bool ok;
+	if (yourself != NULL) {
+		ok = sbAppend(chatHistory, yourself->name, yourself->address, yourself->port, text);
+	} else {
+		// Sent before the welcome came.
+		size_t length = wcslen(text) + 8;
+		wchar_t* notice = (wchar_t*)malloc(length * sizeof(wchar_t));
+		ok = (notice != NULL);
+		if (ok) {
+			swprintf(notice, length, L"* You: %ls", text);
+			ok = sbAppend(chatHistory, L"", L"", 0, notice);
+			free((void*)notice);
+		}
+	}
+	size_t seq = sbEnd(chatHistory) - 1;
+	if (!ok || !lkSeq_Append(&pendingMessages, &seq)) {
+		fatalError("Not enough memory for the chat history");
+	}
+	renderHistory();
+}
+
+/**
+ * The oldest pending message has been acknowledged;
+ * `sequence` is 0 if it was turned down. `maskedText`
+ * is what went out, if the server masked some of it.
+ */
+void confirmOwnMessage(uint64_t sequence, wchar_t const* maskedText) {
+	size_t seq;
+	if (!lkSeq_PopFront(&pendingMessages, &seq)) return; // sent over a connection since lost
+	wchar_t notice[128];
+	if (sequence != 0) {
+		if (maskedText == NULL || sbRewrite(chatHistory, seq, maskedText)) {
+			renderHistory();
+		} else {
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Your message went out as: %.64ls", maskedText);
+			pushChatNotice(notice);
+		}
+		return;
+	}
+	SbEntry entry;
+	if (sbGet(chatHistory, seq, &entry)) {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* The server turned your message down: %.64ls", entry.text);
+	} else {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* The server turned one of your messages down.");
+	}
+	pushChatNotice(notice);
+}
+
+/** Whether the messages still pending went out is not known; a resumed session may send them back. */
+void forgetPendingMessages() {
+	size_t numPending = lkSeq_Size(&pendingMessages);
+	if (numPending == 0) return;
+	lkSeq_Clear(&pendingMessages);
+	wchar_t notice[96];
+	swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %zu of your messages may not have reached everybody.", numPending);
+	pushChatNotice(notice);
+}
+
+TrIncoming* findIncoming(SenderId senderId) {
+	for (size_t i = 0; i < numIncoming; ++i) {
+		if (incoming[i].senderId == senderId) return &incoming[i];
+	}
+	return NULL;
+}
+
+/** Forgets the transfer; a file is kept only if it came whole. */
+void endIncoming(TrIncoming* in) {
+	trEndIncoming(in, trIncomingDone(in));
+	*in = incoming[--numIncoming];
+}
+
+/** "the file NAME" or "a long message", for notices. */
+void describeTransfer(wchar_t* description, size_t size, wchar_t kind, wchar_t const* name) {
+	if (kind == TRANSFER_FILE) {
+		swprintf(description, size, L"the file %ls", name);
+	} else {
+		swprintf(description, size, L"a long message");
+	}
+}
+
+void cutIncomingShort(TrIncoming* in) {
+	wchar_t what[MAX_NAME_LENGTH + 16];
+	wchar_t notice[2 * MAX_NAME_LENGTH + 64];
+	describeTransfer(what, sizeof(what) / sizeof(what[0]), in->kind, in->name);
+	swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls stopped sending %ls.", in->sender.name, what);
+	pushChatNotice(notice);
+	endIncoming(in);
+}
+
+void startIncoming(client_ReceivedMessage const* message) {
+	TrIncoming* in = findIncoming(message->senderId);
+	if (in != NULL) endIncoming(in);
+	if (numIncoming == incomingCapacity) {
+		size_t newCapacity = incomingCapacity ? incomingCapacity * 2 : 4;
+		TrIncoming* newIncoming = (TrIncoming*)realloc((void*)incoming, newCapacity * sizeof(TrIncoming));
+		if (newIncoming == NULL) {
+			fatalError("Not enough memory for the transfers");
+		}
+		incoming = newIncoming;
+		incomingCapacity = newCapacity;
+	}
+	in = &incoming[numIncoming++];
+	bool ok = trStartIncoming(in, message->senderId, message->sender, message->transferKind, message->transferLength, message->text, downloadsDirectory);
+	if (in->kind == TRANSFER_CHAT && ok) return; // shown once it has come whole
+
+	SenderIdentity const* sender = message->sender;
+	wchar_t notice[3 * MAX_NAME_LENGTH + 128];
+	unsigned long long kib = (message->transferLength / 4 * 3 + 1023) / 1024;
+	if (in->kind != TRANSFER_FILE) {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls is sending a message too long to be shown.", sender->name);
+	} else if (!ok) {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls is sending the file %ls, but it can not be saved in %s.", sender->name, in->name, downloadsDirectory);
+	} else if (downloadsDirectory == NULL) {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls is sending the file %ls (%llu KiB); start the client with --downloads=DIR to keep such files.", sender->name, in->name, kib);
+	} else {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls is sending the file %ls (%llu KiB)...", sender->name, in->name, kib);
+	}
+	pushChatNotice(notice);
+}
+
+void takeIncomingPiece(client_ReceivedMessage const* message) {
+	TrIncoming* in = findIncoming(message->senderId);
+	if (in == NULL) return; // it started before this client logged in
+	wchar_t notice[3 * MAX_NAME_LENGTH + 64];
+	bool hadFailed = in->failed;
+	if (!trTakePiece(in, message->text, wcslen(message->text)) && !hadFailed) {
+		wchar_t what[MAX_NAME_LENGTH + 16];
+		describeTransfer(what, sizeof(what) / sizeof(what[0]), in->kind, in->name);
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Receiving %ls from %ls failed.", what, in->sender.name);
+		pushChatNotice(notice);
+	}
+	if (in->received < in->length) return;
+
+	if (trIncomingDone(in) && in->kind == TRANSFER_CHAT) {
+		pushChatHistory(in->sender.name, in->sender.address, in->sender.port, in->text);
+	} else if (trIncomingDone(in) && in->savedAs[0] != L'\0') {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* The file %ls from %ls has been saved as %ls.", in->name, in->sender.name, in->savedAs);
+		pushChatNotice(notice);
+	}
+	endIncoming(in);
+}
+
+/** What was being sent or received over the lost connection is lost with it. */
+void dropTransfers() {
+	if (outgoing.kind != 0) {
+		wchar_t what[MAX_NAME_LENGTH + 16];
+		wchar_t notice[MAX_NAME_LENGTH + 64];
+		describeTransfer(what, sizeof(what) / sizeof(what[0]), outgoing.kind, outgoing.name);
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Sending %ls was cut short.", what);
+		pushChatNotice(notice);
+		trEndOutgoing(&outgoing);
+	}
+	while (numIncoming > 0) {
+		cutIncomingShort(&incoming[numIncoming - 1]);
+	}
+}
+
+void showReceivedMessage(client_ReceivedMessage const* message) {
+	SenderIdentity const* sender = message->sender;
+	wchar_t notice[2 * MAX_NAME_LENGTH + 64];
+	switch (message->type) {
+		case TO_CLIENT_CHAT:
+			if (message->senderIsYourself) break; // shown when it was sent
+			pushChatHistory(sender->name, sender->address, sender->port, message->text);
+		break;
+
+		case TO_CLIENT_ACK:
+			confirmOwnMessage(message->sequence, message->text);
+		break;
+
+		case TO_CLIENT_DIRECT:
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"%ls (to you)", sender->name);
+			pushChatHistory(notice, sender->address, sender->port, message->text);
+		break;
+
+		case TO_CLIENT_NO_SUCH_USER:
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Nobody is called %ls.", message->text);
+			pushChatNotice(notice);
+		break;
+
+		case TO_CLIENT_JOIN:
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls <%ls:%hu> joined.", sender->name, sender->address, sender->port);
+			pushChatNotice(notice);
+		break;
+
+		case TO_CLIENT_LEAVE: {
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls <%ls:%hu> left.", sender->name, sender->address, sender->port);
+			pushChatNotice(notice);
+			TrIncoming* in = findIncoming(message->senderId);
+			if (in != NULL) cutIncomingShort(in);
+		} break;
+
+		case TO_CLIENT_RENAME:
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls is now known as %ls.", message->text, sender->name);
+			pushChatNotice(notice);
+		break;
+
+		case TO_CLIENT_RESUMED:
+			reconnectAttempts = 0;
+			pushChatNotice(L"* Reconnected. You have missed nothing.");
+		break;
+
+		case TO_CLIENT_MISSED:
+			reconnectAttempts = 0;
+			pushChatNotice(L"* Reconnected, but some of the messages sent while you were away are lost.");
+		break;
+
+		case TO_CLIENT_MULTICAST:
+			if (message->text != NULL) {
+				swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Chat messages now come by multicast, from %ls.", message->text);
+				pushChatNotice(notice);
+			} else {
+				pushChatNotice(L"* Chat messages come over the connection.");
+			}
+		break;
+
+		case TO_CLIENT_LOST:
+			pushChatNotice(L"* Some chat messages did not come by multicast, and are lost.");
+		break;
+
+		case TO_CLIENT_SEARCH_RESULTS: {
+			if (message->numResults == 0) {
+				pushChatNotice(L"* Search: nothing found.");
+				break;
+			}
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Search: %zu message(s) found, newest first:", message->numResults);
+			pushChatNotice(notice);
+			size_t iterator = 0;
+			SearchHit hit;
+			while (client_nextSearchResult(message, &iterator, &hit)) {
+				wchar_t line[MAX_NAME_LENGTH + 256];
+				swprintf(line, sizeof(line) / sizeof(line[0]), L"*   #%llu %ls: %ls", (unsigned long long)hit.sequence, hit.name, hit.snippet);
+				pushChatNotice(line);
+			}
+		} break;
+
+		case TO_CLIENT_TRANSFER_START:
+			startIncoming(message);
+		break;
+
+		case TO_CLIENT_TRANSFER_DATA:
+			takeIncomingPiece(message);
+		break;
+
+		case TO_CLIENT_TRANSFER_CANCELLED: {
+			TrIncoming* in = findIncoming(message->senderId);
+			if (in != NULL) cutIncomingShort(in);
+		} break;
+
+		case TO_CLIENT_MEMBERS: {
+			size_t numMembers = 0;
+			size_t iterator = 0;
+			SenderIdentity const* member;
+			while (client_nextMember(&iterator, &member)) {
+				++numMembers;
+			}
+			swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %zu user(s) online. Type /who to list them.", numMembers);
+			pushChatNotice(notice);
+		} break;
+	}
+}
+
+void listOnlineUsers() {
+	pushChatNotice(L"* Online users:");
+	size_t iterator = 0;
+	SenderIdentity const* member;
+	while (client_nextMember(&iterator, &member)) {
+		wchar_t line[MAX_NAME_LENGTH + MAX_ADDRESS_LENGTH + 32];
+		swprintf(line, sizeof(line) / sizeof(line[0]), L"*   %ls <%ls:%hu>", member->name, member->address, member->port);
+		pushChatNotice(line);
+	}
+}
+
+/** `readStatus` is that of what was received; shows every message it completed. */
+void showIncomingMessages(MessageReadStatus readStatus) {
+	while (readStatus == READ_SUCCESS) {
+		client_ReceivedMessage message;
+		readStatus = client_readMessageFromServer(&message);
+		if (readStatus != READ_SUCCESS) break;
+
+		showReceivedMessage(&message);
+
+		client_freeReceivedMessage(&message);
+	}
+	if (readStatus == READ_ERR_BROKEN_SOCKET || readStatus == READ_ERR_PEER_CLOSED) {
+		connectionLost("Connection lost");
+	} else if (readStatus != READ_INCOMPLETE) {
 		char error[32];
 		snprintf(error, 32, "READ_ERR: %d", readStatus);
 		fatalError(error);
 	}
+}
+
+void readIncomingMessage() {
+	showIncomingMessages(client_receiveFromServer(sockfd));
+}
 
-	pushChatHistory(message.sender.name, message.sender.address, message.sender.port, message.text);
+void readMulticast() {
+	showIncomingMessages(client_receiveMulticast(sockfd));
+}
 
-	client_freeReceivedMessage(&message);
+/**
+ * "NAME MESSAGE", or "NAME" then the message on
+ * the next lines, for names with spaces in them.
+ */
+MessageSendStatus sendDirectMessage(wchar_t* command) {
+	wchar_t* split = wcschr(command, L'\n');
+	if (split == NULL) split = wcschr(command, L' ');
+	if (split == NULL || split == command) {
+		pushChatNotice(L"* Usage: /msg NAME MESSAGE");
+		return SEND_SUCCESS;
+	}
+	*split = L'\0';
+	wchar_t const* text = split + 1;
+	if (wcslen(text) > MAX_CHAT_LENGTH) {
+		wchar_t notice[64];
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Direct messages are limited to %d characters.", MAX_CHAT_LENGTH);
+		pushChatNotice(notice);
+		return SEND_SUCCESS;
+	}
+	MessageSendStatus sendStatus = client_sendDirectMessage(sockfd, command, text);
+	if (sendStatus == SEND_SUCCESS) {
+		// The server does not echo direct messages back.
+		size_t length = wcslen(command) + wcslen(text) + 16;
+		wchar_t* notice = (wchar_t*)malloc(length * sizeof(wchar_t));
+		if (notice == NULL) {
+			fatalError("Not enough memory for the chat history");
+		}
+		swprintf(notice, length, L"* To %ls: %ls", command, text);
+		pushChatNotice(notice);
+		free((void*)notice);
+	}
+	return sendStatus;
 }
 
-void runApplication() {
-#define INPUT_MESSAGE_MAX_LENGTH 1023
-	wchar_t inputMessage[INPUT_MESSAGE_MAX_LENGTH + 1];
-	bool stop;
+/** Only announces the file; its pieces go with sendNextPiece(). */
+MessageSendStatus sendFile(wchar_t const* pathText) {
+	wchar_t notice[PATH_MAX + 64];
+	char path[PATH_MAX];
+	size_t pathLength = wcstombs(path, pathText, sizeof(path));
+	char const* error = (pathLength == (size_t)-1 || pathLength == sizeof(path))
+		? "can not be opened"
+		: trSendFile(&outgoing, path);
+	if (error != NULL) {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* %ls %s.", pathText, error);
+		pushChatNotice(notice);
+		return SEND_SUCCESS;
+	}
+	swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Sending the file %ls (%llu bytes)...", outgoing.name, (unsigned long long)outgoing.numBytes);
+	pushChatNotice(notice);
+	return client_startTransfer(sockfd, TRANSFER_FILE, outgoing.length, outgoing.name);
+}
 
+/** Sends the next piece of what is being sent; called when the connection can take it. */
+void sendNextPiece() {
+	static wchar_t piece[TRANSFER_CHUNK_LENGTH];
+	wchar_t notice[MAX_NAME_LENGTH + 64];
+	size_t length;
+	if (!trNextPiece(&outgoing, piece, &length)) {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* Could not read %ls to the end; sending it was cancelled.", outgoing.name);
+		pushChatNotice(notice);
+		trEndOutgoing(&outgoing);
+		if (client_cancelTransfer(sockfd) != SEND_SUCCESS) {
+			connectionLost("Could not send the message");
+		}
+		return;
+	}
+	MessageSendStatus sendStatus = client_sendTransferData(sockfd, piece, length);
+	if (sendStatus == SEND_ERR_NOT_ENOUGH_MEMORY) {
+		fatalError("SEND ERROR");
+	} else if (sendStatus != SEND_SUCCESS) {
+		connectionLost("Could not send the message");
+		return;
+	}
+	if (outgoing.sent < outgoing.length) return;
+
+	if (outgoing.kind == TRANSFER_CHAT) {
+		// The server does not echo transfers back.
+		SenderIdentity const* yourself = client_yourself();
+		if (yourself != NULL) {
+			pushChatHistory(yourself->name, yourself->address, yourself->port, outgoing.text);
+		} else {
+			pushChatNotice(L"* Your long message has been sent.");
+		}
+	} else {
+		swprintf(notice, sizeof(notice) / sizeof(notice[0]), L"* The file %ls has been sent.", outgoing.name);
+		pushChatNotice(notice);
+	}
+	trEndOutgoing(&outgoing);
+}
+
+void sendInputMessage() {
+	if (gbLength(inputBuffer) == 0) return;
+	wchar_t* inputMessage = gbCopyToNewString(inputBuffer);
+	if (inputMessage == NULL) {
+		fatalError("Not enough memory to send the message");
+	}
+
+	MessageSendStatus sendStatus = SEND_SUCCESS;
+	if (wcscmp(inputMessage, L"/who") == 0) {
+		listOnlineUsers();
+	} else if (sockfd < 0) {
+		// Keep it in the editor until it can be sent.
+		pushChatNotice(L"* Not connected; try again once reconnected.");
+		free((void*)inputMessage);
+		return;
+	} else if (outgoing.kind != 0 && (wcsncmp(inputMessage, L"/send ", 6) == 0 || wcslen(inputMessage) > MAX_CHAT_LENGTH)) {
+		// Likewise, until what is being sent is.
+		pushChatNotice(L"* Something is being sent already; try again once it has been.");
+		free((void*)inputMessage);
+		return;
+	} else if (wcsncmp(inputMessage, L"/send ", 6) == 0) {
+		sendStatus = sendFile(inputMessage + 6);
+	} else if (wcslen(inputMessage) > MAX_CHAT_LENGTH) {
+		trSendText(&outgoing, inputMessage);
+		inputMessage = NULL; // taken over
+		sendStatus = client_startTransfer(sockfd, TRANSFER_CHAT, outgoing.length, L"");
+	} else if (wcsncmp(inputMessage, L"/nick ", 6) == 0) {
+		sendStatus = client_rename(sockfd, inputMessage + 6);
+		if (sendStatus == SEND_SUCCESS) {
+			// Sessions are resumed under this name.
+			wcsncpy(username, inputMessage + 6, MAX_NAME_LENGTH);
+		}
+	} else if (wcsncmp(inputMessage, L"/msg ", 5) == 0) {
+		sendStatus = sendDirectMessage(inputMessage + 5);
+	} else if (wcsncmp(inputMessage, L"/search ", 8) == 0) {
+		sendStatus = client_search(sockfd, inputMessage + 8);
+	} else {
+		sendStatus = client_sendMessageToServer(sockfd, inputMessage);
+		if (sendStatus == SEND_SUCCESS) {
+			pushOwnMessage(inputMessage);
+		}
+	}
+	free((void*)inputMessage);
+	if (sendStatus == SEND_ERR_NOT_ENOUGH_MEMORY) {
+		fatalError("SEND ERROR");
+	} else if (sendStatus != SEND_SUCCESS) {
+		connectionLost("Could not send the message");
+		return;
+	}
+	resetInput();
+}
+
+void runApplication() {
 	struct pollfd fds[] = {
-		{ sockfd, POLLIN, 0 }
+		{ srPollFd(sockfd), POLLIN, 0 },
+		{ client_multicastFd(), POLLIN, 0 }
 	};
 	int nfds = sizeof(fds) / sizeof(fds[0]);
 
+	renderInput();
 	while (1) {
-		inputMessage[0] = L'\0';
-		stop = false;
-
-		size_t inputMessageCurrentPos = 0;
 		wint_t c;
-		while (true) {
-			bool haveKeystroke = (wget_wch(messageInputWindow, &c) != ERR);
-			if (poll(fds, nfds, 0) > 0) {
-				short revents = fds[0].revents;
-				fds[0].revents = 0;
-
-				if ((revents & POLLHUP) == POLLHUP) {
-					fatalError("Socket closed on this party");
-				} else if ((revents & POLLERR) == POLLERR) {
-					fatalError("Socket error");
-				} else if ((revents & POLLIN) == POLLIN) {
-					readIncomingMessage();
-				}
+		int keyType = wget_wch(messageInputWindow, &c);
+		bool haveKeystroke = (keyType != ERR);
+		bool isFunctionKey = (keyType == KEY_CODE_YES);
+		reconnectIfDue();
+		fds[0].fd = srPollFd(sockfd); // ignored by poll() while disconnected
+		fds[1].fd = client_multicastFd(); // likewise, unless chat messages come by multicast
+		fds[0].events = (outgoing.kind != 0) ? POLLIN | POLLOUT : POLLIN;
+		bool writable = false;
+		if (poll(fds, nfds, 0) > 0) {
+			short revents = fds[0].revents;
+			writable = ((revents & POLLOUT) == POLLOUT);
+			short multicastRevents = fds[1].revents;
+			fds[0].revents = fds[1].revents = 0;
+
+			if ((revents & POLLIN) == POLLIN) {
+				readIncomingMessage();
+			} else if ((revents & POLLHUP) == POLLHUP) {
+				connectionLost("Socket closed on this party");
+			} else if ((revents & POLLERR) == POLLERR) {
+				connectionLost("Socket error");
 			}
-			if (!haveKeystroke) continue;
+			if ((multicastRevents & POLLIN) == POLLIN && client_multicastFd() >= 0) {
+				readMulticast();
+			}
+		}
+		// Rings have no room to poll for: a send waits for it.
+		if (outgoing.kind != 0 && sockfd >= 0 && (writable || useRings)) {
+			sendNextPiece();
+		}
+		if (!haveKeystroke) continue;
 
-			if (c == '\n') break;
+		if (isFunctionKey) {
+			switch (c) {
+				case KEY_BACKSPACE: gbDeleteBefore(inputBuffer); break;
+				case KEY_DC:        gbDeleteAfter(inputBuffer); break;
+				case KEY_LEFT:      gbMoveLeft(inputBuffer); break;
+				case KEY_RIGHT:     gbMoveRight(inputBuffer); break;
+				case KEY_UP:        inputMoveVertically(true); break;
+				case KEY_DOWN:      inputMoveVertically(false); break;
+				case KEY_HOME:      gbMoveCursorTo(inputBuffer, gbLineStart(inputBuffer, gbCursor(inputBuffer))); break;
+				case KEY_END:       gbMoveCursorTo(inputBuffer, gbLineEnd(inputBuffer, gbCursor(inputBuffer))); break;
+				case KEY_ENTER:     sendInputMessage(); break;
+				case KEY_PPAGE:     scrollHistoryUp(historyRows - 2); break;
+				case KEY_NPAGE:     scrollHistoryDown(historyRows - 2); break;
+				default: break;
+			}
+		} else {
 			switch (c) {
-				case KEY_BACKSPACE:
-				case '\b':
+				case L'\n':
+				case L'\r':
+					sendInputMessage();
+				break;
+
+				case L'\b':
 				case 127:
-				{
-					size_t inputMessageLength = wcslen(inputMessage);
-					if (inputMessageCurrentPos >= inputMessageLength) {
-						inputMessageCurrentPos = inputMessageLength;
-					}
-					if (inputMessageCurrentPos > 0) {
-						--inputMessageCurrentPos;
-						string_delete_char(inputMessage, inputMessageCurrentPos);
-					}
-				}
+					gbDeleteBefore(inputBuffer);
 				break;
 
-				case KEY_LEFT:
-				{
-					if (inputMessageCurrentPos > 0) {
-						--inputMessageCurrentPos;
-					}
-				}
+				case KEY_CTRL('n'):
+					// Ctrl-N starts a new line within the same message.
+					gbInsert(inputBuffer, L'\n');
 				break;
 
-				case KEY_RIGHT:
-				{
-					if (inputMessageCurrentPos <= wcslen(inputMessage)) {
-						++inputMessageCurrentPos;
-					}
-				}
+				case KEY_CTRL('g'):
+					jumpToLatestHistory();
 				break;
 
 				case KEY_CTRL('c'):
-				{
 					handleSigint(SIGINT);
-				}
 				break;
 
 				default:
-				{
-					size_t inputMessageLength = wcslen(inputMessage);
-					if (inputMessageLength < INPUT_MESSAGE_MAX_LENGTH) {
-						string_insert_char(inputMessage, inputMessageCurrentPos, c);
-						++inputMessageCurrentPos;
+					if (iswprint(c)) {
+						gbInsert(inputBuffer, (wchar_t)c);
 					}
-				}
 				break;
 			}
+		}
 
-			// Print currently-entered message onto the input window,
-			// and move the cursor to the correct position.
-			werase(messageInputWindow);
-			wchar_t k = inputMessage[inputMessageCurrentPos];
-			inputMessage[inputMessageCurrentPos] = 0;
-			mvwaddwstr(messageInputWindow, 0, 0, inputMessage);
-			int curX, curY;
-			getyx(messageInputWindow, curY, curX);
-			
-			inputMessage[inputMessageCurrentPos] = k;
-			werase(messageInputWindow);
-			mvwaddwstr(messageInputWindow, 0, 0, inputMessage);
-			wmove(messageInputWindow, curY, curX);
-			wrefresh(messageInputWindow);
-		}
-
-		if (stop) {
-			teardownApplication();
-		}
-		if (wcslen(inputMessage) == 0) continue;
-		MessageSendStatus sendStatus = client_sendMessageToServer(sockfd, username, inputMessage);
-		if (sendStatus != SEND_SUCCESS) {
-			fatalError("SEND ERROR");
-		}
-		werase(messageInputWindow);
-		wrefresh(messageInputWindow);
+		renderInput();
 	}
 }
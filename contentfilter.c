@@ -0,0 +1,387 @@
+/**
+ * The automaton is a DFA: the trie of the terms,
+ * with every missing transition filled in from
+ * the failure links, so that matching never
+ * follows a link. All transitions are in one
+ * flat table, a row of `numClasses` entries per
+ * state, and an entry holds the offset of the
+ * next state's row rather than its number: the
+ * next lookup is one addition away. Its top bit
+ * tells that some term ends in that state,
+ * without looking anywhere else.
+ *
+ * Characters are first mapped to classes: one
+ * per distinct character of the terms (both
+ * cases together), and class 0 for all the
+ * others, so that rows stay short.
+ */
+
+#include "contentfilter.h"
+#include <stdio.h>
+#include <string.h>
+#include <wctype.h>
+#include <time.h>
+#include <signal.h>
+
+#define CF_OUTPUT 0x80000000u
+#define CF_OFFSET_MASK 0x7fffffffu
+
+typedef struct {
+    wchar_t ch;
+    uint32_t class;
+} CfWideClass;
+
+struct _CfAutomaton {
+    uint32_t asciiClasses[128];
+    CfWideClass* wideClasses; // sorted by character
+    size_t numWideClasses;
+    uint32_t numClasses;
+    uint32_t numStates;
+    uint32_t* transitions; // numStates rows of numClasses entries
+    uint32_t* maskLengths; // per state: the longest term ending there, 0 if none
+    bool* blocks;          // per state: a term ending there blocks the message
+    size_t numTerms;
+};
+
+typedef struct {
+    wchar_t* text;
+    size_t length;
+    bool blocks;
+} CfTerm;
+
+static inline uint32_t cfClass(CfAutomaton const* automaton, wchar_t ch) {
+    if ((uint32_t)ch < 128) return automaton->asciiClasses[ch];
+    size_t low = 0, high = automaton->numWideClasses;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        wchar_t found = automaton->wideClasses[middle].ch;
+        if (found == ch) return automaton->wideClasses[middle].class;
+        if (found < ch) low = middle + 1;
+        else high = middle;
+    }
+    return 0;
+}
+
+static void cfFreeTerms(CfTerm* terms, size_t numTerms) {
+    for (size_t i = 0; i < numTerms; ++i) free((void*)terms[i].text);
+    free((void*)terms);
+}
+
+/** NULL if the file can not be read, or if out of memory. */
+static CfTerm* cfReadTerms(char const* path, size_t* numTermsPtr) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return NULL;
+    CfTerm* terms = NULL;
+    size_t numTerms = 0, capacity = 0;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    size_t lineNumber = 0;
+    bool ok = true;
+    while (ok && (lineLength = getline(&line, &lineCapacity, file)) >= 0) {
+        ++lineNumber;
+        while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r')) {
+            line[--lineLength] = '\0';
+        }
+        bool blocks = (line[0] == '!');
+        char const* term = blocks ? line + 1 : line;
+        if (term[0] == '\0' || line[0] == '#') continue;
+
+        size_t length = mbstowcs(NULL, term, 0);
+        if (length == (size_t)-1) {
+            wprintf(L"warning: %s:%zu: not valid text, skipped\n", path, lineNumber);
+            continue;
+        }
+        if (numTerms == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            CfTerm* grown = (CfTerm*)realloc((void*)terms, capacity * sizeof(CfTerm));
+            if (grown == NULL) { ok = false; break; }
+            terms = grown;
+        }
+        CfTerm* added = &terms[numTerms];
+        added->text = (wchar_t*)malloc((length + 1) * sizeof(wchar_t));
+        if (added->text == NULL) { ok = false; break; }
+        mbstowcs(added->text, term, length + 1);
+        added->length = length;
+        added->blocks = blocks;
+        ++numTerms;
+    }
+    free((void*)line);
+    fclose(file);
+    if (!ok) {
+        cfFreeTerms(terms, numTerms);
+        return NULL;
+    }
+    *numTermsPtr = numTerms;
+    return (terms != NULL) ? terms : (CfTerm*)malloc(sizeof(CfTerm));
+}
+
+typedef struct {
+    wchar_t ch;
+    wchar_t key; // its lower case
+    uint32_t class;
+} CfVariant;
+
+static int cfCompareKeys(void const* a, void const* b) {
+    CfVariant const* x = (CfVariant const*)a;
+    CfVariant const* y = (CfVariant const*)b;
+    if (x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+    return (x->ch > y->ch) - (x->ch < y->ch);
+}
+
+static int cfCompareVariants(void const* a, void const* b) {
+    CfVariant const* x = (CfVariant const*)a;
+    CfVariant const* y = (CfVariant const*)b;
+    if (x->ch != y->ch) return (x->ch > y->ch) - (x->ch < y->ch);
+    return (x->class > y->class) - (x->class < y->class);
+}
+
+/** Gives a class to every character of the terms, in either case. */
+static bool cfMakeClasses(CfAutomaton* automaton, CfTerm const* terms, size_t numTerms) {
+    size_t numChars = 0;
+    for (size_t i = 0; i < numTerms; ++i) numChars += terms[i].length;
+    CfVariant* variants = (CfVariant*)malloc((3 * numChars + 1) * sizeof(CfVariant));
+    automaton->wideClasses = (CfWideClass*)malloc((3 * numChars + 1) * sizeof(CfWideClass));
+    if (variants == NULL || automaton->wideClasses == NULL) {
+        free((void*)variants);
+        return false;
+    }
+    size_t numVariants = 0;
+    for (size_t i = 0; i < numTerms; ++i) {
+        for (size_t j = 0; j < terms[i].length; ++j) {
+            wchar_t ch = terms[i].text[j];
+            wchar_t key = (wchar_t)towlower(ch);
+            variants[numVariants++] = (CfVariant){ ch, key, 0 };
+            variants[numVariants++] = (CfVariant){ key, key, 0 };
+            variants[numVariants++] = (CfVariant){ (wchar_t)towupper(ch), key, 0 };
+        }
+    }
+
+    // One class per lower case character...
+    qsort((void*)variants, numVariants, sizeof(CfVariant), cfCompareKeys);
+    automaton->numClasses = 1;
+    for (size_t i = 0; i < numVariants; ++i) {
+        if (i > 0 && variants[i].key != variants[i - 1].key) ++automaton->numClasses;
+        variants[i].class = automaton->numClasses;
+    }
+    if (numVariants > 0) ++automaton->numClasses;
+
+    // ...that a character which is a case of two goes with the first.
+    qsort((void*)variants, numVariants, sizeof(CfVariant), cfCompareVariants);
+    memset((void*)automaton->asciiClasses, 0, sizeof(automaton->asciiClasses));
+    automaton->numWideClasses = 0;
+    for (size_t i = 0; i < numVariants; ++i) {
+        if (i > 0 && variants[i].ch == variants[i - 1].ch) continue;
+        if ((uint32_t)variants[i].ch < 128) {
+            automaton->asciiClasses[variants[i].ch] = variants[i].class;
+        } else {
+            automaton->wideClasses[automaton->numWideClasses++] = (CfWideClass){ variants[i].ch, variants[i].class };
+        }
+    }
+    free((void*)variants);
+    return true;
+}
+
+static bool cfBuild(CfAutomaton* automaton, CfTerm const* terms, size_t numTerms) {
+    size_t maxStates = 1;
+    for (size_t i = 0; i < numTerms; ++i) maxStates += terms[i].length;
+    uint32_t numClasses = automaton->numClasses;
+    if (maxStates * numClasses > CF_OFFSET_MASK) return false; // offsets would not fit
+
+    // The trie; an entry of 0 is a missing transition, as no transition goes back to the root.
+    uint32_t* transitions = (uint32_t*)calloc(maxStates * numClasses, sizeof(uint32_t));
+    uint32_t* maskLengths = (uint32_t*)calloc(maxStates, sizeof(uint32_t));
+    bool* blocks = (bool*)calloc(maxStates, sizeof(bool));
+    uint32_t* failures = (uint32_t*)malloc(maxStates * sizeof(uint32_t));
+    uint32_t* queue = (uint32_t*)malloc(maxStates * sizeof(uint32_t));
+    automaton->transitions = transitions;
+    automaton->maskLengths = maskLengths;
+    automaton->blocks = blocks;
+    bool ok = (transitions != NULL && maskLengths != NULL && blocks != NULL && failures != NULL && queue != NULL);
+    if (!ok) goto FINALIZE;
+
+    uint32_t numStates = 1;
+    for (size_t i = 0; i < numTerms; ++i) {
+        uint32_t state = 0;
+        for (size_t j = 0; j < terms[i].length; ++j) {
+            uint32_t* entry = &transitions[(size_t)state * numClasses + cfClass(automaton, terms[i].text[j])];
+            if (*entry == 0) *entry = numStates++;
+            state = *entry;
+        }
+        if (terms[i].length > maskLengths[state]) maskLengths[state] = (uint32_t)terms[i].length;
+        blocks[state] = blocks[state] || terms[i].blocks;
+    }
+
+    // Breadth first, so that the state a failure link goes to is
+    // complete by the time it is needed.
+    size_t queueBegin = 0, queueEnd = 0;
+    failures[0] = 0;
+    queue[queueEnd++] = 0;
+    while (queueBegin < queueEnd) {
+        uint32_t state = queue[queueBegin++];
+        uint32_t const* failureRow = &transitions[(size_t)failures[state] * numClasses];
+        uint32_t* row = &transitions[(size_t)state * numClasses];
+        for (uint32_t class = 0; class < numClasses; ++class) {
+            uint32_t child = row[class];
+            if (child == 0) {
+                row[class] = (state == 0) ? 0 : failureRow[class];
+                continue;
+            }
+            uint32_t failure = (state == 0) ? 0 : failureRow[class];
+            failures[child] = failure;
+            if (maskLengths[failure] > maskLengths[child]) maskLengths[child] = maskLengths[failure];
+            blocks[child] = blocks[child] || blocks[failure];
+            queue[queueEnd++] = child;
+        }
+    }
+
+    for (size_t i = 0; i < (size_t)numStates * numClasses; ++i) {
+        uint32_t target = transitions[i];
+        transitions[i] = target * numClasses | ((maskLengths[target] > 0 || blocks[target]) ? CF_OUTPUT : 0);
+    }
+    automaton->numStates = numStates;
+    uint32_t* shrunk = (uint32_t*)realloc((void*)transitions, (size_t)numStates * numClasses * sizeof(uint32_t));
+    if (shrunk != NULL) automaton->transitions = shrunk;
+
+FINALIZE:
+    free((void*)failures);
+    free((void*)queue);
+    return ok;
+}
+
+/** NULL if the file can not be read, or if out of memory. */
+CfAutomaton* cfCompile(char const* path) {
+    size_t numTerms;
+    CfTerm* terms = cfReadTerms(path, &numTerms);
+    if (terms == NULL) return NULL;
+    CfAutomaton* automaton = (CfAutomaton*)calloc(1, sizeof(CfAutomaton));
+    bool ok = (automaton != NULL && cfMakeClasses(automaton, terms, numTerms) && cfBuild(automaton, terms, numTerms));
+    cfFreeTerms(terms, numTerms);
+    if (!ok) {
+        cfFree(automaton);
+        return NULL;
+    }
+    automaton->numTerms = numTerms;
+    return automaton;
+}
+
+void cfFree(CfAutomaton* automaton) {
+    if (automaton == NULL) return;
+    free((void*)automaton->wideClasses);
+    free((void*)automaton->transitions);
+    free((void*)automaton->maskLengths);
+    free((void*)automaton->blocks);
+    free((void*)automaton);
+}
+
+size_t cfNumTerms(CfAutomaton const* automaton) {
+    return automaton->numTerms;
+}
+
+size_t cfNumStates(CfAutomaton const* automaton) {
+    return automaton->numStates;
+}
+
+/**
+ * Masks the terms found in the text, in place,
+ * unless one of them blocks it: then it stops
+ * there.
+ */
+CfVerdict cfRun(CfAutomaton const* automaton, wchar_t* text, size_t length, unsigned long* numMatchesPtr) {
+    uint32_t const* transitions = automaton->transitions;
+    uint32_t offset = 0;
+    CfVerdict verdict = CF_PASSED;
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t entry = transitions[offset + cfClass(automaton, text[i])];
+        offset = entry & CF_OFFSET_MASK;
+        if ((entry & CF_OUTPUT) == 0) continue;
+
+        ++*numMatchesPtr;
+        uint32_t state = offset / automaton->numClasses;
+        if (automaton->blocks[state]) return CF_BLOCKED;
+        // Shorter terms ending here are part of the longest one.
+        for (size_t j = i + 1 - automaton->maskLengths[state]; j <= i; ++j) text[j] = CF_MASK;
+        verdict = CF_MASKED;
+    }
+    return verdict;
+}
+
+/** Returns false if the file can not be read, or if out of memory. */
+bool cfInit(ContentFilter* filter, char const* path) {
+    memset((void*)filter, 0, sizeof(*filter));
+    filter->path = path;
+    atomic_init(&filter->pending, NULL);
+    atomic_init(&filter->loading, false);
+    atomic_init(&filter->numReloadsFailed, 0);
+    filter->automaton = cfCompile(path);
+    return filter->automaton != NULL;
+}
+
+void cfDestroy(ContentFilter* filter) {
+    if (filter->loaderStarted) pthread_join(filter->loader, NULL);
+    cfFree(atomic_exchange(&filter->pending, NULL));
+    cfFree(filter->automaton);
+    filter->automaton = NULL;
+}
+
+static void* cfLoad(void* arg) {
+    ContentFilter* filter = (ContentFilter*)arg;
+    CfAutomaton* automaton = cfCompile(filter->path);
+    if (automaton == NULL) {
+        atomic_fetch_add(&filter->numReloadsFailed, 1);
+        wprintf(L"warning: could not reload the content filter from %s; keeping the terms in use\n", filter->path);
+    } else {
+        cfFree(atomic_exchange(&filter->pending, automaton)); // one never used, if reloaded twice
+    }
+    atomic_store(&filter->loading, false);
+    return NULL;
+}
+
+/**
+ * Starts compiling the file again. Returns false
+ * if it is being compiled already, or if no
+ * thread could be started.
+ */
+bool cfReload(ContentFilter* filter) {
+    if (atomic_load(&filter->loading)) return false;
+    if (filter->loaderStarted) {
+        pthread_join(filter->loader, NULL); // it is done, or about to be
+        filter->loaderStarted = false;
+    }
+    atomic_store(&filter->loading, true);
+    // Signals are for the event loop: they must interrupt its poll().
+    sigset_t allSignals, callerSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &callerSignals);
+    filter->loaderStarted = (pthread_create(&filter->loader, NULL, cfLoad, (void*)filter) == 0);
+    pthread_sigmask(SIG_SETMASK, &callerSignals, NULL);
+    if (!filter->loaderStarted) atomic_store(&filter->loading, false);
+    return filter->loaderStarted;
+}
+
+static double cfSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/** Takes in the terms compiled last, if any, then filters the text in place. */
+CfVerdict cfFilter(ContentFilter* filter, wchar_t* text) {
+    if (atomic_load_explicit(&filter->pending, memory_order_relaxed) != NULL) {
+        CfAutomaton* automaton = atomic_exchange(&filter->pending, NULL);
+        cfFree(filter->automaton);
+        filter->automaton = automaton;
+        ++filter->numReloads;
+        wprintf(L"Content filter reloaded: %zu term(s)\n", automaton->numTerms);
+    }
+
+    double startedAt = cfSeconds();
+    size_t length = wcslen(text);
+    CfVerdict verdict = cfRun(filter->automaton, text, length, &filter->numMatches);
+    filter->secondsFiltering += cfSeconds() - startedAt;
+    ++filter->numMessages;
+    filter->numChars += length;
+    if (verdict == CF_MASKED) ++filter->numMasked;
+    if (verdict == CF_BLOCKED) ++filter->numBlocked;
+    return verdict;
+}
@@ -0,0 +1,66 @@
+#ifndef ContentFilter_INCLUDED
+#define ContentFilter_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <wchar.h>
+
+/**
+ * Banned terms, looked for in every chat
+ * message at once (Aho-Corasick), whatever their
+ * number: one table lookup per character.
+ *
+ * The terms are read from a file, one per line,
+ * in any case: a term matches whatever the case
+ * of the text. A message that contains a term is
+ * sent with the term masked, or not at all if
+ * the term's line starts with '!'. Empty lines,
+ * and lines that start with '#', are skipped.
+ *
+ * cfReload() compiles the file again in a thread
+ * of its own; the new terms are swapped in, all
+ * at once, at the next message filtered, so that
+ * messages never wait for a compilation.
+ */
+#define CF_MASK L'*'
+
+typedef enum {
+    CF_PASSED,
+    CF_MASKED,
+    CF_BLOCKED
+} CfVerdict;
+
+typedef struct _CfAutomaton CfAutomaton;
+
+CfAutomaton* cfCompile(char const* path);
+void cfFree(CfAutomaton* automaton);
+size_t cfNumTerms(CfAutomaton const* automaton);
+size_t cfNumStates(CfAutomaton const* automaton);
+CfVerdict cfRun(CfAutomaton const* automaton, wchar_t* text, size_t length, unsigned long* numMatchesPtr);
+
+typedef struct {
+    char const* path;
+    CfAutomaton* automaton; // in use; only ever touched by the filtering thread
+    CfAutomaton* _Atomic pending; // compiled, not in use yet
+    atomic_bool loading;
+    bool loaderStarted;
+    pthread_t loader;
+    atomic_ulong numReloadsFailed;
+    unsigned long numReloads;
+    unsigned long numMessages;
+    unsigned long numChars;
+    unsigned long numMatches;
+    unsigned long numMasked;
+    unsigned long numBlocked;
+    double secondsFiltering;
+} ContentFilter;
+
+bool cfInit(ContentFilter* filter, char const* path);
+void cfDestroy(ContentFilter* filter);
+bool cfReload(ContentFilter* filter);
+CfVerdict cfFilter(ContentFilter* filter, wchar_t* text);
+
+#endif // ContentFilter_INCLUDED
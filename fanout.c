@@ -0,0 +1,203 @@
+/**
+ * Each thread's share is a range of chunk
+ * numbers packed into one 64-bit word, next
+ * chunk in the low half and end in the high
+ * half, so that the owner taking from the front
+ * and thieves taking from the back agree
+ * through a single compare-and-swap.
+ */
+
+#include "fanout.h"
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define FO_CHUNK_SIZE 64 // items
+#define FO_CACHE_LINE 64 // bytes
+
+typedef struct {
+    _Atomic uint64_t range;
+    char padding[FO_CACHE_LINE - sizeof(uint64_t)]; // one share per cache line
+} FoShare;
+
+typedef struct {
+    FanoutPool* pool;
+    size_t index;
+} FoWorker;
+
+struct _FanoutPool {
+    pthread_t* threads;
+    FoWorker* workers;
+    size_t numThreads;
+    FoShare* shares; // one per thread, then the caller's
+
+    pthread_mutex_t mutex;
+    pthread_cond_t jobPosted;
+    pthread_cond_t jobDone;
+    uint64_t job;           // number of the current job
+    size_t numThreadsBusy;
+    bool stopping;
+
+    void* const* items;
+    size_t numItems;
+    FoTask task;
+    void* arg;
+};
+
+static uint64_t foPack(uint32_t next, uint32_t end) {
+    return ((uint64_t)end << 32) | next;
+}
+
+/** Takes a chunk from the front of the share, or from its back when stealing. */
+static bool foTake(FoShare* share, bool stealing, size_t* chunkPtr) {
+    uint64_t range = atomic_load(&share->range);
+    for (;;) {
+        uint32_t next = (uint32_t)range;
+        uint32_t end = (uint32_t)(range >> 32);
+        if (next >= end) return false;
+        uint64_t taken = stealing ? foPack(next, end - 1) : foPack(next + 1, end);
+        if (atomic_compare_exchange_weak(&share->range, &range, taken)) {
+            *chunkPtr = stealing ? end - 1 : next;
+            return true;
+        }
+    }
+}
+
+static void foWork(FanoutPool* pool, size_t self) {
+    size_t numShares = pool->numThreads + 1;
+    for (;;) {
+        size_t chunk;
+        bool found = foTake(&pool->shares[self], false, &chunk);
+        for (size_t k = 1; k < numShares && !found; ++k) {
+            found = foTake(&pool->shares[(self + k) % numShares], true, &chunk);
+        }
+        if (!found) return;
+
+        size_t begin = chunk * FO_CHUNK_SIZE;
+        size_t end = begin + FO_CHUNK_SIZE;
+        if (end > pool->numItems) end = pool->numItems;
+        for (size_t i = begin; i < end; ++i) {
+            pool->task(pool->items[i], pool->arg);
+        }
+    }
+}
+
+static void* foThreadMain(void* arg) {
+    FoWorker* worker = (FoWorker*)arg;
+    FanoutPool* pool = worker->pool;
+    uint64_t lastJob = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->stopping && pool->job == lastJob) {
+            pthread_cond_wait(&pool->jobPosted, &pool->mutex);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+        lastJob = pool->job;
+        pthread_mutex_unlock(&pool->mutex);
+
+        foWork(pool, worker->index);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->numThreadsBusy == 0) pthread_cond_signal(&pool->jobDone);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * Starts numThreads threads besides the caller's.
+ * They never get signals; those are left to the
+ * caller's thread. Returns NULL on failure.
+ */
+FanoutPool* foInit(size_t numThreads) {
+    FanoutPool* pool = (FanoutPool*)calloc(1, sizeof(FanoutPool));
+    if (!pool) return NULL;
+    pool->threads = (pthread_t*)malloc(numThreads * sizeof(pthread_t));
+    pool->workers = (FoWorker*)malloc(numThreads * sizeof(FoWorker));
+    pool->shares = (FoShare*)aligned_alloc(FO_CACHE_LINE, (numThreads + 1) * sizeof(FoShare));
+    if (!pool->threads || !pool->workers || !pool->shares) {
+        free((void*)pool->threads);
+        free((void*)pool->workers);
+        free((void*)pool->shares);
+        free((void*)pool);
+        return NULL;
+    }
+    for (size_t i = 0; i <= numThreads; ++i) {
+        atomic_init(&pool->shares[i].range, 0);
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->jobPosted, NULL);
+    pthread_cond_init(&pool->jobDone, NULL);
+
+    sigset_t allSignals, callerSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &callerSignals);
+    for (; pool->numThreads < numThreads; ++pool->numThreads) {
+        FoWorker* worker = &pool->workers[pool->numThreads];
+        worker->pool = pool;
+        worker->index = pool->numThreads;
+        if (pthread_create(&pool->threads[pool->numThreads], NULL, foThreadMain, worker) != 0) break;
+    }
+    pthread_sigmask(SIG_SETMASK, &callerSignals, NULL);
+
+    if (pool->numThreads < numThreads) {
+        foDestroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void foDestroy(FanoutPool* pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->jobPosted);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 0; i < pool->numThreads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->jobPosted);
+    pthread_cond_destroy(&pool->jobDone);
+    free((void*)pool->threads);
+    free((void*)pool->workers);
+    free((void*)pool->shares);
+    free((void*)pool);
+}
+
+/**
+ * Calls task(items[i], arg) for each i, spread
+ * over the threads, and waits for all of them
+ * to be done.
+ */
+void foRun(FanoutPool* pool, void* const* items, size_t numItems, FoTask task, void* arg) {
+    if (numItems == 0) return;
+    size_t numChunks = (numItems + FO_CHUNK_SIZE - 1) / FO_CHUNK_SIZE;
+    size_t numShares = pool->numThreads + 1;
+    for (size_t i = 0; i < numShares; ++i) {
+        atomic_store(&pool->shares[i].range, foPack(
+            (uint32_t)(numChunks * i / numShares),
+            (uint32_t)(numChunks * (i + 1) / numShares)
+        ));
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->items = items;
+    pool->numItems = numItems;
+    pool->task = task;
+    pool->arg = arg;
+    pool->numThreadsBusy = pool->numThreads;
+    ++pool->job;
+    pthread_cond_broadcast(&pool->jobPosted);
+    pthread_mutex_unlock(&pool->mutex);
+
+    foWork(pool, pool->numThreads);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->numThreadsBusy > 0) {
+        pthread_cond_wait(&pool->jobDone, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
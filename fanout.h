@@ -0,0 +1,30 @@
+#ifndef Fanout_INCLUDED
+#define Fanout_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * A pool of threads that run a task on every
+ * item of an array, e.g. send the same frame to
+ * every socket of a list.
+ *
+ * The array is cut into chunks, and each thread
+ * (the caller included) is handed a share of
+ * them. A thread that is done with its share
+ * takes chunks from the end of the others'
+ * shares (work stealing), so that a few slow
+ * items do not hold everybody up. Each item is
+ * handled by exactly one thread, and foRun()
+ * only returns once all of them have been.
+ */
+typedef struct _FanoutPool FanoutPool;
+
+typedef void (*FoTask)(void* item, void* arg);
+
+FanoutPool* foInit(size_t numThreads);
+void foDestroy(FanoutPool* pool);
+
+void foRun(FanoutPool* pool, void* const* items, size_t numItems, FoTask task, void* arg);
+
+#endif // Fanout_INCLUDED
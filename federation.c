@@ -0,0 +1,152 @@
+#define _GNU_SOURCE // SOCK_NONBLOCK
+
+#include "federation.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <wchar.h>
+
+#define FED_REDIAL_SECONDS 1.0
+
+/** Splits "HOST:PORT" (or "[HOST]:PORT") and resolves it. */
+static bool fedResolve(FedPeer* peer) {
+    char host[256];
+    char const* colon = strrchr(peer->spec, ':');
+    if (colon == NULL || colon == peer->spec || colon[1] == '\0') return false;
+
+    char const* hostStart = peer->spec;
+    size_t hostLength = colon - peer->spec;
+    if (hostStart[0] == '[' && colon[-1] == ']') {
+        ++hostStart;
+        hostLength -= 2;
+    }
+    if (hostLength == 0 || hostLength >= sizeof(host)) return false;
+    memcpy(host, hostStart, hostLength);
+    host[hostLength] = '\0';
+
+    struct addrinfo hints;
+    memset((void*)&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0) return false;
+    memcpy((void*)&peer->address, (void*)result->ai_addr, result->ai_addrlen);
+    peer->addressLength = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+bool fedInit(Federation* fed, NodeId nodeId, char const* const* peerSpecs, size_t numPeers) {
+    fed->nodeId = nodeId;
+    fed->peers = NULL;
+    fed->numPeers = 0;
+    fed->origins = NULL;
+    fed->numOrigins = fed->originsCapacity = 0;
+    fed->numRelayed = fed->numReceived = fed->numDuplicates = 0;
+
+    // Start numbering where the previous run of
+    // this node can not have got to, so that its
+    // peers do not take new messages for old ones.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    fed->nextSequence = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+
+    if (numPeers == 0) return true;
+    fed->peers = (FedPeer*)calloc(numPeers, sizeof(FedPeer));
+    if (fed->peers == NULL) return false;
+    fed->numPeers = numPeers;
+    for (size_t i = 0; i < numPeers; ++i) {
+        FedPeer* peer = &fed->peers[i];
+        peer->spec = peerSpecs[i];
+        if (!fedResolve(peer)) {
+            wprintf(L"error: can not resolve peer %s\n", peer->spec);
+            fedDestroy(fed);
+            return false;
+        }
+    }
+    return true;
+}
+
+void fedDestroy(Federation* fed) {
+    free((void*)fed->peers);
+    fed->peers = NULL;
+    fed->numPeers = 0;
+    free((void*)fed->origins);
+    fed->origins = NULL;
+    fed->numOrigins = fed->originsCapacity = 0;
+}
+
+/**
+ * Starts connecting to the peer, without waiting
+ * for the connection to be established. Returns
+ * the socket, or -1 if it failed right away, in
+ * which case it will be retried later.
+ */
+int fedDial(FedPeer* peer, double now) {
+    int confd = socket(peer->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (confd >= 0
+        && connect(confd, (struct sockaddr const*)&peer->address, peer->addressLength) != 0
+        && errno != EINPROGRESS
+    ) {
+        close(confd);
+        confd = -1;
+    }
+    if (confd < 0) {
+        fedLinkLost(peer, now);
+        return -1;
+    }
+    peer->linked = true;
+    return confd;
+}
+
+void fedLinkLost(FedPeer* peer, double now) {
+    peer->linked = false;
+    peer->nextDialAt = now + FED_REDIAL_SECONDS;
+}
+
+/** -1 if there is no peer to dial. */
+double fedSecondsUntilNextDial(Federation const* fed, double now) {
+    double result = -1;
+    for (size_t i = 0; i < fed->numPeers; ++i) {
+        FedPeer const* peer = &fed->peers[i];
+        if (peer->linked || peer->isSelf) continue;
+        double wait = (peer->nextDialAt > now) ? peer->nextDialAt - now : 0;
+        if (result < 0 || wait < result) result = wait;
+    }
+    return result;
+}
+
+uint64_t fedNextSequence(Federation* fed) {
+    return fed->nextSequence++;
+}
+
+/**
+ * Whether a message relayed by another node has
+ * not been seen yet. Each node has only a few
+ * peers, hence the plain array.
+ */
+bool fedIsNew(Federation* fed, NodeId origin, uint64_t sequence) {
+    if (origin == fed->nodeId) return false;
+    for (size_t i = 0; i < fed->numOrigins; ++i) {
+        FedOrigin* known = &fed->origins[i];
+        if (known->origin != origin) continue;
+        if (sequence <= known->lastSequence) return false;
+        known->lastSequence = sequence;
+        return true;
+    }
+
+    if (fed->numOrigins == fed->originsCapacity) {
+        size_t newCapacity = fed->originsCapacity ? fed->originsCapacity * 2 : 8;
+        FedOrigin* newOrigins = (FedOrigin*)realloc((void*)fed->origins, newCapacity * sizeof(FedOrigin));
+        if (newOrigins == NULL) return true; // deliver it anyway; it is only not remembered
+        fed->origins = newOrigins;
+        fed->originsCapacity = newCapacity;
+    }
+    fed->origins[fed->numOrigins].origin = origin;
+    fed->origins[fed->numOrigins].lastSequence = sequence;
+    ++fed->numOrigins;
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef Federation_INCLUDED
+#define Federation_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+/**
+ * This server's place in a cluster of servers
+ * that relay chat messages to each other.
+ *
+ * Every server opens a link to each peer it was
+ * given, and keeps reopening it while it is
+ * down. A chat message is relayed by the server
+ * its sender is on, once to every other node,
+ * and each node delivers it to its own clients
+ * only: the peers must form a full mesh.
+ *
+ * Messages are numbered per origin node, in
+ * increasing order, so a node that receives one
+ * twice (e.g. when two servers have opened a
+ * link to each other) recognizes the duplicate.
+ */
+typedef struct {
+    char const* spec; // "HOST:PORT", as given
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    bool linked; // a link to it is open or being opened
+    bool isSelf; // it turned out to be this very node; never dialed again
+    double nextDialAt;
+} FedPeer;
+
+typedef struct {
+    NodeId origin;
+    uint64_t lastSequence;
+} FedOrigin;
+
+typedef struct {
+    NodeId nodeId;
+    uint64_t nextSequence;
+    FedPeer* peers;
+    size_t numPeers;
+    FedOrigin* origins;
+    size_t numOrigins;
+    size_t originsCapacity;
+    unsigned long numRelayed;    // sent to other nodes
+    unsigned long numReceived;   // from other nodes, delivered locally
+    unsigned long numDuplicates; // from other nodes, dropped
+} Federation;
+
+bool fedInit(Federation* fed, NodeId nodeId, char const* const* peerSpecs, size_t numPeers);
+void fedDestroy(Federation* fed);
+
+int fedDial(FedPeer* peer, double now);
+void fedLinkLost(FedPeer* peer, double now);
+double fedSecondsUntilNextDial(Federation const* fed, double now);
+
+uint64_t fedNextSequence(Federation* fed);
+bool fedIsNew(Federation* fed, NodeId origin, uint64_t sequence);
+
+#endif // Federation_INCLUDED
@@ -0,0 +1,158 @@
+/**
+ * Layout of the buffer:
+ *
+ *     [ text before cursor | ..gap.. | text after cursor ]
+ *     0                gapStart   gapEnd           capacity
+ *
+ * The character right after the cursor is
+ * at data[gapEnd]. Inserting writes into
+ * data[gapStart] and grows the text on the
+ * left; deleting just widens the gap.
+ */
+
+#include "gapbuf.h"
+#include <string.h>
+
+#define GB_INITIAL_CAPACITY 256
+
+struct _GapBuffer {
+    wchar_t* data;
+    size_t capacity;
+    size_t gapStart;
+    size_t gapEnd;
+    size_t maxLength;
+};
+
+GapBuffer* gbInit(size_t maxLength) {
+    GapBuffer* gb = (GapBuffer*)malloc(sizeof(GapBuffer));
+    if (!gb) return NULL;
+
+    gb->capacity = GB_INITIAL_CAPACITY;
+    gb->data = (wchar_t*)malloc(gb->capacity * sizeof(gb->data[0]));
+    if (!gb->data) {
+        free((void*)gb);
+        return NULL;
+    }
+    gb->gapStart = 0;
+    gb->gapEnd = gb->capacity;
+    gb->maxLength = maxLength;
+    return gb;
+}
+
+void gbDestroy(GapBuffer* gb) {
+    free((void*)gb->data);
+    free((void*)gb);
+}
+
+void gbClear(GapBuffer* gb) {
+    gb->gapStart = 0;
+    gb->gapEnd = gb->capacity;
+}
+
+size_t gbLength(GapBuffer const* gb) {
+    return gb->capacity - (gb->gapEnd - gb->gapStart);
+}
+
+size_t gbCursor(GapBuffer const* gb) {
+    return gb->gapStart;
+}
+
+size_t gbMaxLength(GapBuffer const* gb) {
+    return gb->maxLength;
+}
+
+wchar_t gbCharAt(GapBuffer const* gb, size_t pos) {
+    if (pos < gb->gapStart) return gb->data[pos];
+    return gb->data[pos + (gb->gapEnd - gb->gapStart)];
+}
+
+static bool gbGrow(GapBuffer* gb) {
+    size_t newCapacity = gb->capacity * 2;
+    wchar_t* newData = (wchar_t*)realloc((void*)gb->data, newCapacity * sizeof(gb->data[0]));
+    if (!newData) return false;
+
+    // Move the text after the gap to the end of the new array.
+    size_t tailLength = gb->capacity - gb->gapEnd;
+    size_t newGapEnd = newCapacity - tailLength;
+    memmove((void*)(newData + newGapEnd), (void*)(newData + gb->gapEnd), tailLength * sizeof(newData[0]));
+
+    gb->data = newData;
+    gb->gapEnd = newGapEnd;
+    gb->capacity = newCapacity;
+    return true;
+}
+
+bool gbInsert(GapBuffer* gb, wchar_t c) {
+    if (gbLength(gb) >= gb->maxLength) return false;
+    if (gb->gapStart == gb->gapEnd && !gbGrow(gb)) return false;
+    gb->data[gb->gapStart++] = c;
+    return true;
+}
+
+bool gbDeleteBefore(GapBuffer* gb) {
+    if (gb->gapStart == 0) return false;
+    --gb->gapStart;
+    return true;
+}
+
+bool gbDeleteAfter(GapBuffer* gb) {
+    if (gb->gapEnd == gb->capacity) return false;
+    ++gb->gapEnd;
+    return true;
+}
+
+void gbMoveCursorTo(GapBuffer* gb, size_t pos) {
+    size_t length = gbLength(gb);
+    if (pos > length) pos = length;
+
+    if (pos < gb->gapStart) {
+        size_t delta = gb->gapStart - pos;
+        memmove((void*)(gb->data + gb->gapEnd - delta), (void*)(gb->data + pos), delta * sizeof(gb->data[0]));
+        gb->gapStart -= delta;
+        gb->gapEnd -= delta;
+    } else if (pos > gb->gapStart) {
+        size_t delta = pos - gb->gapStart;
+        memmove((void*)(gb->data + gb->gapStart), (void*)(gb->data + gb->gapEnd), delta * sizeof(gb->data[0]));
+        gb->gapStart += delta;
+        gb->gapEnd += delta;
+    }
+}
+
+bool gbMoveLeft(GapBuffer* gb) {
+    if (gb->gapStart == 0) return false;
+    gb->data[--gb->gapEnd] = gb->data[--gb->gapStart];
+    return true;
+}
+
+bool gbMoveRight(GapBuffer* gb) {
+    if (gb->gapEnd == gb->capacity) return false;
+    gb->data[gb->gapStart++] = gb->data[gb->gapEnd++];
+    return true;
+}
+
+size_t gbLineStart(GapBuffer const* gb, size_t pos) {
+    while (pos > 0 && gbCharAt(gb, pos - 1) != L'\n') {
+        --pos;
+    }
+    return pos;
+}
+
+size_t gbLineEnd(GapBuffer const* gb, size_t pos) {
+    size_t length = gbLength(gb);
+    while (pos < length && gbCharAt(gb, pos) != L'\n') {
+        ++pos;
+    }
+    return pos;
+}
+
+wchar_t* gbCopyToNewString(GapBuffer const* gb) {
+    size_t length = gbLength(gb);
+    wchar_t* s = (wchar_t*)malloc((length + 1) * sizeof(s[0]));
+    if (!s) return NULL;
+
+    size_t tailLength = gb->capacity - gb->gapEnd;
+    memcpy((void*)s, (void*)gb->data, gb->gapStart * sizeof(s[0]));
+    memcpy((void*)(s + gb->gapStart), (void*)(gb->data + gb->gapEnd), tailLength * sizeof(s[0]));
+    s[length] = L'\0';
+    return s;
+}
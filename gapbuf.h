@@ -0,0 +1,42 @@
+#ifndef GapBuf_INCLUDED
+#define GapBuf_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <wchar.h>
+
+/**
+ * A gap buffer of wide characters, used as the
+ * backing store of the message input editor.
+ *
+ * The text is kept in one array with a "gap"
+ * of unused cells at the cursor, so inserting
+ * or deleting at the cursor is O(1) (amortized)
+ * no matter how long the text is. Moving the
+ * cursor by k characters costs O(k).
+ */
+typedef struct _GapBuffer GapBuffer;
+
+GapBuffer* gbInit(size_t maxLength);
+void gbDestroy(GapBuffer* gb);
+void gbClear(GapBuffer* gb);
+
+size_t gbLength(GapBuffer const* gb);
+size_t gbCursor(GapBuffer const* gb);
+size_t gbMaxLength(GapBuffer const* gb);
+wchar_t gbCharAt(GapBuffer const* gb, size_t pos);
+
+bool gbInsert(GapBuffer* gb, wchar_t c);
+bool gbDeleteBefore(GapBuffer* gb);
+bool gbDeleteAfter(GapBuffer* gb);
+
+void gbMoveCursorTo(GapBuffer* gb, size_t pos);
+bool gbMoveLeft(GapBuffer* gb);
+bool gbMoveRight(GapBuffer* gb);
+
+size_t gbLineStart(GapBuffer const* gb, size_t pos);
+size_t gbLineEnd(GapBuffer const* gb, size_t pos);
+
+wchar_t* gbCopyToNewString(GapBuffer const* gb);
+
+#endif // GapBuf_INCLUDED
@@ -0,0 +1,297 @@
+/**
+ * On the wire, after the successor's request
+ * byte:
+ *
+ *     header     { magic, number of fds, state length }
+ *     state      the bytes of the HoBuffer
+ *     fds        in batches of HO_FDS_PER_BATCH, each
+ *                attached (SCM_RIGHTS) to one byte
+ *
+ * and finally one byte back from the successor
+ * once it holds everything. Each side reads
+ * exactly as many bytes as the other wrote, so
+ * the descriptors always arrive with the byte
+ * they were sent with.
+ */
+
+#define _GNU_SOURCE // accept4(), MSG_CMSG_CLOEXEC, struct ucred
+
+#include "handoff.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define HO_MAGIC 0x74636863686f3033ull // "tcpchho3"; change it when the state layout changes
+#define HO_FDS_PER_BATCH 250 // the kernel accepts at most 253 per message
+#define HO_ACK_TIMEOUT_MS 5000
+
+typedef struct {
+    uint64_t magic;
+    uint64_t numFds;
+    uint64_t stateLength;
+} HoHeader;
+
+void hoBufferInit(HoBuffer* buf) {
+    buf->data = NULL;
+    buf->length = buf->capacity = buf->readPos = 0;
+    buf->failed = false;
+}
+
+void hoBufferFree(HoBuffer* buf) {
+    free((void*)buf->data);
+    hoBufferInit(buf);
+}
+
+void hoPut(HoBuffer* buf, void const* data, size_t size) {
+    if (buf->failed) return;
+    if (buf->length + size > buf->capacity) {
+        size_t newCapacity = buf->capacity ? buf->capacity : 4096;
+        while (newCapacity < buf->length + size) newCapacity *= 2;
+        char* newData = (char*)realloc((void*)buf->data, newCapacity);
+        if (newData == NULL) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = newData;
+        buf->capacity = newCapacity;
+    }
+    memcpy((void*)(buf->data + buf->length), data, size);
+    buf->length += size;
+}
+
+void hoPutU64(HoBuffer* buf, uint64_t value) {
+    hoPut(buf, &value, sizeof(value));
+}
+
+void hoPutDouble(HoBuffer* buf, double value) {
+    hoPut(buf, &value, sizeof(value));
+}
+
+void hoPutString(HoBuffer* buf, wchar_t const* s) {
+    size_t length = wcslen(s);
+    hoPutU64(buf, length);
+    hoPut(buf, s, length * sizeof(wchar_t));
+}
+
+/** Leaves `data` as it is if there are not `size` bytes left. */
+bool hoGet(HoBuffer* buf, void* data, size_t size) {
+    if (buf->failed || buf->length - buf->readPos < size) {
+        buf->failed = true;
+        return false;
+    }
+    memcpy(data, (void*)(buf->data + buf->readPos), size);
+    buf->readPos += size;
+    return true;
+}
+
+uint64_t hoGetU64(HoBuffer* buf) {
+    uint64_t value = 0;
+    hoGet(buf, &value, sizeof(value));
+    return value;
+}
+
+double hoGetDouble(HoBuffer* buf) {
+    double value = 0;
+    hoGet(buf, &value, sizeof(value));
+    return value;
+}
+
+bool hoGetString(HoBuffer* buf, wchar_t* dest, size_t maxLength) {
+    uint64_t length = hoGetU64(buf);
+    if (length > maxLength) buf->failed = true;
+    if (buf->failed || !hoGet(buf, dest, length * sizeof(wchar_t))) {
+        dest[0] = L'\0';
+        return false;
+    }
+    dest[length] = L'\0';
+    return true;
+}
+
+static bool hoAddress(char const* path, struct sockaddr_un* addr) {
+    memset((void*)addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/**
+ * Replaces whatever is at `path`: either nothing,
+ * a stale socket, or the socket of the server
+ * this one has just taken over from.
+ */
+int hoListen(char const* path) {
+    struct sockaddr_un addr;
+    if (!hoAddress(path, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** -1 if no server is running there. */
+int hoConnect(char const* path) {
+    struct sockaddr_un addr;
+    if (!hoAddress(path, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    char request = 'H';
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || send(fd, &request, 1, MSG_NOSIGNAL) != 1
+    ) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Accepts the successor's connection and its
+ * request, if it runs as the same user as this
+ * process and asks within HO_ACK_TIMEOUT_MS: it
+ * gets every connection and the resume secret.
+ * The returned socket is blocking.
+ */
+int hoAcceptSuccessor(int listeningFd) {
+    int channel = accept4(listeningFd, NULL, NULL, SOCK_CLOEXEC);
+    if (channel < 0) return -1;
+    struct ucred peer;
+    socklen_t peerLength = sizeof(peer);
+    struct pollfd pfd = { channel, POLLIN, 0 };
+    char request;
+    if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) != 0 || peer.uid != geteuid()
+        || poll(&pfd, 1, HO_ACK_TIMEOUT_MS) != 1
+        || recv(channel, &request, 1, 0) != 1 || request != 'H'
+    ) {
+        close(channel);
+        return -1;
+    }
+    return channel;
+}
+
+static bool hoSendAll(int channel, void const* data, size_t size) {
+    char const* bytes = (char const*)data;
+    while (size > 0) {
+        ssize_t n = send(channel, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool hoReceiveAll(int channel, void* data, size_t size) {
+    char* bytes = (char*)data;
+    while (size > 0) {
+        ssize_t n = recv(channel, bytes, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * Sends everything and waits for the successor
+ * to confirm. Only then may this process stop
+ * serving; if this fails, it must go on.
+ */
+bool hoSend(int channel, HoBuffer const* state, int const* fds, size_t numFds) {
+    HoHeader header = { HO_MAGIC, numFds, state->length };
+    if (!hoSendAll(channel, &header, sizeof(header)) || !hoSendAll(channel, state->data, state->length)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < numFds; i += HO_FDS_PER_BATCH) {
+        size_t batchSize = (numFds - i < HO_FDS_PER_BATCH) ? numFds - i : HO_FDS_PER_BATCH;
+        char control[CMSG_SPACE(HO_FDS_PER_BATCH * sizeof(int))];
+        memset(control, 0, sizeof(control));
+        char byte = 'F';
+        struct iovec iov = { &byte, 1 };
+        struct msghdr msg;
+        memset((void*)&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(batchSize * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batchSize * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + i, batchSize * sizeof(int));
+        ssize_t n;
+        do {
+            n = sendmsg(channel, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n != 1) return false;
+    }
+
+    struct pollfd pfd = { channel, POLLIN, 0 };
+    char ack;
+    return poll(&pfd, 1, HO_ACK_TIMEOUT_MS) == 1 && recv(channel, &ack, 1, 0) == 1;
+}
+
+/**
+ * Receives what hoSend() sent and confirms it.
+ * On success, the caller owns *fdsPtr and the
+ * descriptors in it.
+ */
+bool hoReceive(int channel, HoBuffer* state, int** fdsPtr, size_t* numFdsPtr) {
+    hoBufferInit(state);
+    *fdsPtr = NULL;
+    *numFdsPtr = 0;
+
+    HoHeader header;
+    if (!hoReceiveAll(channel, &header, sizeof(header)) || header.magic != HO_MAGIC) return false;
+    size_t numFds = 0;
+    state->data = (char*)malloc(header.stateLength ? header.stateLength : 1);
+    int* fds = (int*)malloc((header.numFds ? header.numFds : 1) * sizeof(int));
+    if (state->data == NULL || fds == NULL) goto FAIL;
+    state->capacity = header.stateLength;
+    if (!hoReceiveAll(channel, state->data, header.stateLength)) goto FAIL;
+    state->length = header.stateLength;
+
+    while (numFds < header.numFds) {
+        char control[CMSG_SPACE(HO_FDS_PER_BATCH * sizeof(int))];
+        char byte;
+        struct iovec iov = { &byte, 1 };
+        struct msghdr msg;
+        memset((void*)&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n;
+        do {
+            n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (n != 1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) goto FAIL;
+        size_t batchSize = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (batchSize > header.numFds - numFds) goto FAIL;
+        memcpy(fds + numFds, CMSG_DATA(cmsg), batchSize * sizeof(int));
+        numFds += batchSize;
+    }
+
+    char ack = 'K';
+    if (send(channel, &ack, 1, MSG_NOSIGNAL) != 1) goto FAIL;
+    *fdsPtr = fds;
+    *numFdsPtr = numFds;
+    return true;
+
+FAIL:
+    for (size_t i = 0; i < numFds; ++i) close(fds[i]);
+    free((void*)fds);
+    hoBufferFree(state);
+    return false;
+}
@@ -0,0 +1,51 @@
+#ifndef Handoff_INCLUDED
+#define Handoff_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+/**
+ * Hot restart: a new server process takes the
+ * listening socket, every connection and the
+ * state that goes with them over from the
+ * running one, through a Unix domain socket, so
+ * that no client notices.
+ *
+ * The running server listens on that socket
+ * (hoListen). The new one connects to it and
+ * asks for the handoff (hoConnect). The running
+ * server then sends its state as one byte string
+ * followed by its file descriptors (hoSend),
+ * waits for the new one to confirm it got them
+ * all (hoReceive), and exits.
+ */
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    size_t readPos;
+    bool failed; // ran out of memory while writing, or of data while reading
+} HoBuffer;
+
+void hoBufferInit(HoBuffer* buf);
+void hoBufferFree(HoBuffer* buf);
+
+void hoPut(HoBuffer* buf, void const* data, size_t size);
+void hoPutU64(HoBuffer* buf, uint64_t value);
+void hoPutDouble(HoBuffer* buf, double value);
+void hoPutString(HoBuffer* buf, wchar_t const* s);
+bool hoGet(HoBuffer* buf, void* data, size_t size);
+uint64_t hoGetU64(HoBuffer* buf);
+double hoGetDouble(HoBuffer* buf);
+bool hoGetString(HoBuffer* buf, wchar_t* dest, size_t maxLength);
+
+int hoListen(char const* path);
+int hoConnect(char const* path);
+int hoAcceptSuccessor(int listeningFd);
+
+bool hoSend(int channel, HoBuffer const* state, int const* fds, size_t numFds);
+bool hoReceive(int channel, HoBuffer* state, int** fdsPtr, size_t* numFdsPtr);
+
+#endif // Handoff_INCLUDED
@@ -0,0 +1,145 @@
+/**
+ * A chained hash table. Each string is allocated
+ * together with its entry, right after it, so
+ * the entry can be found back from the string.
+ */
+
+#include "intern.h"
+#include <stddef.h>
+#include <string.h>
+
+#define IP_INITIAL_NUM_BUCKETS 64
+
+typedef struct _IpEntry {
+    struct _IpEntry* next;
+    size_t hash;
+    size_t refCount;
+    size_t length;
+    wchar_t text[];
+} IpEntry;
+
+struct _InternPool {
+    IpEntry** buckets;
+    size_t numBuckets;
+    size_t numEntries;
+};
+
+InternPool* ipInit() {
+    InternPool* pool = (InternPool*)malloc(sizeof(InternPool));
+    if (!pool) return NULL;
+    pool->buckets = (IpEntry**)calloc(IP_INITIAL_NUM_BUCKETS, sizeof(IpEntry*));
+    if (!pool->buckets) {
+        free((void*)pool);
+        return NULL;
+    }
+    pool->numBuckets = IP_INITIAL_NUM_BUCKETS;
+    pool->numEntries = 0;
+    return pool;
+}
+
+void ipDestroy(InternPool* pool) {
+    for (size_t b = 0; b < pool->numBuckets; ++b) {
+        IpEntry* entry = pool->buckets[b];
+        while (entry != NULL) {
+            IpEntry* next = entry->next;
+            free((void*)entry);
+            entry = next;
+        }
+    }
+    free((void*)pool->buckets);
+    free((void*)pool);
+}
+
+static IpEntry* ipEntryOf(wchar_t const* interned) {
+    return (IpEntry*)((char*)interned - offsetof(IpEntry, text));
+}
+
+static size_t ipHash(wchar_t const* s, size_t length) {
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) h = (h ^ (size_t)s[i]) * 1099511628211ULL;
+    return h;
+}
+
+static void ipRehash(InternPool* pool) {
+    size_t newNumBuckets = pool->numBuckets * 2;
+    IpEntry** newBuckets = (IpEntry**)calloc(newNumBuckets, sizeof(IpEntry*));
+    if (!newBuckets) return; // the chains just get longer
+    for (size_t b = 0; b < pool->numBuckets; ++b) {
+        IpEntry* entry = pool->buckets[b];
+        while (entry != NULL) {
+            IpEntry* next = entry->next;
+            size_t nb = entry->hash & (newNumBuckets - 1);
+            entry->next = newBuckets[nb];
+            newBuckets[nb] = entry;
+            entry = next;
+        }
+    }
+    free((void*)pool->buckets);
+    pool->buckets = newBuckets;
+    pool->numBuckets = newNumBuckets;
+}
+
+/**
+ * Returns the interned copy of the first `length`
+ * characters of `s`, with one more reference
+ * taken, or NULL if out of memory.
+ */
+wchar_t const* ipIntern(InternPool* pool, wchar_t const* s, size_t length) {
+    size_t hash = ipHash(s, length);
+    for (IpEntry* entry = pool->buckets[hash & (pool->numBuckets - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->length == length && wmemcmp(entry->text, s, length) == 0) {
+            ++entry->refCount;
+            return entry->text;
+        }
+    }
+
+    if (pool->numEntries >= pool->numBuckets) ipRehash(pool);
+
+    IpEntry* entry = (IpEntry*)malloc(sizeof(IpEntry) + (length + 1) * sizeof(wchar_t));
+    if (!entry) return NULL;
+    entry->hash = hash;
+    entry->refCount = 1;
+    entry->length = length;
+    wmemcpy(entry->text, s, length);
+    entry->text[length] = L'\0';
+
+    size_t b = hash & (pool->numBuckets - 1);
+    entry->next = pool->buckets[b];
+    pool->buckets[b] = entry;
+    ++pool->numEntries;
+    return entry->text;
+}
+
+/**
+ * Returns the interned copy of the first `length`
+ * characters of `s` if there is one, without
+ * taking a reference, or NULL.
+ */
+wchar_t const* ipFind(InternPool const* pool, wchar_t const* s, size_t length) {
+    size_t hash = ipHash(s, length);
+    for (IpEntry* entry = pool->buckets[hash & (pool->numBuckets - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->length == length && wmemcmp(entry->text, s, length) == 0) {
+            return entry->text;
+        }
+    }
+    return NULL;
+}
+
+/** Does nothing if `interned` is NULL. */
+void ipRelease(InternPool* pool, wchar_t const* interned) {
+    if (interned == NULL) return;
+    IpEntry* entry = ipEntryOf(interned);
+    if (--entry->refCount > 0) return;
+
+    IpEntry** link = &pool->buckets[entry->hash & (pool->numBuckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    free((void*)entry);
+    --pool->numEntries;
+}
+
+size_t ipSize(InternPool const* pool) {
+    return pool->numEntries;
+}
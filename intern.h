@@ -0,0 +1,25 @@
+#ifndef Intern_INCLUDED
+#define Intern_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <wchar.h>
+
+/**
+ * A pool of immutable, reference-counted wide
+ * strings, each stored only once however many
+ * times it is interned. Interned strings can be
+ * compared by pointer.
+ */
+typedef struct _InternPool InternPool;
+
+InternPool* ipInit();
+void ipDestroy(InternPool* pool);
+
+wchar_t const* ipIntern(InternPool* pool, wchar_t const* s, size_t length);
+wchar_t const* ipFind(InternPool const* pool, wchar_t const* s, size_t length);
+void ipRelease(InternPool* pool, wchar_t const* interned);
+
+size_t ipSize(InternPool const* pool);
+
+#endif // Intern_INCLUDED
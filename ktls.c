@@ -0,0 +1,424 @@
+/**
+ * Once the handshake is over, each side has
+ * sent exactly one record under the new keys,
+ * its Finished message; the kernel takes over
+ * at record number 1. Session resumption and
+ * renegotiation are turned off, so that this
+ * always holds.
+ *
+ * The keys are derived like OpenSSL itself
+ * does in TLS 1.2 (RFC 5246, section 6.3): the
+ * key block is PRF(master secret, "key
+ * expansion", server random + client random),
+ * and with AES-GCM holds the client's write
+ * key, the server's, then the client's 4-byte
+ * implicit nonce (the kernel's "salt") and the
+ * server's.
+ */
+
+#include "ktls.h"
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/tls.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/x509v3.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#define KT_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define KT_FIRST_RECORD 1
+#define KT_SALT_LENGTH 4
+#define KT_MAX_KEY_LENGTH 32
+
+struct _KtContext {
+    SSL_CTX* ssl;
+    bool isServer;
+};
+
+/**
+ * The OpenSSL session of each socket, indexed by
+ * fd: during the handshake, then for good if
+ * the kernel could not take it over. Sockets
+ * with kernel TLS or none at all have none.
+ */
+typedef struct {
+    SSL* ssl;
+    bool isServer;
+    bool handshaking;
+} KtSession;
+
+static KtSession* sessions = NULL;
+static size_t numSessionSlots = 0;
+
+static BIO_METHOD* socketMethod = NULL; // made once, kept for good
+
+static SSL* ktSession(int fd) {
+    return ((size_t)fd < numSessionSlots) ? sessions[fd].ssl : NULL;
+}
+
+//////////////////////
+// SOCKET BIO       //
+//////////////////////
+
+// Like OpenSSL's own socket BIO, but never raises SIGPIPE.
+
+static int ktBioWrite(BIO* bio, char const* bytes, int numBytes) {
+    BIO_clear_retry_flags(bio);
+    ssize_t n = send((int)BIO_get_fd(bio, NULL), (void const*)bytes, (size_t)numBytes, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) BIO_set_retry_write(bio);
+    return (int)n;
+}
+
+static int ktBioRead(BIO* bio, char* bytes, int numBytes) {
+    BIO_clear_retry_flags(bio);
+    ssize_t n = recv((int)BIO_get_fd(bio, NULL), (void*)bytes, (size_t)numBytes, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) BIO_set_retry_read(bio);
+    return (int)n;
+}
+
+static long ktBioCtrl(BIO* bio, int cmd, long num, void* ptr) {
+    (void)num;
+    switch (cmd) {
+        case BIO_C_SET_FD:
+            BIO_set_data(bio, (void*)(intptr_t)*(int*)ptr);
+            BIO_set_init(bio, 1);
+            return 1;
+        case BIO_C_GET_FD:
+            if (ptr != NULL) *(int*)ptr = (int)(intptr_t)BIO_get_data(bio);
+            return (long)(intptr_t)BIO_get_data(bio);
+        case BIO_CTRL_FLUSH:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static BIO* ktNewSocketBio(int fd) {
+    if (socketMethod == NULL) {
+        socketMethod = BIO_meth_new(BIO_TYPE_SOURCE_SINK | BIO_get_new_index(), "tcpchat socket");
+        if (socketMethod == NULL
+            || !BIO_meth_set_write(socketMethod, ktBioWrite)
+            || !BIO_meth_set_read(socketMethod, ktBioRead)
+            || !BIO_meth_set_ctrl(socketMethod, ktBioCtrl)
+        ) {
+            BIO_meth_free(socketMethod);
+            socketMethod = NULL;
+            return NULL;
+        }
+    }
+    BIO* bio = BIO_new(socketMethod);
+    if (bio != NULL) BIO_set_fd(bio, fd, BIO_NOCLOSE);
+    return bio;
+}
+
+//////////////////////
+// CONTEXTS         //
+//////////////////////
+
+static KtContext* ktNewContext(SSL_METHOD const* method, bool isServer) {
+    KtContext* ctx = (KtContext*)malloc(sizeof(KtContext));
+    if (ctx == NULL) return NULL;
+    ctx->isServer = isServer;
+    ctx->ssl = SSL_CTX_new(method);
+    if (ctx->ssl == NULL
+        || !SSL_CTX_set_min_proto_version(ctx->ssl, TLS1_2_VERSION)
+        || !SSL_CTX_set_max_proto_version(ctx->ssl, TLS1_2_VERSION)
+        || !SSL_CTX_set_cipher_list(ctx->ssl, KT_CIPHERS)
+    ) {
+        ktFreeContext(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_options(ctx->ssl, SSL_OP_NO_TICKET | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_session_cache_mode(ctx->ssl, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_mode(ctx->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return ctx;
+}
+
+/** Returns NULL if the files cannot be loaded. */
+KtContext* ktServerContext(char const* certFile, char const* keyFile) {
+    KtContext* ctx = ktNewContext(TLS_server_method(), true);
+    if (ctx == NULL) return NULL;
+    if (SSL_CTX_use_certificate_chain_file(ctx->ssl, certFile) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx->ssl, keyFile, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx->ssl) != 1
+    ) {
+        ktFreeContext(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * The server's certificate is checked against
+ * the given CA certificates, or the system's if
+ * caFile is NULL.
+ */
+KtContext* ktClientContext(char const* caFile) {
+    KtContext* ctx = ktNewContext(TLS_client_method(), false);
+    if (ctx == NULL) return NULL;
+    int loaded = (caFile != NULL)
+        ? SSL_CTX_load_verify_locations(ctx->ssl, caFile, NULL)
+        : SSL_CTX_set_default_verify_paths(ctx->ssl);
+    if (loaded != 1) {
+        ktFreeContext(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx->ssl, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+void ktFreeContext(KtContext* ctx) {
+    if (ctx == NULL) return;
+    SSL_CTX_free(ctx->ssl);
+    free((void*)ctx);
+}
+
+//////////////////////
+// HANDSHAKE        //
+//////////////////////
+
+/**
+ * Starts a handshake on the socket, as the
+ * context's side. A client checks that the
+ * server's certificate is for the given host
+ * (name or IP address), unless it is NULL.
+ * Returns false if out of memory.
+ */
+bool ktStart(KtContext* ctx, int fd, char const* host) {
+    if ((size_t)fd >= numSessionSlots) {
+        size_t newNumSlots = (numSessionSlots > 0) ? numSessionSlots : 64;
+        while (newNumSlots <= (size_t)fd) newNumSlots *= 2;
+        KtSession* newSessions = (KtSession*)realloc((void*)sessions, newNumSlots * sizeof(KtSession));
+        if (newSessions == NULL) return false;
+        memset((void*)(newSessions + numSessionSlots), 0, (newNumSlots - numSessionSlots) * sizeof(KtSession));
+        sessions = newSessions;
+        numSessionSlots = newNumSlots;
+    }
+    ktEnd(fd);
+
+    SSL* ssl = SSL_new(ctx->ssl);
+    BIO* bio = (ssl != NULL) ? ktNewSocketBio(fd) : NULL;
+    if (bio == NULL) {
+        SSL_free(ssl);
+        return false;
+    }
+    SSL_set_bio(ssl, bio, bio);
+    if (ctx->isServer) {
+        SSL_set_accept_state(ssl);
+    } else {
+        SSL_set_connect_state(ssl);
+        if (host != NULL) {
+            struct in6_addr unused;
+            bool isAddress = inet_pton(AF_INET, host, &unused) == 1 || inet_pton(AF_INET6, host, &unused) == 1;
+            X509_VERIFY_PARAM* param = SSL_get0_param(ssl);
+            int ok = isAddress ? X509_VERIFY_PARAM_set1_ip_asc(param, host) : X509_VERIFY_PARAM_set1_host(param, host, 0);
+            if (!isAddress) SSL_set_tlsext_host_name(ssl, host);
+            if (!ok) {
+                SSL_free(ssl);
+                return false;
+            }
+        }
+    }
+    sessions[fd].ssl = ssl;
+    sessions[fd].isServer = ctx->isServer;
+    sessions[fd].handshaking = true;
+    return true;
+}
+
+typedef union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+} KtCryptoInfo;
+
+static size_t ktFillCryptoInfo(KtCryptoInfo* crypto, size_t keyLength, unsigned char const* key, unsigned char const* salt) {
+    unsigned char sequence[8] = { 0, 0, 0, 0, 0, 0, 0, KT_FIRST_RECORD };
+    memset((void*)crypto, 0, sizeof(*crypto));
+    crypto->info.version = TLS_1_2_VERSION;
+    if (keyLength == 16) {
+        crypto->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(crypto->aes128.key, key, keyLength);
+        memcpy(crypto->aes128.salt, salt, KT_SALT_LENGTH);
+        memcpy(crypto->aes128.iv, sequence, sizeof(sequence)); // explicit nonce, counted up from here
+        memcpy(crypto->aes128.rec_seq, sequence, sizeof(sequence));
+        return sizeof(crypto->aes128);
+    }
+    crypto->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy(crypto->aes256.key, key, keyLength);
+    memcpy(crypto->aes256.salt, salt, KT_SALT_LENGTH);
+    memcpy(crypto->aes256.iv, sequence, sizeof(sequence));
+    memcpy(crypto->aes256.rec_seq, sequence, sizeof(sequence));
+    return sizeof(crypto->aes256);
+}
+
+/**
+ * Fills the key block of the session; returns
+ * its key length, or 0 if its cipher is not one
+ * the kernel knows.
+ */
+static size_t ktDeriveKeyBlock(SSL* ssl, unsigned char* keyBlock) {
+    SSL_CIPHER const* cipher = SSL_get_current_cipher(ssl);
+    if (cipher == NULL || SSL_version(ssl) != TLS1_2_VERSION) return 0;
+    int cipherNid = SSL_CIPHER_get_cipher_nid(cipher);
+    size_t keyLength = (cipherNid == NID_aes_128_gcm) ? 16 : (cipherNid == NID_aes_256_gcm) ? 32 : 0;
+    EVP_MD const* digest = SSL_CIPHER_get_handshake_digest(cipher);
+    if (keyLength == 0 || digest == NULL) return 0;
+
+    unsigned char masterSecret[SSL_MAX_MASTER_KEY_LENGTH];
+    size_t masterSecretLength = SSL_SESSION_get_master_key(SSL_get_session(ssl), masterSecret, sizeof(masterSecret));
+    unsigned char seed[13 + 2 * SSL3_RANDOM_SIZE];
+    memcpy(seed, "key expansion", 13);
+    SSL_get_server_random(ssl, seed + 13, SSL3_RANDOM_SIZE);
+    SSL_get_client_random(ssl, seed + 13 + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+
+    EVP_KDF* kdf = EVP_KDF_fetch(NULL, OSSL_KDF_NAME_TLS1_PRF, NULL);
+    EVP_KDF_CTX* kdfContext = (kdf != NULL) ? EVP_KDF_CTX_new(kdf) : NULL;
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, (char*)EVP_MD_get0_name(digest), 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SECRET, masterSecret, masterSecretLength),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SEED, seed, sizeof(seed)),
+        OSSL_PARAM_construct_end()
+    };
+    bool derived = kdfContext != NULL && masterSecretLength > 0
+        && EVP_KDF_derive(kdfContext, keyBlock, 2 * (keyLength + KT_SALT_LENGTH), params) == 1;
+    EVP_KDF_CTX_free(kdfContext);
+    EVP_KDF_free(kdf);
+    OPENSSL_cleanse(masterSecret, sizeof(masterSecret));
+    return derived ? keyLength : 0;
+}
+
+typedef enum {
+    KT_INSTALLED,
+    KT_UNSUPPORTED, // the socket is untouched; go on in user space
+    KT_BROKEN
+} KtInstallStatus;
+
+static KtInstallStatus ktInstallInKernel(int fd, SSL* ssl, bool isServer) {
+    unsigned char keyBlock[2 * (KT_MAX_KEY_LENGTH + KT_SALT_LENGTH)];
+    size_t keyLength = ktDeriveKeyBlock(ssl, keyBlock);
+    if (keyLength == 0) return KT_UNSUPPORTED;
+    unsigned char const* clientKey = keyBlock;
+    unsigned char const* serverKey = keyBlock + keyLength;
+    unsigned char const* clientSalt = keyBlock + 2 * keyLength;
+    unsigned char const* serverSalt = clientSalt + KT_SALT_LENGTH;
+
+    KtInstallStatus status = KT_UNSUPPORTED;
+    KtCryptoInfo crypto;
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+        // Until TLS_TX is set, the socket still works as a plain one.
+        size_t size = ktFillCryptoInfo(&crypto, keyLength, isServer ? serverKey : clientKey, isServer ? serverSalt : clientSalt);
+        if (setsockopt(fd, SOL_TLS, TLS_TX, &crypto, size) == 0) {
+            size = ktFillCryptoInfo(&crypto, keyLength, isServer ? clientKey : serverKey, isServer ? clientSalt : serverSalt);
+            status = (setsockopt(fd, SOL_TLS, TLS_RX, &crypto, size) == 0) ? KT_INSTALLED : KT_BROKEN;
+        }
+    }
+    OPENSSL_cleanse(&crypto, sizeof(crypto));
+    OPENSSL_cleanse(keyBlock, sizeof(keyBlock));
+    return status;
+}
+
+/**
+ * Goes on with the handshake as far as the
+ * socket allows. Once it is done, the session
+ * is handed to the kernel if it can take it.
+ * A handshake only ever waits to read: its
+ * records are small enough for the send buffer.
+ */
+KtStatus ktHandshake(int fd) {
+    SSL* ssl = ktSession(fd);
+    if (ssl == NULL || !sessions[fd].handshaking) return KT_FAILED;
+    ERR_clear_error();
+    int result = SSL_do_handshake(ssl);
+    if (result != 1) {
+        int error = SSL_get_error(ssl, result);
+        return (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) ? KT_IN_PROGRESS : KT_FAILED;
+    }
+    sessions[fd].handshaking = false;
+
+    switch (ktInstallInKernel(fd, ssl, sessions[fd].isServer)) {
+        case KT_INSTALLED:
+            SSL_free(ssl);
+            sessions[fd].ssl = NULL;
+            return KT_DONE;
+        case KT_UNSUPPORTED:
+            return KT_DONE;
+        default:
+            return KT_FAILED;
+    }
+}
+
+/** Whether the socket's TLS has stayed in user space (or is still being negotiated). */
+bool ktInUserSpace(int fd) {
+    return ktSession(fd) != NULL;
+}
+
+/** Forgets the socket's session, if any; call before closing it. */
+void ktEnd(int fd) {
+    SSL* ssl = ktSession(fd);
+    if (ssl == NULL) return;
+    SSL_free(ssl);
+    sessions[fd].ssl = NULL;
+}
+
+//////////////////////
+// SEND AND RECEIVE //
+//////////////////////
+
+static ssize_t ktError(SSL* ssl, int result) {
+    switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) return 0; // closed without a close_notify
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/** send() with MSG_NOSIGNAL, through OpenSSL if the socket's TLS is in user space. */
+ssize_t ktSend(int fd, void const* bytes, size_t numBytes) {
+    SSL* ssl = ktSession(fd);
+    if (ssl == NULL) return send(fd, bytes, numBytes, MSG_NOSIGNAL);
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_write(ssl, bytes, (numBytes > INT_MAX) ? INT_MAX : (int)numBytes);
+    return (result > 0) ? result : ktError(ssl, result);
+}
+
+/**
+ * recv(), through OpenSSL if the socket's TLS
+ * is in user space. Then, ktPending() tells how
+ * much of a record has been decrypted but not
+ * returned yet: poll() cannot know about it.
+ */
+ssize_t ktRecv(int fd, void* bytes, size_t numBytes) {
+    SSL* ssl = ktSession(fd);
+    if (ssl == NULL) return recv(fd, bytes, numBytes, 0);
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_read(ssl, bytes, (numBytes > INT_MAX) ? INT_MAX : (int)numBytes);
+    return (result > 0) ? result : ktError(ssl, result);
+}
+
+size_t ktPending(int fd) {
+    SSL* ssl = ktSession(fd);
+    return (ssl != NULL) ? (size_t)SSL_pending(ssl) : 0;
+}
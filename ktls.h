@@ -0,0 +1,51 @@
+#ifndef KernelTls_INCLUDED
+#define KernelTls_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * TLS with the record layer in the kernel
+ * (kTLS). The handshake is done by OpenSSL, in
+ * user space; the session keys are then handed
+ * to the kernel (setsockopt(TCP_ULP, "tls")),
+ * and from there on the socket is read and
+ * written like a plain one: the kernel encrypts
+ * whatever is sent and decrypts whatever is
+ * received, and OpenSSL is out of the way.
+ *
+ * Where the kernel cannot do it (no "tls"
+ * module), the session stays in user space, and
+ * ktSend()/ktRecv() go through OpenSSL. They
+ * work on any socket, with or without TLS, so
+ * the send and receive paths need not know.
+ *
+ * Only TLS 1.2 with AES-GCM is offered, which
+ * any kernel with kTLS can take over.
+ */
+typedef struct _KtContext KtContext;
+
+typedef enum {
+    KT_DONE,
+    KT_IN_PROGRESS, // wait for the socket to be readable, then call again
+    KT_FAILED
+} KtStatus;
+
+// The first byte a TLS client sends (a handshake record).
+#define KT_HANDSHAKE_RECORD 0x16
+
+KtContext* ktServerContext(char const* certFile, char const* keyFile);
+KtContext* ktClientContext(char const* caFile);
+void ktFreeContext(KtContext* ctx);
+
+bool ktStart(KtContext* ctx, int fd, char const* host);
+KtStatus ktHandshake(int fd);
+bool ktInUserSpace(int fd);
+void ktEnd(int fd);
+
+ssize_t ktSend(int fd, void const* bytes, size_t numBytes);
+ssize_t ktRecv(int fd, void* bytes, size_t numBytes);
+size_t ktPending(int fd);
+
+#endif // KernelTls_INCLUDED
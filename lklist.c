@@ -86,10 +86,10 @@ void lkSetNodeData(LkList* ll, LkNode* node, void const* dataPtr) {
 
 bool lkInsert(LkList* ll, LkNode* where, void const* dataPtr) {
     LkNode* newNode = (LkNode*)malloc(sizeof(LkNode) + ll->dataSize);
-    lkSetNodeData(ll, newNode, dataPtr);
     if (newNode == NULL) {
         return false;
     }
+    lkSetNodeData(ll, newNode, dataPtr);
 
     if (ll->head == NULL) {
         newNode->next = newNode->prev = NULL;
@@ -175,12 +175,11 @@ int lkIndexOf(LkList* ll, void const* dataPtr) {
 
 void lkClear(LkList* ll) {
     LkNode* current = lkHead(ll);
-    LkNode* before = NULL;
-    while (lkNext(&current)) {
-        free((void*)before);
-        before = current;
+    while (current != NULL) {
+        LkNode* next = current->next;
+        free((void*)current);
+        current = next;
     }
-    free((void*)current);
 
     ll->size = 0;
     ll->head = ll->tail = NULL;
@@ -230,6 +229,62 @@ typedef struct {
 } Student;
 
 LK_WANT_STRUCT_TYPE(Student, Student_, )
+LK_WANT_UNROLLED_TYPE(int, UInt_, )
+LK_WANT_VECTOR_TYPE(int, VInt_, )
+
+void testUnrolled() {
+    LkUInt_Unrolled u;
+    lkUInt_Init(&u);
+    size_t n = 3 * LK_CHUNK_CAPACITY(int) + 5;
+    for (int i = 0; i < (int)n; ++i) lkUInt_Append(&u, &i);
+    // Every other one, then all of the first chunk's.
+    LkUInt_Iter it = lkUInt_Begin(&u);
+    for (int* p; (p = lkUInt_Next(&it)) != NULL; ) {
+        if (*p % 2 == 1 || *p < (int)LK_CHUNK_CAPACITY(int)) lkUInt_RemoveCurrent(&it);
+    }
+    bool ok = (lkUInt_Size(&u) == (n - LK_CHUNK_CAPACITY(int) + 1) / 2);
+    int expected = (int)LK_CHUNK_CAPACITY(int);
+    it = lkUInt_Begin(&u);
+    for (int* p; (p = lkUInt_Next(&it)) != NULL; expected += 2) ok = ok && (*p == expected);
+    ok = ok && (*lkUInt_At(&u, 1) == (int)LK_CHUNK_CAPACITY(int) + 2) && lkUInt_At(&u, lkUInt_Size(&u)) == NULL;
+    printf("Unrolled list after removals in order: %s\n", ok ? "yes" : "NO"); // Expected: yes
+
+    it = lkUInt_Begin(&u);
+    while (lkUInt_Next(&it) != NULL) lkUInt_RemoveCurrent(&it);
+    printf("Unrolled list emptied: size %zu, %s\n", lkUInt_Size(&u), (u.head == NULL && u.tail == NULL) ? "no chunk left" : "CHUNKS LEFT"); // Expected: size 0, no chunk left
+    int one = 1;
+    lkUInt_Append(&u, &one);
+    printf("Unrolled list appended to again: %d\n", *lkUInt_At(&u, 0)); // Expected: 1
+    lkUInt_Destroy(&u);
+}
+
+void testVector() {
+    LkVInt_Vector v;
+    lkVInt_Init(&v);
+    int x = 0;
+    // Wrap around the ring before it grows.
+    for (int i = 0; i < 6; ++i) lkVInt_Append(&v, &i);
+    for (int i = 0; i < 4; ++i) lkVInt_PopFront(&v, &x);
+    for (int i = 6; i < 20; ++i) lkVInt_Append(&v, &i);
+    bool ok = (lkVInt_Size(&v) == 16);
+    for (size_t i = 0; i < lkVInt_Size(&v); ++i) ok = ok && (*lkVInt_At(&v, i) == (int)i + 4);
+    printf("Vector in order after growing: %s\n", ok ? "yes" : "NO"); // Expected: yes
+
+    LkVInt_Iter it = lkVInt_Begin(&v);
+    for (int* p; (p = lkVInt_Next(&it)) != NULL; ) {
+        if (*p == 5 || *p == 18 || *p % 3 == 0) lkVInt_RemoveCurrent(&it);
+    }
+    printf("Vector after removals: ");
+    it = lkVInt_Begin(&v);
+    for (int* p; (p = lkVInt_Next(&it)) != NULL; ) printf("%d ", *p);
+    printf("\n"); // Expected: 4 7 8 10 11 13 14 16 17 19
+
+    lkVInt_PopFront(&v, &x);
+    printf("Popped %d, size %zu\n", x, lkVInt_Size(&v)); // Expected: Popped 4, size 9
+    lkVInt_Clear(&v);
+    printf("Cleared: %s\n", (lkVInt_PopFront(&v, &x) || lkVInt_At(&v, 0) != NULL) ? "NO" : "yes"); // Expected: yes
+    lkVInt_Destroy(&v);
+}
 
 int main() {
     LkInt_List* ll = lkInt_Init();
@@ -279,6 +334,9 @@ int main() {
 
     lkDestroy(ll);
 
+    testUnrolled();
+    testVector();
+
     printf("TEST DONE.\n");
 }
 #endif // LK_RUN_TEST
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 typedef struct _LkNode LkNode;
 typedef struct _LkList LkList;
@@ -125,7 +126,7 @@ TEMPLATE_FUNCTION void lk##PREFIX##Destroy##SUFFIX(LkList* ll) { \
     CZ(ll, T) \
     return lkDestroy(ll); \
 } \
-TEMPLATE_FUNCTION LkNode* lk##PREFIX##Locate##SUFsFIX(LkList const* ll, int pos) { \
+TEMPLATE_FUNCTION LkNode* lk##PREFIX##Locate##SUFFIX(LkList const* ll, int pos) { \
     CZ(ll, T) \
     return lkLocate(ll, pos); \
 } \
@@ -183,4 +184,205 @@ TEMPLATE_FUNCTION T* lk##PREFIX##CopyToNewArray##SUFFIX(LkList const* ll) { \
     return (T*)lkCopyToNewArray(ll); \
 } \
 
+/**
+ * Type-specialized containers, all static
+ * inline, that keep their elements by value and
+ * many to a block of memory rather than one to
+ * a node, so that walking them walks memory in
+ * order: an unrolled list (linked chunks of
+ * LK_CHUNK_CAPACITY(T) elements) and a vector
+ * (one growable array, used as a ring, so that
+ * it makes a queue too). Both have the same
+ * API; for a container `c` of T, with the
+ * functions lk##PREFIX##Name##SUFFIX:
+ *
+ *   Init(&c), Clear(&c), Destroy(&c), Size(&c)
+ *   Append(&c, &data)  false if out of memory
+ *   At(&c, i)          NULL past the end; O(1) for a vector
+ *   Lk..Iter it = Begin(&c);
+ *   for (T* p; (p = Next(&it)) != NULL; ) { ... }
+ *   RemoveCurrent(&it) removes what Next() returned last
+ *
+ * and a vector has PopFront(&c, &data) as well.
+ * Elements move: a pointer to one is only good
+ * until the next removal (or, for a vector, the
+ * next Append()).
+ */
+#define LK_INLINE static inline
+#define LK_CHUNK_BYTES 512
+#define LK_CHUNK_CAPACITY(T) (sizeof(T) * 8 > LK_CHUNK_BYTES ? 8 : LK_CHUNK_BYTES / sizeof(T))
+#define LK_VECTOR_MIN_CAPACITY 8
+
+#define LK_WANT_UNROLLED_TYPE(T, PREFIX, SUFFIX) \
+typedef struct _Lk##PREFIX##Chunk##SUFFIX { \
+    struct _Lk##PREFIX##Chunk##SUFFIX* prev; \
+    struct _Lk##PREFIX##Chunk##SUFFIX* next; \
+    size_t count; \
+    T items[LK_CHUNK_CAPACITY(T)]; \
+} Lk##PREFIX##Chunk##SUFFIX; \
+typedef struct { \
+    Lk##PREFIX##Chunk##SUFFIX* head; \
+    Lk##PREFIX##Chunk##SUFFIX* tail; \
+    size_t size; \
+} Lk##PREFIX##Unrolled##SUFFIX; \
+typedef struct { \
+    Lk##PREFIX##Unrolled##SUFFIX* list; \
+    Lk##PREFIX##Chunk##SUFFIX* chunk; \
+    size_t index; /* in the chunk, of what Next() returns */ \
+} Lk##PREFIX##Iter##SUFFIX; \
+LK_INLINE void lk##PREFIX##Init##SUFFIX(Lk##PREFIX##Unrolled##SUFFIX* c) { \
+    c->head = c->tail = NULL; \
+    c->size = 0; \
+} \
+LK_INLINE void lk##PREFIX##Clear##SUFFIX(Lk##PREFIX##Unrolled##SUFFIX* c) { \
+    while (c->head != NULL) { \
+        Lk##PREFIX##Chunk##SUFFIX* next = c->head->next; \
+        free((void*)c->head); \
+        c->head = next; \
+    } \
+    c->tail = NULL; \
+    c->size = 0; \
+} \
+LK_INLINE void lk##PREFIX##Destroy##SUFFIX(Lk##PREFIX##Unrolled##SUFFIX* c) { \
+    lk##PREFIX##Clear##SUFFIX(c); \
+} \
+LK_INLINE size_t lk##PREFIX##Size##SUFFIX(Lk##PREFIX##Unrolled##SUFFIX const* c) { \
+    return c->size; \
+} \
+LK_INLINE T* lk##PREFIX##At##SUFFIX(Lk##PREFIX##Unrolled##SUFFIX const* c, size_t i) { \
+    Lk##PREFIX##Chunk##SUFFIX* chunk = c->head; \
+    for (; chunk != NULL && i >= chunk->count; chunk = chunk->next) i -= chunk->count; \
+    return (chunk != NULL) ? &chunk->items[i] : NULL; \
+} \
+LK_INLINE bool lk##PREFIX##Append##SUFFIX(Lk##PREFIX##Unrolled##SUFFIX* c, T const* dataPtr) { \
+    Lk##PREFIX##Chunk##SUFFIX* chunk = c->tail; \
+    if (chunk == NULL || chunk->count == LK_CHUNK_CAPACITY(T)) { \
+        chunk = (Lk##PREFIX##Chunk##SUFFIX*)malloc(sizeof(Lk##PREFIX##Chunk##SUFFIX)); \
+        if (chunk == NULL) return false; \
+        chunk->prev = c->tail; \
+        chunk->next = NULL; \
+        chunk->count = 0; \
+        if (c->tail != NULL) { \
+            c->tail->next = chunk; \
+        } else { \
+            c->head = chunk; \
+        } \
+        c->tail = chunk; \
+    } \
+    chunk->items[chunk->count++] = *dataPtr; \
+    ++c->size; \
+    return true; \
+} \
+LK_INLINE Lk##PREFIX##Iter##SUFFIX lk##PREFIX##Begin##SUFFIX(Lk##PREFIX##Unrolled##SUFFIX* c) { \
+    Lk##PREFIX##Iter##SUFFIX it = { c, c->head, 0 }; \
+    return it; \
+} \
+LK_INLINE T* lk##PREFIX##Next##SUFFIX(Lk##PREFIX##Iter##SUFFIX* it) { \
+    while (it->chunk != NULL && it->index >= it->chunk->count) { \
+        it->chunk = it->chunk->next; \
+        it->index = 0; \
+    } \
+    return (it->chunk != NULL) ? &it->chunk->items[it->index++] : NULL; \
+} \
+/* A chunk left empty is freed; one left with room for the next one's elements takes them over. */ \
+LK_INLINE void lk##PREFIX##RemoveCurrent##SUFFIX(Lk##PREFIX##Iter##SUFFIX* it) { \
+    Lk##PREFIX##Unrolled##SUFFIX* c = it->list; \
+    Lk##PREFIX##Chunk##SUFFIX* chunk = it->chunk; \
+    size_t i = --it->index; \
+    memmove((void*)&chunk->items[i], (void const*)&chunk->items[i + 1], (chunk->count - i - 1) * sizeof(T)); \
+    --chunk->count; \
+    --c->size; \
+    Lk##PREFIX##Chunk##SUFFIX* next = chunk->next; \
+    if (chunk->count > 0 && (next == NULL || chunk->count + next->count > LK_CHUNK_CAPACITY(T))) return; \
+    if (chunk->count > 0) { \
+        memcpy((void*)&chunk->items[chunk->count], (void const*)next->items, next->count * sizeof(T)); \
+        chunk->count += next->count; \
+        chunk = next; /* the one to unlink */ \
+    } else { \
+        it->chunk = next; \
+        it->index = 0; \
+    } \
+    if (chunk->prev != NULL) chunk->prev->next = chunk->next; else c->head = chunk->next; \
+    if (chunk->next != NULL) chunk->next->prev = chunk->prev; else c->tail = chunk->prev; \
+    free((void*)chunk); \
+} \
+
+#define LK_WANT_VECTOR_TYPE(T, PREFIX, SUFFIX) \
+typedef struct { \
+    T* items; /* a ring, from `first` */ \
+    size_t first; \
+    size_t size; \
+    size_t capacity; /* 0, or a power of 2 */ \
+} Lk##PREFIX##Vector##SUFFIX; \
+typedef struct { \
+    Lk##PREFIX##Vector##SUFFIX* vector; \
+    size_t index; /* of what Next() returns */ \
+} Lk##PREFIX##Iter##SUFFIX; \
+LK_INLINE void lk##PREFIX##Init##SUFFIX(Lk##PREFIX##Vector##SUFFIX* c) { \
+    c->items = NULL; \
+    c->first = c->size = c->capacity = 0; \
+} \
+/* Keeps the memory, for the elements to come. */ \
+LK_INLINE void lk##PREFIX##Clear##SUFFIX(Lk##PREFIX##Vector##SUFFIX* c) { \
+    c->first = c->size = 0; \
+} \
+LK_INLINE void lk##PREFIX##Destroy##SUFFIX(Lk##PREFIX##Vector##SUFFIX* c) { \
+    free((void*)c->items); \
+    lk##PREFIX##Init##SUFFIX(c); \
+} \
+LK_INLINE size_t lk##PREFIX##Size##SUFFIX(Lk##PREFIX##Vector##SUFFIX const* c) { \
+    return c->size; \
+} \
+LK_INLINE T* lk##PREFIX##At##SUFFIX(Lk##PREFIX##Vector##SUFFIX const* c, size_t i) { \
+    return (i < c->size) ? &c->items[(c->first + i) & (c->capacity - 1)] : NULL; \
+} \
+LK_INLINE bool lk##PREFIX##Append##SUFFIX(Lk##PREFIX##Vector##SUFFIX* c, T const* dataPtr) { \
+    if (c->size == c->capacity) { \
+        size_t capacity = c->capacity ? 2 * c->capacity : LK_VECTOR_MIN_CAPACITY; \
+        T* items = (T*)malloc(capacity * sizeof(T)); \
+        if (items == NULL) return false; \
+        size_t numToEnd = c->capacity - c->first; \
+        if (numToEnd > c->size) numToEnd = c->size; \
+        if (c->size > 0) { \
+            memcpy((void*)items, (void const*)&c->items[c->first], numToEnd * sizeof(T)); \
+            memcpy((void*)&items[numToEnd], (void const*)c->items, (c->size - numToEnd) * sizeof(T)); \
+        } \
+        free((void*)c->items); \
+        c->items = items; \
+        c->first = 0; \
+        c->capacity = capacity; \
+    } \
+    c->items[(c->first + c->size) & (c->capacity - 1)] = *dataPtr; \
+    ++c->size; \
+    return true; \
+} \
+LK_INLINE bool lk##PREFIX##PopFront##SUFFIX(Lk##PREFIX##Vector##SUFFIX* c, T* dataPtr) { \
+    if (c->size == 0) return false; \
+    *dataPtr = c->items[c->first]; \
+    c->first = (c->first + 1) & (c->capacity - 1); \
+    --c->size; \
+    return true; \
+} \
+LK_INLINE Lk##PREFIX##Iter##SUFFIX lk##PREFIX##Begin##SUFFIX(Lk##PREFIX##Vector##SUFFIX* c) { \
+    Lk##PREFIX##Iter##SUFFIX it = { c, 0 }; \
+    return it; \
+} \
+LK_INLINE T* lk##PREFIX##Next##SUFFIX(Lk##PREFIX##Iter##SUFFIX* it) { \
+    Lk##PREFIX##Vector##SUFFIX* c = it->vector; \
+    return (it->index < c->size) ? &c->items[(c->first + it->index++) & (c->capacity - 1)] : NULL; \
+} \
+/* Closes the gap from whichever side has fewer elements to move. */ \
+LK_INLINE void lk##PREFIX##RemoveCurrent##SUFFIX(Lk##PREFIX##Iter##SUFFIX* it) { \
+    Lk##PREFIX##Vector##SUFFIX* c = it->vector; \
+    size_t mask = c->capacity - 1; \
+    size_t i = --it->index; \
+    if (i < c->size / 2) { \
+        for (size_t j = i; j > 0; --j) c->items[(c->first + j) & mask] = c->items[(c->first + j - 1) & mask]; \
+        c->first = (c->first + 1) & mask; \
+    } else { \
+        for (size_t j = i; j + 1 < c->size; ++j) c->items[(c->first + j) & mask] = c->items[(c->first + j + 1) & mask]; \
+    } \
+    --c->size; \
+} \
+
 #endif // LkList_INCLUDED
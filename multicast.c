@@ -0,0 +1,326 @@
+/**
+ * A publisher sends all the fragments of a
+ * message with one sendmmsg() (or a few, for a
+ * very large one). A datagram the kernel would
+ * not take is simply dropped: the receivers ask
+ * for the message again.
+ *
+ * A receiver keeps one slot per message past
+ * the next one it expects, each filled as its
+ * fragments come. A datagram numbered N tells
+ * that every message before N was published; a
+ * heartbeat numbered N, that N was too. What is
+ * known to have been published and is not
+ * there is a hole.
+ */
+
+#define _GNU_SOURCE // sendmmsg(), recvmmsg()
+
+#include "multicast.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define MC_MAGIC "TCMC"
+#define MC_BATCH 64 // datagrams per sendmmsg() or recvmmsg()
+#define MC_SOCKET_BUFFER_BYTES (1024 * 1024) // room for a burst
+
+/** "GROUP:PORT", GROUP being an IPv4 multicast address. */
+bool mcParseGroup(char const* spec, struct sockaddr_in* group) {
+    char address[INET_ADDRSTRLEN];
+    char const* colon = strrchr(spec, ':');
+    if (colon == NULL || (size_t)(colon - spec) >= sizeof(address)) return false;
+    memcpy(address, spec, colon - spec);
+    address[colon - spec] = '\0';
+    char* end;
+    unsigned long port = strtoul(colon + 1, &end, 10);
+    if (*end != '\0' || port == 0 || port > 65535) return false;
+
+    memset((void*)group, 0, sizeof(*group));
+    group->sin_family = AF_INET;
+    group->sin_port = htons((unsigned short)port);
+    return inet_pton(AF_INET, address, &group->sin_addr) == 1 && IN_MULTICAST(ntohl(group->sin_addr.s_addr));
+}
+
+static void mcPutHeader(unsigned char* header, uint64_t sequence, size_t index, size_t numFragments) {
+    uint64_t sequenceBE = htobe64(sequence);
+    uint16_t indexBE = htons((uint16_t)index);
+    uint16_t numFragmentsBE = htons((uint16_t)numFragments);
+    memcpy(header, MC_MAGIC, 4);
+    memcpy(header + 4, &sequenceBE, 8);
+    memcpy(header + 12, &indexBE, 2);
+    memcpy(header + 14, &numFragmentsBE, 2);
+}
+
+/**
+ * Datagrams leave through the interface with
+ * that address (NULL: the one the routing table
+ * picks), go no further than the LAN, and reach
+ * the receivers on this host too. Returns false
+ * if the group is malformed or the socket could
+ * not be set up.
+ */
+bool mcOpenPublisher(McPublisher* publisher, char const* groupSpec, char const* interfaceAddress) {
+    memset((void*)publisher, 0, sizeof(*publisher));
+    publisher->fd = -1;
+    if (!mcParseGroup(groupSpec, &publisher->group)) return false;
+    struct in_addr interfaceAddr = { htonl(INADDR_ANY) };
+    if (interfaceAddress != NULL && inet_pton(AF_INET, interfaceAddress, &interfaceAddr) != 1) return false;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    unsigned char ttl = 1;
+    unsigned char loop = 1;
+    int bufferBytes = MC_SOCKET_BUFFER_BYTES;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferBytes, sizeof(bufferBytes)); // the kernel may cap it
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interfaceAddr, sizeof(interfaceAddr)) != 0
+        || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0
+        || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0
+        || connect(fd, (struct sockaddr*)&publisher->group, sizeof(publisher->group)) != 0
+    ) {
+        close(fd);
+        return false;
+    }
+    publisher->fd = fd;
+    return true;
+}
+
+void mcClosePublisher(McPublisher* publisher) {
+    if (publisher->fd >= 0) close(publisher->fd);
+    publisher->fd = -1;
+}
+
+/** `bytes` is the message's frame, as sent over a connection. */
+void mcPublish(McPublisher* publisher, uint64_t sequence, void const* bytes, size_t numBytes, double now) {
+    if (publisher->fd < 0) return;
+    size_t numFragments = (numBytes + MC_FRAGMENT_BYTES - 1) / MC_FRAGMENT_BYTES;
+    if (numFragments == 0 || numFragments > MC_MAX_FRAGMENTS) {
+        ++publisher->numTooBig;
+        return;
+    }
+
+    unsigned char headers[MC_BATCH][MC_HEADER_BYTES];
+    struct iovec iov[MC_BATCH][2];
+    struct mmsghdr msgs[MC_BATCH];
+    for (size_t first = 0; first < numFragments; first += MC_BATCH) {
+        size_t count = (numFragments - first < MC_BATCH) ? numFragments - first : MC_BATCH;
+        memset((void*)msgs, 0, count * sizeof(msgs[0]));
+        for (size_t i = 0; i < count; ++i) {
+            size_t offset = (first + i) * MC_FRAGMENT_BYTES;
+            mcPutHeader(headers[i], sequence, first + i, numFragments);
+            iov[i][0].iov_base = headers[i];
+            iov[i][0].iov_len = MC_HEADER_BYTES;
+            iov[i][1].iov_base = (char*)bytes + offset;
+            iov[i][1].iov_len = (numBytes - offset < MC_FRAGMENT_BYTES) ? numBytes - offset : MC_FRAGMENT_BYTES;
+            msgs[i].msg_hdr.msg_iov = iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 2;
+        }
+        int numSent = sendmmsg(publisher->fd, msgs, (unsigned)count, 0);
+        if (numSent < 0) numSent = 0;
+        publisher->numDatagrams += (unsigned long)numSent;
+        publisher->numDropped += (unsigned long)(count - numSent);
+    }
+    ++publisher->numMessages;
+    publisher->lastSentAt = now;
+}
+
+/** -1 if not publishing. */
+double mcSecondsUntilHeartbeat(McPublisher const* publisher, double now) {
+    if (publisher->fd < 0) return -1;
+    double seconds = publisher->lastSentAt + MC_HEARTBEAT_SECONDS - now;
+    return (seconds > 0) ? seconds : 0;
+}
+
+/** Sends a heartbeat if nothing has been sent for MC_HEARTBEAT_SECONDS. */
+void mcHeartbeat(McPublisher* publisher, uint64_t lastSequence, double now) {
+    if (publisher->fd < 0 || now < publisher->lastSentAt + MC_HEARTBEAT_SECONDS) return;
+    unsigned char header[MC_HEADER_BYTES];
+    mcPutHeader(header, lastSequence, 0, 0);
+    if (send(publisher->fd, header, sizeof(header), 0) != sizeof(header)) ++publisher->numDropped;
+    publisher->lastSentAt = now;
+}
+
+/** Joins the group on the interface with that address (INADDR_ANY: any). */
+bool mcJoin(McReceiver* receiver, struct in_addr group, unsigned short port, struct in_addr interfaceAddress) {
+    receiver->fd = -1;
+    receiver->lastSent = 0;
+    receiver->slots = (McSlot*)calloc(MC_WINDOW, sizeof(McSlot));
+    if (receiver->slots == NULL) return false;
+
+    // Bound to the group itself, so that nothing else sent to that port comes in.
+    struct sockaddr_in addr;
+    memset((void*)&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = group;
+    struct ip_mreq membership = { group, interfaceAddress };
+    int reuse = 1;
+    int bufferBytes = MC_SOCKET_BUFFER_BYTES;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes)); // the kernel may cap it
+    }
+    if (fd < 0
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 // other receivers on this host
+        || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0
+    ) {
+        if (fd >= 0) close(fd);
+        mcLeave(receiver);
+        return false;
+    }
+    receiver->fd = fd;
+    return true;
+}
+
+static void mcClearSlot(McSlot* slot) {
+    free((void*)slot->bytes);
+    slot->bytes = NULL;
+    slot->sequence = 0;
+}
+
+void mcLeave(McReceiver* receiver) {
+    if (receiver->fd >= 0) close(receiver->fd);
+    receiver->fd = -1;
+    if (receiver->slots != NULL) {
+        mcForget(receiver, UINT64_MAX);
+        free((void*)receiver->slots);
+        receiver->slots = NULL;
+    }
+}
+
+/** The slot for that message, emptied if it held an older one; NULL if out of memory. */
+static McSlot* mcSlot(McReceiver* receiver, uint64_t sequence, size_t numFragments, size_t capacity) {
+    McSlot* slot = &receiver->slots[sequence % MC_WINDOW];
+    if (slot->sequence == sequence) return slot;
+    mcClearSlot(slot);
+    slot->bytes = (char*)malloc(capacity);
+    if (slot->bytes == NULL) return NULL;
+    slot->sequence = sequence;
+    slot->numFragments = (uint32_t)numFragments;
+    slot->numReceived = 0;
+    slot->numBytes = 0;
+    memset((void*)slot->received, 0, sizeof(slot->received));
+    return slot;
+}
+
+/** Returns false if out of memory; a datagram that makes no sense is ignored. */
+static bool mcAccept(McReceiver* receiver, uint64_t next, unsigned char const* datagram, size_t length) {
+    if (length < MC_HEADER_BYTES || memcmp(datagram, MC_MAGIC, 4) != 0) return true;
+    uint64_t sequenceBE;
+    uint16_t indexBE, numFragmentsBE;
+    memcpy(&sequenceBE, datagram + 4, 8);
+    memcpy(&indexBE, datagram + 12, 2);
+    memcpy(&numFragmentsBE, datagram + 14, 2);
+    uint64_t sequence = be64toh(sequenceBE);
+    size_t index = ntohs(indexBE);
+    size_t numFragments = ntohs(numFragmentsBE);
+    size_t fragmentBytes = length - MC_HEADER_BYTES;
+
+    if (sequence == 0 || sequence >= next + MC_WINDOW) return true;
+    uint64_t lastSent = (numFragments == 0) ? sequence : sequence - 1;
+    if (lastSent > receiver->lastSent) receiver->lastSent = lastSent;
+    if (numFragments == 0 || sequence < next || numFragments > MC_MAX_FRAGMENTS || index >= numFragments) return true;
+    bool isLast = (index + 1 == numFragments);
+    if (isLast ? (fragmentBytes == 0 || fragmentBytes > MC_FRAGMENT_BYTES) : fragmentBytes != MC_FRAGMENT_BYTES) return true;
+
+    McSlot* slot = mcSlot(receiver, sequence, numFragments, numFragments * MC_FRAGMENT_BYTES);
+    if (slot == NULL) return false;
+    if (slot->numFragments != numFragments || (slot->received[index / 64] & (1ull << (index % 64))) != 0) return true;
+    slot->received[index / 64] |= 1ull << (index % 64);
+    memcpy(slot->bytes + index * MC_FRAGMENT_BYTES, datagram + MC_HEADER_BYTES, fragmentBytes);
+    ++slot->numReceived;
+    if (isLast) slot->numBytes = index * MC_FRAGMENT_BYTES + fragmentBytes;
+    return true;
+}
+
+/**
+ * Takes in every datagram waiting, keeping the
+ * messages from `next` on. Returns false if out
+ * of memory.
+ */
+bool mcReceive(McReceiver* receiver, uint64_t next) {
+    static unsigned char datagrams[MC_BATCH][MC_DATAGRAM_BYTES];
+    struct iovec iov[MC_BATCH];
+    struct mmsghdr msgs[MC_BATCH];
+    for (;;) {
+        memset((void*)msgs, 0, sizeof(msgs));
+        for (size_t i = 0; i < MC_BATCH; ++i) {
+            iov[i].iov_base = datagrams[i];
+            iov[i].iov_len = MC_DATAGRAM_BYTES;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int numReceived = recvmmsg(receiver->fd, msgs, MC_BATCH, MSG_DONTWAIT, NULL);
+        if (numReceived <= 0) return true;
+        for (int i = 0; i < numReceived; ++i) {
+            if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) continue;
+            if (!mcAccept(receiver, next, datagrams[i], msgs[i].msg_len)) return false;
+        }
+        if (numReceived < MC_BATCH) return true;
+    }
+}
+
+/**
+ * Keeps a whole message got some other way (sent
+ * again over the connection, out of order).
+ * Returns false if out of memory.
+ */
+bool mcStore(McReceiver* receiver, uint64_t next, uint64_t sequence, void const* bytes, size_t numBytes) {
+    if (sequence < next || sequence >= next + MC_WINDOW) return true;
+    if (sequence - 1 > receiver->lastSent) receiver->lastSent = sequence - 1;
+    McSlot* slot = &receiver->slots[sequence % MC_WINDOW];
+    mcClearSlot(slot); // even if some of its fragments came
+    slot = mcSlot(receiver, sequence, 1, numBytes);
+    if (slot == NULL) return false;
+    memcpy(slot->bytes, bytes, numBytes);
+    slot->numReceived = 1;
+    slot->numBytes = numBytes;
+    return true;
+}
+
+/**
+ * The frame of that message, to be freed by the
+ * caller, if all of it has come; NULL if not.
+ */
+char* mcTake(McReceiver* receiver, uint64_t sequence, size_t* numBytesPtr) {
+    McSlot* slot = &receiver->slots[sequence % MC_WINDOW];
+    if (slot->sequence != sequence || slot->numReceived < slot->numFragments) return NULL;
+    char* bytes = slot->bytes;
+    *numBytesPtr = slot->numBytes;
+    slot->bytes = NULL;
+    slot->sequence = 0;
+    return bytes;
+}
+
+/** Drops what is kept of the messages up to that one. */
+void mcForget(McReceiver* receiver, uint64_t upTo) {
+    for (size_t i = 0; i < MC_WINDOW; ++i) {
+        if (receiver->slots[i].sequence != 0 && receiver->slots[i].sequence <= upTo) {
+            mcClearSlot(&receiver->slots[i]);
+        }
+    }
+}
+
+static bool mcHas(McReceiver const* receiver, uint64_t sequence) {
+    McSlot const* slot = &receiver->slots[sequence % MC_WINDOW];
+    return slot->sequence == sequence && slot->numReceived == slot->numFragments;
+}
+
+/**
+ * If `next` is known to have been published but
+ * has not come, the last message of the hole
+ * that starts there; 0 if there is no hole.
+ */
+uint64_t mcHoleEnd(McReceiver const* receiver, uint64_t next) {
+    if (receiver->lastSent < next || mcHas(receiver, next)) return 0;
+    uint64_t end = (receiver->lastSent < next + MC_WINDOW) ? receiver->lastSent : next + MC_WINDOW - 1;
+    for (uint64_t sequence = next + 1; sequence <= end; ++sequence) {
+        if (mcHas(receiver, sequence)) return sequence - 1;
+    }
+    return end;
+}
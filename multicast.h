@@ -0,0 +1,88 @@
+#ifndef Multicast_INCLUDED
+#define Multicast_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * Chat messages published once to a UDP
+ * multicast group, for clients on the same LAN
+ * that would rather get them from there than
+ * each over its own connection.
+ *
+ * Every datagram starts with a 16-byte header,
+ * in network byte order:
+ *     "TCMC", sequence number (64 bits),
+ *     fragment index, number of fragments
+ *     (16 bits each)
+ * followed by that fragment of the message's
+ * frame, exactly as it would be sent over a
+ * connection. A frame is cut into as many
+ * fragments as it takes for each datagram to
+ * fit in an Ethernet frame. A datagram with no
+ * fragments is a heartbeat: it only tells the
+ * number of the last message published, so that
+ * a receiver learns that it missed the last
+ * ones even when nothing follows them.
+ *
+ * Multicast is not reliable: a receiver that
+ * finds a hole in the numbers asks for what it
+ * missed over its connection (see K in
+ * protocol.c), and holds what came after the
+ * hole until then.
+ */
+#define MC_DATAGRAM_BYTES 1472 // an Ethernet frame, less the IP and UDP headers
+#define MC_HEADER_BYTES 16
+#define MC_FRAGMENT_BYTES (MC_DATAGRAM_BYTES - MC_HEADER_BYTES)
+#define MC_MAX_FRAGMENTS 1024 // larger messages are only sent again on request
+#define MC_WINDOW 512 // messages held past a hole, at most
+#define MC_HEARTBEAT_SECONDS 1.0
+
+typedef struct {
+    int fd; // -1: not publishing
+    struct sockaddr_in group;
+    double lastSentAt;
+    unsigned long numMessages;
+    unsigned long numDatagrams;
+    unsigned long numDropped; // datagrams the kernel would not take
+    unsigned long numTooBig;  // messages not published at all
+} McPublisher;
+
+bool mcParseGroup(char const* spec, struct sockaddr_in* group);
+bool mcOpenPublisher(McPublisher* publisher, char const* groupSpec, char const* interfaceAddress);
+void mcClosePublisher(McPublisher* publisher);
+void mcPublish(McPublisher* publisher, uint64_t sequence, void const* bytes, size_t numBytes, double now);
+double mcSecondsUntilHeartbeat(McPublisher const* publisher, double now);
+void mcHeartbeat(McPublisher* publisher, uint64_t lastSequence, double now);
+
+typedef struct {
+    uint64_t sequence; // 0: free
+    uint32_t numFragments;
+    uint32_t numReceived;
+    uint64_t received[MC_MAX_FRAGMENTS / 64];
+    char* bytes;
+    size_t numBytes; // known once the last fragment is in
+} McSlot;
+
+/**
+ * What a client has received from the group
+ * past the next message it expects, by number
+ * modulo MC_WINDOW.
+ */
+typedef struct {
+    int fd; // -1: not joined
+    McSlot* slots;
+    uint64_t lastSent; // every message up to this one is known to have been published
+} McReceiver;
+
+bool mcJoin(McReceiver* receiver, struct in_addr group, unsigned short port, struct in_addr interfaceAddress);
+void mcLeave(McReceiver* receiver);
+bool mcReceive(McReceiver* receiver, uint64_t next);
+bool mcStore(McReceiver* receiver, uint64_t next, uint64_t sequence, void const* bytes, size_t numBytes);
+char* mcTake(McReceiver* receiver, uint64_t sequence, size_t* numBytesPtr);
+void mcForget(McReceiver* receiver, uint64_t upTo);
+uint64_t mcHoleEnd(McReceiver const* receiver, uint64_t next);
+
+#endif // Multicast_INCLUDED
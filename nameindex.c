@@ -0,0 +1,111 @@
+/**
+ * Chained hash table; the chains are doubly
+ * linked through the entries themselves, so an
+ * entry is removed without looking for it.
+ */
+
+#include "nameindex.h"
+#include <stdint.h>
+
+#define NI_INITIAL_NUM_BUCKETS 64
+
+struct _NameIndex {
+    NiEntry** buckets;
+    size_t numBuckets;
+    size_t numEntries;
+};
+
+NameIndex* niInit() {
+    NameIndex* index = (NameIndex*)malloc(sizeof(NameIndex));
+    if (!index) return NULL;
+    index->buckets = (NiEntry**)calloc(NI_INITIAL_NUM_BUCKETS, sizeof(NiEntry*));
+    if (!index->buckets) {
+        free((void*)index);
+        return NULL;
+    }
+    index->numBuckets = NI_INITIAL_NUM_BUCKETS;
+    index->numEntries = 0;
+    return index;
+}
+
+/** The entries are left alone; they belong to their holders. */
+void niDestroy(NameIndex* index) {
+    free((void*)index->buckets);
+    free((void*)index);
+}
+
+void niEntryInit(NiEntry* entry) {
+    entry->next = NULL;
+    entry->pprev = NULL;
+    entry->name = NULL;
+}
+
+static size_t niBucketOf(NameIndex const* index, wchar_t const* name) {
+    uint64_t h = (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & (index->numBuckets - 1);
+}
+
+static void niLink(NiEntry** head, NiEntry* entry) {
+    entry->next = *head;
+    if (*head != NULL) (*head)->pprev = &entry->next;
+    *head = entry;
+    entry->pprev = head;
+}
+
+static void niRehash(NameIndex* index) {
+    size_t oldNumBuckets = index->numBuckets;
+    NiEntry** oldBuckets = index->buckets;
+    NiEntry** newBuckets = (NiEntry**)calloc(oldNumBuckets * 2, sizeof(NiEntry*));
+    if (!newBuckets) return; // the chains just get longer
+
+    index->buckets = newBuckets;
+    index->numBuckets = oldNumBuckets * 2;
+    for (size_t b = 0; b < oldNumBuckets; ++b) {
+        NiEntry* entry = oldBuckets[b];
+        while (entry != NULL) {
+            NiEntry* next = entry->next;
+            niLink(&newBuckets[niBucketOf(index, entry->name)], entry);
+            entry = next;
+        }
+    }
+    free((void*)oldBuckets);
+}
+
+/** The entry must not be in the index already. */
+void niInsert(NameIndex* index, NiEntry* entry, wchar_t const* name) {
+    if (index->numEntries >= index->numBuckets) niRehash(index);
+    entry->name = name;
+    niLink(&index->buckets[niBucketOf(index, name)], entry);
+    ++index->numEntries;
+}
+
+/** Does nothing if the entry is not in the index. */
+void niRemove(NameIndex* index, NiEntry* entry) {
+    if (entry->pprev == NULL) return;
+    *entry->pprev = entry->next;
+    if (entry->next != NULL) entry->next->pprev = entry->pprev;
+    entry->next = NULL;
+    entry->pprev = NULL;
+    entry->name = NULL;
+    --index->numEntries;
+}
+
+NiEntry* niFind(NameIndex const* index, wchar_t const* name) {
+    NiEntry* entry = index->buckets[niBucketOf(index, name)];
+    while (entry != NULL && entry->name != name) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+NiEntry* niFindNext(NiEntry const* entry) {
+    NiEntry* next = entry->next;
+    while (next != NULL && next->name != entry->name) {
+        next = next->next;
+    }
+    return next;
+}
+
+size_t niSize(NameIndex const* index) {
+    return index->numEntries;
+}
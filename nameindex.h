@@ -0,0 +1,41 @@
+#ifndef NameIndex_INCLUDED
+#define NameIndex_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <wchar.h>
+
+/**
+ * A hash index from names to whatever holds
+ * them, with the entries embedded in the
+ * holders. Names must be interned (see
+ * intern.h): they are hashed and compared by
+ * pointer. Several entries may have the same
+ * name; niFind() then niFindNext() go through
+ * all of them.
+ */
+typedef struct _NiEntry {
+    struct _NiEntry* next;
+    struct _NiEntry** pprev; // NULL when not in the index
+    wchar_t const* name;
+} NiEntry;
+
+typedef struct _NameIndex NameIndex;
+
+/** The structure of type T whose FIELD is the given entry. */
+#define niOwner(entry, T, FIELD) ((T*)((char*)(entry) - offsetof(T, FIELD)))
+
+NameIndex* niInit();
+void niDestroy(NameIndex* index);
+
+void niEntryInit(NiEntry* entry);
+void niInsert(NameIndex* index, NiEntry* entry, wchar_t const* name);
+void niRemove(NameIndex* index, NiEntry* entry);
+
+NiEntry* niFind(NameIndex const* index, wchar_t const* name);
+NiEntry* niFindNext(NiEntry const* entry);
+
+size_t niSize(NameIndex const* index);
+
+#endif // NameIndex_INCLUDED
@@ -0,0 +1,44 @@
+#ifndef Probes_INCLUDED
+#define Probes_INCLUDED
+
+/**
+ * Static tracepoints (USDT) of the server, under
+ * the provider "tcpchat", for bpftrace or perf
+ * to attach to the running binary, e.g.
+ *
+ *   bpftrace -e 'usdt:./server:tcpchat:send { @bytes = hist(arg1); }'
+ *
+ * Each one is a single NOP until something
+ * attaches to it; its arguments are only
+ * computed, never passed. Without <sys/sdt.h>
+ * (systemtap-sdt-dev), or built with
+ * -DNO_PROBES, they are not there at all.
+ *
+ * accept        fd, sender ID, address family
+ * frame_header  length announced, characters of it buffered (in the client too)
+ * message_read  fd, MessageReadStatus, frame type (-1 on failure), bytes
+ * broadcast_start  bytes, clients
+ * broadcast_end    bytes, clients
+ * send          fd, bytes, MessageSendStatus
+ * splice        fd, bytes, ZcStatus
+ * disconnect    fd, sender ID, whether a send to it had failed
+ */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE2(name, a, b) DTRACE_PROBE2(tcpchat, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(tcpchat, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(tcpchat, name, a, b, c, d)
+#else
+// sizeof: neither computed nor left unused.
+#define PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define PROBE3(name, a, b, c) (PROBE2(name, a, b), (void)sizeof(c))
+#define PROBE4(name, a, b, c, d) (PROBE3(name, a, b, c), (void)sizeof(d))
+#endif
+
+#endif // Probes_INCLUDED
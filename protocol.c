@@ -1,12 +1,21 @@
 /**
- * 
+ *
  */
 
 #include "protocol.h"
+#include "textscan.h"
+#include "ktls.h"
+#include "shmring.h"
+#include "multicast.h"
+#include "probes.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 
 ///////////////////////
 // UTILITY FUNCTIONS //
@@ -27,128 +36,368 @@ size_t numDigitsOf(size_t n) {
 //////////////////////////////////////////////////
 
 #define CONTENT_LENGTH_STRING_BUFFER_LENGTH 22 // max(size_t) = 2^64 - 1, which has 20 digits
+#define FRAME_READER_MIN_FREE_SPACE 4096 // bytes
+#define SEND_STALL_TIMEOUT_MS 10000 // how long a non-blocking socket may stay full
+#define NACK_RETRY_SECONDS 1.0 // before chat messages missing by multicast are asked for again
 
 MessageReadStatus recvError(int numBytesRead) {
-    if (numBytesRead < 0) {
+    if (numBytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return READ_INCOMPLETE; // non-blocking socket with nothing to read
+    } else if (numBytesRead < 0) {
         return READ_ERR_BROKEN_SOCKET;
     } else /* if (numBytesRead == 0) */ {
         return READ_ERR_PEER_CLOSED;
     }
 }
 
+void frameReader_init(FrameReader* reader) {
+    reader->data = NULL;
+    reader->begin = reader->end = reader->capacity = 0;
+}
+
+void frameReader_free(FrameReader* reader) {
+    free((void*)reader->data);
+    frameReader_init(reader);
+}
+
+/**
+ * Makes room for at least `minFreeSpace` more
+ * bytes after reader->end, first by moving the
+ * unconsumed bytes to the front of the buffer,
+ * then by growing it.
+ */
+bool frameReaderReserve(FrameReader* reader, size_t minFreeSpace) {
+    if (reader->begin > 0) {
+        memmove((void*)reader->data, (void*)(reader->data + reader->begin), reader->end - reader->begin);
+        reader->end -= reader->begin;
+        reader->begin = 0;
+    }
+    if (reader->capacity - reader->end >= minFreeSpace) return true;
+
+    size_t newCapacity = reader->capacity ? reader->capacity : FRAME_READER_MIN_FREE_SPACE;
+    while (newCapacity - reader->end < minFreeSpace) {
+        newCapacity *= 2;
+    }
+    char* newData = (char*)realloc((void*)reader->data, newCapacity);
+    if (!newData) return false;
+    reader->data = newData;
+    reader->capacity = newCapacity;
+    return true;
+}
+
+/**
+ * Frees the buffer if nothing is buffered, so
+ * that an idle connection costs no buffer.
+ */
+void frameReader_trim(FrameReader* reader) {
+    if (reader->begin == reader->end) frameReader_free(reader);
+}
+
+/**
+ * Puts back bytes that were received, but not
+ * consumed, by another process (hot restart).
+ */
+bool frameReader_restore(FrameReader* reader, void const* bytes, size_t numBytes) {
+    frameReader_free(reader);
+    if (numBytes == 0) return true;
+    if (!frameReaderReserve(reader, numBytes)) return false;
+    memcpy((void*)reader->data, bytes, numBytes);
+    reader->end = numBytes;
+    return true;
+}
+
+/**
+ * Calls recv() once on the socket and appends
+ * whatever arrived to the reader's buffer.
+ */
+MessageReadStatus rawReceive(int confd, FrameReader* reader) {
+    if (reader->capacity - reader->end < FRAME_READER_MIN_FREE_SPACE
+        && !frameReaderReserve(reader, FRAME_READER_MIN_FREE_SPACE)
+    ) {
+        return READ_ERR_NOT_ENOUGH_MEMORY;
+    }
+
+    ssize_t numBytesRead = srAttached(confd)
+        ? srRecv(confd, (void*)(reader->data + reader->end), reader->capacity - reader->end)
+        : ktRecv(confd, (void*)(reader->data + reader->end), reader->capacity - reader->end);
+    if (numBytesRead <= 0) {
+        return recvError(numBytesRead);
+    }
+    reader->end += numBytesRead;
+
+    // With TLS in user space, what is left of the
+    // record would not wake poll() up again.
+    while (ktPending(confd) > 0) {
+        if (reader->capacity - reader->end < FRAME_READER_MIN_FREE_SPACE
+            && !frameReaderReserve(reader, FRAME_READER_MIN_FREE_SPACE)
+        ) {
+            return READ_ERR_NOT_ENOUGH_MEMORY;
+        }
+        numBytesRead = ktRecv(confd, (void*)(reader->data + reader->end), reader->capacity - reader->end);
+        if (numBytesRead <= 0) break;
+        reader->end += numBytesRead;
+    }
+    return READ_SUCCESS;
+}
+
 /**
  * Raw message syntax:
  * <Message length>:<Message>
- * 
+ *
  * For example:
  * 11:Hello World
  * 1:.
- * 
- * This function tries to read the socket
- * till it encounters the delimiter ':',
- * so that it could know the message
- * length. Later, it will try to receive
- * that message in full.
+ *
+ * This function looks for a complete message
+ * among the bytes buffered in the reader. If
+ * there is one, it is consumed and its content
+ * is returned through payloadPtr/lengthPtr;
+ * it is NOT null-terminated and stays valid
+ * until the next rawReceive() on this reader.
+ * A message longer than maxLength characters
+ * (unless 0) is an error, known as soon as its
+ * length is, so that it is never made room for.
  */
-MessageReadStatus rawReadMessage(int confd, wchar_t** bufferPtr, size_t* currentBufferLengthPtr, size_t* actualMessageLength) {
-    ///////////////////////////////////////////////////////
-    // GET MESSAGE LENGTH/CONTENT LENGTH INTO tempBuffer //
-    ///////////////////////////////////////////////////////
+MessageReadStatus rawReadMessage(FrameReader* reader, size_t maxLength, wchar_t const** payloadPtr, size_t* lengthPtr) {
+    wchar_t const* chars = (wchar_t const*)(reader->data + reader->begin);
+    size_t numChars = (reader->end - reader->begin) / sizeof(wchar_t);
 
-    size_t totalNumCharsRead = 0;
+    ///////////////////////////////////////
+    // GET MESSAGE LENGTH/CONTENT LENGTH //
+    ///////////////////////////////////////
 
+    size_t messageLength = 0;
     size_t messageStartPos = 0;
-    wchar_t tempBuffer[CONTENT_LENGTH_STRING_BUFFER_LENGTH + 1];
-
-    bool foundDelimiter = false;
-    do {
-        size_t numBytesRead = recv(confd, (void*)(tempBuffer + totalNumCharsRead), (CONTENT_LENGTH_STRING_BUFFER_LENGTH - totalNumCharsRead) * sizeof(tempBuffer[0]), 0);
-        if (numBytesRead <= 0) {
-            return recvError(numBytesRead);
+    for (size_t i = 0; ; ++i) {
+        if (i >= CONTENT_LENGTH_STRING_BUFFER_LENGTH) return READ_ERR_MALFUNCTIONING_PEER;
+        if (i >= numChars) return READ_INCOMPLETE;
+        if (chars[i] == L':') {
+            messageStartPos = i + 1;
+            break;
         }
+        if (chars[i] < L'0' || chars[i] > L'9') return READ_ERR_MALFUNCTIONING_PEER;
+        messageLength = messageLength * 10 + (size_t)(chars[i] - L'0');
+        if (maxLength > 0 && messageLength > maxLength) return READ_ERR_MALFUNCTIONING_PEER;
+    }
+    if (messageLength == 0) {
+        return READ_ERR_MALFUNCTIONING_PEER;
+    }
+    PROBE2(frame_header, messageLength, numChars - messageStartPos);
 
-        size_t numCharsRead = numBytesRead / sizeof(tempBuffer[0]);
-        size_t previousTotalNumCharsRead = totalNumCharsRead;
-        totalNumCharsRead += numCharsRead;
-        size_t i;
-        for (i = previousTotalNumCharsRead; i < totalNumCharsRead; ++i) {
-            if (tempBuffer[i] == L':') {
-                foundDelimiter = true;
-                tempBuffer[i] = L'\0';
-                messageStartPos = i + 1;
-                break;
+    //////////////////////////////////////
+    // GET THE ACTUAL MESSAGE (CONTENT) //
+    //////////////////////////////////////
+
+    if (numChars - messageStartPos < messageLength) {
+        // Make sure the whole message will fit in the
+        // buffer, so that it can be received in place.
+        size_t frameBytes = (messageStartPos + messageLength) * sizeof(wchar_t);
+        if (reader->capacity - reader->begin < frameBytes) {
+            if (!frameReaderReserve(reader, frameBytes - (reader->end - reader->begin))) {
+                return READ_ERR_NOT_ENOUGH_MEMORY;
             }
         }
-    } while (!foundDelimiter);
+        return READ_INCOMPLETE;
+    }
 
-    wchar_t* endptr_unused;
-    size_t messageLength = (size_t)wcstoul(tempBuffer, &endptr_unused, 10);
-    if (messageLength == 0) {
+    // Checked once here, so that nothing further
+    // down meets a stray L'\0' or a non-character.
+    if (!tsIsValidText(chars + messageStartPos, messageLength)) {
         return READ_ERR_MALFUNCTIONING_PEER;
     }
 
-    ////////////////////////////////////////////////////////
-    // CHECK MESSAGE BUFFER SIZE AND REALLOCATE IF NEEDED //
-    ////////////////////////////////////////////////////////
+    *payloadPtr = chars + messageStartPos;
+    *lengthPtr = messageLength;
+    reader->begin += (messageStartPos + messageLength) * sizeof(wchar_t);
+    if (reader->begin == reader->end) {
+        reader->begin = reader->end = 0;
+    }
+    return READ_SUCCESS;
+}
 
-    wchar_t* buffer = *bufferPtr;
-    if (messageLength + 1 > currentBufferLengthPtr[0]) {
-        size_t newBufferLength = messageLength + 1;
-        free((void*)buffer);
-        buffer = bufferPtr[0] = (wchar_t*)malloc(newBufferLength * sizeof(buffer[0]));
-        if (buffer == NULL) {
-            return READ_ERR_NOT_ENOUGH_MEMORY;
+/**
+ * On a non-blocking socket whose send buffer (or
+ * ring) is full, waits for it to drain like a
+ * blocking send would, but only for so long: a
+ * peer that reads nothing for that long is given
+ * up on.
+ */
+bool waitUntilWritable(int confd) {
+    if (errno == EINTR) return true;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+    if (srAttached(confd)) return srWaitWritable(confd, SEND_STALL_TIMEOUT_MS);
+    struct pollfd pfd = { confd, POLLOUT, 0 };
+    return poll(&pfd, 1, SEND_STALL_TIMEOUT_MS) > 0 && (pfd.revents & POLLOUT) == POLLOUT;
+}
+
+MessageSendStatus sendEncodedFrame(int confd, EncodedFrame const* frame) {
+    char const* bytes = (char const*)frame->data;
+    size_t numBytesLeft = frame->length * sizeof(frame->data[0]);
+    while (numBytesLeft > 0) {
+        ssize_t numBytesSent = srAttached(confd)
+            ? srSend(confd, (void const*)bytes, numBytesLeft)
+            : ktSend(confd, (void const*)bytes, numBytesLeft);
+        if (numBytesSent < 0 && waitUntilWritable(confd)) {
+            continue;
         }
-        currentBufferLengthPtr[0] = newBufferLength;
+        if (numBytesSent <= 0) {
+            return SEND_ERR_INTERRUPTED;
+        }
+        bytes += numBytesSent;
+        numBytesLeft -= numBytesSent;
     }
+    return SEND_SUCCESS;
+}
 
-    /////////////////////////////////////////////////////////
-    // Copy initial message segment that is accidentally   //
-    // received during message length retrieval (the XXX   //
-    // part in MessageLength:XXX...) into the right buffer //
-    // and at the right position.                          //
-    /////////////////////////////////////////////////////////
+void freeEncodedFrame(EncodedFrame* frame) {
+    free((void*)frame->buffer);
+    frame->buffer = NULL;
+    frame->data = NULL;
+    frame->length = 0;
+}
 
-    for (size_t i = messageStartPos; i < totalNumCharsRead; ++i) {
-        buffer[i - messageStartPos] = tempBuffer[i];
-    }
-    totalNumCharsRead = totalNumCharsRead - messageStartPos;
+/**
+ * Builds a frame's payload, leaving enough
+ * room in front of it for the length header,
+ * so that the finished frame can be sent with
+ * a single send() and without another copy.
+ */
+typedef struct {
+    wchar_t* buffer;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} FrameBuilder;
 
-    //////////////////////////////////////
-    // GET THE ACTUAL MESSAGE (CONTENT) //
-    //////////////////////////////////////
+#define FRAME_HEADER_RESERVE (CONTENT_LENGTH_STRING_BUFFER_LENGTH + 1)
+
+void builderInit(FrameBuilder* builder, size_t payloadLengthHint) {
+    builder->capacity = FRAME_HEADER_RESERVE + payloadLengthHint;
+    builder->buffer = (wchar_t*)malloc(builder->capacity * sizeof(wchar_t));
+    builder->length = FRAME_HEADER_RESERVE;
+    builder->failed = (builder->buffer == NULL);
+}
 
-    while (totalNumCharsRead < messageLength) {
-        size_t numBytesRead = recv(confd, (void*)(buffer + totalNumCharsRead), (messageLength - totalNumCharsRead) * sizeof(buffer[0]), 0);
-        if (numBytesRead <= 0) {
-            return recvError(numBytesRead);
+void builderAppendChars(FrameBuilder* builder, wchar_t const* s, size_t n) {
+    if (builder->failed) return;
+    if (builder->length + n > builder->capacity) {
+        size_t newCapacity = builder->capacity * 2;
+        if (newCapacity < builder->length + n) newCapacity = builder->length + n;
+        wchar_t* newBuffer = (wchar_t*)realloc((void*)builder->buffer, newCapacity * sizeof(wchar_t));
+        if (!newBuffer) {
+            builder->failed = true;
+            return;
         }
+        builder->buffer = newBuffer;
+        builder->capacity = newCapacity;
+    }
+    wmemcpy(builder->buffer + builder->length, s, n);
+    builder->length += n;
+}
 
-        size_t numCharsRead = numBytesRead / sizeof(buffer[0]);
-        totalNumCharsRead += numCharsRead;
-    };
-    buffer[totalNumCharsRead] = L'\0';
+void builderAppendString(FrameBuilder* builder, wchar_t const* s) {
+    builderAppendChars(builder, s, wcslen(s));
+}
 
-    return READ_SUCCESS;
+void builderAppendNumber(FrameBuilder* builder, unsigned long long n) {
+    wchar_t digits[CONTENT_LENGTH_STRING_BUFFER_LENGTH];
+    size_t numDigits = 0;
+    do {
+        digits[CONTENT_LENGTH_STRING_BUFFER_LENGTH - ++numDigits] = L'0' + (wchar_t)(n % 10);
+        n /= 10;
+    } while (n > 0);
+    builderAppendChars(builder, digits + CONTENT_LENGTH_STRING_BUFFER_LENGTH - numDigits, numDigits);
+}
+
+void builderAppendLine(FrameBuilder* builder, wchar_t const* s) {
+    builderAppendString(builder, s);
+    builderAppendChars(builder, L"\n", 1);
 }
 
-MessageSendStatus rawSendMessage(int confd, wchar_t const* const messageToSend) {
-    size_t messageLength = wcslen(messageToSend);
-    size_t headerLength = numDigitsOf(messageLength) + 1 /* the delimiter L':' */;
-    wchar_t headerBuffer[CONTENT_LENGTH_STRING_BUFFER_LENGTH + 2];
-    swprintf(headerBuffer, headerLength + 1, L"%zu:", messageLength);
-    size_t numBytesSent = send(confd, (void*)headerBuffer, headerLength * sizeof(headerBuffer[0]), 0);
-    if (numBytesSent < headerLength) {
-        return SEND_ERR_INTERRUPTED;
+void builderAppendNumberLine(FrameBuilder* builder, unsigned long long n) {
+    builderAppendNumber(builder, n);
+    builderAppendChars(builder, L"\n", 1);
+}
+
+bool builderFinish(FrameBuilder* builder, EncodedFrame* frame) {
+    if (builder->failed) {
+        free((void*)builder->buffer);
+        return false;
     }
-    
-    size_t expectedNumBytesSent = wcslen(messageToSend) * sizeof(messageToSend[0]);
-    numBytesSent = send(confd, (void*)messageToSend, expectedNumBytesSent, 0);
-    if (numBytesSent < expectedNumBytesSent) {
-        return SEND_ERR_INTERRUPTED;
+
+    size_t payloadLength = builder->length - FRAME_HEADER_RESERVE;
+    size_t headerLength = numDigitsOf(payloadLength) + 1 /* the delimiter L':' */;
+    wchar_t* header = builder->buffer + FRAME_HEADER_RESERVE - headerLength;
+    header[headerLength - 1] = L':';
+    for (size_t i = headerLength - 1, n = payloadLength; i > 0; --i, n /= 10) {
+        header[i - 1] = L'0' + (wchar_t)(n % 10);
     }
 
-    return SEND_SUCCESS;
+    frame->buffer = builder->buffer;
+    frame->data = header;
+    frame->length = headerLength + payloadLength;
+    return true;
+}
+
+MessageSendStatus builderSend(FrameBuilder* builder, int confd) {
+    EncodedFrame frame;
+    if (!builderFinish(builder, &frame)) return SEND_ERR_NOT_ENOUGH_MEMORY;
+    MessageSendStatus sendStatus = sendEncodedFrame(confd, &frame);
+    freeEncodedFrame(&frame);
+    return sendStatus;
+}
+
+/**
+ * Reads the fields of a received payload, which
+ * is not null-terminated.
+ */
+typedef struct {
+    wchar_t const* pos;
+    wchar_t const* end;
+} FieldCursor;
+
+bool fieldNextLine(FieldCursor* cursor, wchar_t const** linePtr, size_t* lengthPtr) {
+    wchar_t const* newline = tsFindChar(cursor->pos, cursor->end - cursor->pos, L'\n');
+    if (newline == NULL) return false;
+    *linePtr = cursor->pos;
+    *lengthPtr = newline - cursor->pos;
+    cursor->pos = newline + 1;
+    return true;
+}
+
+bool fieldNextNumber(FieldCursor* cursor, unsigned long long* valuePtr) {
+    wchar_t const* line;
+    size_t length;
+    if (!fieldNextLine(cursor, &line, &length)) return false;
+    if (length == 0 || length > 20) return false;
+    unsigned long long value = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (line[i] < L'0' || line[i] > L'9') return false;
+        value = value * 10 + (unsigned long long)(line[i] - L'0');
+    }
+    *valuePtr = value;
+    return true;
+}
+
+/** The rest of the payload, as a new null-terminated string. */
+wchar_t* fieldRestToNewString(FieldCursor* cursor, size_t* lengthPtr) {
+    size_t length = cursor->end - cursor->pos;
+    wchar_t* s = (wchar_t*)malloc((length + 1) * sizeof(wchar_t));
+    if (s == NULL) return NULL;
+    wmemcpy(s, cursor->pos, length);
+    s[length] = L'\0';
+    cursor->pos = cursor->end;
+    if (lengthPtr) *lengthPtr = length;
+    return s;
+}
+
+/** Reads the one-character frame type on the first line. */
+bool fieldFrameType(FieldCursor* cursor, wchar_t* typePtr) {
+    wchar_t const* line;
+    size_t length;
+    if (!fieldNextLine(cursor, &line, &length) || length != 1) return false;
+    *typePtr = line[0];
+    return true;
 }
 
 /////////////////////////////////////////////////
@@ -156,85 +405,960 @@ MessageSendStatus rawSendMessage(int confd, wchar_t const* const messageToSend)
 /////////////////////////////////////////////////
 
 /*
- * From a client's perspective:
+ * Every message starts with a line holding its
+ * one-character type.
+ *
+ * A connection starts with the client logging
+ * in. The server then refers to every user by
+ * a numeric sender ID, and describes each ID
+ * (address, port, name) once per connection,
+ * so that chat messages only carry the ID.
+ *
+ * The list of online users is versioned: a
+ * client gets the whole list once, right after
+ * logging in, then only the changes to it. All
+ * changes that happen during one iteration of
+ * the server's event loop are sent together.
+ *
+ * FROM A CLIENT TO THE SERVER:
  *
- * FORMAT OF A MESSAGE SENT TO OTHER PEOPLE BY ME (FORMAT 1):
- * (technically, a message sent from a client to server)
- * Line 1     Sender Name
+ * L: LOG IN (must be the first message, only once)
+ * Line 1     "L"
+ * Line >= 2  Name
+ *
+ * R: LOG IN AGAIN (instead of L, after losing the
+ *    connection; the chat messages missed since
+ *    are sent again if the server still has them)
+ * Line 1     "R"
+ * Line 2     Resume token, from the last W
+ * Line 3     Sequence number of the last M or E received
+ * Line >= 4  Name
+ *
+ * M: CHAT MESSAGE (at most MAX_CHAT_LENGTH
+ *    characters; longer ones are sent with H)
+ * Line 1     "M"
  * Line >= 2  Actual Message
- * 
- * FORMAT OF A MESSAGE SENT TO ME BY ANOTHER PERSON (FORMAT 2):
- * (technically, a message sent from server to a client)
- * Line 1     Sender Address
- * Line 2     Sender Port
- * Line 3     Sender Name
- * Line 4
- *     If Sender is Yourself:
- *          "Yourself"
- *     Else:
- *          "Else"
- * Line >= 5  Actual Message
+ *
+ * N: CHANGE MY NAME
+ * Line 1     "N"
+ * Line >= 2  New Name
+ *
+ * T: DIRECT MESSAGE (only to the users, on this
+ *    server, who go by that name)
+ * Line 1     "T"
+ * Line 2     Recipient's name
+ * Line >= 3  Actual Message
+ *
+ * O: PONG (reply to I)
+ * Line 1     "O"
+ *
+ * G: SEND ME THE CHAT MESSAGES BY MULTICAST (1),
+ *    OR OVER THIS CONNECTION (0); the reply is a G
+ * Line 1     "G"
+ * Line 2     1 or 0
+ * Line 3     If 0: sequence number of the last M or
+ *            E received; those after it are sent
+ *            again, right after the reply
+ *
+ * K: SEND THESE CHAT MESSAGES AGAIN (they did not
+ *    come by multicast); they come as E's, after
+ *    an X for those that are lost
+ * Line 1     "K"
+ * Line 2     Sequence number of the first one
+ * Line 3     Sequence number of the last one
+ *
+ * Q: SEARCH THE CHAT MESSAGES SENT LATELY (for
+ *    those with every word); the reply is a Q
+ * Line 1     "Q"
+ * Line >= 2  Words
+ *
+ * H: START A TRANSFER (a chat message too long
+ *    for an M, or a file; one at a time), whose
+ *    data then comes in C's
+ * Line 1     "H"
+ * Line 2     "M" for a chat message, "F" for a file
+ *            (in base64)
+ * Line 3     Number of characters of data to come
+ * Line >= 4  The file's name (empty for a message)
+ *
+ * C: NEXT PIECE OF THE TRANSFER (once all its
+ *    characters have come, it is over)
+ * Line 1     "C"
+ * Line >= 2  Data, at most TRANSFER_CHUNK_LENGTH
+ *            characters
+ *
+ * Z: CANCEL THE TRANSFER
+ * Line 1     "Z"
+ *
+ * A: ACKNOWLEDGE MY CHAT MESSAGES, RATHER THAN
+ *    SEND THEM BACK TO ME (right after the L or
+ *    R, so that it holds for every M after it)
+ * Line 1     "A"
+ *
+ * FROM THE SERVER TO A CLIENT:
+ *
+ * W: WELCOME (reply to L or R; after an R, the
+ *    missed M's come right after it, as E's)
+ * Line 1     "W"
+ * Line 2     The client's own sender ID
+ * Line 3     Resume token, for the next R
+ * Line 4     Sequence number from which on the
+ *            client gets every chat message
+ *
+ * S: ONLINE USERS (after W, replaces the whole list)
+ * Line 1     "S"
+ * Line 2     List version
+ * Lines >= 3 One JOIN record per user
+ *
+ * D: CHANGES TO THE ONLINE USERS
+ * Line 1     "D"
+ * Line 2     Version the changes apply to
+ * Line 3     Version after the changes
+ * Lines >= 4 JOIN, LEAVE and RENAME records
+ *
+ * M: CHAT MESSAGE (numbered by the server, for R)
+ * Line 1     "M"
+ * Line 2     Sequence number
+ * Line 3     Sender ID
+ * Line >= 4  Actual Message
+ *
+ * A: ONE OF YOUR CHAT MESSAGES HAS GONE OUT (after
+ *    an A, instead of the M to the sender; one per
+ *    M, in order, when the M would have been sent).
+ *    By multicast, the sender's own chat messages
+ *    still come back as E's.
+ * Line 1     "A"
+ * Line 2     Its sequence number, or 0 if it was
+ *            turned down (by the content filter)
+ * Line >= 3  Only if the content filter masked
+ *            some of it: the message as it went out
+ *
+ * E: CHAT MESSAGE FROM A USER OF ANOTHER SERVER,
+ *    OR SENT AGAIN AFTER AN R
+ * Line 1     "E"
+ * Line 2     Sequence number
+ * Line 3     Sender's address
+ * Line 4     Sender's port
+ * Line 5     Sender's name
+ * Line >= 6  Actual Message
+ *
+ * T: DIRECT MESSAGE
+ * Line 1     "T"
+ * Line 2     Sender ID
+ * Line >= 3  Actual Message
+ *
+ * U: NOBODY GOES BY THAT NAME (reply to T)
+ * Line 1     "U"
+ * Line >= 2  The recipient's name, as in the T
+ *
+ * I: PING (sent when the client has been silent
+ *    for a while; it must reply with an O soon)
+ * Line 1     "I"
+ *
+ * G: WHERE CHAT MESSAGES COME FROM (reply to G;
+ *    also sent when multicast is no longer
+ *    offered); once it says a group, they are
+ *    published to it as E's (see multicast.h)
+ *    and no longer sent over this connection
+ * Line 1     "G"
+ * Line 2     Multicast group's address, or empty
+ *            for this connection
+ * Line 3     Multicast group's port, or 0
+ *
+ * X: CHAT MESSAGES LOST FOR GOOD (reply to K)
+ * Line 1     "X"
+ * Line 2     Sequence number of the last one lost
+ *
+ * Q: SEARCH RESULTS (reply to Q), newest first
+ * Line 1     "Q"
+ * Line 2     Number of results
+ * Lines >= 3 One SEARCH RESULT record per result
+ *
+ * H, C and Z: ANOTHER USER'S TRANSFER, relayed
+ *    piece by piece as it comes in, with the
+ *    sender ID inserted as Line 2. Z also comes
+ *    when the server cuts the transfer short.
+ *    Pieces without an H (the transfer started
+ *    before the client logged in) are ignored,
+ *    and a transfer ends with its sender's LEAVE.
+ *
+ * BETWEEN SERVERS OF A CLUSTER:
+ *
+ * P: HELLO (instead of L, from the server that
+ *    opened the link; the other one replies
+ *    with its own P)
+ * Line 1     "P"
+ * Line 2     Node ID
+ *
+ * F: RELAYED CHAT MESSAGE
+ * Line 1     "F"
+ * Line 2     Node ID of the server the sender is on
+ * Line 3     Sequence number, given by that server
+ * Line 4     Sender's address
+ * Line 5     Sender's port
+ * Line 6     Sender's name
+ * Line >= 7  Actual Message
+ *
+ * I and O: PING and PONG, as between a server
+ *    and a client, in both directions.
+ *
+ * Records, one field per line (names cannot
+ * contain line breaks):
+ *     "J", Sender ID, Address, Port, Name
+ *     "L", Sender ID
+ *     "R", Sender ID, New Name
+ * SEARCH RESULT records have no type (line
+ * breaks in the snippet are sent as spaces):
+ *     Sequence number, Sender's name, Snippet
  */
 
-void client_setup() {}
+#define FRAME_LOGIN L'L'
+#define FRAME_RESUME L'R'
+#define FRAME_RENAME L'N'
+#define FRAME_WELCOME L'W'
+#define FRAME_MEMBERS L'S'
+#define FRAME_PRESENCE_DELTA L'D'
+#define FRAME_CHAT L'M'
+#define FRAME_REMOTE_CHAT L'E'
+#define FRAME_PEER_HELLO L'P'
+#define FRAME_RELAYED_CHAT L'F'
+#define FRAME_DIRECT L'T'
+#define FRAME_NO_SUCH_USER L'U'
+#define FRAME_PING L'I'
+#define FRAME_PONG L'O'
+#define FRAME_MULTICAST L'G'
+#define FRAME_NACK L'K'
+#define FRAME_LOST L'X'
+#define FRAME_SEARCH L'Q'
+#define FRAME_TRANSFER_START L'H'
+#define FRAME_TRANSFER_DATA L'C'
+#define FRAME_TRANSFER_CANCEL L'Z'
+#define FRAME_ACK L'A'
 
-void client_teardown() {}
+#define RECORD_JOIN L'J'
+#define RECORD_LEAVE L'L'
+#define RECORD_RENAME L'R'
 
-MessageReadStatus client_readMessageFromServer(int confd, client_ReceivedMessage* msgPtr) {
-    msgPtr->text = NULL;
+/////////////// CLIENT ///////////////
+
+typedef struct {
+    SenderId id;
+    bool used;
+    SenderIdentity identity;
+} CachedIdentity;
+
+FrameReader clientReader;
+int clientConfd = -1; // to answer pings while reading
+SenderId clientOwnId = 0;
+uint64_t clientMembersVersion = 0;
+FieldCursor clientPendingRecords = { NULL, NULL }; // Rest of a D message being read
+SenderIdentity clientDepartedIdentity; // The last user who left
+SenderIdentity clientRemoteSender; // The sender of the last E message
+wchar_t clientResumeToken[MAX_RESUME_TOKEN_LENGTH + 1] = L""; // from the last W
+uint64_t clientLastSequence = 0; // of the last chat message received
+bool clientResuming = false; // an R has been sent, the W has not come yet
+bool clientWantsMulticast = false; // asked for with a G after each W
+bool clientWantsAcks = false; // asked for with an A after each L or R
+McReceiver clientMulticast = { -1, NULL, 0 }; // joined while the server says so
+FrameReader clientMulticastReader; // the next chat message, once it has come by multicast
+uint64_t clientNackedTo = 0; // the last chat message asked for again,
+double clientNackedAt = 0;   // and when
+CachedIdentity* identityCache = NULL;
+size_t identityCacheCapacity = 0; // always a power of 2
+size_t identityCacheSize = 0;
+
+size_t identityCacheHome(SenderId id) {
+    return (id * 2654435761u) & (identityCacheCapacity - 1);
+}
+
+CachedIdentity* identityCacheSlot(SenderId id) {
+    size_t mask = identityCacheCapacity - 1;
+    for (size_t i = identityCacheHome(id); ; i = (i + 1) & mask) {
+        if (!identityCache[i].used || identityCache[i].id == id) return &identityCache[i];
+    }
+}
+
+CachedIdentity* identityCacheFind(SenderId id) {
+    if (identityCacheCapacity == 0) return NULL;
+    CachedIdentity* slot = identityCacheSlot(id);
+    return slot->used ? slot : NULL;
+}
+
+CachedIdentity* identityCacheInsert(SenderId id) {
+    if ((identityCacheSize + 1) * 2 > identityCacheCapacity) {
+        CachedIdentity* oldCache = identityCache;
+        size_t oldCapacity = identityCacheCapacity;
+        size_t newCapacity = oldCapacity ? oldCapacity * 2 : 16;
+        CachedIdentity* newCache = (CachedIdentity*)calloc(newCapacity, sizeof(CachedIdentity));
+        if (newCache == NULL) return NULL;
+        identityCache = newCache;
+        identityCacheCapacity = newCapacity;
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (oldCache[i].used) {
+                *identityCacheSlot(oldCache[i].id) = oldCache[i];
+            }
+        }
+        free((void*)oldCache);
+    }
+
+    CachedIdentity* slot = identityCacheSlot(id);
+    if (!slot->used) {
+        slot->used = true;
+        slot->id = id;
+        ++identityCacheSize;
+    }
+    return slot;
+}
+
+/**
+ * Linear probing removal: entries after the hole
+ * that would no longer be found are shifted back.
+ */
+void identityCacheRemove(CachedIdentity* slot) {
+    size_t mask = identityCacheCapacity - 1;
+    size_t hole = slot - identityCache;
+    identityCache[hole].used = false;
+    --identityCacheSize;
+    for (size_t i = (hole + 1) & mask; identityCache[i].used; i = (i + 1) & mask) {
+        size_t home = identityCacheHome(identityCache[i].id);
+        bool homeIsBetweenHoleAndI = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (homeIsBetweenHoleAndI) continue;
+        identityCache[hole] = identityCache[i];
+        identityCache[i].used = false;
+        hole = i;
+    }
+}
+
+void identityCacheClear() {
+    for (size_t i = 0; i < identityCacheCapacity; ++i) {
+        identityCache[i].used = false;
+    }
+    identityCacheSize = 0;
+}
+
+void client_setup() {
+    frameReader_init(&clientReader);
+    frameReader_init(&clientMulticastReader);
+}
+
+void client_teardown() {
+    frameReader_free(&clientReader);
+    mcLeave(&clientMulticast);
+    frameReader_free(&clientMulticastReader);
+    free((void*)identityCache);
+    identityCache = NULL;
+    identityCacheCapacity = identityCacheSize = 0;
+}
+
+MessageSendStatus clientSendAckWish(int confd) {
+    FrameBuilder builder;
+    builderInit(&builder, 2);
+    builderAppendChars(&builder, L"A\n", 2);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus client_login(int confd, wchar_t const* const name) {
+    FrameBuilder builder;
+    builderInit(&builder, 2 + wcslen(name));
+    builderAppendChars(&builder, L"L\n", 2);
+    builderAppendString(&builder, name);
+    MessageSendStatus sendStatus = builderSend(&builder, confd);
+    if (sendStatus != SEND_SUCCESS || !clientWantsAcks) return sendStatus;
+    return clientSendAckWish(confd);
+}
+
+/**
+ * Logs in again after the connection was lost,
+ * asking for the chat messages missed since;
+ * the reply is a TO_CLIENT_RESUMED or a
+ * TO_CLIENT_MISSED. Simply logs in if the
+ * client never was.
+ */
+MessageSendStatus client_resume(int confd, wchar_t const* const name) {
+    if (clientResumeToken[0] == L'\0') return client_login(confd, name);
+    FrameBuilder builder;
+    builderInit(&builder, 32 + MAX_RESUME_TOKEN_LENGTH + wcslen(name));
+    builderAppendChars(&builder, L"R\n", 2);
+    builderAppendLine(&builder, clientResumeToken);
+    builderAppendNumberLine(&builder, clientLastSequence);
+    builderAppendString(&builder, name);
+    clientResuming = true;
+    MessageSendStatus sendStatus = builderSend(&builder, confd);
+    if (sendStatus != SEND_SUCCESS || !clientWantsAcks) return sendStatus;
+    return clientSendAckWish(confd);
+}
+
+/** Forgets what came over the lost connection, but not the resume token. */
+void client_connectionLost() {
+    frameReader_free(&clientReader);
+    mcLeave(&clientMulticast);
+    frameReader_free(&clientMulticastReader);
+    clientPendingRecords.pos = clientPendingRecords.end = NULL;
+    identityCacheClear();
+    clientMembersVersion = 0;
+    clientResuming = false;
+}
+
+/**
+ * Asks the server, after each login, for the
+ * chat messages by multicast; whether it sends
+ * them that way is told by a TO_CLIENT_MULTICAST.
+ * client_multicastFd() is then to be polled.
+ */
+void client_wantMulticast() {
+    clientWantsMulticast = true;
+}
+
+/**
+ * Asks the server, at each login, to answer each
+ * chat message this user sends with a
+ * TO_CLIENT_ACK, in the order they were sent,
+ * rather than with the message itself: the
+ * client shows them as soon as they are sent.
+ */
+void client_wantAcks() {
+    clientWantsAcks = true;
+}
+
+/** -1 unless chat messages come by multicast. */
+int client_multicastFd() {
+    return clientMulticast.fd;
+}
+
+MessageSendStatus clientSendMulticastWish(int confd, bool on) {
+    FrameBuilder builder;
+    builderInit(&builder, 32);
+    builderAppendChars(&builder, on ? L"G\n1\n" : L"G\n0\n", 4);
+    if (!on) builderAppendNumberLine(&builder, clientLastSequence);
+    return builderSend(&builder, confd);
+}
+
+double clientSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
 
-    wchar_t* buffer = NULL;
-    size_t bufferLength = 0;
-    size_t actualMessageLength = 0;
-    MessageReadStatus _returnValue_ = READ_SUCCESS;
-    {
-#define FAIL(readStatus) { _returnValue_ = readStatus; goto FINALIZE; }
-
-        MessageReadStatus readStatus = rawReadMessage(confd, &buffer, &bufferLength, &actualMessageLength);
-        if (readStatus != READ_SUCCESS) FAIL(readStatus)
-
-        wchar_t* tokenizerInternalData;
-
-        // Using FORMAT 2
-        {
-            // Line 1
-            wchar_t* senderAddress = wcstok(buffer, L"\n", &tokenizerInternalData);
-            size_t senderAddressLength = wcslen(senderAddress);
-            if (senderAddressLength == 0 || senderAddressLength > MAX_ADDRESS_LENGTH) FAIL(READ_ERR_MALFUNCTIONING_PEER)
-            wcscpy(msgPtr->sender.address, senderAddress);
-        } {
-            // Line 2
-            wchar_t* senderPortString = wcstok(NULL, L"\n", &tokenizerInternalData);
-            wchar_t* endptr_unused;
-            unsigned short senderPort = (unsigned short)wcstoul(senderPortString, &endptr_unused, 10);
-            msgPtr->sender.port = senderPort;
-        } {
-            // Line 3
-            wchar_t* senderName = wcstok(NULL, L"\n", &tokenizerInternalData);
-            size_t senderNameLength = wcslen(senderName);
-            if (senderNameLength > MAX_NAME_LENGTH) FAIL(READ_ERR_MALFUNCTIONING_PEER)
-            wcscpy(msgPtr->sender.name, senderName);
-        } {
-            // Line 4
-            wchar_t* isYourself = wcstok(NULL, L"\n", &tokenizerInternalData);
-            msgPtr->senderIsYourself = (wcscmp(isYourself, L"Yourself") == 0);
-        } {
-            // Line >= 5
-            wchar_t* actualMessage = wcstok(NULL, L"", &tokenizerInternalData);
-
-            size_t actualMessageLength = wcslen(actualMessage);
-            msgPtr->text = (wchar_t*)malloc((actualMessageLength + 1) * sizeof(msgPtr->text[0]));
-            if (msgPtr->text == NULL) FAIL(READ_ERR_NOT_ENOUGH_MEMORY)
-            wcscpy(msgPtr->text, actualMessage);
+/**
+ * Asks for the chat messages missing from the
+ * next one on, if any are known to be, unless
+ * they have just been asked for.
+ */
+MessageSendStatus clientAskForHole(int confd) {
+    uint64_t next = clientLastSequence + 1;
+    uint64_t end = mcHoleEnd(&clientMulticast, next);
+    if (end == 0) return SEND_SUCCESS;
+    uint64_t first = next;
+    if (clientSeconds() < clientNackedAt + NACK_RETRY_SECONDS && clientNackedTo >= next) {
+        if (end <= clientNackedTo) return SEND_SUCCESS;
+        first = clientNackedTo + 1;
+    }
+    clientNackedTo = end;
+    clientNackedAt = clientSeconds();
+
+    FrameBuilder builder;
+    builderInit(&builder, 48);
+    builderAppendChars(&builder, L"K\n", 2);
+    builderAppendNumberLine(&builder, first);
+    builderAppendNumberLine(&builder, end);
+    return builderSend(&builder, confd);
+}
+
+/**
+ * Takes in the chat messages that have come by
+ * multicast, to be read with
+ * client_readMessageFromServer(), and asks for
+ * those that went missing.
+ */
+MessageReadStatus client_receiveMulticast(int confd) {
+    clientConfd = confd;
+    if (clientMulticast.fd < 0) return READ_SUCCESS;
+    if (!mcReceive(&clientMulticast, clientLastSequence + 1)) return READ_ERR_NOT_ENOUGH_MEMORY;
+    return (clientAskForHole(confd) == SEND_SUCCESS) ? READ_SUCCESS : READ_ERR_BROKEN_SOCKET;
+}
+
+/**
+ * Joins the group on the interface the
+ * connection goes through: the one on the
+ * server's LAN.
+ */
+bool clientJoinMulticast(wchar_t const* group, unsigned short port) {
+    char groupAscii[INET_ADDRSTRLEN];
+    struct in_addr groupAddr;
+    if (wcslen(group) >= sizeof(groupAscii) || wcstombs(groupAscii, group, sizeof(groupAscii)) == (size_t)-1
+        || inet_pton(AF_INET, groupAscii, &groupAddr) != 1
+    ) {
+        return false;
+    }
+    struct in_addr interfaceAddr = { htonl(INADDR_ANY) };
+    struct sockaddr_in local;
+    socklen_t localLength = sizeof(local);
+    if (getsockname(clientConfd, (struct sockaddr*)&local, &localLength) == 0 && local.sin_family == AF_INET) {
+        interfaceAddr = local.sin_addr;
+    }
+    clientNackedTo = 0;
+    clientNackedAt = 0;
+    return mcJoin(&clientMulticast, groupAddr, port, interfaceAddr);
+}
+
+/**
+ * A chat message that came over the connection
+ * while they come by multicast: one sent again,
+ * maybe ahead of some still missing. It is kept
+ * until its turn comes.
+ */
+MessageReadStatus clientHoldChat(uint64_t sequence, wchar_t const* payload, size_t payloadLength) {
+    if (sequence <= clientLastSequence) return READ_SUCCESS; // got it already
+    size_t headerLength = numDigitsOf(payloadLength) + 1;
+    wchar_t* frame = (wchar_t*)malloc((headerLength + payloadLength + 1) * sizeof(wchar_t));
+    if (frame == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+    swprintf(frame, headerLength + 1, L"%zu:", payloadLength);
+    wmemcpy(frame + headerLength, payload, payloadLength);
+    bool ok = mcStore(&clientMulticast, clientLastSequence + 1, sequence, frame, (headerLength + payloadLength) * sizeof(wchar_t));
+    free((void*)frame);
+    return ok ? READ_SUCCESS : READ_ERR_NOT_ENOUGH_MEMORY;
+}
+
+/**
+ * The next message to handle: the next chat
+ * message if it has come by multicast (or has
+ * been held), or else the next one from the
+ * connection. What comes by multicast can only
+ * be that E; anything else is dropped, and
+ * asked for again once the hole is noticed.
+ */
+MessageReadStatus clientNextPayload(wchar_t const** payloadPtr, size_t* lengthPtr) {
+    while (clientMulticast.fd >= 0) {
+        size_t numBytes;
+        char* bytes = mcTake(&clientMulticast, clientLastSequence + 1, &numBytes);
+        if (bytes == NULL) {
+            // what is held past it may have shown a hole
+            if (clientAskForHole(clientConfd) != SEND_SUCCESS) return READ_ERR_BROKEN_SOCKET;
+            break;
         }
+        bool ok = frameReader_restore(&clientMulticastReader, bytes, numBytes);
+        free((void*)bytes);
+        if (!ok) return READ_ERR_NOT_ENOUGH_MEMORY;
+
+        wchar_t frameType;
+        unsigned long long sequence;
+        if (rawReadMessage(&clientMulticastReader, 0, payloadPtr, lengthPtr) == READ_SUCCESS && clientMulticastReader.end == 0) {
+            FieldCursor cursor = { *payloadPtr, *payloadPtr + *lengthPtr };
+            if (fieldFrameType(&cursor, &frameType) && frameType == FRAME_REMOTE_CHAT
+                && fieldNextNumber(&cursor, &sequence) && sequence == clientLastSequence + 1
+            ) {
+                return READ_SUCCESS;
+            }
+        }
+        frameReader_free(&clientMulticastReader);
+    }
+    return rawReadMessage(&clientReader, 0, payloadPtr, lengthPtr); // the server is trusted with longer frames
+}
+
+MessageSendStatus client_rename(int confd, wchar_t const* const newName) {
+    FrameBuilder builder;
+    builderInit(&builder, 2 + wcslen(newName));
+    builderAppendChars(&builder, L"N\n", 2);
+    builderAppendString(&builder, newName);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus client_search(int confd, wchar_t const* const query) {
+    FrameBuilder builder;
+    builderInit(&builder, 2 + wcslen(query));
+    builderAppendChars(&builder, L"Q\n", 2);
+    builderAppendString(&builder, query);
+    return builderSend(&builder, confd);
+}
+
+/**
+ * The results of a TO_CLIENT_SEARCH_RESULTS, one
+ * by one, from an iterator set to 0. They are
+ * valid as long as the message.
+ */
+bool client_nextSearchResult(client_ReceivedMessage const* msgPtr, size_t* iteratorPtr, SearchHit* hitPtr) {
+    wchar_t const* pos = msgPtr->text + *iteratorPtr;
+    if (*pos == L'\0') return false; // a sequence number is never empty
+    hitPtr->sequence = wcstoull(pos, NULL, 10);
+    pos += wcslen(pos) + 1;
+    hitPtr->name = pos;
+    pos += wcslen(pos) + 1;
+    hitPtr->snippet = pos;
+    hitPtr->snippetLength = wcslen(pos);
+    pos += hitPtr->snippetLength + 1;
+    *iteratorPtr = pos - msgPtr->text;
+    return true;
+}
+
+/** This user, as the others see it; NULL until the list of online users has come. */
+SenderIdentity const* client_yourself() {
+    CachedIdentity* yourself = identityCacheFind(clientOwnId);
+    return (yourself != NULL) ? &yourself->identity : NULL;
+}
+
+bool client_nextMember(size_t* iteratorPtr, SenderIdentity const** identityPtr) {
+    for (size_t i = *iteratorPtr; i < identityCacheCapacity; ++i) {
+        if (identityCache[i].used) {
+            *identityPtr = &identityCache[i].identity;
+            *iteratorPtr = i + 1;
+            return true;
+        }
+    }
+    *iteratorPtr = identityCacheCapacity;
+    return false;
+}
+
+MessageReadStatus client_receiveFromServer(int confd) {
+    clientConfd = confd;
+    return rawReceive(confd, &clientReader);
+}
+
+MessageSendStatus sendPong(int confd) {
+    FrameBuilder builder;
+    builderInit(&builder, 2);
+    builderAppendChars(&builder, L"O\n", 2);
+    return builderSend(&builder, confd);
+}
+
+bool fieldCopyLine(FieldCursor* cursor, wchar_t* dest, size_t maxLength) {
+    wchar_t const* line;
+    size_t length;
+    if (!fieldNextLine(cursor, &line, &length) || length > maxLength) return false;
+    wmemcpy(dest, line, length);
+    dest[length] = L'\0';
+    return true;
+}
+
+/** Address, port and name, one per line. */
+bool fieldReadIdentity(FieldCursor* cursor, SenderIdentity* identity) {
+    unsigned long long port;
+    if (!fieldCopyLine(cursor, identity->address, MAX_ADDRESS_LENGTH)
+        || !fieldNextNumber(cursor, &port) || port > 65535
+        || !fieldCopyLine(cursor, identity->name, MAX_NAME_LENGTH)
+    ) {
+        return false;
+    }
+    identity->port = (unsigned short)port;
+    return true;
+}
+
+void builderAppendIdentity(FrameBuilder* builder, wchar_t const* address, unsigned short port, wchar_t const* name) {
+    builderAppendLine(builder, address);
+    builderAppendNumberLine(builder, port);
+    builderAppendLine(builder, name);
+}
+
+/**
+ * Applies the next record of clientPendingRecords
+ * to the identity cache and describes it in msgPtr.
+ */
+MessageReadStatus clientApplyRecord(client_ReceivedMessage* msgPtr) {
+    FieldCursor* cursor = &clientPendingRecords;
+    wchar_t recordType;
+    unsigned long long id;
+    if (!fieldFrameType(cursor, &recordType) || !fieldNextNumber(cursor, &id)) {
+        return READ_ERR_MALFUNCTIONING_PEER;
+    }
+
+    switch (recordType) {
+        case RECORD_JOIN: {
+            CachedIdentity* cached = identityCacheInsert((SenderId)id);
+            if (cached == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+            if (!fieldReadIdentity(cursor, &cached->identity)) return READ_ERR_MALFUNCTIONING_PEER;
+            msgPtr->type = TO_CLIENT_JOIN;
+            msgPtr->sender = &cached->identity;
+        } break;
+
+        case RECORD_LEAVE: {
+            CachedIdentity* cached = identityCacheFind((SenderId)id);
+            if (cached == NULL) return READ_ERR_MALFUNCTIONING_PEER;
+            clientDepartedIdentity = cached->identity;
+            identityCacheRemove(cached);
+            msgPtr->type = TO_CLIENT_LEAVE;
+            msgPtr->sender = &clientDepartedIdentity;
+        } break;
+
+        case RECORD_RENAME: {
+            CachedIdentity* cached = identityCacheFind((SenderId)id);
+            if (cached == NULL) return READ_ERR_MALFUNCTIONING_PEER;
+            size_t oldNameLength = wcslen(cached->identity.name);
+            msgPtr->text = (wchar_t*)malloc((oldNameLength + 1) * sizeof(wchar_t));
+            if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+            wmemcpy(msgPtr->text, cached->identity.name, oldNameLength + 1);
+            if (!fieldCopyLine(cursor, cached->identity.name, MAX_NAME_LENGTH)) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            msgPtr->type = TO_CLIENT_RENAME;
+            msgPtr->sender = &cached->identity;
+        } break;
+
+        default:
+            return READ_ERR_MALFUNCTIONING_PEER;
+    }
+
+    msgPtr->senderId = (SenderId)id;
+    msgPtr->senderIsYourself = ((SenderId)id == clientOwnId);
+    return READ_SUCCESS;
+}
+
+MessageReadStatus clientReadMembers(FieldCursor* cursor, client_ReceivedMessage* msgPtr) {
+    unsigned long long version;
+    if (!fieldNextNumber(cursor, &version)) return READ_ERR_MALFUNCTIONING_PEER;
+    clientMembersVersion = version;
+
+    identityCacheClear();
+    clientPendingRecords = *cursor;
+    while (clientPendingRecords.pos < clientPendingRecords.end) {
+        MessageReadStatus readStatus = clientApplyRecord(msgPtr);
+        if (readStatus != READ_SUCCESS) return readStatus;
+        if (msgPtr->type != TO_CLIENT_JOIN) return READ_ERR_MALFUNCTIONING_PEER;
     }
 
-FINALIZE:
-    free((void*)buffer);
-    if (_returnValue_ != READ_SUCCESS) {
-        client_freeReceivedMessage(msgPtr);
+    CachedIdentity* yourself = identityCacheFind(clientOwnId);
+    if (yourself == NULL) return READ_ERR_MALFUNCTIONING_PEER;
+    msgPtr->type = TO_CLIENT_MEMBERS;
+    msgPtr->sender = &yourself->identity;
+    msgPtr->senderIsYourself = true;
+    return READ_SUCCESS;
+}
+
+MessageReadStatus client_readMessageFromServer(client_ReceivedMessage* msgPtr) {
+    msgPtr->text = NULL;
+    msgPtr->senderId = 0;
+    msgPtr->senderIsYourself = false;
+    msgPtr->transferKind = 0;
+    msgPtr->transferLength = 0;
+    msgPtr->sequence = 0;
+
+    // Hand out the records of a D message one by one.
+    if (clientPendingRecords.pos < clientPendingRecords.end) {
+        return clientApplyRecord(msgPtr);
+    }
+
+    // Handle bookkeeping messages silently until
+    // something comes up that the user should see.
+    for (;;) {
+        wchar_t const* payload;
+        size_t payloadLength;
+        MessageReadStatus readStatus = clientNextPayload(&payload, &payloadLength);
+        if (readStatus != READ_SUCCESS) return readStatus;
+
+        FieldCursor cursor = { payload, payload + payloadLength };
+        wchar_t frameType;
+        if (!fieldFrameType(&cursor, &frameType)) return READ_ERR_MALFUNCTIONING_PEER;
+
+        switch (frameType) {
+            case FRAME_WELCOME: {
+                unsigned long long id, caughtUpTo;
+                if (!fieldNextNumber(&cursor, &id)
+                    || !fieldCopyLine(&cursor, clientResumeToken, MAX_RESUME_TOKEN_LENGTH)
+                    || !fieldNextNumber(&cursor, &caughtUpTo)
+                ) {
+                    return READ_ERR_MALFUNCTIONING_PEER;
+                }
+                clientOwnId = (SenderId)id;
+                bool resumed = clientResuming;
+                bool missedNothing = (caughtUpTo == clientLastSequence);
+                clientResuming = false;
+                clientLastSequence = caughtUpTo;
+                if (clientWantsMulticast && clientSendMulticastWish(clientConfd, true) != SEND_SUCCESS) {
+                    return READ_ERR_BROKEN_SOCKET;
+                }
+                if (resumed) {
+                    msgPtr->type = missedNothing ? TO_CLIENT_RESUMED : TO_CLIENT_MISSED;
+                    msgPtr->sender = NULL;
+                    return READ_SUCCESS;
+                }
+            } break;
+
+            case FRAME_MEMBERS:
+                return clientReadMembers(&cursor, msgPtr);
+
+            case FRAME_PRESENCE_DELTA: {
+                unsigned long long fromVersion, toVersion;
+                if (!fieldNextNumber(&cursor, &fromVersion) || !fieldNextNumber(&cursor, &toVersion)) {
+                    return READ_ERR_MALFUNCTIONING_PEER;
+                }
+                if (fromVersion != clientMembersVersion) return READ_ERR_MALFUNCTIONING_PEER;
+                clientMembersVersion = toVersion;
+                if (cursor.pos < cursor.end) {
+                    clientPendingRecords = cursor;
+                    return clientApplyRecord(msgPtr);
+                }
+            } break;
+
+            case FRAME_CHAT:
+            case FRAME_DIRECT: {
+                unsigned long long sequence, id;
+                if (frameType == FRAME_CHAT) {
+                    if (!fieldNextNumber(&cursor, &sequence)) return READ_ERR_MALFUNCTIONING_PEER;
+                    if (clientMulticast.fd >= 0 && sequence != clientLastSequence + 1) {
+                        readStatus = clientHoldChat(sequence, payload, payloadLength);
+                        if (readStatus != READ_SUCCESS) return readStatus;
+                        break;
+                    }
+                    clientLastSequence = sequence;
+                }
+                if (!fieldNextNumber(&cursor, &id)) return READ_ERR_MALFUNCTIONING_PEER;
+                CachedIdentity* cached = identityCacheFind((SenderId)id);
+                if (cached == NULL) return READ_ERR_MALFUNCTIONING_PEER;
+
+                msgPtr->text = fieldRestToNewString(&cursor, NULL);
+                if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+                msgPtr->type = (frameType == FRAME_CHAT) ? TO_CLIENT_CHAT : TO_CLIENT_DIRECT;
+                msgPtr->sender = &cached->identity;
+                msgPtr->senderId = cached->id;
+                msgPtr->senderIsYourself = (cached->id == clientOwnId);
+                return READ_SUCCESS;
+            }
+
+            case FRAME_TRANSFER_START:
+            case FRAME_TRANSFER_DATA:
+            case FRAME_TRANSFER_CANCEL: {
+                unsigned long long id, length = 0;
+                wchar_t const* kind = L"";
+                size_t kindLength;
+                if (!fieldNextNumber(&cursor, &id)) return READ_ERR_MALFUNCTIONING_PEER;
+                if (frameType == FRAME_TRANSFER_START
+                    && (!fieldNextLine(&cursor, &kind, &kindLength) || kindLength != 1 || !fieldNextNumber(&cursor, &length))
+                ) {
+                    return READ_ERR_MALFUNCTIONING_PEER;
+                }
+                CachedIdentity* cached = identityCacheFind((SenderId)id);
+                if (cached == NULL) return READ_ERR_MALFUNCTIONING_PEER;
+
+                if (frameType != FRAME_TRANSFER_CANCEL) {
+                    msgPtr->text = fieldRestToNewString(&cursor, NULL);
+                    if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+                }
+                msgPtr->type = (frameType == FRAME_TRANSFER_START) ? TO_CLIENT_TRANSFER_START
+                    : (frameType == FRAME_TRANSFER_DATA) ? TO_CLIENT_TRANSFER_DATA : TO_CLIENT_TRANSFER_CANCELLED;
+                msgPtr->sender = &cached->identity;
+                msgPtr->senderId = cached->id;
+                msgPtr->senderIsYourself = (cached->id == clientOwnId);
+                msgPtr->transferKind = kind[0];
+                msgPtr->transferLength = length;
+                return READ_SUCCESS;
+            }
+
+            case FRAME_SEARCH: {
+                // Checked now; the fields are then read with
+                // client_nextSearchResult(), each ended by a null.
+                unsigned long long numResults, sequence;
+                size_t length;
+                if (!fieldNextNumber(&cursor, &numResults)) return READ_ERR_MALFUNCTIONING_PEER;
+                msgPtr->text = fieldRestToNewString(&cursor, &length);
+                if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+                FieldCursor results = { msgPtr->text, msgPtr->text + length };
+                wchar_t const* field;
+                size_t fieldLength;
+                bool ok = true;
+                for (unsigned long long i = 0; i < numResults && ok; ++i) {
+                    ok = fieldNextNumber(&results, &sequence)
+                        && fieldNextLine(&results, &field, &fieldLength) && fieldLength <= MAX_NAME_LENGTH
+                        && fieldNextLine(&results, &field, &fieldLength);
+                }
+                if (!ok || results.pos != results.end) {
+                    client_freeReceivedMessage(msgPtr);
+                    return READ_ERR_MALFUNCTIONING_PEER;
+                }
+                for (size_t i = 0; i < length; ++i) {
+                    if (msgPtr->text[i] == L'\n') msgPtr->text[i] = L'\0';
+                }
+                msgPtr->type = TO_CLIENT_SEARCH_RESULTS;
+                msgPtr->numResults = (size_t)numResults;
+                msgPtr->sender = NULL;
+            } return READ_SUCCESS;
+
+            case FRAME_NO_SUCH_USER:
+                msgPtr->text = fieldRestToNewString(&cursor, NULL);
+                if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+                msgPtr->type = TO_CLIENT_NO_SUCH_USER;
+                msgPtr->sender = NULL;
+            return READ_SUCCESS;
+
+            case FRAME_PING:
+                if (sendPong(clientConfd) != SEND_SUCCESS) return READ_ERR_BROKEN_SOCKET;
+            break;
+
+            case FRAME_REMOTE_CHAT: {
+                unsigned long long sequence;
+                if (!fieldNextNumber(&cursor, &sequence)) return READ_ERR_MALFUNCTIONING_PEER;
+                if (clientMulticast.fd >= 0 && sequence != clientLastSequence + 1) {
+                    readStatus = clientHoldChat(sequence, payload, payloadLength);
+                    if (readStatus != READ_SUCCESS) return readStatus;
+                    break;
+                }
+                if (!fieldReadIdentity(&cursor, &clientRemoteSender)) return READ_ERR_MALFUNCTIONING_PEER;
+                clientLastSequence = sequence;
+                msgPtr->text = fieldRestToNewString(&cursor, NULL);
+                if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+                msgPtr->type = TO_CLIENT_CHAT;
+                msgPtr->sender = &clientRemoteSender;
+                // By multicast, this user's own messages come as E's too.
+                CachedIdentity* yourself = identityCacheFind(clientOwnId);
+                msgPtr->senderIsYourself = (clientMulticast.fd >= 0 && yourself != NULL
+                    && yourself->identity.port == clientRemoteSender.port
+                    && wcscmp(yourself->identity.address, clientRemoteSender.address) == 0
+                    && wcscmp(yourself->identity.name, clientRemoteSender.name) == 0
+                );
+                return READ_SUCCESS;
+            }
+
+            case FRAME_MULTICAST: {
+                wchar_t group[MAX_ADDRESS_LENGTH + 1];
+                unsigned long long port;
+                if (!fieldCopyLine(&cursor, group, MAX_ADDRESS_LENGTH) || !fieldNextNumber(&cursor, &port) || port > 65535) {
+                    return READ_ERR_MALFUNCTIONING_PEER;
+                }
+                bool wasJoined = (clientMulticast.fd >= 0);
+                mcLeave(&clientMulticast);
+                bool joined = (group[0] != L'\0' && clientJoinMulticast(group, (unsigned short)port));
+                if (!joined && (wasJoined || group[0] != L'\0')) {
+                    // Back to the connection, from where multicast left
+                    // off; the server says so with another G.
+                    if (clientSendMulticastWish(clientConfd, false) != SEND_SUCCESS) return READ_ERR_BROKEN_SOCKET;
+                    break;
+                }
+                msgPtr->type = TO_CLIENT_MULTICAST;
+                msgPtr->sender = NULL;
+                if (joined) {
+                    size_t length = wcslen(group) + 8;
+                    msgPtr->text = (wchar_t*)malloc(length * sizeof(wchar_t));
+                    if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+                    swprintf(msgPtr->text, length, L"%ls:%llu", group, port);
+                }
+            } return READ_SUCCESS;
+
+            case FRAME_LOST: {
+                unsigned long long lastLost;
+                if (!fieldNextNumber(&cursor, &lastLost)) return READ_ERR_MALFUNCTIONING_PEER;
+                if (lastLost <= clientLastSequence) break;
+                clientLastSequence = lastLost;
+                if (clientMulticast.fd >= 0) mcForget(&clientMulticast, lastLost);
+                msgPtr->type = TO_CLIENT_LOST;
+                msgPtr->sender = NULL;
+            } return READ_SUCCESS;
+
+            case FRAME_ACK: {
+                unsigned long long sequence;
+                if (!fieldNextNumber(&cursor, &sequence)) return READ_ERR_MALFUNCTIONING_PEER;
+                // It stands for the M it spares; by multicast,
+                // the E comes all the same, in its turn.
+                if (clientMulticast.fd < 0 && sequence > clientLastSequence) clientLastSequence = sequence;
+                if (cursor.pos < cursor.end) {
+                    msgPtr->text = fieldRestToNewString(&cursor, NULL);
+                    if (msgPtr->text == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+                }
+                msgPtr->type = TO_CLIENT_ACK;
+                msgPtr->sender = NULL;
+                msgPtr->sequence = sequence;
+            } return READ_SUCCESS;
+
+            default:
+                return READ_ERR_MALFUNCTIONING_PEER;
+        }
     }
-    return _returnValue_;
 }
 
 void client_freeReceivedMessage(client_ReceivedMessage* msgPtr) {
@@ -242,81 +1366,458 @@ void client_freeReceivedMessage(client_ReceivedMessage* msgPtr) {
     msgPtr->text = NULL;
 }
 
-MessageSendStatus client_sendMessageToServer(int confd, wchar_t const* const name, wchar_t const* const messageToSend) {
-    // Using FORMAT 1
-    size_t bufferLength = wcslen(name) + 1 /*the newline L'\n'*/ + wcslen(messageToSend);
-    wchar_t* buffer = (wchar_t*)malloc((bufferLength + 2) * sizeof(buffer[0]));
-    if (buffer == NULL) return SEND_ERR_NOT_ENOUGH_MEMORY;
-    swprintf(buffer, bufferLength + 1, L"%ls\n%ls", name, messageToSend);
-    MessageSendStatus sendStatus = rawSendMessage(confd, buffer);
-    free((void*)buffer);
-    return sendStatus;
+MessageSendStatus client_sendMessageToServer(int confd, wchar_t const* const messageToSend) {
+    FrameBuilder builder;
+    size_t length = wcslen(messageToSend);
+    builderInit(&builder, 2 + length);
+    builderAppendChars(&builder, L"M\n", 2);
+    builderAppendChars(&builder, messageToSend, length);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus client_sendDirectMessage(int confd, wchar_t const* const recipientName, wchar_t const* const messageToSend) {
+    FrameBuilder builder;
+    size_t length = wcslen(messageToSend);
+    builderInit(&builder, 3 + wcslen(recipientName) + length);
+    builderAppendChars(&builder, L"T\n", 2);
+    builderAppendLine(&builder, recipientName);
+    builderAppendChars(&builder, messageToSend, length);
+    return builderSend(&builder, confd);
+}
+
+/**
+ * Announces a transfer of `length` characters,
+ * to be sent with client_sendTransferData(), in
+ * pieces of at most TRANSFER_CHUNK_LENGTH.
+ */
+MessageSendStatus client_startTransfer(int confd, wchar_t kind, uint64_t length, wchar_t const* const name) {
+    FrameBuilder builder;
+    builderInit(&builder, 32 + wcslen(name));
+    builderAppendChars(&builder, L"H\n", 2);
+    builderAppendChars(&builder, &kind, 1);
+    builderAppendChars(&builder, L"\n", 1);
+    builderAppendNumberLine(&builder, length);
+    builderAppendString(&builder, name);
+    return builderSend(&builder, confd);
 }
 
+MessageSendStatus client_sendTransferData(int confd, wchar_t const* data, size_t length) {
+    FrameBuilder builder;
+    builderInit(&builder, 2 + length);
+    builderAppendChars(&builder, L"C\n", 2);
+    builderAppendChars(&builder, data, length);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus client_cancelTransfer(int confd) {
+    FrameBuilder builder;
+    builderInit(&builder, 2);
+    builderAppendChars(&builder, L"Z\n", 2);
+    return builderSend(&builder, confd);
+}
+
+/////////////// SERVER ///////////////
+
 void server_setup() {}
 void server_teardown() {}
 
-MessageReadStatus server_readMessageFromClient(int confd, server_MessageSentFromClient* msgPtr) {
-    MessageReadStatus _returnValue_ = READ_SUCCESS;
+MessageReadStatus server_receiveFromClient(int confd, FrameReader* reader) {
+    return rawReceive(confd, reader);
+}
 
+MessageReadStatus server_readMessageFromClient(FrameReader* reader, server_MessageSentFromClient* msgPtr) {
     msgPtr->text = NULL;
+    msgPtr->nodeId = 0;
+    msgPtr->relay = NULL;
+    msgPtr->recipient = NULL;
+    msgPtr->resumeToken = NULL;
+    msgPtr->sequence = 0;
+    msgPtr->toSequence = 0;
+    msgPtr->multicast = false;
+    msgPtr->transferKind = 0;
+    msgPtr->transferLength = 0;
+
+    wchar_t const* payload;
+    size_t payloadLength;
+    MessageReadStatus readStatus = rawReadMessage(reader, MAX_FRAME_LENGTH, &payload, &payloadLength);
+    if (readStatus != READ_SUCCESS) return readStatus;
+
+    FieldCursor cursor = { payload, payload + payloadLength };
+    wchar_t frameType;
+    if (!fieldFrameType(&cursor, &frameType)) return READ_ERR_MALFUNCTIONING_PEER;
+
+    switch (frameType) {
+        case FRAME_LOGIN:
+        case FRAME_RENAME: {
+            msgPtr->type = (frameType == FRAME_LOGIN) ? FROM_CLIENT_LOGIN : FROM_CLIENT_RENAME;
+            size_t nameLength = cursor.end - cursor.pos;
+            if (nameLength > MAX_NAME_LENGTH) return READ_ERR_MALFUNCTIONING_PEER;
+        } break;
+
+        case FRAME_RESUME: {
+            msgPtr->type = FROM_CLIENT_RESUME;
+            wchar_t const* token;
+            size_t tokenLength;
+            unsigned long long sequence;
+            if (!fieldNextLine(&cursor, &token, &tokenLength) || tokenLength > MAX_RESUME_TOKEN_LENGTH
+                || !fieldNextNumber(&cursor, &sequence)
+                || (size_t)(cursor.end - cursor.pos) > MAX_NAME_LENGTH
+            ) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            FieldCursor tokenCursor = { token, token + tokenLength };
+            msgPtr->resumeToken = fieldRestToNewString(&tokenCursor, NULL);
+            if (msgPtr->resumeToken == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+            msgPtr->sequence = sequence;
+        } break;
 
-    wchar_t* buffer = NULL;
-    size_t bufferLength = 0;
-    size_t actualMessageLength;
-    MessageReadStatus readStatus = rawReadMessage(confd, &buffer, &bufferLength, &actualMessageLength);
-    if (readStatus != READ_SUCCESS) FAIL(readStatus)
-
-    // Using FORMAT 1
-    wchar_t* tokenizerInternalData;
-    {
-        // Line 1
-        wchar_t* senderName = wcstok(buffer, L"\n", &tokenizerInternalData);
-        size_t senderNameLength = wcslen(senderName);
-        if (senderNameLength > MAX_NAME_LENGTH) FAIL(READ_ERR_MALFUNCTIONING_PEER)
-        wcscpy(msgPtr->name, senderName);
-    } {
-        // Line >= 2
-        wchar_t* message = wcstok(NULL, L"", &tokenizerInternalData);
-        size_t messageLength = wcslen(message);
-        msgPtr->text = (wchar_t*)malloc((messageLength + 1) * sizeof(message[0]));
-        wcscpy(msgPtr->text, message);
-    }
-
-FINALIZE:
-    free((void*)buffer);
-    msgPtr->confd = confd;
-    return _returnValue_;
+        case FRAME_SEARCH:
+            msgPtr->type = FROM_CLIENT_SEARCH;
+        break;
+
+        case FRAME_CHAT:
+            msgPtr->type = FROM_CLIENT_CHAT;
+            if (cursor.end - cursor.pos > MAX_CHAT_LENGTH) return READ_ERR_MALFUNCTIONING_PEER;
+        break;
+
+        case FRAME_DIRECT: {
+            msgPtr->type = FROM_CLIENT_DIRECT;
+            wchar_t const* name;
+            size_t nameLength;
+            if (!fieldNextLine(&cursor, &name, &nameLength) || nameLength == 0 || nameLength > MAX_NAME_LENGTH) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            if (cursor.end - cursor.pos > MAX_CHAT_LENGTH) return READ_ERR_MALFUNCTIONING_PEER;
+            FieldCursor nameCursor = { name, name + nameLength };
+            msgPtr->recipient = fieldRestToNewString(&nameCursor, NULL);
+            if (msgPtr->recipient == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+        } break;
+
+        case FRAME_TRANSFER_START: {
+            wchar_t const* kind;
+            size_t kindLength;
+            unsigned long long length;
+            if (!fieldNextLine(&cursor, &kind, &kindLength) || kindLength != 1
+                || (kind[0] != TRANSFER_CHAT && kind[0] != TRANSFER_FILE)
+                || !fieldNextNumber(&cursor, &length) || length == 0
+                || (kind[0] == TRANSFER_CHAT && length > MAX_LONG_MESSAGE_LENGTH)
+                || (size_t)(cursor.end - cursor.pos) > MAX_NAME_LENGTH
+                || tsFindChar(cursor.pos, cursor.end - cursor.pos, L'\n') != NULL
+            ) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            msgPtr->type = FROM_CLIENT_TRANSFER_START;
+            msgPtr->transferKind = kind[0];
+            msgPtr->transferLength = length;
+        } break;
+
+        case FRAME_TRANSFER_DATA:
+            msgPtr->type = FROM_CLIENT_TRANSFER_DATA;
+            if (cursor.pos == cursor.end || cursor.end - cursor.pos > TRANSFER_CHUNK_LENGTH) return READ_ERR_MALFUNCTIONING_PEER;
+        break;
+
+        case FRAME_TRANSFER_CANCEL:
+            msgPtr->type = FROM_CLIENT_TRANSFER_CANCEL;
+        return READ_SUCCESS;
+
+        case FRAME_ACK:
+            msgPtr->type = FROM_CLIENT_WANT_ACKS;
+        return READ_SUCCESS;
+
+        case FRAME_PEER_HELLO: {
+            unsigned long long nodeId;
+            if (!fieldNextNumber(&cursor, &nodeId) || nodeId == 0 || nodeId > UINT32_MAX) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            msgPtr->type = FROM_PEER_HELLO;
+            msgPtr->nodeId = (NodeId)nodeId;
+        } return READ_SUCCESS;
+
+        case FRAME_PING:
+        case FRAME_PONG:
+            msgPtr->type = (frameType == FRAME_PING) ? FROM_PEER_PING : FROM_CLIENT_PONG;
+        return READ_SUCCESS;
+
+        case FRAME_MULTICAST: {
+            unsigned long long on, sequence = 0;
+            if (!fieldNextNumber(&cursor, &on) || on > 1 || (on == 0 && !fieldNextNumber(&cursor, &sequence))) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            msgPtr->type = FROM_CLIENT_MULTICAST;
+            msgPtr->multicast = (on == 1);
+            msgPtr->sequence = sequence;
+        } return READ_SUCCESS;
+
+        case FRAME_NACK: {
+            unsigned long long first, last;
+            if (!fieldNextNumber(&cursor, &first) || !fieldNextNumber(&cursor, &last) || first == 0 || first > last) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            msgPtr->type = FROM_CLIENT_NACK;
+            msgPtr->sequence = first;
+            msgPtr->toSequence = last;
+        } return READ_SUCCESS;
+
+        case FRAME_RELAYED_CHAT: {
+            msgPtr->type = FROM_PEER_CHAT;
+            unsigned long long originNode, sequence, port;
+            wchar_t const* address;
+            wchar_t const* name;
+            size_t addressLength, nameLength;
+            if (!fieldNextNumber(&cursor, &originNode) || originNode == 0 || originNode > UINT32_MAX
+                || !fieldNextNumber(&cursor, &sequence)
+                || !fieldNextLine(&cursor, &address, &addressLength) || addressLength > MAX_ADDRESS_LENGTH
+                || !fieldNextNumber(&cursor, &port) || port > 65535
+                || !fieldNextLine(&cursor, &name, &nameLength) || nameLength > MAX_NAME_LENGTH
+                || cursor.end - cursor.pos > MAX_CHAT_LENGTH
+            ) {
+                return READ_ERR_MALFUNCTIONING_PEER;
+            }
+            msgPtr->relay = server_newRelayInfo((NodeId)originNode, sequence, name, nameLength, address, addressLength, (unsigned short)port);
+            if (msgPtr->relay == NULL) return READ_ERR_NOT_ENOUGH_MEMORY;
+        } break;
+
+        default:
+            return READ_ERR_MALFUNCTIONING_PEER;
+    }
+
+    msgPtr->text = fieldRestToNewString(&cursor, NULL);
+    if (msgPtr->text == NULL) {
+        server_freeMessageFromClient(msgPtr);
+        return READ_ERR_NOT_ENOUGH_MEMORY;
+    }
+    return READ_SUCCESS;
 }
 
 void server_freeMessageFromClient(server_MessageSentFromClient* msgPtr) {
     free((void*)msgPtr->text);
     msgPtr->text = NULL;
+    free((void*)msgPtr->relay);
+    msgPtr->relay = NULL;
+    free((void*)msgPtr->recipient);
+    msgPtr->recipient = NULL;
+    free((void*)msgPtr->resumeToken);
+    msgPtr->resumeToken = NULL;
 }
 
-MessageSendStatus server_forwardMessageToClient(int confd, wchar_t const* text, SenderIdentity const* senderIdentity, bool senderIsHim) {
-    // Using FORMAT 2
-    size_t payloadLength = wcslen(senderIdentity->address)                   // Sender Address
-        + 1 + numDigitsOf(senderIdentity->port)           // Sender Port
-        + 1 + wcslen(senderIdentity->name)                // Sender Name
-        + 1 + (senderIsHim ? wcslen(L"Yourself") : wcslen(L"Else"))  // Sender Is Yourself
-        + 1 + wcslen(text)                                // Actual Message
-        + 1;
-
-    wchar_t* payload = (wchar_t*)malloc(
-        (payloadLength + 1) * sizeof(wchar_t)
-    );
-    if (payload == NULL) return SEND_ERR_NOT_ENOUGH_MEMORY;
-
-    swprintf(payload, payloadLength, L"%ls\n%hu\n%ls\n%ls\n%ls",
-        senderIdentity->address,
-        senderIdentity->port,
-        senderIdentity->name,
-        (senderIsHim ? L"Yourself" : L"Else"),
-        text
-    );
-
-    MessageSendStatus sendStatus = rawSendMessage(confd, payload);
-    free((void*)payload);
-    return sendStatus;
+MessageSendStatus server_welcomeClient(int confd, SenderId yourId, wchar_t const* resumeToken, uint64_t caughtUpTo) {
+    FrameBuilder builder;
+    builderInit(&builder, 48 + MAX_RESUME_TOKEN_LENGTH);
+    builderAppendChars(&builder, L"W\n", 2);
+    builderAppendNumberLine(&builder, yourId);
+    builderAppendLine(&builder, resumeToken);
+    builderAppendNumberLine(&builder, caughtUpTo);
+    return builderSend(&builder, confd);
+}
+
+void builderAppendPresenceRecords(FrameBuilder* builder, PresenceChange const* changes, size_t numChanges) {
+    for (size_t i = 0; i < numChanges; ++i) {
+        PresenceChange const* change = &changes[i];
+        switch (change->type) {
+            case PRESENCE_JOIN:
+                builderAppendChars(builder, L"J\n", 2);
+                builderAppendNumberLine(builder, change->id);
+                builderAppendIdentity(builder, change->address, change->port, change->name);
+            break;
+
+            case PRESENCE_LEAVE:
+                builderAppendChars(builder, L"L\n", 2);
+                builderAppendNumberLine(builder, change->id);
+            break;
+
+            case PRESENCE_RENAME:
+                builderAppendChars(builder, L"R\n", 2);
+                builderAppendNumberLine(builder, change->id);
+                builderAppendLine(builder, change->name);
+            break;
+        }
+    }
+}
+
+bool server_encodeMembership(EncodedFrame* frame, uint64_t version, PresenceChange const* members, size_t numMembers) {
+    FrameBuilder builder;
+    builderInit(&builder, 32 + numMembers * 48);
+    builderAppendChars(&builder, L"S\n", 2);
+    builderAppendNumberLine(&builder, version);
+    builderAppendPresenceRecords(&builder, members, numMembers);
+    return builderFinish(&builder, frame);
+}
+
+bool server_encodePresenceDelta(EncodedFrame* frame, uint64_t fromVersion, uint64_t toVersion, PresenceChange const* changes, size_t numChanges) {
+    FrameBuilder builder;
+    builderInit(&builder, 64 + numChanges * 48);
+    builderAppendChars(&builder, L"D\n", 2);
+    builderAppendNumberLine(&builder, fromVersion);
+    builderAppendNumberLine(&builder, toVersion);
+    builderAppendPresenceRecords(&builder, changes, numChanges);
+    return builderFinish(&builder, frame);
+}
+
+bool server_encodeChatMessage(EncodedFrame* frame, uint64_t sequence, SenderId senderId, wchar_t const* text) {
+    FrameBuilder builder;
+    size_t textLength = wcslen(text);
+    builderInit(&builder, 40 + textLength);
+    builderAppendChars(&builder, L"M\n", 2);
+    builderAppendNumberLine(&builder, sequence);
+    builderAppendNumberLine(&builder, senderId);
+    builderAppendChars(&builder, text, textLength);
+    return builderFinish(&builder, frame);
+}
+
+/** `text`: NULL, unless the content filter masked some of it. */
+bool server_encodeAck(EncodedFrame* frame, uint64_t sequence, wchar_t const* text) {
+    FrameBuilder builder;
+    size_t textLength = (text != NULL) ? wcslen(text) : 0;
+    builderInit(&builder, 24 + textLength);
+    builderAppendChars(&builder, L"A\n", 2);
+    builderAppendNumberLine(&builder, sequence);
+    if (text != NULL) builderAppendChars(&builder, text, textLength);
+    return builderFinish(&builder, frame);
+}
+
+bool server_encodeDirectMessage(EncodedFrame* frame, SenderId senderId, wchar_t const* text) {
+    FrameBuilder builder;
+    size_t textLength = wcslen(text);
+    builderInit(&builder, 24 + textLength);
+    builderAppendChars(&builder, L"T\n", 2);
+    builderAppendNumberLine(&builder, senderId);
+    builderAppendChars(&builder, text, textLength);
+    return builderFinish(&builder, frame);
+}
+
+MessageSendStatus server_tellNoSuchUser(int confd, wchar_t const* name) {
+    FrameBuilder builder;
+    builderInit(&builder, 2 + wcslen(name));
+    builderAppendChars(&builder, L"U\n", 2);
+    builderAppendString(&builder, name);
+    return builderSend(&builder, confd);
+}
+
+/** `group` is empty, and `port` 0, for the client's connection. */
+MessageSendStatus server_tellMulticast(int confd, wchar_t const* group, unsigned short port) {
+    FrameBuilder builder;
+    builderInit(&builder, 16 + wcslen(group));
+    builderAppendChars(&builder, L"G\n", 2);
+    builderAppendLine(&builder, group);
+    builderAppendNumberLine(&builder, port);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus server_tellLost(int confd, uint64_t lastLost) {
+    FrameBuilder builder;
+    builderInit(&builder, 24);
+    builderAppendChars(&builder, L"X\n", 2);
+    builderAppendNumberLine(&builder, lastLost);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus server_tellSearchResults(int confd, SearchHit const* hits, size_t numHits) {
+    FrameBuilder builder;
+    builderInit(&builder, 24 + numHits * 128);
+    builderAppendChars(&builder, L"Q\n", 2);
+    builderAppendNumberLine(&builder, numHits);
+    for (size_t i = 0; i < numHits; ++i) {
+        builderAppendNumberLine(&builder, hits[i].sequence);
+        builderAppendLine(&builder, hits[i].name);
+        wchar_t const* pos = hits[i].snippet;
+        wchar_t const* end = pos + hits[i].snippetLength;
+        while (pos < end) {
+            wchar_t const* newline = wmemchr(pos, L'\n', end - pos);
+            wchar_t const* stop = (newline != NULL) ? newline : end;
+            builderAppendChars(&builder, pos, stop - pos);
+            if (newline != NULL) builderAppendChars(&builder, L" ", 1);
+            pos = (newline != NULL) ? newline + 1 : end;
+        }
+        builderAppendChars(&builder, L"\n", 1);
+    }
+    return builderSend(&builder, confd);
+}
+
+bool server_encodeTransferStart(EncodedFrame* frame, SenderId senderId, wchar_t kind, uint64_t length, wchar_t const* name) {
+    FrameBuilder builder;
+    builderInit(&builder, 48 + wcslen(name));
+    builderAppendChars(&builder, L"H\n", 2);
+    builderAppendNumberLine(&builder, senderId);
+    builderAppendChars(&builder, &kind, 1);
+    builderAppendChars(&builder, L"\n", 1);
+    builderAppendNumberLine(&builder, length);
+    builderAppendString(&builder, name);
+    return builderFinish(&builder, frame);
+}
+
+bool server_encodeTransferData(EncodedFrame* frame, SenderId senderId, wchar_t const* data) {
+    FrameBuilder builder;
+    size_t dataLength = wcslen(data);
+    builderInit(&builder, 24 + dataLength);
+    builderAppendChars(&builder, L"C\n", 2);
+    builderAppendNumberLine(&builder, senderId);
+    builderAppendChars(&builder, data, dataLength);
+    return builderFinish(&builder, frame);
+}
+
+bool server_encodeTransferCancel(EncodedFrame* frame, SenderId senderId) {
+    FrameBuilder builder;
+    builderInit(&builder, 24);
+    builderAppendChars(&builder, L"Z\n", 2);
+    builderAppendNumberLine(&builder, senderId);
+    return builderFinish(&builder, frame);
+}
+
+bool server_encodeRemoteChatMessage(EncodedFrame* frame, uint64_t sequence, server_RelayInfo const* relay, wchar_t const* text) {
+    FrameBuilder builder;
+    size_t textLength = wcslen(text);
+    builderInit(&builder, 56 + wcslen(relay->address) + wcslen(relay->name) + textLength);
+    builderAppendChars(&builder, L"E\n", 2);
+    builderAppendNumberLine(&builder, sequence);
+    builderAppendIdentity(&builder, relay->address, relay->port, relay->name);
+    builderAppendChars(&builder, text, textLength);
+    return builderFinish(&builder, frame);
+}
+
+/** One allocation, freed with free(). */
+server_RelayInfo* server_newRelayInfo(NodeId originNode, uint64_t sequence, wchar_t const* name, size_t nameLength, wchar_t const* address, size_t addressLength, unsigned short port) {
+    server_RelayInfo* relay = (server_RelayInfo*)malloc(sizeof(server_RelayInfo) + (nameLength + addressLength + 2) * sizeof(wchar_t));
+    if (relay == NULL) return NULL;
+    wchar_t* strings = (wchar_t*)(relay + 1);
+    wmemcpy(strings, name, nameLength);
+    strings[nameLength] = L'\0';
+    wmemcpy(strings + nameLength + 1, address, addressLength);
+    strings[nameLength + 1 + addressLength] = L'\0';
+    relay->originNode = originNode;
+    relay->sequence = sequence;
+    relay->name = strings;
+    relay->address = strings + nameLength + 1;
+    relay->port = port;
+    return relay;
+}
+
+MessageSendStatus server_greetPeer(int confd, NodeId nodeId) {
+    FrameBuilder builder;
+    builderInit(&builder, 16);
+    builderAppendChars(&builder, L"P\n", 2);
+    builderAppendNumberLine(&builder, nodeId);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus server_ping(int confd) {
+    FrameBuilder builder;
+    builderInit(&builder, 2);
+    builderAppendChars(&builder, L"I\n", 2);
+    return builderSend(&builder, confd);
+}
+
+MessageSendStatus server_pong(int confd) {
+    return sendPong(confd);
+}
+
+bool server_encodeRelayedChat(EncodedFrame* frame, server_RelayInfo const* relay, wchar_t const* text) {
+    FrameBuilder builder;
+    size_t textLength = wcslen(text);
+    builderInit(&builder, 64 + wcslen(relay->address) + wcslen(relay->name) + textLength);
+    builderAppendChars(&builder, L"F\n", 2);
+    builderAppendNumberLine(&builder, relay->originNode);
+    builderAppendNumberLine(&builder, relay->sequence);
+    builderAppendIdentity(&builder, relay->address, relay->port, relay->name);
+    builderAppendChars(&builder, text, textLength);
+    return builderFinish(&builder, frame);
 }
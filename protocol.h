@@ -4,16 +4,37 @@
 #include <wctype.h>
 #include <wchar.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define MAX_NAME_LENGTH 255
 #define MAX_ADDRESS_LENGTH 63
+#define MAX_RESUME_TOKEN_LENGTH 64
+
+/**
+ * What a server takes in one frame, in
+ * characters of payload; whatever is longer is
+ * turned down as soon as its header has come,
+ * before any memory is set aside for it. Chat
+ * messages are shorter still, so that they fit
+ * in one frame along with their sender; longer
+ * ones, and files, are sent as transfers, piece
+ * by piece.
+ */
+#define MAX_FRAME_LENGTH (64 * 1024)
+#define MAX_CHAT_LENGTH (16 * 1024)
+#define MAX_LONG_MESSAGE_LENGTH (1024 * 1024)
+#define TRANSFER_CHUNK_LENGTH (15 * 1024) // so that a whole piece, as relayed, fits in a pipe
+#define TRANSFER_CHAT L'M' // a long chat message
+#define TRANSFER_FILE L'F' // a file, in base64
 
 typedef enum {
     READ_SUCCESS = 0,
     READ_ERR_MALFUNCTIONING_PEER,
     READ_ERR_BROKEN_SOCKET,
     READ_ERR_PEER_CLOSED,
-    READ_ERR_NOT_ENOUGH_MEMORY
+    READ_ERR_NOT_ENOUGH_MEMORY,
+    READ_INCOMPLETE // No complete frame has been received yet
 } MessageReadStatus;
 
 typedef enum {
@@ -22,42 +43,221 @@ typedef enum {
     SEND_ERR_NOT_ENOUGH_MEMORY
 } MessageSendStatus;
 
+/**
+ * Compact number the server assigns to each
+ * connection. The sender of a chat message is
+ * identified by it instead of by its name and
+ * address.
+ */
+typedef uint32_t SenderId;
+
+/**
+ * Number identifying a server within a cluster
+ * of servers relaying chat messages to each
+ * other. 0 means unknown.
+ */
+typedef uint32_t NodeId;
+
 typedef struct {
     wchar_t name[MAX_NAME_LENGTH + 1];
     wchar_t address[MAX_ADDRESS_LENGTH + 1];
     unsigned short port;
 } SenderIdentity;
 
+/**
+ * Bytes received from a peer but not consumed
+ * yet. Frames are cut out of it as soon as they
+ * are complete, and whatever follows them (the
+ * beginning of the next frame) stays buffered.
+ */
+typedef struct {
+    char* data;
+    size_t begin;
+    size_t end;
+    size_t capacity;
+} FrameReader;
+
+void              frameReader_init(FrameReader* reader);
+void              frameReader_free(FrameReader* reader);
+void              frameReader_trim(FrameReader* reader);
+bool              frameReader_restore(FrameReader* reader, void const* bytes, size_t numBytes);
+
+/**
+ * A frame (header included) encoded once and
+ * ready to be sent to any number of peers.
+ */
+typedef struct {
+    wchar_t* buffer;
+    wchar_t const* data;
+    size_t length;
+} EncodedFrame;
+
+MessageSendStatus sendEncodedFrame(int confd, EncodedFrame const* frame);
+void              freeEncodedFrame(EncodedFrame* frame);
+
+typedef enum {
+    PRESENCE_JOIN,
+    PRESENCE_LEAVE,
+    PRESENCE_RENAME
+} PresenceChangeType;
+
+/**
+ * One change to the list of online users. The
+ * strings are only read while encoding; LEAVE
+ * only needs the ID, RENAME the ID and name.
+ */
+typedef struct {
+    PresenceChangeType type;
+    SenderId id;
+    wchar_t const* name;
+    wchar_t const* address;
+    unsigned short port;
+} PresenceChange;
+
+/**
+ * A chat message found by a search; the snippet
+ * is a piece of its text.
+ */
+typedef struct {
+    uint64_t sequence;
+    wchar_t const* name;
+    wchar_t const* snippet;
+    size_t snippetLength;
+} SearchHit;
+
 ///////////////////////
 ///// CLIENT API //////
 ///////////////////////
 
+typedef enum {
+    TO_CLIENT_CHAT,
+    TO_CLIENT_DIRECT,       // A chat message to this user only
+    TO_CLIENT_NO_SUCH_USER, // A direct message went to nobody; the text is the name
+    TO_CLIENT_JOIN,
+    TO_CLIENT_LEAVE,
+    TO_CLIENT_RENAME,
+    TO_CLIENT_MEMBERS, // The whole list of online users has been (re)loaded
+    TO_CLIENT_RESUMED, // After client_resume(): every chat message missed is coming
+    TO_CLIENT_MISSED,  // After client_resume(): some chat messages were lost for good
+    TO_CLIENT_MULTICAST, // Where chat messages come from now: the text is "GROUP:PORT", or NULL for the connection
+    TO_CLIENT_LOST,    // Some chat messages that did not come by multicast are lost for good
+    TO_CLIENT_SEARCH_RESULTS, // Reply to client_search(); see client_nextSearchResult()
+    TO_CLIENT_TRANSFER_START, // A user starts sending a long chat message or a file; the text is the file's name
+    TO_CLIENT_TRANSFER_DATA,  // The next piece of it
+    TO_CLIENT_TRANSFER_CANCELLED, // It will not be sent whole
+    TO_CLIENT_ACK // The oldest chat message this user sent and not yet acknowledged went out; see client_wantAcks()
+} client_MessageType;
+
 typedef struct {
-    wchar_t* text;
-    SenderIdentity sender;
+    client_MessageType type;
+    wchar_t* text; // The message for TO_CLIENT_CHAT, the old name for TO_CLIENT_RENAME
+    SenderIdentity const* sender; // Valid until the next read
+    SenderId senderId; // 0 for a user of another server
     bool senderIsYourself;
+    size_t numResults; // TO_CLIENT_SEARCH_RESULTS only
+    wchar_t transferKind;    // TO_CLIENT_TRANSFER_START only: TRANSFER_CHAT or TRANSFER_FILE,
+    uint64_t transferLength; // and the number of characters to come in pieces
+    uint64_t sequence; // TO_CLIENT_ACK only: the number it was given, 0 if it was turned down;
+                       // the text is then NULL, unless the content filter masked some of it
 } client_ReceivedMessage;
 
 void              client_setup();
 void              client_teardown();
-MessageReadStatus client_readMessageFromServer(int confd, client_ReceivedMessage* msgPtr);
+MessageSendStatus client_login(int confd, wchar_t const* const name);
+MessageSendStatus client_resume(int confd, wchar_t const* const name);
+void              client_connectionLost();
+void              client_wantMulticast();
+void              client_wantAcks();
+int               client_multicastFd();
+MessageReadStatus client_receiveMulticast(int confd);
+MessageReadStatus client_receiveFromServer(int confd);
+MessageReadStatus client_readMessageFromServer(client_ReceivedMessage* msgPtr);
 void              client_freeReceivedMessage(client_ReceivedMessage* msgPtr);
-MessageSendStatus client_sendMessageToServer(int confd, wchar_t const* const name, wchar_t const* const messageToSend);
+MessageSendStatus client_sendMessageToServer(int confd, wchar_t const* const messageToSend);
+MessageSendStatus client_rename(int confd, wchar_t const* const newName);
+MessageSendStatus client_sendDirectMessage(int confd, wchar_t const* const recipientName, wchar_t const* const messageToSend);
+bool              client_nextMember(size_t* iteratorPtr, SenderIdentity const** identityPtr);
+MessageSendStatus client_search(int confd, wchar_t const* const query);
+bool              client_nextSearchResult(client_ReceivedMessage const* msgPtr, size_t* iteratorPtr, SearchHit* hitPtr);
+SenderIdentity const* client_yourself();
+MessageSendStatus client_startTransfer(int confd, wchar_t kind, uint64_t length, wchar_t const* const name);
+MessageSendStatus client_sendTransferData(int confd, wchar_t const* data, size_t length);
+MessageSendStatus client_cancelTransfer(int confd);
 
 ///////////////////////
 ///// SERVER API //////
 ///////////////////////
 
+typedef enum {
+    FROM_CLIENT_LOGIN,
+    FROM_CLIENT_CHAT,
+    FROM_CLIENT_RENAME,
+    FROM_CLIENT_DIRECT,
+    FROM_PEER_HELLO, // Another server, which opens a relay link instead of logging in
+    FROM_PEER_CHAT,  // A chat message relayed by another server
+    FROM_PEER_PING,  // Another server checking that the link is alive
+    FROM_CLIENT_PONG, // The reply to server_ping()
+    FROM_CLIENT_RESUME, // A login from a client that was logged in before and lost its connection
+    FROM_CLIENT_MULTICAST, // Which way the client wants chat messages sent to it
+    FROM_CLIENT_NACK,  // Chat messages that did not come by multicast, to send again
+    FROM_CLIENT_SEARCH, // Words to look for in the chat messages sent lately
+    FROM_CLIENT_TRANSFER_START, // A long chat message or a file, to come in pieces
+    FROM_CLIENT_TRANSFER_DATA,  // The next piece of it
+    FROM_CLIENT_TRANSFER_CANCEL, // The rest of it will not come
+    FROM_CLIENT_WANT_ACKS // Its chat messages are to be acknowledged, not sent back to it
+} server_MessageType;
+
+/**
+ * Where a chat message relayed between servers
+ * comes from. The origin node numbers its
+ * messages in increasing order.
+ */
 typedef struct {
-    wchar_t* text;
-    int confd;
-    wchar_t name[MAX_NAME_LENGTH + 1];
+    NodeId originNode;
+    uint64_t sequence;
+    wchar_t const* name;    // stored right after the struct,
+    wchar_t const* address; // in the same allocation
+    unsigned short port;
+} server_RelayInfo;
+
+typedef struct {
+    server_MessageType type;
+    wchar_t* text; // The name, for FROM_CLIENT_LOGIN, FROM_CLIENT_RESUME and FROM_CLIENT_RENAME; the words, for FROM_CLIENT_SEARCH
+    NodeId nodeId; // FROM_PEER_HELLO only
+    server_RelayInfo* relay; // who sent a FROM_PEER_CHAT or FROM_CLIENT_CHAT; freed with the message
+    wchar_t* recipient; // FROM_CLIENT_DIRECT only
+    wchar_t* resumeToken; // FROM_CLIENT_RESUME only,
+    uint64_t sequence;    // with the last chat message the client got (also FROM_CLIENT_MULTICAST, when off;
+                          // the first to send again, for FROM_CLIENT_NACK)
+    uint64_t toSequence;  // FROM_CLIENT_NACK only: the last to send again
+    bool multicast;       // FROM_CLIENT_MULTICAST only: on or off
+    wchar_t transferKind;    // FROM_CLIENT_TRANSFER_START only: TRANSFER_CHAT or TRANSFER_FILE,
+    uint64_t transferLength; // and the number of characters to come in pieces
 } server_MessageSentFromClient;
 
 void              server_setup();
 void              server_teardown();
-MessageReadStatus server_readMessageFromClient(int confd, server_MessageSentFromClient* msgPtr);
+MessageReadStatus server_receiveFromClient(int confd, FrameReader* reader);
+MessageReadStatus server_readMessageFromClient(FrameReader* reader, server_MessageSentFromClient* msgPtr);
 void              server_freeMessageFromClient(server_MessageSentFromClient* msgPtr);
-MessageSendStatus server_forwardMessageToClient(int confd, wchar_t const* text, SenderIdentity const* senderIdentity, bool senderIsHim);
+MessageSendStatus server_welcomeClient(int confd, SenderId yourId, wchar_t const* resumeToken, uint64_t caughtUpTo);
+bool              server_encodeMembership(EncodedFrame* frame, uint64_t version, PresenceChange const* members, size_t numMembers);
+bool              server_encodePresenceDelta(EncodedFrame* frame, uint64_t fromVersion, uint64_t toVersion, PresenceChange const* changes, size_t numChanges);
+bool              server_encodeChatMessage(EncodedFrame* frame, uint64_t sequence, SenderId senderId, wchar_t const* text);
+bool              server_encodeAck(EncodedFrame* frame, uint64_t sequence, wchar_t const* text);
+bool              server_encodeDirectMessage(EncodedFrame* frame, SenderId senderId, wchar_t const* text);
+MessageSendStatus server_tellNoSuchUser(int confd, wchar_t const* name);
+MessageSendStatus server_tellMulticast(int confd, wchar_t const* group, unsigned short port);
+MessageSendStatus server_tellLost(int confd, uint64_t lastLost);
+MessageSendStatus server_tellSearchResults(int confd, SearchHit const* hits, size_t numHits);
+bool              server_encodeTransferStart(EncodedFrame* frame, SenderId senderId, wchar_t kind, uint64_t length, wchar_t const* name);
+bool              server_encodeTransferData(EncodedFrame* frame, SenderId senderId, wchar_t const* data);
+bool              server_encodeTransferCancel(EncodedFrame* frame, SenderId senderId);
+bool              server_encodeRemoteChatMessage(EncodedFrame* frame, uint64_t sequence, server_RelayInfo const* relay, wchar_t const* text);
+server_RelayInfo* server_newRelayInfo(NodeId originNode, uint64_t sequence, wchar_t const* name, size_t nameLength, wchar_t const* address, size_t addressLength, unsigned short port);
+MessageSendStatus server_greetPeer(int confd, NodeId nodeId);
+MessageSendStatus server_ping(int confd);
+MessageSendStatus server_pong(int confd);
+bool              server_encodeRelayedChat(EncodedFrame* frame, server_RelayInfo const* relay, wchar_t const* text);
 
 #endif // PROTOCOL_INCLUDED
@@ -0,0 +1,62 @@
+#include "ratelimit.h"
+
+void rlInit(RateLimiter* limiter, RateLimit const* limit, double now) {
+    limiter->messageTokens = limit->messageBurst;
+    limiter->byteTokens = limit->byteBurst;
+    limiter->lastRefill = now;
+    limiter->throttledSince = 0;
+    limiter->secondsThrottled = 0;
+    limiter->timesThrottled = 0;
+    limiter->throttled = false;
+}
+
+static double refilled(double tokens, double ratePerSecond, double burst, double elapsed) {
+    tokens += ratePerSecond * elapsed;
+    return tokens > burst ? burst : tokens;
+}
+
+void rlRefill(RateLimiter* limiter, RateLimit const* limit, double now) {
+    double elapsed = now - limiter->lastRefill;
+    if (elapsed <= 0) return;
+    limiter->lastRefill = now;
+    if (limit->messagesPerSecond > 0) {
+        limiter->messageTokens = refilled(limiter->messageTokens, limit->messagesPerSecond, limit->messageBurst, elapsed);
+    }
+    if (limit->bytesPerSecond > 0) {
+        limiter->byteTokens = refilled(limiter->byteTokens, limit->bytesPerSecond, limit->byteBurst, elapsed);
+    }
+
+    if (limiter->throttled && rlAllows(limiter, limit)) {
+        limiter->throttled = false;
+        limiter->secondsThrottled += now - limiter->throttledSince;
+    }
+}
+
+bool rlAllows(RateLimiter const* limiter, RateLimit const* limit) {
+    return (limit->messagesPerSecond <= 0 || limiter->messageTokens > 0)
+        && (limit->bytesPerSecond <= 0 || limiter->byteTokens > 0);
+}
+
+void rlCharge(RateLimiter* limiter, RateLimit const* limit, size_t numBytes, double now) {
+    if (limit->messagesPerSecond > 0) limiter->messageTokens -= 1;
+    if (limit->bytesPerSecond > 0) limiter->byteTokens -= (double)numBytes;
+
+    if (!limiter->throttled && !rlAllows(limiter, limit)) {
+        limiter->throttled = true;
+        limiter->throttledSince = now;
+        ++limiter->timesThrottled;
+    }
+}
+
+static double secondsUntilPositive(double tokens, double ratePerSecond) {
+    if (ratePerSecond <= 0 || tokens > 0) return 0;
+    // Aim slightly above zero so that the
+    // bucket really is positive on wakeup.
+    return (1e-6 - tokens) / ratePerSecond;
+}
+
+double rlSecondsUntilAllowed(RateLimiter const* limiter, RateLimit const* limit) {
+    double a = secondsUntilPositive(limiter->messageTokens, limit->messagesPerSecond);
+    double b = secondsUntilPositive(limiter->byteTokens, limit->bytesPerSecond);
+    return a > b ? a : b;
+}
@@ -0,0 +1,43 @@
+#ifndef RateLimit_INCLUDED
+#define RateLimit_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Per-connection admission control with two
+ * token buckets: one counting messages, one
+ * counting bytes. Each bucket refills at its
+ * rate up to its burst size; a rate of 0 means
+ * no limit.
+ *
+ * A message is admitted as long as both buckets
+ * are positive, and its full cost is charged
+ * afterwards, so a bucket may go into debt. The
+ * connection is then throttled until the debt
+ * has been paid back.
+ */
+typedef struct {
+    double messagesPerSecond;
+    double messageBurst;
+    double bytesPerSecond;
+    double byteBurst;
+} RateLimit;
+
+typedef struct {
+    double messageTokens;
+    double byteTokens;
+    double lastRefill;
+    double throttledSince;     // when `throttled` was last set
+    double secondsThrottled;   // total, not counting the current throttle
+    unsigned long timesThrottled;
+    bool throttled;
+} RateLimiter;
+
+void rlInit(RateLimiter* limiter, RateLimit const* limit, double now);
+void rlRefill(RateLimiter* limiter, RateLimit const* limit, double now);
+bool rlAllows(RateLimiter const* limiter, RateLimit const* limit);
+void rlCharge(RateLimiter* limiter, RateLimit const* limit, size_t numBytes, double now);
+double rlSecondsUntilAllowed(RateLimiter const* limiter, RateLimit const* limit);
+
+#endif // RateLimit_INCLUDED
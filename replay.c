@@ -0,0 +1,152 @@
+/**
+ * The numbers of the messages kept always follow
+ * each other, so only the last one is stored:
+ * a message too big to be kept at all drops
+ * all the others with it, rather than leave a
+ * hole that could not be told apart.
+ *
+ * A token reads "ID.SINCE.MAC", MAC being the
+ * first bytes of HMAC-SHA256(secret, ID, SINCE)
+ * in hexadecimal.
+ */
+
+#include "replay.h"
+#include <string.h>
+#include <sys/random.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+#define RP_MAC_LENGTH 16 // bytes of the HMAC kept in a token
+
+/** Returns false if out of memory, or if no secret could be drawn. */
+bool rpInit(ReplayBuffer* buffer, size_t maxMessages, size_t maxBytes) {
+    buffer->entries = NULL;
+    buffer->first = 0;
+    buffer->size = 0;
+    buffer->maxMessages = maxMessages;
+    buffer->numBytes = 0;
+    buffer->maxBytes = maxBytes;
+    buffer->lastSequence = 0;
+    if (getrandom(buffer->secret, RP_SECRET_LENGTH, 0) != RP_SECRET_LENGTH) return false;
+    if (maxMessages == 0) return true;
+    buffer->entries = (RpEntry*)malloc(maxMessages * sizeof(RpEntry));
+    return buffer->entries != NULL;
+}
+
+static void rpDropOldest(ReplayBuffer* buffer) {
+    RpEntry* entry = &buffer->entries[buffer->first];
+    free((void*)entry->sender);
+    free((void*)entry->text);
+    buffer->numBytes -= entry->numBytes;
+    buffer->first = (buffer->first + 1) % buffer->maxMessages;
+    --buffer->size;
+}
+
+void rpDestroy(ReplayBuffer* buffer) {
+    while (buffer->size > 0) rpDropOldest(buffer);
+    free((void*)buffer->entries);
+    buffer->entries = NULL;
+    OPENSSL_cleanse(buffer->secret, RP_SECRET_LENGTH);
+}
+
+/**
+ * Numbers the message and keeps it, taking
+ * both allocations over (they are freed even
+ * if it is not kept). Returns its number.
+ */
+uint64_t rpAppend(ReplayBuffer* buffer, server_RelayInfo* sender, wchar_t* text) {
+    uint64_t sequence = ++buffer->lastSequence;
+    size_t numBytes = sizeof(RpEntry) + sizeof(server_RelayInfo)
+        + (wcslen(sender->name) + wcslen(sender->address) + wcslen(text) + 3) * sizeof(wchar_t);
+    if (buffer->maxMessages == 0 || numBytes > buffer->maxBytes) {
+        while (buffer->size > 0) rpDropOldest(buffer);
+        free((void*)sender);
+        free((void*)text);
+        return sequence;
+    }
+
+    while (buffer->size == buffer->maxMessages || buffer->numBytes + numBytes > buffer->maxBytes) {
+        rpDropOldest(buffer);
+    }
+    RpEntry* entry = &buffer->entries[(buffer->first + buffer->size) % buffer->maxMessages];
+    entry->sender = sender;
+    entry->text = text;
+    entry->numBytes = numBytes;
+    buffer->numBytes += numBytes;
+    ++buffer->size;
+    return sequence;
+}
+
+/** The number of the oldest message kept; lastSequence + 1 if none. */
+uint64_t rpOldestSequence(ReplayBuffer const* buffer) {
+    return buffer->lastSequence - buffer->size + 1;
+}
+
+/** The message with that number, or NULL if it is not kept. */
+RpEntry const* rpFind(ReplayBuffer const* buffer, uint64_t sequence) {
+    uint64_t oldest = rpOldestSequence(buffer);
+    if (sequence < oldest || sequence > buffer->lastSequence) return NULL;
+    return &buffer->entries[(buffer->first + (size_t)(sequence - oldest)) % buffer->maxMessages];
+}
+
+static void rpMac(ReplayBuffer const* buffer, SenderId senderId, uint64_t since, unsigned char* mac) {
+    unsigned char data[sizeof(uint32_t) + sizeof(uint64_t)];
+    for (size_t i = 0; i < sizeof(uint32_t); ++i) data[i] = (unsigned char)(senderId >> (8 * i));
+    for (size_t i = 0; i < sizeof(uint64_t); ++i) data[sizeof(uint32_t) + i] = (unsigned char)(since >> (8 * i));
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    HMAC(EVP_sha256(), buffer->secret, RP_SECRET_LENGTH, data, sizeof(data), digest, &digestLength);
+    memcpy(mac, digest, RP_MAC_LENGTH);
+}
+
+/** `token` must have room for MAX_RESUME_TOKEN_LENGTH + 1 characters. */
+void rpMakeToken(ReplayBuffer const* buffer, SenderId senderId, uint64_t since, wchar_t* token) {
+    unsigned char mac[RP_MAC_LENGTH];
+    rpMac(buffer, senderId, since, mac);
+    int length = swprintf(token, MAX_RESUME_TOKEN_LENGTH + 1, L"%u.%llu.", senderId, (unsigned long long)since);
+    for (size_t i = 0; i < RP_MAC_LENGTH; ++i) {
+        length += swprintf(token + length, MAX_RESUME_TOKEN_LENGTH + 1 - length, L"%02x", mac[i]);
+    }
+}
+
+static bool rpParseNumber(wchar_t const** sPtr, wchar_t end, uint64_t* valuePtr) {
+    wchar_t const* s = *sPtr;
+    uint64_t value = 0;
+    if (*s < L'0' || *s > L'9') return false;
+    for (; *s >= L'0' && *s <= L'9'; ++s) {
+        if (value > (UINT64_MAX - 9) / 10) return false;
+        value = value * 10 + (uint64_t)(*s - L'0');
+    }
+    if (*s != end) return false;
+    *sPtr = s + 1;
+    *valuePtr = value;
+    return true;
+}
+
+/** Whether this server issued the token; if so, tells what it holds. */
+bool rpCheckToken(ReplayBuffer const* buffer, wchar_t const* token, SenderId* senderIdPtr, uint64_t* sincePtr) {
+    uint64_t senderId, since;
+    if (!rpParseNumber(&token, L'.', &senderId) || senderId > UINT32_MAX || !rpParseNumber(&token, L'.', &since)) {
+        return false;
+    }
+    unsigned char mac[RP_MAC_LENGTH];
+    for (size_t i = 0; i < RP_MAC_LENGTH; ++i) {
+        unsigned value = 0;
+        for (size_t j = 0; j < 2; ++j) {
+            wchar_t c = *token++;
+            if (c >= L'0' && c <= L'9') value = value * 16 + (unsigned)(c - L'0');
+            else if (c >= L'a' && c <= L'f') value = value * 16 + (unsigned)(c - L'a' + 10);
+            else return false;
+        }
+        mac[i] = (unsigned char)value;
+    }
+    if (*token != L'\0') return false;
+
+    unsigned char expected[RP_MAC_LENGTH];
+    rpMac(buffer, (SenderId)senderId, since, expected);
+    if (CRYPTO_memcmp(mac, expected, RP_MAC_LENGTH) != 0) return false;
+    *senderIdPtr = (SenderId)senderId;
+    *sincePtr = since;
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef Replay_INCLUDED
+#define Replay_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "protocol.h"
+
+/**
+ * The chat messages broadcast lately, so that a
+ * client that lost its connection can get those
+ * it missed when it comes back (session resume).
+ *
+ * Every broadcast chat message is numbered, in
+ * increasing order; the most recent ones are
+ * kept, up to a number of messages and of
+ * bytes, oldest dropped first.
+ *
+ * A client is told a resume token when it logs
+ * in. It holds the client's sender ID and the
+ * number of the last message sent before it
+ * logged in, with a MAC: a client is only ever
+ * given the messages sent since it first logged
+ * in, and only by a server that has the same
+ * secret (the one that issued the token, or the
+ * process that took over from it).
+ */
+#define RP_SECRET_LENGTH 32
+
+typedef struct {
+    server_RelayInfo* sender; // who sent it, as the others saw them
+    wchar_t* text;
+    size_t numBytes; // counted against the limit
+} RpEntry;
+
+typedef struct {
+    RpEntry* entries; // a ring, from `first`
+    size_t first;
+    size_t size;
+    size_t maxMessages; // 0: none kept, they are only numbered
+    size_t numBytes;
+    size_t maxBytes;
+    uint64_t lastSequence; // of the last message numbered; 0: none yet
+    unsigned char secret[RP_SECRET_LENGTH];
+} ReplayBuffer;
+
+bool rpInit(ReplayBuffer* buffer, size_t maxMessages, size_t maxBytes);
+void rpDestroy(ReplayBuffer* buffer);
+
+uint64_t rpAppend(ReplayBuffer* buffer, server_RelayInfo* sender, wchar_t* text);
+uint64_t rpOldestSequence(ReplayBuffer const* buffer);
+RpEntry const* rpFind(ReplayBuffer const* buffer, uint64_t sequence);
+
+void rpMakeToken(ReplayBuffer const* buffer, SenderId senderId, uint64_t since, wchar_t* token);
+bool rpCheckToken(ReplayBuffer const* buffer, wchar_t const* token, SenderId* senderIdPtr, uint64_t* sincePtr);
+
+#endif // Replay_INCLUDED
@@ -0,0 +1,357 @@
+/**
+ * Storage layout:
+ *
+ * - Blocks: a FIFO of arena blocks holding the
+ *   null-terminated message texts back to back.
+ *   Texts never span two blocks; a text bigger
+ *   than SB_BLOCK_CHARS gets a block of its own.
+ *
+ * - Records: a ring of fixed-size records, one
+ *   per retained message, oldest first. Since
+ *   texts are appended in the same order, the
+ *   records of the oldest block always form a
+ *   prefix of the ring.
+ *
+ * - Identities: a hash table of interned senders,
+ *   reference-counted by the records using them.
+ */
+
+#include "scrollback.h"
+#include <string.h>
+#include <stdint.h>
+
+#define SB_BLOCK_CHARS 16384
+#define SB_INITIAL_NUM_RECORDS 256
+#define SB_INITIAL_NUM_BUCKETS 64
+#define SB_NO_IDENTITY UINT32_MAX
+
+typedef struct _SbBlock {
+    struct _SbBlock* next;
+    size_t used;
+    size_t capacity;
+    wchar_t text[];
+} SbBlock;
+
+typedef struct {
+    wchar_t const* text;
+    uint32_t textLength;
+    uint32_t identity;
+} SbRecord;
+
+typedef struct {
+    SbIdentity identity;
+    size_t hash;
+    size_t refCount;
+    uint32_t nextInBucket; // or in the free list, when refCount == 0
+} SbIdentitySlot;
+
+struct _Scrollback {
+    size_t budgetBytes;
+    size_t usedBytes;
+
+    SbBlock* oldestBlock;
+    SbBlock* newestBlock;
+
+    SbRecord* records;
+    size_t recordsCapacity;
+    size_t recordsHead;  // ring index of the oldest record
+    size_t numRecords;
+    size_t firstSeq;
+
+    SbIdentitySlot* identities;
+    size_t identitiesCapacity;
+    size_t numIdentities;
+    uint32_t freeIdentity;
+    uint32_t* buckets;
+    size_t numBuckets;
+};
+
+Scrollback* sbInit(size_t budgetBytes) {
+    Scrollback* sb = (Scrollback*)calloc(1, sizeof(Scrollback));
+    if (!sb) return NULL;
+    sb->budgetBytes = budgetBytes;
+    sb->freeIdentity = SB_NO_IDENTITY;
+
+    sb->numBuckets = SB_INITIAL_NUM_BUCKETS;
+    sb->buckets = (uint32_t*)malloc(sb->numBuckets * sizeof(sb->buckets[0]));
+    if (!sb->buckets) {
+        free((void*)sb);
+        return NULL;
+    }
+    for (size_t i = 0; i < sb->numBuckets; ++i) {
+        sb->buckets[i] = SB_NO_IDENTITY;
+    }
+    sb->usedBytes = sizeof(Scrollback) + sb->numBuckets * sizeof(sb->buckets[0]);
+    return sb;
+}
+
+void sbDestroy(Scrollback* sb) {
+    SbBlock* block = sb->oldestBlock;
+    while (block) {
+        SbBlock* next = block->next;
+        free((void*)block);
+        block = next;
+    }
+    for (size_t i = 0; i < sb->identitiesCapacity; ++i) {
+        if (sb->identities[i].refCount > 0) {
+            free((void*)sb->identities[i].identity.name);
+            free((void*)sb->identities[i].identity.address);
+        }
+    }
+    free((void*)sb->identities);
+    free((void*)sb->buckets);
+    free((void*)sb->records);
+    free((void*)sb);
+}
+
+size_t sbFirst(Scrollback const* sb) {
+    return sb->firstSeq;
+}
+
+size_t sbEnd(Scrollback const* sb) {
+    return sb->firstSeq + sb->numRecords;
+}
+
+size_t sbMemoryUsage(Scrollback const* sb) {
+    return sb->usedBytes;
+}
+
+//////////////////////////////////////////////
+// IDENTITIES                               //
+//////////////////////////////////////////////
+
+static size_t sbHashIdentity(wchar_t const* name, wchar_t const* address, unsigned short port) {
+    size_t h = 14695981039346656037ULL;
+    for (; *name; ++name) h = (h ^ (size_t)*name) * 1099511628211ULL;
+    h = (h ^ L'\n') * 1099511628211ULL;
+    for (; *address; ++address) h = (h ^ (size_t)*address) * 1099511628211ULL;
+    return (h ^ port) * 1099511628211ULL;
+}
+
+static size_t sbIdentityBytes(SbIdentity const* identity) {
+    return (wcslen(identity->name) + wcslen(identity->address) + 2) * sizeof(wchar_t);
+}
+
+static bool sbRehash(Scrollback* sb) {
+    size_t newNumBuckets = sb->numBuckets * 2;
+    uint32_t* newBuckets = (uint32_t*)malloc(newNumBuckets * sizeof(newBuckets[0]));
+    if (!newBuckets) return false;
+    for (size_t i = 0; i < newNumBuckets; ++i) {
+        newBuckets[i] = SB_NO_IDENTITY;
+    }
+    for (size_t i = 0; i < sb->identitiesCapacity; ++i) {
+        SbIdentitySlot* slot = &sb->identities[i];
+        if (slot->refCount == 0) continue;
+        size_t b = slot->hash % newNumBuckets;
+        slot->nextInBucket = newBuckets[b];
+        newBuckets[b] = (uint32_t)i;
+    }
+    free((void*)sb->buckets);
+    sb->usedBytes += (newNumBuckets - sb->numBuckets) * sizeof(newBuckets[0]);
+    sb->buckets = newBuckets;
+    sb->numBuckets = newNumBuckets;
+    return true;
+}
+
+static wchar_t* sbDuplicate(wchar_t const* s) {
+    size_t length = wcslen(s);
+    wchar_t* copy = (wchar_t*)malloc((length + 1) * sizeof(copy[0]));
+    if (copy) wmemcpy(copy, s, length + 1);
+    return copy;
+}
+
+/**
+ * Returns the index of the identity, with one
+ * more reference taken, or SB_NO_IDENTITY if
+ * out of memory.
+ */
+static uint32_t sbInternIdentity(Scrollback* sb, wchar_t const* name, wchar_t const* address, unsigned short port) {
+    size_t hash = sbHashIdentity(name, address, port);
+    for (uint32_t i = sb->buckets[hash % sb->numBuckets]; i != SB_NO_IDENTITY; i = sb->identities[i].nextInBucket) {
+        SbIdentitySlot* slot = &sb->identities[i];
+        if (slot->hash == hash && slot->identity.port == port
+            && wcscmp(slot->identity.name, name) == 0
+            && wcscmp(slot->identity.address, address) == 0
+        ) {
+            ++slot->refCount;
+            return i;
+        }
+    }
+
+    if (sb->numIdentities >= sb->numBuckets && !sbRehash(sb)) return SB_NO_IDENTITY;
+
+    if (sb->freeIdentity == SB_NO_IDENTITY) {
+        size_t newCapacity = sb->identitiesCapacity ? sb->identitiesCapacity * 2 : 16;
+        SbIdentitySlot* newIdentities = (SbIdentitySlot*)realloc((void*)sb->identities, newCapacity * sizeof(newIdentities[0]));
+        if (!newIdentities) return SB_NO_IDENTITY;
+        for (size_t i = newCapacity; i > sb->identitiesCapacity; --i) {
+            newIdentities[i - 1].refCount = 0;
+            newIdentities[i - 1].nextInBucket = sb->freeIdentity;
+            sb->freeIdentity = (uint32_t)(i - 1);
+        }
+        sb->usedBytes += (newCapacity - sb->identitiesCapacity) * sizeof(newIdentities[0]);
+        sb->identities = newIdentities;
+        sb->identitiesCapacity = newCapacity;
+    }
+
+    uint32_t i = sb->freeIdentity;
+    SbIdentitySlot* slot = &sb->identities[i];
+    slot->identity.name = sbDuplicate(name);
+    slot->identity.address = sbDuplicate(address);
+    if (!slot->identity.name || !slot->identity.address) {
+        free((void*)slot->identity.name);
+        free((void*)slot->identity.address);
+        return SB_NO_IDENTITY;
+    }
+    sb->freeIdentity = slot->nextInBucket;
+
+    slot->identity.port = port;
+    slot->hash = hash;
+    slot->refCount = 1;
+    slot->nextInBucket = sb->buckets[hash % sb->numBuckets];
+    sb->buckets[hash % sb->numBuckets] = i;
+    ++sb->numIdentities;
+    sb->usedBytes += sbIdentityBytes(&slot->identity);
+    return i;
+}
+
+static void sbReleaseIdentity(Scrollback* sb, uint32_t i) {
+    SbIdentitySlot* slot = &sb->identities[i];
+    if (--slot->refCount > 0) return;
+
+    uint32_t* link = &sb->buckets[slot->hash % sb->numBuckets];
+    while (*link != i) {
+        link = &sb->identities[*link].nextInBucket;
+    }
+    *link = slot->nextInBucket;
+
+    sb->usedBytes -= sbIdentityBytes(&slot->identity);
+    free((void*)slot->identity.name);
+    free((void*)slot->identity.address);
+    slot->nextInBucket = sb->freeIdentity;
+    sb->freeIdentity = i;
+    --sb->numIdentities;
+}
+
+//////////////////////////////////////////////
+// BLOCKS AND RECORDS                       //
+//////////////////////////////////////////////
+
+static SbRecord* sbRecordAt(Scrollback const* sb, size_t index) {
+    return &sb->records[(sb->recordsHead + index) % sb->recordsCapacity];
+}
+
+static void sbEvictOldestBlock(Scrollback* sb) {
+    SbBlock* block = sb->oldestBlock;
+    while (sb->numRecords > 0) {
+        SbRecord* record = sbRecordAt(sb, 0);
+        if (record->text < block->text || record->text >= block->text + block->capacity) break;
+        sbReleaseIdentity(sb, record->identity);
+        sb->recordsHead = (sb->recordsHead + 1) % sb->recordsCapacity;
+        --sb->numRecords;
+        ++sb->firstSeq;
+    }
+
+    sb->oldestBlock = block->next;
+    if (sb->oldestBlock == NULL) sb->newestBlock = NULL;
+    sb->usedBytes -= sizeof(SbBlock) + block->capacity * sizeof(block->text[0]);
+    free((void*)block);
+}
+
+static bool sbGrowRecords(Scrollback* sb) {
+    size_t newCapacity = sb->recordsCapacity ? sb->recordsCapacity * 2 : SB_INITIAL_NUM_RECORDS;
+    SbRecord* newRecords = (SbRecord*)malloc(newCapacity * sizeof(newRecords[0]));
+    if (!newRecords) return false;
+    for (size_t i = 0; i < sb->numRecords; ++i) {
+        newRecords[i] = *sbRecordAt(sb, i);
+    }
+    free((void*)sb->records);
+    sb->usedBytes += (newCapacity - sb->recordsCapacity) * sizeof(newRecords[0]);
+    sb->records = newRecords;
+    sb->recordsCapacity = newCapacity;
+    sb->recordsHead = 0;
+    return true;
+}
+
+/**
+ * Returns where a text of `numChars` characters
+ * (including the terminator) should be written,
+ * evicting old blocks if the budget requires it.
+ */
+static wchar_t* sbReserveText(Scrollback* sb, size_t numChars) {
+    SbBlock* block = sb->newestBlock;
+    if (block && block->capacity - block->used >= numChars) {
+        wchar_t* where = block->text + block->used;
+        block->used += numChars;
+        return where;
+    }
+
+    size_t capacity = numChars > SB_BLOCK_CHARS ? numChars : SB_BLOCK_CHARS;
+    size_t blockBytes = sizeof(SbBlock) + capacity * sizeof(block->text[0]);
+    while (sb->oldestBlock && sb->usedBytes + blockBytes > sb->budgetBytes) {
+        sbEvictOldestBlock(sb);
+    }
+
+    block = (SbBlock*)malloc(blockBytes);
+    if (!block) return NULL;
+    block->next = NULL;
+    block->used = numChars;
+    block->capacity = capacity;
+    if (sb->newestBlock) {
+        sb->newestBlock->next = block;
+    } else {
+        sb->oldestBlock = block;
+    }
+    sb->newestBlock = block;
+    sb->usedBytes += blockBytes;
+    return block->text;
+}
+
+bool sbAppend(Scrollback* sb, wchar_t const* name, wchar_t const* address, unsigned short port, wchar_t const* text) {
+    size_t textLength = wcslen(text);
+    if (textLength > UINT32_MAX - 1) return false;
+
+    if (sb->numRecords == sb->recordsCapacity && !sbGrowRecords(sb)) return false;
+
+    wchar_t* where = sbReserveText(sb, textLength + 1);
+    if (!where) return false;
+    wmemcpy(where, text, textLength + 1);
+
+    // Intern after reserving, so that an identity
+    // evicted along with the old block is not freed
+    // while we are holding a reference to it.
+    uint32_t identity = sbInternIdentity(sb, name, address, port);
+    if (identity == SB_NO_IDENTITY) {
+        sb->newestBlock->used -= textLength + 1;
+        return false;
+    }
+
+    SbRecord* record = &sb->records[(sb->recordsHead + sb->numRecords) % sb->recordsCapacity];
+    record->text = where;
+    record->textLength = (uint32_t)textLength;
+    record->identity = identity;
+    ++sb->numRecords;
+    return true;
+}
+
+bool sbGet(Scrollback const* sb, size_t seq, SbEntry* entryPtr) {
+    if (seq < sb->firstSeq || seq >= sbEnd(sb)) return false;
+    SbRecord const* record = sbRecordAt(sb, seq - sb->firstSeq);
+    entryPtr->sender = &sb->identities[record->identity].identity;
+    entryPtr->text = record->text;
+    entryPtr->textLength = record->textLength;
+    return true;
+}
+
+/**
+ * Writes a text of the same length over that of
+ * a message. Returns false if the message is
+ * gone, or if the lengths differ.
+ */
+bool sbRewrite(Scrollback* sb, size_t seq, wchar_t const* text) {
+    if (seq < sb->firstSeq || seq >= sbEnd(sb)) return false;
+    SbRecord const* record = sbRecordAt(sb, seq - sb->firstSeq);
+    if (wcslen(text) != record->textLength) return false;
+    wmemcpy((wchar_t*)record->text, text, record->textLength); // in a block of this Scrollback
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef Scrollback_INCLUDED
+#define Scrollback_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <wchar.h>
+
+/**
+ * In-memory chat history with a fixed memory
+ * budget.
+ *
+ * Message texts are packed one after another
+ * into large arena blocks, and each sender
+ * (name, address, port) is stored only once no
+ * matter how many messages it sent. When the
+ * budget is exceeded, the oldest arena block is
+ * dropped together with every message in it.
+ *
+ * Every appended message gets a sequence number
+ * (0, 1, 2...) that never changes; the retained
+ * messages are those in [sbFirst(), sbEnd()).
+ */
+typedef struct _Scrollback Scrollback;
+
+typedef struct {
+    wchar_t const* name;
+    wchar_t const* address;
+    unsigned short port;
+} SbIdentity;
+
+typedef struct {
+    SbIdentity const* sender;
+    wchar_t const* text; // null-terminated
+    size_t textLength;
+} SbEntry;
+
+Scrollback* sbInit(size_t budgetBytes);
+void sbDestroy(Scrollback* sb);
+
+bool sbAppend(Scrollback* sb, wchar_t const* name, wchar_t const* address, unsigned short port, wchar_t const* text);
+
+size_t sbFirst(Scrollback const* sb);
+size_t sbEnd(Scrollback const* sb);
+bool sbGet(Scrollback const* sb, size_t seq, SbEntry* entryPtr);
+bool sbRewrite(Scrollback* sb, size_t seq, wchar_t const* text);
+
+size_t sbMemoryUsage(Scrollback const* sb);
+
+#endif // Scrollback_INCLUDED
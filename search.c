@@ -0,0 +1,708 @@
+/**
+ * A term's postings in the segment being filled
+ * are kept with the term, and gathered into one
+ * block when the segment is frozen. A frozen
+ * segment is never changed: the indexer reads
+ * the ones it merges without holding the lock,
+ * and only takes it to swap the result in.
+ *
+ * Term IDs are given in the order words first
+ * come, and are never taken back.
+ */
+
+#include "search.h"
+#include <string.h>
+#include <wctype.h>
+#include <signal.h>
+#include <time.h>
+
+struct _SxTerm {
+    wchar_t* word;
+    size_t length;
+    size_t hash;
+    unsigned char* postings; // in the segment being filled
+    size_t numBytes;
+    size_t capacity;
+    uint64_t lastSequence;   // of its last posting there; 0: none
+};
+
+struct _SxSegment {
+    uint64_t firstSequence;
+    uint64_t lastSequence;
+    unsigned level; // merged that many times
+    size_t numTerms;
+    uint32_t* termIds;  // sorted
+    size_t* offsets;    // of each term's postings in `bytes`, and of the end
+    unsigned char* bytes;
+};
+
+typedef struct {
+    uint64_t* items;
+    size_t size;
+    size_t capacity;
+} SxList;
+
+typedef struct {
+    unsigned char* bytes;
+    size_t numBytes;
+    size_t capacity;
+} SxBytes;
+
+static double sxSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/** The next word from `*posPtr` on, in lower case and cut to SX_MAX_WORD_LENGTH; false if none. */
+static bool sxNextWord(wchar_t const* text, size_t length, size_t* posPtr, wchar_t* word, size_t* wordLengthPtr, size_t* startPtr) {
+    size_t pos = *posPtr;
+    while (pos < length && !iswalnum(text[pos])) ++pos;
+    if (pos == length) return false;
+    *startPtr = pos;
+    size_t wordLength = 0;
+    for (; pos < length && iswalnum(text[pos]); ++pos) {
+        if (wordLength < SX_MAX_WORD_LENGTH) word[wordLength++] = (wchar_t)towlower(text[pos]);
+    }
+    *posPtr = pos;
+    *wordLengthPtr = wordLength;
+    return true;
+}
+
+static size_t sxHash(wchar_t const* word, size_t length) {
+    size_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) h = (h ^ (size_t)word[i]) * 1099511628211ULL;
+    return h;
+}
+
+/** The slot of that word in the hash table: its ID + 1, or 0 where it would go. */
+static uint32_t* sxTermSlot(SearchIndex const* index, wchar_t const* word, size_t length, size_t hash) {
+    size_t mask = index->numTermSlots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        uint32_t* slot = &index->termSlots[i];
+        if (*slot == 0) return slot;
+        SxTerm const* term = &index->terms[*slot - 1];
+        if (term->hash == hash && term->length == length && wmemcmp(term->word, word, length) == 0) return slot;
+    }
+}
+
+static bool sxGrowTermSlots(SearchIndex* index) {
+    size_t numSlots = index->numTermSlots * 2;
+    uint32_t* slots = (uint32_t*)calloc(numSlots, sizeof(uint32_t));
+    if (slots == NULL) return false;
+    for (size_t id = 0; id < index->numTerms; ++id) {
+        for (size_t i = index->terms[id].hash & (numSlots - 1);; i = (i + 1) & (numSlots - 1)) {
+            if (slots[i] == 0) {
+                slots[i] = (uint32_t)id + 1;
+                break;
+            }
+        }
+    }
+    free((void*)index->termSlots);
+    index->termSlots = slots;
+    index->numTermSlots = numSlots;
+    return true;
+}
+
+/** The ID of that word, given one if new; -1 if out of memory. */
+static int64_t sxTermId(SearchIndex* index, wchar_t const* word, size_t length) {
+    size_t hash = sxHash(word, length);
+    uint32_t* slot = sxTermSlot(index, word, length, hash);
+    if (*slot != 0) return *slot - 1;
+
+    if (2 * (index->numTerms + 1) > index->numTermSlots) {
+        if (index->numTerms + 1 >= UINT32_MAX || !sxGrowTermSlots(index)) return -1;
+        slot = sxTermSlot(index, word, length, hash);
+    }
+    if (index->numTerms == index->termCapacity) {
+        size_t capacity = index->termCapacity ? 2 * index->termCapacity : 1024;
+        SxTerm* terms = (SxTerm*)realloc((void*)index->terms, capacity * sizeof(SxTerm));
+        if (terms == NULL) return -1;
+        index->terms = terms;
+        index->termCapacity = capacity;
+    }
+    SxTerm* term = &index->terms[index->numTerms];
+    term->word = (wchar_t*)malloc(length * sizeof(wchar_t));
+    if (term->word == NULL) return -1;
+    wmemcpy(term->word, word, length);
+    term->length = length;
+    term->hash = hash;
+    term->postings = NULL;
+    term->numBytes = term->capacity = 0;
+    term->lastSequence = 0;
+    *slot = (uint32_t)++index->numTerms;
+    return index->numTerms - 1;
+}
+
+static bool sxReserve(SxBytes* bytes, size_t more) {
+    if (bytes->numBytes + more <= bytes->capacity) return true;
+    size_t capacity = bytes->capacity ? 2 * bytes->capacity : 16;
+    while (capacity < bytes->numBytes + more) capacity *= 2;
+    unsigned char* grown = (unsigned char*)realloc((void*)bytes->bytes, capacity);
+    if (grown == NULL) return false;
+    bytes->bytes = grown;
+    bytes->capacity = capacity;
+    return true;
+}
+
+static bool sxPutVarint(SxBytes* bytes, uint64_t value) {
+    if (!sxReserve(bytes, 10)) return false;
+    while (value >= 0x80) {
+        bytes->bytes[bytes->numBytes++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes->bytes[bytes->numBytes++] = (unsigned char)value;
+    return true;
+}
+
+static uint64_t sxGetVarint(unsigned char const** posPtr) {
+    unsigned char const* pos = *posPtr;
+    uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        unsigned char byte = *pos++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) break;
+    }
+    *posPtr = pos;
+    return value;
+}
+
+static bool sxListAppend(SxList* list, uint64_t value) {
+    if (list->size == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : 64;
+        uint64_t* items = (uint64_t*)realloc((void*)list->items, capacity * sizeof(uint64_t));
+        if (items == NULL) return false;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->size++] = value;
+    return true;
+}
+
+/** Appends the postings from `from` on; the first one follows `previous`. */
+static bool sxDecode(unsigned char const* pos, unsigned char const* end, uint64_t previous, uint64_t from, SxList* list) {
+    while (pos < end) {
+        previous += sxGetVarint(&pos);
+        if (previous >= from && !sxListAppend(list, previous)) return false;
+    }
+    return true;
+}
+
+static SxSegment* sxNewSegment(size_t numTerms) {
+    SxSegment* segment = (SxSegment*)calloc(1, sizeof(SxSegment));
+    if (segment == NULL) return NULL;
+    segment->termIds = (uint32_t*)malloc((numTerms + 1) * sizeof(uint32_t));
+    segment->offsets = (size_t*)malloc((numTerms + 1) * sizeof(size_t));
+    if (segment->termIds == NULL || segment->offsets == NULL) {
+        free((void*)segment->termIds);
+        free((void*)segment->offsets);
+        free((void*)segment);
+        return NULL;
+    }
+    return segment;
+}
+
+static void sxFreeSegment(SxSegment* segment) {
+    free((void*)segment->termIds);
+    free((void*)segment->offsets);
+    free((void*)segment->bytes);
+    free((void*)segment);
+}
+
+/** The postings of that term in the segment, if it has any. */
+static bool sxFindTerm(SxSegment const* segment, uint32_t termId, unsigned char const** beginPtr, unsigned char const** endPtr) {
+    size_t low = 0, high = segment->numTerms;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (segment->termIds[middle] < termId) low = middle + 1;
+        else high = middle;
+    }
+    if (low == segment->numTerms || segment->termIds[low] != termId) return false;
+    *beginPtr = segment->bytes + segment->offsets[low];
+    *endPtr = segment->bytes + segment->offsets[low + 1];
+    return true;
+}
+
+static int sxCompareIds(void const* a, void const* b) {
+    uint32_t x = *(uint32_t const*)a, y = *(uint32_t const*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t sxOldestKept(SearchIndex const* index) {
+    return (index->size > 0) ? index->messages[index->first].sequence : UINT64_MAX;
+}
+
+/** Turns the segment being filled, up to that message, into a frozen one; with the lock held. */
+static bool sxFreeze(SearchIndex* index, uint64_t lastSequence) {
+    SxSegment* segment = sxNewSegment(index->numFilled);
+    if (segment == NULL) return false;
+    qsort((void*)index->filled, index->numFilled, sizeof(uint32_t), sxCompareIds);
+    size_t numBytes = 0;
+    for (size_t i = 0; i < index->numFilled; ++i) numBytes += index->terms[index->filled[i]].numBytes;
+    segment->bytes = (unsigned char*)malloc(numBytes + 1);
+    if (segment->bytes == NULL) {
+        sxFreeSegment(segment);
+        return false;
+    }
+    if (index->numSegments == index->segmentCapacity) {
+        size_t capacity = index->segmentCapacity ? 2 * index->segmentCapacity : 16;
+        SxSegment** segments = (SxSegment**)realloc((void*)index->segments, capacity * sizeof(SxSegment*));
+        if (segments == NULL) {
+            sxFreeSegment(segment);
+            return false;
+        }
+        index->segments = segments;
+        index->segmentCapacity = capacity;
+    }
+
+    segment->firstSequence = index->fillingFrom;
+    segment->lastSequence = lastSequence;
+    segment->numTerms = index->numFilled;
+    size_t offset = 0;
+    for (size_t i = 0; i < index->numFilled; ++i) {
+        SxTerm* term = &index->terms[index->filled[i]];
+        segment->termIds[i] = index->filled[i];
+        segment->offsets[i] = offset;
+        memcpy(segment->bytes + offset, term->postings, term->numBytes);
+        offset += term->numBytes;
+        free((void*)term->postings);
+        term->postings = NULL;
+        term->numBytes = term->capacity = 0;
+        term->lastSequence = 0;
+    }
+    segment->offsets[index->numFilled] = offset;
+    index->segments[index->numSegments++] = segment;
+    index->stats.numPostingBytes += offset;
+    index->numFilled = 0;
+    index->fillingFrom = 0;
+    index->numFilling = 0;
+    return true;
+}
+
+/**
+ * One segment out of consecutive ones, without
+ * the postings of the messages before `from`.
+ * NULL if out of memory.
+ */
+static SxSegment* sxMerge(SxSegment* const* inputs, size_t numInputs, uint64_t from) {
+    size_t numIds = 0;
+    for (size_t i = 0; i < numInputs; ++i) numIds += inputs[i]->numTerms;
+    uint32_t* ids = (uint32_t*)malloc((numIds + 1) * sizeof(uint32_t));
+    SxList postings = { NULL, 0, 0 };
+    SxBytes bytes = { NULL, 0, 0 };
+    SxSegment* merged = NULL;
+    if (ids == NULL) goto FINALIZE;
+    numIds = 0;
+    for (size_t i = 0; i < numInputs; ++i) {
+        memcpy(ids + numIds, inputs[i]->termIds, inputs[i]->numTerms * sizeof(uint32_t));
+        numIds += inputs[i]->numTerms;
+    }
+    qsort((void*)ids, numIds, sizeof(uint32_t), sxCompareIds);
+    size_t numTerms = 0;
+    for (size_t i = 0; i < numIds; ++i) {
+        if (numTerms == 0 || ids[numTerms - 1] != ids[i]) ids[numTerms++] = ids[i];
+    }
+
+    merged = sxNewSegment(numTerms);
+    if (merged == NULL) goto FINALIZE;
+    merged->firstSequence = (inputs[0]->firstSequence > from) ? inputs[0]->firstSequence : from;
+    merged->lastSequence = inputs[numInputs - 1]->lastSequence;
+    merged->level = inputs[0]->level + 1;
+    for (size_t t = 0; t < numTerms; ++t) {
+        postings.size = 0;
+        for (size_t i = 0; i < numInputs; ++i) {
+            unsigned char const* begin;
+            unsigned char const* end;
+            if (sxFindTerm(inputs[i], ids[t], &begin, &end)
+                && !sxDecode(begin, end, inputs[i]->firstSequence - 1, from, &postings)
+            ) {
+                goto FAILED;
+            }
+        }
+        if (postings.size == 0) continue; // only in messages no longer kept
+        merged->termIds[merged->numTerms] = ids[t];
+        merged->offsets[merged->numTerms++] = bytes.numBytes;
+        uint64_t previous = merged->firstSequence - 1;
+        for (size_t p = 0; p < postings.size; ++p) {
+            if (!sxPutVarint(&bytes, postings.items[p] - previous)) goto FAILED;
+            previous = postings.items[p];
+        }
+    }
+    merged->offsets[merged->numTerms] = bytes.numBytes;
+    merged->bytes = bytes.bytes;
+    bytes.bytes = NULL;
+    goto FINALIZE;
+
+FAILED:
+    sxFreeSegment(merged);
+    merged = NULL;
+FINALIZE:
+    free((void*)ids);
+    free((void*)postings.items);
+    free((void*)bytes.bytes);
+    return merged;
+}
+
+/** Merges the last segments while SX_MERGE_FACTOR of them are of the same size. */
+static void sxMergeSegments(SearchIndex* index) {
+    while (index->numSegments >= SX_MERGE_FACTOR) {
+        SxSegment** inputs = &index->segments[index->numSegments - SX_MERGE_FACTOR];
+        bool sameLevel = true;
+        for (size_t i = 1; i < SX_MERGE_FACTOR; ++i) {
+            sameLevel = sameLevel && (inputs[i]->level == inputs[0]->level);
+        }
+        if (!sameLevel) return;
+
+        // Nobody else changes the segments: no need for the lock to read them.
+        SxSegment* merged = sxMerge(inputs, SX_MERGE_FACTOR, sxOldestKept(index));
+        if (merged == NULL) return; // searches just look at more segments
+
+        pthread_mutex_lock(&index->mutex);
+        SxSegment* replaced[SX_MERGE_FACTOR];
+        memcpy((void*)replaced, (void*)inputs, sizeof(replaced));
+        inputs[0] = merged;
+        index->numSegments -= SX_MERGE_FACTOR - 1;
+        for (size_t i = 0; i < SX_MERGE_FACTOR; ++i) {
+            index->stats.numPostingBytes -= replaced[i]->offsets[replaced[i]->numTerms];
+        }
+        index->stats.numPostingBytes += merged->offsets[merged->numTerms];
+        ++index->stats.numMerges;
+        pthread_mutex_unlock(&index->mutex);
+
+        for (size_t i = 0; i < SX_MERGE_FACTOR; ++i) sxFreeSegment(replaced[i]);
+    }
+}
+
+/** Adds a posting for the message being indexed, unless the word has had one. */
+static bool sxPost(SearchIndex* index, uint32_t termId, uint64_t sequence) {
+    SxTerm* term = &index->terms[termId];
+    if (term->lastSequence == sequence) return true;
+    if (term->lastSequence == 0) {
+        if (index->numFilled == index->filledCapacity) {
+            size_t capacity = index->filledCapacity ? 2 * index->filledCapacity : 1024;
+            uint32_t* filled = (uint32_t*)realloc((void*)index->filled, capacity * sizeof(uint32_t));
+            if (filled == NULL) return false;
+            index->filled = filled;
+            index->filledCapacity = capacity;
+        }
+        index->filled[index->numFilled++] = termId;
+    }
+    uint64_t previous = term->lastSequence ? term->lastSequence : index->fillingFrom - 1;
+    SxBytes bytes = { term->postings, term->numBytes, term->capacity };
+    bool ok = sxPutVarint(&bytes, sequence - previous);
+    term->postings = bytes.bytes;
+    term->numBytes = bytes.numBytes;
+    term->capacity = bytes.capacity;
+    if (ok) term->lastSequence = sequence;
+    return ok;
+}
+
+/** Takes the message in; it is dropped if out of memory. */
+static void sxIndex(SearchIndex* index, SxMessage* message) {
+    double startedAt = sxSeconds();
+    pthread_mutex_lock(&index->mutex);
+    if (index->size == index->maxMessages) {
+        SxMessage* oldest = &index->messages[index->first];
+        free((void*)oldest->name);
+        free((void*)oldest->text);
+        index->first = (index->first + 1) % index->maxMessages;
+        --index->size;
+    }
+    index->messages[(index->first + index->size++) % index->maxMessages] = *message;
+
+    if (index->fillingFrom == 0) index->fillingFrom = message->sequence;
+    wchar_t word[SX_MAX_WORD_LENGTH];
+    size_t length = wcslen(message->text);
+    size_t pos = 0, wordLength, start;
+    while (sxNextWord(message->text, length, &pos, word, &wordLength, &start)) {
+        int64_t termId = sxTermId(index, word, wordLength);
+        if (termId < 0 || !sxPost(index, (uint32_t)termId, message->sequence)) break;
+    }
+    ++index->stats.numIndexed;
+
+    bool frozen = false;
+    if (++index->numFilling >= SX_SEGMENT_MESSAGES) frozen = sxFreeze(index, message->sequence);
+    // Drop the segments with no message kept.
+    uint64_t oldestKept = sxOldestKept(index);
+    size_t numExpired = 0;
+    while (numExpired < index->numSegments && index->segments[numExpired]->lastSequence < oldestKept) {
+        index->stats.numPostingBytes -= index->segments[numExpired]->offsets[index->segments[numExpired]->numTerms];
+        sxFreeSegment(index->segments[numExpired++]);
+    }
+    if (numExpired > 0) {
+        index->numSegments -= numExpired;
+        memmove((void*)index->segments, (void*)(index->segments + numExpired), index->numSegments * sizeof(SxSegment*));
+    }
+    index->stats.secondsIndexing += sxSeconds() - startedAt;
+    pthread_mutex_unlock(&index->mutex);
+
+    if (frozen) sxMergeSegments(index);
+}
+
+static void* sxIndexerMain(void* arg) {
+    SearchIndex* index = (SearchIndex*)arg;
+    for (;;) {
+        pthread_mutex_lock(&index->queueMutex);
+        while (index->queueSize == 0 && !index->stopping) {
+            pthread_cond_wait(&index->queued, &index->queueMutex);
+        }
+        if (index->queueSize == 0) {
+            pthread_mutex_unlock(&index->queueMutex);
+            return NULL;
+        }
+        SxMessage* batch = index->queue;
+        size_t batchSize = index->queueSize;
+        index->queue = NULL;
+        index->queueSize = index->queueCapacity = 0;
+        pthread_mutex_unlock(&index->queueMutex);
+
+        for (size_t i = 0; i < batchSize; ++i) sxIndex(index, &batch[i]);
+        free((void*)batch);
+    }
+}
+
+/** Returns false if out of memory, or if no thread could be started. */
+bool sxInit(SearchIndex* index, size_t maxMessages) {
+    memset((void*)index, 0, sizeof(*index));
+    index->maxMessages = maxMessages;
+    index->messages = (SxMessage*)malloc(maxMessages * sizeof(SxMessage));
+    index->numTermSlots = 2048;
+    index->termSlots = (uint32_t*)calloc(index->numTermSlots, sizeof(uint32_t));
+    if (index->messages == NULL || index->termSlots == NULL) {
+        free((void*)index->messages);
+        free((void*)index->termSlots);
+        index->maxMessages = 0;
+        return false;
+    }
+    pthread_mutex_init(&index->queueMutex, NULL);
+    pthread_cond_init(&index->queued, NULL);
+    pthread_mutex_init(&index->mutex, NULL);
+
+    // Signals are for the event loop: they must interrupt its poll().
+    sigset_t allSignals, callerSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &callerSignals);
+    bool started = (pthread_create(&index->indexer, NULL, sxIndexerMain, (void*)index) == 0);
+    pthread_sigmask(SIG_SETMASK, &callerSignals, NULL);
+    if (!started) {
+        index->stopping = true;
+        sxDestroy(index);
+        return false;
+    }
+    return true;
+}
+
+static void sxFreeMessages(SxMessage* messages, size_t first, size_t size, size_t capacity) {
+    for (size_t i = 0; i < size; ++i) {
+        SxMessage* message = &messages[(first + i) % capacity];
+        free((void*)message->name);
+        free((void*)message->text);
+    }
+}
+
+void sxDestroy(SearchIndex* index) {
+    if (index->maxMessages == 0) return;
+    pthread_mutex_lock(&index->queueMutex);
+    bool running = !index->stopping;
+    index->stopping = true;
+    pthread_cond_signal(&index->queued);
+    pthread_mutex_unlock(&index->queueMutex);
+    if (running) pthread_join(index->indexer, NULL);
+
+    sxFreeMessages(index->queue, 0, index->queueSize, index->queueSize);
+    free((void*)index->queue);
+    sxFreeMessages(index->messages, index->first, index->size, index->maxMessages);
+    free((void*)index->messages);
+    for (size_t i = 0; i < index->numTerms; ++i) {
+        free((void*)index->terms[i].word);
+        free((void*)index->terms[i].postings);
+    }
+    free((void*)index->terms);
+    free((void*)index->termSlots);
+    free((void*)index->filled);
+    for (size_t i = 0; i < index->numSegments; ++i) sxFreeSegment(index->segments[i]);
+    free((void*)index->segments);
+    pthread_mutex_destroy(&index->queueMutex);
+    pthread_cond_destroy(&index->queued);
+    pthread_mutex_destroy(&index->mutex);
+    index->maxMessages = 0;
+}
+
+/**
+ * Hands a chat message over to be indexed, by
+ * copy. Returns false if out of memory.
+ */
+bool sxAdd(SearchIndex* index, uint64_t sequence, wchar_t const* name, wchar_t const* text) {
+    SxMessage message = { sequence, wcsdup(name), wcsdup(text) };
+    if (message.name == NULL || message.text == NULL) {
+        free((void*)message.name);
+        free((void*)message.text);
+        return false;
+    }
+    pthread_mutex_lock(&index->queueMutex);
+    bool ok = true;
+    if (index->queueSize == index->queueCapacity) {
+        size_t capacity = index->queueCapacity ? 2 * index->queueCapacity : 64;
+        SxMessage* queue = (SxMessage*)realloc((void*)index->queue, capacity * sizeof(SxMessage));
+        ok = (queue != NULL);
+        if (ok) {
+            index->queue = queue;
+            index->queueCapacity = capacity;
+        }
+    }
+    if (ok) {
+        index->queue[index->queueSize++] = message;
+        pthread_cond_signal(&index->queued);
+    }
+    pthread_mutex_unlock(&index->queueMutex);
+    if (!ok) {
+        free((void*)message.name);
+        free((void*)message.text);
+    }
+    return ok;
+}
+
+/** Every message, kept, with that word in it, oldest first; with the lock held. */
+static bool sxCollect(SearchIndex const* index, uint32_t termId, SxList* list) {
+    uint64_t from = sxOldestKept(index);
+    for (size_t i = 0; i < index->numSegments; ++i) {
+        SxSegment const* segment = index->segments[i];
+        unsigned char const* begin;
+        unsigned char const* end;
+        if (sxFindTerm(segment, termId, &begin, &end) && !sxDecode(begin, end, segment->firstSequence - 1, from, list)) {
+            return false;
+        }
+    }
+    SxTerm const* term = &index->terms[termId];
+    return term->lastSequence == 0 || sxDecode(term->postings, term->postings + term->numBytes, index->fillingFrom - 1, from, list);
+}
+
+/** Keeps in `list` what is also in `other`; both are sorted. */
+static void sxIntersect(SxList* list, SxList const* other) {
+    size_t kept = 0;
+    for (size_t i = 0, j = 0; i < list->size && j < other->size;) {
+        if (list->items[i] < other->items[j]) ++i;
+        else if (list->items[i] > other->items[j]) ++j;
+        else {
+            list->items[kept++] = list->items[i];
+            ++i;
+            ++j;
+        }
+    }
+    list->size = kept;
+}
+
+static SxMessage const* sxFindMessage(SearchIndex const* index, uint64_t sequence) {
+    size_t low = 0, high = index->size;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        SxMessage const* message = &index->messages[(index->first + middle) % index->maxMessages];
+        if (message->sequence == sequence) return message;
+        if (message->sequence < sequence) low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
+/** A piece of the text around the first word of the query it has, line breaks and all. */
+static wchar_t* sxSnippet(wchar_t const* text, wchar_t (*words)[SX_MAX_WORD_LENGTH], size_t const* wordLengths, size_t numWords, size_t* lengthPtr) {
+    size_t length = wcslen(text);
+    size_t pos = 0, wordLength, start = 0, found = 0;
+    wchar_t word[SX_MAX_WORD_LENGTH];
+    while (found == 0 && sxNextWord(text, length, &pos, word, &wordLength, &start)) {
+        for (size_t i = 0; i < numWords; ++i) {
+            if (wordLength == wordLengths[i] && wmemcmp(word, words[i], wordLength) == 0) {
+                found = start + 1;
+                break;
+            }
+        }
+    }
+    size_t from = (found > SX_SNIPPET_LENGTH / 4) ? found - 1 - SX_SNIPPET_LENGTH / 4 : 0;
+    size_t snippetLength = (length - from < SX_SNIPPET_LENGTH) ? length - from : SX_SNIPPET_LENGTH;
+    wchar_t* snippet = (wchar_t*)malloc((snippetLength + 1) * sizeof(wchar_t));
+    if (snippet == NULL) return NULL;
+    wmemcpy(snippet, text + from, snippetLength);
+    snippet[snippetLength] = L'\0';
+    *lengthPtr = snippetLength;
+    return snippet;
+}
+
+/**
+ * The newest messages with every word of the
+ * query, at most `maxHits`; their names and
+ * snippets are to be freed with sxFreeHits().
+ * Returns false if out of memory.
+ */
+bool sxSearch(SearchIndex* index, wchar_t const* query, SearchHit* hits, size_t maxHits, size_t* numHitsPtr) {
+    *numHitsPtr = 0;
+    if (index->maxMessages == 0) return true;
+    double startedAt = sxSeconds();
+
+    wchar_t words[SX_MAX_QUERY_WORDS][SX_MAX_WORD_LENGTH];
+    size_t wordLengths[SX_MAX_QUERY_WORDS];
+    size_t numWords = 0;
+    size_t length = wcslen(query);
+    size_t pos = 0, start;
+    while (numWords < SX_MAX_QUERY_WORDS && sxNextWord(query, length, &pos, words[numWords], &wordLengths[numWords], &start)) {
+        ++numWords;
+    }
+
+    SxList found = { NULL, 0, 0 };
+    SxList other = { NULL, 0, 0 };
+    bool ok = true;
+    pthread_mutex_lock(&index->mutex);
+    for (size_t i = 0; i < numWords && ok; ++i) {
+        uint32_t* slot = sxTermSlot(index, words[i], wordLengths[i], sxHash(words[i], wordLengths[i]));
+        if (*slot == 0) {
+            found.size = 0; // nowhere
+            break;
+        }
+        SxList* list = (i == 0) ? &found : &other;
+        list->size = 0;
+        ok = sxCollect(index, *slot - 1, list);
+        if (i > 0) sxIntersect(&found, &other);
+        if (found.size == 0) break;
+    }
+    for (size_t i = found.size; i > 0 && *numHitsPtr < maxHits && ok; --i) {
+        SxMessage const* message = sxFindMessage(index, found.items[i - 1]);
+        if (message == NULL) continue;
+        SearchHit* hit = &hits[*numHitsPtr];
+        hit->sequence = message->sequence;
+        hit->name = wcsdup(message->name);
+        hit->snippet = sxSnippet(message->text, words, wordLengths, numWords, &hit->snippetLength);
+        ok = (hit->name != NULL && hit->snippet != NULL);
+        if (!ok) {
+            free((void*)hit->name);
+            free((void*)hit->snippet);
+        } else {
+            ++*numHitsPtr;
+        }
+    }
+    ++index->stats.numSearches;
+    index->stats.secondsSearching += sxSeconds() - startedAt;
+    pthread_mutex_unlock(&index->mutex);
+    free((void*)found.items);
+    free((void*)other.items);
+    if (!ok) {
+        sxFreeHits(hits, *numHitsPtr);
+        *numHitsPtr = 0;
+    }
+    return ok;
+}
+
+void sxFreeHits(SearchHit* hits, size_t numHits) {
+    for (size_t i = 0; i < numHits; ++i) {
+        free((void*)hits[i].name);
+        free((void*)hits[i].snippet);
+    }
+}
+
+SxStats sxGetStats(SearchIndex* index) {
+    pthread_mutex_lock(&index->mutex);
+    SxStats stats = index->stats;
+    stats.numKept = index->size;
+    stats.numWords = index->numTerms;
+    stats.numSegments = index->numSegments;
+    pthread_mutex_unlock(&index->mutex);
+    return stats;
+}
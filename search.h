@@ -0,0 +1,105 @@
+#ifndef Search_INCLUDED
+#define Search_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <wchar.h>
+
+#include "protocol.h"
+
+/**
+ * Full-text search over the last chat messages
+ * sent: an inverted index, from every word to
+ * the sequence numbers of the messages it is
+ * in.
+ *
+ * The event loop only hands each message over,
+ * copied; a thread of its own indexes it, so
+ * that broadcasts never wait for the index.
+ * New postings go to a segment being filled;
+ * every SX_SEGMENT_MESSAGES messages, it is
+ * frozen, and every SX_MERGE_FACTOR frozen
+ * segments of the same size are merged into
+ * one, by that same thread, dropping the
+ * messages no longer kept. A posting list holds
+ * the differences between successive sequence
+ * numbers, as varints.
+ *
+ * Words are the runs of letters and digits, in
+ * lower case. A search finds the messages that
+ * have every word of the query, newest first.
+ * Searches run on the caller's thread and only
+ * ever wait for one message to be indexed.
+ */
+#define SX_SEGMENT_MESSAGES 256
+#define SX_MERGE_FACTOR 4
+#define SX_MAX_WORD_LENGTH 32 // longer words are cut there
+#define SX_MAX_QUERY_WORDS 8
+#define SX_MAX_RESULTS 20
+#define SX_SNIPPET_LENGTH 80
+
+typedef struct {
+    uint64_t sequence;
+    wchar_t* name;
+    wchar_t* text;
+} SxMessage;
+
+typedef struct {
+    unsigned long numIndexed;
+    size_t numKept;
+    size_t numWords;
+    size_t numSegments;
+    unsigned long numMerges;
+    size_t numPostingBytes; // in frozen segments
+    double secondsIndexing;
+    unsigned long numSearches;
+    double secondsSearching;
+} SxStats;
+
+typedef struct _SxTerm SxTerm;
+typedef struct _SxSegment SxSegment;
+
+typedef struct {
+    size_t maxMessages; // 0: no search
+
+    // Handed over by the event loop:
+    pthread_mutex_t queueMutex;
+    pthread_cond_t queued;
+    SxMessage* queue;
+    size_t queueSize;
+    size_t queueCapacity;
+    bool stopping;
+    pthread_t indexer;
+
+    // The index, only changed by the indexer, under `mutex`:
+    pthread_mutex_t mutex;
+    SxMessage* messages; // a ring, from `first`
+    size_t first;
+    size_t size;
+    SxTerm* terms;       // by term ID
+    size_t numTerms;
+    size_t termCapacity;
+    uint32_t* termSlots; // hash table of term IDs + 1, by word
+    size_t numTermSlots;
+    uint32_t* filled;    // IDs of the terms with postings in the segment being filled
+    size_t numFilled;
+    size_t filledCapacity;
+    uint64_t fillingFrom; // first message of the segment being filled, 0 if none yet
+    size_t numFilling;
+    SxSegment** segments; // frozen, oldest first
+    size_t numSegments;
+    size_t segmentCapacity;
+
+    SxStats stats;
+} SearchIndex;
+
+bool sxInit(SearchIndex* index, size_t maxMessages);
+void sxDestroy(SearchIndex* index);
+bool sxAdd(SearchIndex* index, uint64_t sequence, wchar_t const* name, wchar_t const* text);
+bool sxSearch(SearchIndex* index, wchar_t const* query, SearchHit* hits, size_t maxHits, size_t* numHitsPtr);
+void sxFreeHits(SearchHit* hits, size_t numHits);
+SxStats sxGetStats(SearchIndex* index);
+
+#endif // Search_INCLUDED
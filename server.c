@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // accept4()
+
 #include <locale.h>
 #include <wctype.h>
 #include <wchar.h>
@@ -9,45 +11,237 @@
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include <poll.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 
 #include <stdio.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
 
 #include "protocol.h"
 #include "lklist.h"
+#include "ratelimit.h"
+#include "federation.h"
+#include "handoff.h"
+#include "intern.h"
+#include "timerwheel.h"
+#include "nameindex.h"
+#include "textscan.h"
+#include "fanout.h"
+#include "ktls.h"
+#include "replay.h"
+#include "shmring.h"
+#include "multicast.h"
+#include "contentfilter.h"
+#include "search.h"
+#include "zerocopy.h"
+#include "probes.h"
+#include "capture.h"
 
 typedef struct {
-    int confd;
-    wchar_t address[MAX_ADDRESS_LENGTH + 1];
     unsigned short port;
+    RateLimit rateLimit;
+    int backlog;
+    int acceptBudget; // max. connections accepted per iteration
+    int readBudget;   // bytes read from each connection per iteration; 0: no limit
+    NodeId nodeId; // 0 if this server is not part of a cluster
+    char const** peerSpecs;
+    size_t numPeers;
+    char const* handoffPath; // Unix socket for hot restarts, or NULL
+    char const* unixSocketPath; // Unix socket for clients on this host, or NULL
+    double pingInterval;  // 0: never ping
+    double pongTimeout;
+    double idleTimeout;   // 0: users may stay silent forever
+    double frameTimeout;  // for logging in, then for each frame; 0: no limit
+    int fanoutThreads;    // besides the event loop's; 0: no fanout pool
+    char const* tlsCertFile; // NULL: TLS is not offered
+    char const* tlsKeyFile;
+    size_t replayMessages; // chat messages kept for the clients that come back
+    size_t replayBytes;
+    char const* multicastGroup; // "GROUP:PORT" to publish chat messages to, or NULL
+    char const* multicastInterface; // address of the interface to publish on, or NULL
+    char const* filterPath; // banned terms, or NULL
+    size_t searchMessages; // chat messages that can be searched; 0: no search
+    char const* capturePath; // where to record the frames clients send, or NULL
+} ServerConfig;
+
+/**
+ * Counters printed on SIGUSR1. The per-client
+ * throttle counters of the clients still
+ * connected are added when printing.
+ */
+typedef struct {
+    unsigned long timesThrottled;
+    double secondsThrottled;
+    unsigned long numTlsInKernel;    // handshakes after which the kernel took over
+    unsigned long numTlsInUserSpace; // and after which it could not
+    unsigned long numResumed;        // sessions resumed
+    unsigned long numResumedWithGap; // of which some messages could not be sent again
+    unsigned long numRings;          // clients given shared memory rings
+    unsigned long numNacks;          // requests for chat messages missed by multicast
+    unsigned long numTransfers;      // long chat messages and files sent
+    unsigned long numTransferPieces; // relayed
+    unsigned long numSpliced;        // pieces sent to a client from a pipe
+    unsigned long numReadBudgetsSpent; // turns in which a client read all it was allowed to
+} ServerStats;
+
+ServerStats serverStats = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+volatile sig_atomic_t statsRequested = 0;
+volatile sig_atomic_t filterReloadRequested = 0;
+volatile sig_atomic_t stopRequested = 0;
+
+InternPool* internedStrings = NULL; // names and addresses
+NameIndex* clientsByName = NULL; // the users logged in
+TimerWheel timers; // one timer per client
+KtContext* tlsContext = NULL; // NULL: TLS is not offered
+ReplayBuffer replay; // the chat messages sent lately, numbered
+McPublisher multicast = { .fd = -1 }; // publishes them too, if asked to
+ContentFilter contentFilter; // no automaton: nothing is filtered
+SearchIndex search; // the chat messages sent lately, by word
+ZcFanout zeroCopy = { { -1, -1 }, { -1, -1 }, -1, 0 }; // pieces of transfers, to splice to the sockets
+Capture capture = { .fd = -1 }; // no fd: nothing is captured
+
+#define ACCEPT_PAUSE_SECONDS 0.1
+#define FANOUT_MIN_AUDIENCE 1024 // smaller broadcasts are not worth waking the pool for
+#define TIMER_TICK_SECONDS 0.1
+#define SPLICE_STALL_TIMEOUT_MS 10000 // as long as sendEncodedFrame() waits for a full socket
+
+double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+typedef union {
+    struct sockaddr any;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+} PeerAddress;
+
+/**
+ * What is only needed now and then about a
+ * client: when it logs in, is described to the
+ * others, or is a link to another server.
+ */
+typedef struct {
+    PeerAddress peerAddress;
+    wchar_t const* address; // interned; formatted on demand, NULL until then
+    unsigned short port;
+    NodeId peerNodeId;   // 0 until the peer has said hello
+    FedPeer* dialedPeer; // the peer this link was opened to, if it was opened by this server
+    struct _Client* owner;
+    NiEntry byName;      // in clientsByName once logged in
+    TwTimer timer;       // set to the earliest of the deadlines below
+    double lastHeardFrom;
+    double lastActive;    // logged in, chatted or renamed
+    double pingedAt;      // a ping is outstanding if after lastHeardFrom
+    double frameDeadline; // 0 unless logging in or in the middle of a frame
+    uint64_t transferLeft; // characters of the transfer it is sending still to come
+    bool transferIsChat;   // a long chat message, filtered piece by piece
+    bool transferBlocked;  // by the content filter; the rest of it is dropped
+} ClientDetails;
+
+/**
+ * What the event loop looks at on every
+ * iteration, kept small: with many idle
+ * connections, walking the client list is what
+ * costs, and an idle client holds no buffer.
+ */
+typedef struct _Client {
+    int confd;
+    SenderId senderId;
+    bool loggedIn : 1;
+    bool announced : 1;   // the other clients know it is online
+    bool nameChanged : 1; // since it was last announced
+    bool broken : 1;      // a send to it has failed; disconnect it soon
+    bool isPeer : 1;      // another server of the cluster, not a user
+    bool connecting : 1;  // a link to a peer that is not established yet
+    bool tlsChecked : 1;  // whether it speaks TLS has been looked at
+    bool handshaking : 1; // its TLS handshake is not over yet
+    bool multicast : 1;   // gets the chat messages by multicast instead
+    bool wantsAcks : 1;   // its own chat messages are acknowledged, not sent back
+    bool backlogged : 1;  // its read budget ran out with input left; read again at once
+    int readDebt;         // bytes read past its budget, paid back on its next turn
+    FrameReader reader;
+    RateLimiter limiter;
+    wchar_t const* name; // interned; NULL until it logs in
+    ClientDetails* details;
 } Client;
 
 typedef struct {
-    Client* sender;
+    SenderId senderId;
     server_MessageSentFromClient message;
+    bool turnedDown; // by the content filter; only its sender hears of it, by an ack
+    bool masked;     // likewise, partly; its sender's ack says what went out
 } Message;
 
 LK_WANT_STRUCT_TYPE(Client, Client_, )
-LK_WANT_STRUCT_TYPE(Message, Message_, )
+LK_WANT_VECTOR_TYPE(Message, Message_, )
+LK_WANT_VECTOR_TYPE(SenderId, SenderId_, )
 
-struct pollfd* allocateAndListPollFds(LkClient_List const* clientList, int listeningSockFd, size_t* nfds) {
-    *nfds = 1 + lkClient_Size(clientList);
+/**
+ * Broadcasts to large audiences are sent by a
+ * pool of threads, each to its own part of the
+ * audience. A broadcast is over before anything
+ * else is sent, so every client still gets its
+ * frames in order. The audience is listed again
+ * only after it has changed.
+ */
+typedef struct {
+    FanoutPool* pool;   // NULL: everything is sent from the event loop's thread
+    Client** audience;  // the clients announced as online
+    size_t audienceSize;
+    size_t audienceCapacity;
+    bool audienceChanged;
+} Fanout;
+
+Fanout fanout = { NULL, NULL, 0, 0, true };
+
+/**
+ * Changes to the list of online users are not
+ * sent as they happen, but collected during one
+ * iteration of the event loop and then sent to
+ * everybody in a single message. A client that
+ * has just logged in gets the whole list instead.
+ */
+typedef struct {
+    uint64_t version;
+    bool hasPendingJoinsOrRenames;
+    LkSenderId_Vector departedIds;
+} Presence;
+
+// The first fds polled, then one per client.
+#define LISTENING_FD_INDEX 0
+#define HANDOFF_FD_INDEX 1 // a successor asking to take over (hot restart)
+#define UNIX_FD_INDEX 2    // clients on this host
+#define FIRST_CLIENT_FD_INDEX 3
+
+struct pollfd* allocateAndListPollFds(LkClient_List const* clientList, int listeningSockFd, int handoffSockFd, int unixSockFd, size_t* nfds) {
+    *nfds = FIRST_CLIENT_FD_INDEX + lkClient_Size(clientList);
     struct pollfd* fds = (struct pollfd*)malloc((*nfds) * sizeof(struct pollfd));
     if (!fds) return NULL;
 
-    fds[0].fd = listeningSockFd;
-    fds[0].events = POLLIN;
-    fds[0].revents = 0;
+    fds[LISTENING_FD_INDEX].fd = listeningSockFd;
+    fds[LISTENING_FD_INDEX].events = POLLIN;
+    fds[LISTENING_FD_INDEX].revents = 0;
+    fds[HANDOFF_FD_INDEX].fd = handoffSockFd; // ignored by poll() if -1
+    fds[HANDOFF_FD_INDEX].events = POLLIN;
+    fds[HANDOFF_FD_INDEX].revents = 0;
+    fds[UNIX_FD_INDEX].fd = unixSockFd; // ignored by poll() if -1
+    fds[UNIX_FD_INDEX].events = POLLIN;
+    fds[UNIX_FD_INDEX].revents = 0;
 
-    if (*nfds > 1) {
+    if (*nfds > FIRST_CLIENT_FD_INDEX) {
         // Client list is not empty
         LkClient_Node* current = lkClient_Head(clientList);
-        int i = 1;
+        int i = FIRST_CLIENT_FD_INDEX;
         do {
-            fds[i].fd = lkClient_GetNodeData(clientList, current)->confd;
+            fds[i].fd = srPollFd(lkClient_GetNodeData(clientList, current)->confd);
             fds[i].events = POLLIN;
             fds[i].revents = 0;
             ++i;
@@ -57,51 +251,1741 @@ struct pollfd* allocateAndListPollFds(LkClient_List const* clientList, int liste
     return fds;
 }
 
-bool forwardMessageToAllClients(LkClient_List* clientList, Message const* message, SenderIdentity const* senderIdentity) {
+/**
+ * Formats the client's address the first time
+ * it is needed, i.e. when it logs in, so that
+ * accepting connections stays cheap.
+ */
+wchar_t const* clientAddress(Client* client) {
+    ClientDetails* details = client->details;
+    if (details->address != NULL) return details->address;
+
+    char addressString[MAX_ADDRESS_LENGTH + 1] = "";
+    if (details->peerAddress.any.sa_family == AF_UNIX) {
+        // Unix socket clients are all the same to the others.
+        details->port = 0;
+        strcpy(addressString, "local");
+    } else if (details->peerAddress.any.sa_family == AF_INET) {
+        // IPv4
+        struct sockaddr_in* A = &details->peerAddress.v4;
+        details->port = ntohs(A->sin_port);
+        inet_ntop(AF_INET, (void*)(&A->sin_addr), addressString, MAX_ADDRESS_LENGTH);
+    } else {
+        // IPv6
+        struct sockaddr_in6* A = &details->peerAddress.v6;
+        details->port = ntohs(A->sin6_port);
+        inet_ntop(AF_INET6, (void*)(&A->sin6_addr), addressString, MAX_ADDRESS_LENGTH);
+    }
+    wchar_t address[MAX_ADDRESS_LENGTH + 1];
+    size_t length = mbstowcs(address, addressString, MAX_ADDRESS_LENGTH);
+    if (length == (size_t)-1) length = 0;
+    details->address = ipIntern(internedStrings, address, length);
+    return details->address ? details->address : L"";
+}
+
+wchar_t const* clientName(Client const* client) {
+    return client->name ? client->name : L"";
+}
+
+/** Returns false if out of memory. */
+bool initClient(Client* client, int confd, SenderId senderId, ServerConfig const* config, double now) {
+    client->details = (ClientDetails*)calloc(1, sizeof(ClientDetails));
+    if (client->details == NULL) return false;
+    niEntryInit(&client->details->byName);
+    client->confd = confd;
+    client->senderId = senderId;
+    client->loggedIn = false;
+    client->announced = false;
+    client->nameChanged = false;
+    client->broken = false;
+    client->isPeer = false;
+    client->connecting = false;
+    client->tlsChecked = (tlsContext == NULL);
+    client->handshaking = false;
+    client->multicast = false;
+    client->wantsAcks = false;
+    client->backlogged = false;
+    client->readDebt = 0;
+    frameReader_init(&client->reader);
+    rlInit(&client->limiter, &config->rateLimit, now);
+    client->name = NULL;
+    return true;
+}
+
+/** Everything but the socket. */
+void freeClient(Client* client) {
+    twCancel(&timers, &client->details->timer);
+    niRemove(clientsByName, &client->details->byName);
+    frameReader_free(&client->reader);
+    ipRelease(internedStrings, client->name);
+    ipRelease(internedStrings, client->details->address);
+    free((void*)client->details);
+}
+
+void sendFrameToClient(Client* client, EncodedFrame const* frame) {
+    if (client->broken) return;
+    MessageSendStatus sendStatus = sendEncodedFrame(client->confd, frame);
+    PROBE3(send, client->confd, frame->length * sizeof(frame->data[0]), sendStatus);
+    if (sendStatus != SEND_SUCCESS) {
+        wprintf(L"error: could not send to a client, dropping it\n");
+        client->broken = true;
+    }
+}
+
+void sendFrameToClientTask(void* client, void* frame) {
+    sendFrameToClient((Client*)client, (EncodedFrame const*)frame);
+}
+
+/**
+ * A chat message as it goes out: the frame, and
+ * the ack that goes to its sender instead, if
+ * the sender asked for acks.
+ */
+typedef struct {
+    EncodedFrame const* frame;
+    EncodedFrame const* ack;
+    SenderId senderId; // 0: relayed from a peer; nobody to ack
+} ChatBroadcast;
+
+void sendChatToClientTask(void* client, void* chat) {
+    Client* target = (Client*)client;
+    ChatBroadcast const* broadcast = (ChatBroadcast const*)chat;
+    if (broadcast->senderId != 0 && target->senderId == broadcast->senderId && target->wantsAcks) {
+        sendFrameToClient(target, broadcast->ack);
+    } else if (!target->multicast) {
+        sendFrameToClient(target, broadcast->frame);
+    }
+}
+
+/** Returns false if out of memory. */
+bool listAudience(LkClient_List* clientList) {
+    size_t numClients = lkClient_Size(clientList);
+    if (numClients > fanout.audienceCapacity) {
+        Client** audience = (Client**)realloc((void*)fanout.audience, numClients * sizeof(Client*));
+        if (audience == NULL) return false;
+        fanout.audience = audience;
+        fanout.audienceCapacity = numClients;
+    }
+    fanout.audienceSize = 0;
+    LkClient_Node* current = lkClient_Head(clientList);
+    for (; current != NULL; lkClient_Next(&current)) {
+        Client* client = lkClient_GetNodeData(clientList, current);
+        if (client->announced) fanout.audience[fanout.audienceSize++] = client;
+    }
+    fanout.audienceChanged = false;
+    return true;
+}
+
+/**
+ * Calls `send` for every client that has been
+ * announced as online, from the pool of threads
+ * if the audience is large enough.
+ */
+void forwardToAllClients(LkClient_List* clientList, size_t numBytes, FoTask send, void* arg) {
+    PROBE2(broadcast_start, numBytes, lkClient_Size(clientList));
+    if (fanout.pool != NULL && lkClient_Size(clientList) >= FANOUT_MIN_AUDIENCE
+        && (!fanout.audienceChanged || listAudience(clientList))
+    ) {
+        foRun(fanout.pool, (void* const*)fanout.audience, fanout.audienceSize, send, arg);
+        PROBE2(broadcast_end, numBytes, lkClient_Size(clientList));
+        return;
+    }
+
     LkClient_Node* current = lkClient_Head(clientList);
     if (current != NULL) {
         do {
             Client* targetClient = lkClient_GetNodeData(clientList, current);
-            MessageSendStatus sendStatus = server_forwardMessageToClient(
-                targetClient->confd,
-                message->message.text,
-                senderIdentity,
-                message->sender->confd == targetClient->confd
-            );
-            if (sendStatus != SEND_SUCCESS) {
-                return false;
+            if (targetClient->announced) send((void*)targetClient, arg);
+        } while (lkClient_Next(&current));
+    }
+    PROBE2(broadcast_end, numBytes, lkClient_Size(clientList));
+}
+
+/**
+ * The frame is encoded once by the caller and
+ * the very same bytes go to every client.
+ */
+void forwardMessageToAllClients(LkClient_List* clientList, EncodedFrame const* frame) {
+    forwardToAllClients(clientList, frame->length * sizeof(frame->data[0]), sendFrameToClientTask, (void*)frame);
+}
+
+/**
+ * Likewise, save to those that get it by
+ * multicast, and to its sender if it gets an
+ * ack instead.
+ */
+void forwardChatToAllClients(LkClient_List* clientList, ChatBroadcast const* chat) {
+    forwardToAllClients(clientList, chat->frame->length * sizeof(chat->frame->data[0]), sendChatToClientTask, (void*)chat);
+}
+
+/** Names travel as a single line. Returns the length. */
+size_t sanitizeName(wchar_t* sanitized, wchar_t const* name) {
+    size_t i;
+    for (i = 0; name[i] != L'\0' && i < MAX_NAME_LENGTH; ++i) {
+        sanitized[i] = (name[i] < L' ') ? L' ' : name[i];
+    }
+    return i;
+}
+
+/** Returns false if out of memory; the name is then unchanged. */
+bool setClientName(Client* client, wchar_t const* name) {
+    wchar_t sanitized[MAX_NAME_LENGTH + 1];
+    wchar_t const* interned = ipIntern(internedStrings, sanitized, sanitizeName(sanitized, name));
+    if (interned == NULL) return false;
+    niRemove(clientsByName, &client->details->byName);
+    ipRelease(internedStrings, client->name);
+    client->name = interned;
+    niInsert(clientsByName, &client->details->byName, interned);
+    return true;
+}
+
+/**
+ * The first user logged in under that name (go
+ * on with niFindNext()), or NULL. A name nobody
+ * has is not even interned.
+ */
+NiEntry* findUsersNamed(wchar_t const* name) {
+    wchar_t sanitized[MAX_NAME_LENGTH + 1];
+    wchar_t const* interned = ipFind(internedStrings, sanitized, sanitizeName(sanitized, name));
+    return (interned != NULL) ? niFind(clientsByName, interned) : NULL;
+}
+
+/**
+ * Tells the sender of a chat message that it
+ * was turned down; it may have left meanwhile.
+ * Returns false if out of memory.
+ */
+bool ackTurnedDown(LkClient_List* clientList, SenderId senderId) {
+    LkClient_Node* current = lkClient_Head(clientList);
+    for (; current != NULL; lkClient_Next(&current)) {
+        Client* client = lkClient_GetNodeData(clientList, current);
+        if (client->senderId != senderId) continue;
+        EncodedFrame ack;
+        if (!server_encodeAck(&ack, 0, NULL)) return false;
+        sendFrameToClient(client, &ack);
+        freeEncodedFrame(&ack);
+        break;
+    }
+    return true;
+}
+
+/** Costs a lookup and a send per recipient, whatever the number of clients. */
+bool sendDirectMessage(wchar_t const* recipientName, SenderId senderId, wchar_t const* text) {
+    EncodedFrame frame;
+    if (!server_encodeDirectMessage(&frame, senderId, text)) return false;
+    for (NiEntry* entry = findUsersNamed(recipientName); entry != NULL; entry = niFindNext(entry)) {
+        Client* recipient = niOwner(entry, ClientDetails, byName)->owner;
+        if (recipient->announced) {
+            sendFrameToClient(recipient, &frame);
+        }
+    }
+    freeEncodedFrame(&frame);
+    return true;
+}
+
+/**
+ * Registers the client's name and tells it its
+ * own sender ID, with a token to resume the
+ * session by; the client gets every chat
+ * message after `caughtUpTo`. Everybody learns
+ * about it when the presence changes are flushed.
+ */
+void handleLogin(Presence* presence, Client* newcomer, wchar_t const* name, uint64_t since, uint64_t caughtUpTo) {
+    wchar_t token[MAX_RESUME_TOKEN_LENGTH + 1];
+    rpMakeToken(&replay, newcomer->senderId, since, token);
+    if (!setClientName(newcomer, name)
+        || server_welcomeClient(newcomer->confd, newcomer->senderId, token, caughtUpTo) != SEND_SUCCESS
+    ) {
+        newcomer->broken = true;
+        return;
+    }
+    newcomer->loggedIn = true;
+    presence->hasPendingJoinsOrRenames = true;
+}
+
+/**
+ * Sends the chat messages numbered `first` to
+ * `last` over the client's connection, as far
+ * as they are still kept; an X tells it about
+ * those that are not. Returns false if out of
+ * memory.
+ */
+bool sendChatMessagesAgain(Client* client, uint64_t first, uint64_t last) {
+    if (last > replay.lastSequence) last = replay.lastSequence;
+    if (first > last) return true;
+    uint64_t oldest = rpOldestSequence(&replay);
+    if (first < oldest) {
+        uint64_t lastLost = (last < oldest) ? last : oldest - 1;
+        if (server_tellLost(client->confd, lastLost) != SEND_SUCCESS) client->broken = true;
+        first = lastLost + 1;
+    }
+    for (uint64_t sequence = first; sequence <= last && !client->broken; ++sequence) {
+        RpEntry const* entry = rpFind(&replay, sequence);
+        EncodedFrame frame;
+        if (!server_encodeRemoteChatMessage(&frame, sequence, entry->sender, entry->text)) return false;
+        sendFrameToClient(client, &frame);
+        freeEncodedFrame(&frame);
+    }
+    return true;
+}
+
+/**
+ * Logs the client in again, in place of the
+ * session its token was given to: that one is
+ * ended if it is not over yet, and the chat
+ * messages sent since its last one are sent
+ * again, as far as they are still kept. A token
+ * this server did not issue is a plain login.
+ * Returns false if out of memory.
+ */
+bool handleResume(Presence* presence, Client* client, wchar_t const* name, wchar_t const* token, uint64_t lastSequence) {
+    SenderId previousId;
+    uint64_t since;
+    if (!rpCheckToken(&replay, token, &previousId, &since) || since > replay.lastSequence) {
+        handleLogin(presence, client, name, replay.lastSequence, replay.lastSequence);
+        return true;
+    }
+
+    // The previous connection may not have been noticed to be dead yet.
+    for (NiEntry* entry = findUsersNamed(name); entry != NULL; entry = niFindNext(entry)) {
+        Client* previous = niOwner(entry, ClientDetails, byName)->owner;
+        if (previous->senderId == previousId) previous->broken = true;
+    }
+
+    uint64_t after = (lastSequence > since) ? lastSequence : since;
+    if (after > replay.lastSequence) after = replay.lastSequence;
+    if (after + 1 < rpOldestSequence(&replay)) after = rpOldestSequence(&replay) - 1;
+    handleLogin(presence, client, name, since, after);
+    ++serverStats.numResumed;
+    if (after != lastSequence) ++serverStats.numResumedWithGap;
+    return sendChatMessagesAgain(client, after + 1, replay.lastSequence);
+}
+
+/**
+ * Switches the client to multicast, if it is
+ * offered, or back to its connection; in the
+ * latter case, it is sent the chat messages
+ * after `lastReceived` right away, in case some
+ * did not come by multicast. Returns false if
+ * out of memory.
+ */
+bool handleMulticastWish(Client* client, bool on, uint64_t lastReceived) {
+    on = on && multicast.fd >= 0;
+    client->multicast = on;
+    wchar_t group[INET_ADDRSTRLEN] = L"";
+    if (on) {
+        char groupAscii[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &multicast.group.sin_addr, groupAscii, sizeof(groupAscii));
+        swprintf(group, INET_ADDRSTRLEN, L"%s", groupAscii);
+    }
+    if (server_tellMulticast(client->confd, group, on ? ntohs(multicast.group.sin_port) : 0) != SEND_SUCCESS) {
+        client->broken = true;
+        return true;
+    }
+    return on || sendChatMessagesAgain(client, lastReceived + 1, replay.lastSequence);
+}
+
+void handleRename(Presence* presence, Client* client, wchar_t const* newName) {
+    if (!setClientName(client, newName)) return;
+    if (client->announced) {
+        client->nameChanged = true;
+    }
+    presence->hasPendingJoinsOrRenames = true;
+}
+
+void describeClient(PresenceChange* change, PresenceChangeType type, Client* client) {
+    change->type = type;
+    change->id = client->senderId;
+    change->name = client->name;
+    change->address = clientAddress(client);
+    change->port = client->details->port;
+}
+
+/**
+ * Sends the joins and renames of this iteration
+ * to the clients that were already online, as
+ * one delta, then the whole (updated) list to
+ * the clients that have just logged in. The list
+ * is encoded once for all of them, so a burst of
+ * N logins costs O(N) bytes per client instead
+ * of one list per login.
+ */
+bool flushJoinsAndRenames(LkClient_List* clientList, Presence* presence) {
+    if (!presence->hasPendingJoinsOrRenames) return true;
+    presence->hasPendingJoinsOrRenames = false;
+
+    size_t numClients = lkClient_Size(clientList);
+    if (numClients == 0) return true;
+    PresenceChange* changes = (PresenceChange*)malloc(numClients * sizeof(PresenceChange));
+    if (!changes) return false;
+
+    size_t numChanges = 0;
+    size_t numNewcomers = 0;
+    LkClient_Node* current = lkClient_Head(clientList);
+    do {
+        Client* client = lkClient_GetNodeData(clientList, current);
+        if (client->loggedIn && !client->announced) {
+            describeClient(&changes[numChanges++], PRESENCE_JOIN, client);
+            ++numNewcomers;
+        } else if (client->nameChanged) {
+            describeClient(&changes[numChanges++], PRESENCE_RENAME, client);
+        }
+    } while (lkClient_Next(&current));
+
+    bool ok = true;
+    EncodedFrame frame;
+    if (numChanges > 0) {
+        ok = server_encodePresenceDelta(&frame, presence->version, presence->version + 1, changes, numChanges);
+        if (ok) {
+            ++presence->version;
+            forwardMessageToAllClients(clientList, &frame);
+            freeEncodedFrame(&frame);
+        }
+    }
+
+    if (ok && numNewcomers > 0) {
+        size_t numMembers = 0;
+        current = lkClient_Head(clientList);
+        do {
+            Client* client = lkClient_GetNodeData(clientList, current);
+            if (client->loggedIn) {
+                describeClient(&changes[numMembers++], PRESENCE_JOIN, client);
             }
         } while (lkClient_Next(&current));
+
+        ok = server_encodeMembership(&frame, presence->version, changes, numMembers);
+        if (ok) {
+            current = lkClient_Head(clientList);
+            do {
+                Client* client = lkClient_GetNodeData(clientList, current);
+                if (client->loggedIn && !client->announced) {
+                    sendFrameToClient(client, &frame);
+                    client->announced = true;
+                    fanout.audienceChanged = true;
+                }
+            } while (lkClient_Next(&current));
+            freeEncodedFrame(&frame);
+        }
+    }
+
+    current = lkClient_Head(clientList);
+    do {
+        lkClient_GetNodeData(clientList, current)->nameChanged = false;
+    } while (lkClient_Next(&current));
+
+    free((void*)changes);
+    return ok;
+}
+
+/**
+ * Sent after the chat messages of the iteration,
+ * so that messages from a client that has just
+ * left can still be attributed to it.
+ */
+bool flushLeaves(LkClient_List* clientList, Presence* presence) {
+    size_t numChanges = lkSenderId_Size(&presence->departedIds);
+    if (numChanges == 0) return true;
+
+    PresenceChange* changes = (PresenceChange*)malloc(numChanges * sizeof(PresenceChange));
+    if (!changes) return false;
+    size_t i = 0;
+    LkSenderId_Iter it = lkSenderId_Begin(&presence->departedIds);
+    for (SenderId* id; (id = lkSenderId_Next(&it)) != NULL; ++i) {
+        changes[i].type = PRESENCE_LEAVE;
+        changes[i].id = *id;
+    }
+    lkSenderId_Clear(&presence->departedIds);
+
+    EncodedFrame frame;
+    bool ok = server_encodePresenceDelta(&frame, presence->version, presence->version + 1, changes, numChanges);
+    free((void*)changes);
+    if (!ok) return false;
+    ++presence->version;
+    forwardMessageToAllClients(clientList, &frame);
+    freeEncodedFrame(&frame);
+    return true;
+}
+
+/**
+ * A client that logged in and left within the
+ * same iteration was never announced; its chat
+ * messages can not be attributed, so drop them.
+ */
+void dropMessagesFrom(LkMessage_Vector* messages, SenderId senderId) {
+    LkMessage_Iter it = lkMessage_Begin(messages);
+    for (Message* msg; (msg = lkMessage_Next(&it)) != NULL; ) {
+        if (msg->senderId == senderId) {
+            server_freeMessageFromClient(&msg->message);
+            lkMessage_RemoveCurrent(&it);
+        }
+    }
+}
+
+bool disconnectClient(LkClient_List* clientList, LkClient_Node* node, Presence* presence, LkMessage_Vector* messages) {
+    Client* client = lkClient_GetNodeData(clientList, node);
+    wprintf(L"info: a client disconnected\n");
+    PROBE3(disconnect, client->confd, client->senderId, (int)client->broken);
+    if (!client->isPeer) cpRecord(&capture, CP_CLOSE, client->senderId, NULL, 0);
+    if (client->announced) {
+        fanout.audienceChanged = true;
+        if (!lkSenderId_Append(&presence->departedIds, &client->senderId)) return false;
+    } else if (client->loggedIn) {
+        dropMessagesFrom(messages, client->senderId);
+    }
+    serverStats.timesThrottled += client->limiter.timesThrottled;
+    serverStats.secondsThrottled += client->limiter.secondsThrottled;
+    if (client->details->dialedPeer != NULL) {
+        fedLinkLost(client->details->dialedPeer, monotonicSeconds());
+    }
+    srEnd(client->confd);
+    ktEnd(client->confd);
+    close(client->confd);
+    freeClient(client);
+    lkClient_Remove(clientList, node);
+    return true;
+}
+
+/**
+ * Returns whether any client was disconnected.
+ */
+bool disconnectBrokenClients(LkClient_List* clientList, Presence* presence, LkMessage_Vector* messages, bool* outOfMemory) {
+    bool any = false;
+    LkClient_Node* current = lkClient_Head(clientList);
+    while (current != NULL) {
+        LkClient_Node* next = lkClient_After(current);
+        if (lkClient_GetNodeData(clientList, current)->broken) {
+            if (!disconnectClient(clientList, current, presence, messages)) *outOfMemory = true;
+            any = true;
+        }
+        current = next;
+    }
+    return any;
+}
+
+/** Links to other servers carry many users' messages; they are not limited. */
+RateLimit const* clientRateLimit(Client const* client, ServerConfig const* config) {
+    static RateLimit const unlimited = { 0, 0, 0, 0 };
+    return client->isPeer ? &unlimited : &config->rateLimit;
+}
+
+bool clientHasIntroducedItself(Client const* client) {
+    return client->loggedIn || client->details->peerNodeId != 0;
+}
+
+/** When the client's timer should go off next, or -1 if never. */
+double clientNextDeadline(Client const* client, ServerConfig const* config) {
+    ClientDetails const* details = client->details;
+    double next = -1;
+    if (config->pingInterval > 0) {
+        next = (details->pingedAt > details->lastHeardFrom)
+            ? details->pingedAt + config->pongTimeout
+            : details->lastHeardFrom + config->pingInterval;
+    }
+    if (config->idleTimeout > 0 && client->loggedIn) {
+        double idleDeadline = details->lastActive + config->idleTimeout;
+        if (next < 0 || idleDeadline < next) next = idleDeadline;
+    }
+    if (details->frameDeadline > 0 && (next < 0 || details->frameDeadline < next)) {
+        next = details->frameDeadline;
+    }
+    return next;
+}
+
+/**
+ * Deadlines that move later (the client has
+ * been heard from, or has finished a frame) are
+ * only caught up with when the timer goes off;
+ * the timer has to be rescheduled right away
+ * only when a deadline comes earlier.
+ */
+void rescheduleClientTimer(Client* client, ServerConfig const* config) {
+    double next = clientNextDeadline(client, config);
+    if (next < 0) {
+        twCancel(&timers, &client->details->timer);
+    } else {
+        twStart(&timers, &client->details->timer, next);
+    }
+}
+
+/** For a client that has just taken its place in the client list. */
+void startClientTimer(Client* client, ServerConfig const* config, double now) {
+    ClientDetails* details = client->details;
+    details->owner = client;
+    details->lastHeardFrom = now;
+    details->lastActive = now;
+    details->pingedAt = 0;
+    details->frameDeadline = (config->frameTimeout > 0 && !clientHasIntroducedItself(client))
+        ? now + config->frameTimeout
+        : 0;
+    rescheduleClientTimer(client, config);
+}
+
+/**
+ * Gives a client that has logged in (or a peer
+ * that has said hello) a deadline to finish the
+ * frame it has begun to send, so that trickling
+ * bytes in cannot hold a connection forever.
+ * Until then, the deadline to log in stands.
+ */
+void watchPartialFrame(Client* client, ServerConfig const* config, double now) {
+    if (config->frameTimeout <= 0 || !clientHasIntroducedItself(client)) return;
+    ClientDetails* details = client->details;
+    bool partial = (client->reader.end > client->reader.begin)
+        && rlAllows(&client->limiter, clientRateLimit(client, config)) && !client->backlogged; // not just held back
+    if (!partial) {
+        details->frameDeadline = 0;
+    } else if (details->frameDeadline == 0) {
+        details->frameDeadline = now + config->frameTimeout;
+        rescheduleClientTimer(client, config);
+    }
+}
+
+/**
+ * Handles the clients whose timer has gone off:
+ * pings those that have been silent for a while,
+ * and drops those that have not answered, have
+ * been idle for too long, or are too slow to
+ * log in or to finish a frame. Only these
+ * clients are looked at.
+ */
+void expireTimers(ServerConfig const* config, double now) {
+    TwTimer* timer = twExpire(&timers, now);
+    while (timer != NULL) {
+        TwTimer* next = timer->next;
+        ClientDetails* details = twOwner(timer, ClientDetails, timer);
+        Client* client = details->owner;
+        bool pingOutstanding = (details->pingedAt > details->lastHeardFrom);
+
+        if (client->broken) {
+            // Dropped anyway.
+        } else if (details->frameDeadline > 0 && now >= details->frameDeadline) {
+            wprintf(L"info: a client took too long to %ls\n", clientHasIntroducedItself(client) ? L"send a message" : L"log in");
+            client->broken = true;
+        } else if (config->idleTimeout > 0 && client->loggedIn && now >= details->lastActive + config->idleTimeout) {
+            wprintf(L"info: a client has been idle for too long\n");
+            client->broken = true;
+        } else if (config->pingInterval > 0 && pingOutstanding && now >= details->pingedAt + config->pongTimeout) {
+            wprintf(L"info: a client did not answer a ping\n");
+            client->broken = true;
+        } else if (config->pingInterval > 0 && !pingOutstanding && now >= details->lastHeardFrom + config->pingInterval) {
+            // A link that is still being opened can not be
+            // pinged, but gets as long to open as to answer.
+            if (!client->connecting && server_ping(client->confd) != SEND_SUCCESS) {
+                client->broken = true;
+            }
+            details->pingedAt = now;
+        }
+
+        if (!client->broken) rescheduleClientTimer(client, config);
+        timer = next;
+    }
+}
+
+/**
+ * Handles a P message: either another server
+ * opening a link to this one, or the reply to
+ * one this server has opened.
+ */
+MessageReadStatus handlePeerHello(Client* client, NodeId nodeId, Federation* fed) {
+    if (fed->nodeId == 0) return READ_ERR_MALFUNCTIONING_PEER; // not part of a cluster
+    ClientDetails* details = client->details;
+    if (client->loggedIn || details->peerNodeId != 0) return READ_ERR_MALFUNCTIONING_PEER;
+
+    if (!client->isPeer) {
+        // Reply even to this node itself, so that it
+        // learns not to dial itself again.
+        client->isPeer = true;
+        if (server_greetPeer(client->confd, fed->nodeId) != SEND_SUCCESS) return READ_ERR_BROKEN_SOCKET;
+    }
+    if (nodeId == fed->nodeId) {
+        if (details->dialedPeer != NULL) details->dialedPeer->isSelf = true;
+        return READ_ERR_MALFUNCTIONING_PEER;
+    }
+    details->peerNodeId = nodeId;
+    wprintf(L"info: linked to node %u\n", nodeId);
+    return READ_SUCCESS;
+}
+
+/**
+ * TLS is offered on the same port as plain
+ * text: a client that starts with a TLS
+ * handshake record gets a handshake, any other
+ * is read as plain text. Once the handshake is
+ * over, the kernel (or OpenSSL, if the kernel
+ * cannot) encrypts and decrypts, and the
+ * client is read and written like any other.
+ * On the Unix socket, a client may start by
+ * asking for shared memory rings instead.
+ * Returns READ_SUCCESS once the client can be
+ * read from.
+ */
+MessageReadStatus negotiateTls(Client* client, double now) {
+    if (!client->tlsChecked) {
+        unsigned char firstByte;
+        ssize_t numBytesRead = recv(client->confd, (void*)&firstByte, 1, MSG_PEEK);
+        if (numBytesRead == 0) return READ_ERR_PEER_CLOSED;
+        if (numBytesRead < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? READ_INCOMPLETE : READ_ERR_BROKEN_SOCKET;
+        }
+        client->tlsChecked = true;
+        if (firstByte == SR_REQUEST && client->details->peerAddress.any.sa_family == AF_UNIX) {
+            if (!srAccept(client->confd)) {
+                wprintf(L"warning: could not set shared memory rings up for a client\n");
+                return READ_ERR_BROKEN_SOCKET;
+            }
+            ++serverStats.numRings;
+            return READ_INCOMPLETE; // polled through the rings from now on
+        }
+        if (firstByte != KT_HANDSHAKE_RECORD || tlsContext == NULL) return READ_SUCCESS;
+        if (!ktStart(tlsContext, client->confd, NULL)) return READ_ERR_NOT_ENOUGH_MEMORY;
+        client->handshaking = true;
+    }
+
+    client->details->lastHeardFrom = now;
+    switch (ktHandshake(client->confd)) {
+        case KT_IN_PROGRESS:
+            return READ_INCOMPLETE;
+        case KT_FAILED:
+            wprintf(L"info: a TLS handshake failed\n");
+            return READ_ERR_MALFUNCTIONING_PEER;
+        default:
+            break;
+    }
+    client->handshaking = false;
+    if (!ktInUserSpace(client->confd)) {
+        ++serverStats.numTlsInKernel;
+    } else if (serverStats.numTlsInUserSpace++ == 0) {
+        wprintf(L"warning: the kernel cannot take TLS over (is the tls module loaded?); encrypting in user space\n");
+    }
+    // The client speaks only after the handshake.
+    return READ_INCOMPLETE;
+}
+
+/** Replies to a search with the newest chat messages found. */
+MessageSendStatus answerSearch(Client* client, wchar_t const* query) {
+    SearchHit hits[SX_MAX_RESULTS];
+    size_t numHits;
+    if (!sxSearch(&search, query, hits, SX_MAX_RESULTS, &numHits)) return SEND_ERR_NOT_ENOUGH_MEMORY;
+    MessageSendStatus sendStatus = server_tellSearchResults(client->confd, hits, numHits);
+    sxFreeHits(hits, numHits);
+    return sendStatus;
+}
+
+/**
+ * Masks the banned terms in a message from a
+ * user, and says in `*maskedPtr` (if given)
+ * whether there were any. Returns false if it
+ * must not be sent at all.
+ */
+bool passesContentFilter(wchar_t* text, bool* maskedPtr) {
+    CfVerdict verdict = (contentFilter.automaton != NULL) ? cfFilter(&contentFilter, text) : CF_PASSED;
+    if (maskedPtr != NULL) *maskedPtr = (verdict == CF_MASKED);
+    return verdict != CF_BLOCKED;
+}
+
+bool isTransferFrame(server_MessageType type) {
+    return type == FROM_CLIENT_TRANSFER_START || type == FROM_CLIENT_TRANSFER_DATA || type == FROM_CLIENT_TRANSFER_CANCEL;
+}
+
+/**
+ * Keeps count of what is left of the transfer
+ * the client is sending, and queues its frames
+ * to be relayed. A long chat message goes
+ * through the content filter piece by piece:
+ * once a piece is blocked, the others are told
+ * the transfer is cancelled and the rest of it
+ * is dropped. Takes the message over.
+ */
+MessageReadStatus takeTransferFrame(Client* client, Message* msg, LkMessage_Vector* messages) {
+    ClientDetails* details = client->details;
+    server_MessageSentFromClient* message = &msg->message;
+    bool ok = true;
+    bool dropIt = details->transferBlocked;
+    switch (message->type) {
+        case FROM_CLIENT_TRANSFER_START:
+            ok = (details->transferLeft == 0);
+            details->transferLeft = message->transferLength;
+            details->transferIsChat = (message->transferKind == TRANSFER_CHAT);
+            details->transferBlocked = dropIt = false;
+            ++serverStats.numTransfers;
+        break;
+
+        case FROM_CLIENT_TRANSFER_DATA: {
+            size_t length = wcslen(message->text);
+            ok = (length <= details->transferLeft);
+            if (!ok) break;
+            details->transferLeft -= length;
+            if (dropIt) break;
+            if (details->transferIsChat && !passesContentFilter(message->text, NULL)) {
+                details->transferBlocked = true;
+                message->type = FROM_CLIENT_TRANSFER_CANCEL;
+            }
+        } break;
+
+        default: // FROM_CLIENT_TRANSFER_CANCEL
+            dropIt = dropIt || (details->transferLeft == 0); // over already
+            details->transferLeft = 0;
+        break;
+    }
+    if (!ok || dropIt) {
+        server_freeMessageFromClient(message);
+        return ok ? READ_SUCCESS : READ_ERR_MALFUNCTIONING_PEER;
+    }
+    if (!lkMessage_Append(messages, msg)) {
+        server_freeMessageFromClient(message);
+        return READ_ERR_NOT_ENOUGH_MEMORY;
+    }
+    return READ_SUCCESS;
+}
+
+/**
+ * Reads and handles the client's messages, as
+ * many as its rate limit admits. What is over
+ * the limit is left in the socket, so that TCP
+ * flow control slows the sender down. Returns
+ * READ_INCOMPLETE if the client is fine.
+ *
+ * Within one iteration of the event loop, the
+ * client may read no more than its read budget
+ * (deficit round robin, each iteration a round):
+ * the socket is read until it is empty, or the
+ * budget spent, and then it is the next client's
+ * turn. The frame that overspends it is read
+ * whole, and the bytes over are taken off the
+ * client's next turn.
+ */
+MessageReadStatus readMessagesFromClient(Client* client, bool socketIsReadable, Presence* presence, LkMessage_Vector* messages, Federation* fed, ServerConfig const* config, double now) {
+    RateLimit const* rateLimit = clientRateLimit(client, config);
+    if (!rlAllows(&client->limiter, rateLimit)) return READ_INCOMPLETE;
+
+    if (!client->tlsChecked || client->handshaking) {
+        if (!socketIsReadable) return READ_INCOMPLETE;
+        MessageReadStatus tlsStatus = negotiateTls(client, now);
+        if (tlsStatus != READ_SUCCESS) return tlsStatus;
+    }
+
+    client->backlogged = false;
+    bool hasBufferedInput = (client->reader.end > client->reader.begin);
+    if (!socketIsReadable && !hasBufferedInput) {
+        client->readDebt = 0;
+        return READ_INCOMPLETE;
+    }
+    bool budgeted = (config->readBudget > 0);
+    long credit = (long)config->readBudget - client->readDebt;
+    client->readDebt = 0;
+
+    for (;;) {
+        while (rlAllows(&client->limiter, rateLimit) && (!budgeted || credit > 0)) {
+            size_t numBytesBuffered = client->reader.end - client->reader.begin;
+            char const* frameBytes = client->reader.data + client->reader.begin; // still there once read
+            Message msg;
+            msg.senderId = client->senderId;
+            msg.turnedDown = false;
+            msg.masked = false;
+            MessageReadStatus readStatus = server_readMessageFromClient(&client->reader, &msg.message);
+            size_t numBytesRead = numBytesBuffered - (client->reader.end - client->reader.begin);
+            PROBE4(message_read, client->confd, readStatus, (readStatus == READ_SUCCESS) ? (int)msg.message.type : -1, numBytesRead);
+            if (readStatus == READ_INCOMPLETE) break; // the rest of the frame is still to come
+            if (readStatus != READ_SUCCESS) return readStatus;
+            rlCharge(&client->limiter, rateLimit, numBytesRead, now);
+            credit -= (long)numBytesRead;
+            if (!client->isPeer && msg.message.type != FROM_PEER_HELLO) {
+                cpRecord(&capture, CP_FRAME, client->senderId, frameBytes, numBytesRead);
+            }
+
+            if (msg.message.type == FROM_CLIENT_PONG) {
+                server_freeMessageFromClient(&msg.message); // it has been heard from, that is all
+            } else if (msg.message.type == FROM_PEER_PING) {
+                server_freeMessageFromClient(&msg.message);
+                if (!client->isPeer) return READ_ERR_MALFUNCTIONING_PEER;
+                if (server_pong(client->confd) != SEND_SUCCESS) return READ_ERR_BROKEN_SOCKET;
+            } else if (msg.message.type == FROM_PEER_HELLO) {
+                readStatus = handlePeerHello(client, msg.message.nodeId, fed);
+                server_freeMessageFromClient(&msg.message);
+                if (readStatus != READ_SUCCESS) return readStatus;
+            } else if (client->isPeer) {
+                bool ok = (msg.message.type == FROM_PEER_CHAT && client->details->peerNodeId != 0);
+                if (ok && fedIsNew(fed, msg.message.relay->originNode, msg.message.relay->sequence)) {
+                    ++fed->numReceived;
+                    msg.senderId = 0; // no local sender; it stays even if the link goes down
+                    if (!lkMessage_Append(messages, &msg)) {
+                        server_freeMessageFromClient(&msg.message);
+                        return READ_ERR_NOT_ENOUGH_MEMORY;
+                    }
+                } else {
+                    if (ok) ++fed->numDuplicates;
+                    server_freeMessageFromClient(&msg.message);
+                    if (!ok) return READ_ERR_MALFUNCTIONING_PEER;
+                }
+            } else if (msg.message.type == FROM_CLIENT_LOGIN || msg.message.type == FROM_CLIENT_RESUME) {
+                bool ok = !client->loggedIn;
+                bool outOfMemory = false;
+                if (ok) {
+                    if (msg.message.type == FROM_CLIENT_LOGIN) {
+                        handleLogin(presence, client, msg.message.text, replay.lastSequence, replay.lastSequence);
+                    } else {
+                        outOfMemory = !handleResume(presence, client, msg.message.text, msg.message.resumeToken, msg.message.sequence);
+                    }
+                    client->details->lastActive = now;
+                    rescheduleClientTimer(client, config); // now it may be idle
+                }
+                server_freeMessageFromClient(&msg.message);
+                if (!ok) return READ_ERR_MALFUNCTIONING_PEER;
+                if (outOfMemory) return READ_ERR_NOT_ENOUGH_MEMORY;
+            } else if (!client->loggedIn || msg.message.type == FROM_PEER_CHAT) {
+                server_freeMessageFromClient(&msg.message);
+                return READ_ERR_MALFUNCTIONING_PEER;
+            } else if (msg.message.type == FROM_CLIENT_WANT_ACKS) {
+                client->wantsAcks = true;
+                server_freeMessageFromClient(&msg.message);
+            } else if (msg.message.type == FROM_CLIENT_RENAME) {
+                handleRename(presence, client, msg.message.text);
+                client->details->lastActive = now;
+                server_freeMessageFromClient(&msg.message);
+            } else if (msg.message.type == FROM_CLIENT_MULTICAST || msg.message.type == FROM_CLIENT_NACK) {
+                bool ok;
+                if (msg.message.type == FROM_CLIENT_MULTICAST) {
+                    ok = handleMulticastWish(client, msg.message.multicast, msg.message.sequence);
+                } else {
+                    // No more than it could hold past the hole.
+                    uint64_t last = msg.message.toSequence;
+                    if (last - msg.message.sequence >= MC_WINDOW) last = msg.message.sequence + MC_WINDOW - 1;
+                    ++serverStats.numNacks;
+                    ok = sendChatMessagesAgain(client, msg.message.sequence, last);
+                }
+                server_freeMessageFromClient(&msg.message);
+                if (!ok) return READ_ERR_NOT_ENOUGH_MEMORY;
+            } else if (msg.message.type == FROM_CLIENT_SEARCH) {
+                MessageSendStatus sendStatus = answerSearch(client, msg.message.text);
+                server_freeMessageFromClient(&msg.message);
+                if (sendStatus == SEND_ERR_NOT_ENOUGH_MEMORY) return READ_ERR_NOT_ENOUGH_MEMORY;
+                if (sendStatus != SEND_SUCCESS) return READ_ERR_BROKEN_SOCKET;
+            } else if (isTransferFrame(msg.message.type)) {
+                client->details->lastActive = now;
+                readStatus = takeTransferFrame(client, &msg, messages);
+                if (readStatus != READ_SUCCESS) return readStatus;
+            } else if (!passesContentFilter(msg.message.text, &msg.masked)) {
+                client->details->lastActive = now;
+                if (msg.message.type == FROM_CLIENT_CHAT && client->wantsAcks) {
+                    // Its ack comes in turn, after those of the messages before it.
+                    msg.turnedDown = true;
+                    if (!lkMessage_Append(messages, &msg)) {
+                        server_freeMessageFromClient(&msg.message);
+                        return READ_ERR_NOT_ENOUGH_MEMORY;
+                    }
+                } else {
+                    server_freeMessageFromClient(&msg.message); // dropped without a word, like a DM to nobody would be
+                }
+            } else if (msg.message.type == FROM_CLIENT_DIRECT) {
+                client->details->lastActive = now;
+                if (findUsersNamed(msg.message.recipient) == NULL) {
+                    // Nobody to deliver it to; say so right away.
+                    MessageSendStatus sendStatus = server_tellNoSuchUser(client->confd, msg.message.recipient);
+                    server_freeMessageFromClient(&msg.message);
+                    if (sendStatus != SEND_SUCCESS) return READ_ERR_BROKEN_SOCKET;
+                } else if (!lkMessage_Append(messages, &msg)) {
+                    server_freeMessageFromClient(&msg.message);
+                    return READ_ERR_NOT_ENOUGH_MEMORY;
+                }
+            } else {
+                client->details->lastActive = now;
+                // Identify the sender now: it may be gone by the
+                // time the message is relayed or sent again.
+                wchar_t const* address = clientAddress(client);
+                msg.message.relay = server_newRelayInfo(fed->nodeId, (fed->nodeId != 0) ? fedNextSequence(fed) : 0,
+                    client->name, wcslen(client->name), address, wcslen(address), client->details->port
+                );
+                if (msg.message.relay == NULL) {
+                    server_freeMessageFromClient(&msg.message);
+                    return READ_ERR_NOT_ENOUGH_MEMORY;
+                }
+                if (!lkMessage_Append(messages, &msg)) {
+                    server_freeMessageFromClient(&msg.message);
+                    return READ_ERR_NOT_ENOUGH_MEMORY;
+                }
+            }
+        }
+        if (!rlAllows(&client->limiter, rateLimit)) return READ_INCOMPLETE; // until prepareToPoll() says
+        if (budgeted && credit <= 0) {
+            // Its turn is over; read it again in the next
+            // iteration, which should not wait.
+            client->backlogged = true;
+            client->readDebt = (int)-credit;
+            ++serverStats.numReadBudgetsSpent;
+            return READ_INCOMPLETE;
+        }
+        if (!socketIsReadable) return READ_INCOMPLETE;
+        MessageReadStatus readStatus = server_receiveFromClient(client->confd, &client->reader);
+        if (readStatus == READ_INCOMPLETE) return READ_INCOMPLETE; // all read
+        if (readStatus != READ_SUCCESS) return readStatus;
+        client->details->lastHeardFrom = now;
     }
+}
+
+/**
+ * Sends a relayed chat message to every other
+ * node once, even if there are two links to it.
+ */
+void relayToPeers(LkClient_List* clientList, EncodedFrame const* frame, Federation* fed) {
+    NodeId sentTo[64];
+    size_t numSentTo = 0;
+    LkClient_Node* current = lkClient_Head(clientList);
+    for (; current != NULL; lkClient_Next(&current)) {
+        Client* peer = lkClient_GetNodeData(clientList, current);
+        if (!peer->isPeer || peer->broken) continue;
+        NodeId nodeId = peer->details->peerNodeId;
+        if (nodeId == 0) continue;
+
+        bool alreadySent = false;
+        for (size_t i = 0; i < numSentTo && !alreadySent; ++i) {
+            alreadySent = (sentTo[i] == nodeId);
+        }
+        if (alreadySent) continue;
+        sendFrameToClient(peer, frame);
+        if (numSentTo < sizeof(sentTo) / sizeof(sentTo[0])) {
+            sentTo[numSentTo++] = nodeId;
+        }
+        ++fed->numRelayed;
+    }
+}
+
+/**
+ * Relays the start, a piece or the end of a
+ * transfer to every user announced as online
+ * but its sender, by multicast or not. Pieces
+ * are big: to the sockets the kernel writes to
+ * on its own, they are spliced from a pipe, so
+ * that they are copied only once for all.
+ * Returns false if out of memory.
+ */
+bool relayTransfer(LkClient_List* clientList, Message const* msg) {
+    server_MessageSentFromClient const* message = &msg->message;
+    EncodedFrame frame;
+    bool encoded = (message->type == FROM_CLIENT_TRANSFER_START)
+        ? server_encodeTransferStart(&frame, msg->senderId, message->transferKind, message->transferLength, message->text)
+        : (message->type == FROM_CLIENT_TRANSFER_DATA)
+        ? server_encodeTransferData(&frame, msg->senderId, message->text)
+        : server_encodeTransferCancel(&frame, msg->senderId);
+    if (!encoded) return false;
+    bool isPiece = (message->type == FROM_CLIENT_TRANSFER_DATA);
+    bool loaded = isPiece && zcLoad(&zeroCopy, frame.data, frame.length * sizeof(frame.data[0]));
+    if (isPiece) ++serverStats.numTransferPieces;
+
+    LkClient_Node* current = lkClient_Head(clientList);
+    for (; current != NULL; lkClient_Next(&current)) {
+        Client* client = lkClient_GetNodeData(clientList, current);
+        if (!client->announced || client->broken || client->senderId == msg->senderId) continue;
+        ZcStatus status = ZC_PIPE_FAILED;
+        if (loaded && zcCanSend(client->confd)) {
+            status = zcSend(&zeroCopy, client->confd, SPLICE_STALL_TIMEOUT_MS);
+            PROBE3(splice, client->confd, zeroCopy.numBytes, status);
+        }
+        if (status == ZC_SENT) {
+            ++serverStats.numSpliced;
+        } else if (status == ZC_SOCKET_FAILED) {
+            wprintf(L"error: could not send to a client, dropping it\n");
+            client->broken = true;
+        } else {
+            sendFrameToClient(client, &frame);
+        }
+    }
+    if (loaded) zcUnload(&zeroCopy);
+    freeEncodedFrame(&frame);
     return true;
 }
 
-int eventLoop(int sockfd) {
+/**
+ * Finishes opening a link to a peer once poll()
+ * reports its socket writable. Returns false if
+ * the connection failed.
+ */
+bool finishDialing(Client* client, Federation* fed) {
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (getsockopt(client->confd, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0 || error != 0) {
+        wprintf(L"info: could not link to peer %s\n", client->details->dialedPeer->spec);
+        return false;
+    }
+    client->connecting = false;
+    return server_greetPeer(client->confd, fed->nodeId) == SEND_SUCCESS;
+}
+
+/**
+ * Stops polling throttled clients for input (and
+ * the listening socket, while accepting is
+ * paused), and returns how long poll() may sleep
+ * before one of them may be read again, a peer
+ * should be dialed again, a client's timer goes
+ * off, or a multicast heartbeat is due (-1:
+ * forever). It may not sleep at all if a client
+ * has input left over from its last turn.
+ */
+int prepareToPoll(LkClient_List* clientList, struct pollfd* fds, Federation const* fed, ServerConfig const* config, double acceptPausedUntil, double now) {
+    double timeout = fedSecondsUntilNextDial(fed, now);
+    double untilTimer = twSecondsUntilNext(&timers, now);
+    if (untilTimer >= 0 && (timeout < 0 || untilTimer < timeout)) timeout = untilTimer;
+    double untilHeartbeat = mcSecondsUntilHeartbeat(&multicast, now);
+    if (untilHeartbeat >= 0 && (timeout < 0 || untilHeartbeat < timeout)) timeout = untilHeartbeat;
+    if (acceptPausedUntil > now) {
+        fds[LISTENING_FD_INDEX].events = fds[UNIX_FD_INDEX].events = 0;
+        if (timeout < 0 || acceptPausedUntil - now < timeout) timeout = acceptPausedUntil - now;
+    } else {
+        fds[LISTENING_FD_INDEX].events = fds[UNIX_FD_INDEX].events = POLLIN;
+    }
+    LkClient_Node* current = lkClient_Head(clientList);
+    for (int i = FIRST_CLIENT_FD_INDEX; current != NULL; ++i, lkClient_Next(&current)) {
+        Client* client = lkClient_GetNodeData(clientList, current);
+        RateLimit const* rateLimit = clientRateLimit(client, config);
+        rlRefill(&client->limiter, rateLimit, now);
+        fds[i].fd = srPollFd(client->confd); // it may have got rings since the fds were listed
+        if (client->connecting) {
+            fds[i].events = POLLOUT;
+        } else if (rlAllows(&client->limiter, rateLimit)) {
+            fds[i].events = POLLIN;
+            if (client->backlogged) timeout = 0;
+        } else {
+            fds[i].events = 0;
+            double wait = rlSecondsUntilAllowed(&client->limiter, rateLimit);
+            if (timeout < 0 || wait < timeout) timeout = wait;
+        }
+    }
+    if (timeout < 0) return -1;
+    return (int)ceil(timeout * 1000); // never wakes up before it is due
+}
+
+/**
+ * Accepts the pending connections, up to the
+ * per-iteration budget so that a reconnect storm
+ * cannot starve the connected clients. Whatever
+ * is left stays in the backlog for the next
+ * iteration. Returns the number of connections
+ * accepted, or -1 on a fatal error.
+ */
+int acceptNewClients(int sockfd, LkClient_List* clientList, SenderId* nextSenderId, ServerConfig const* config, double now, double* acceptPausedUntil) {
+    int numAccepted = 0;
+    while (numAccepted < config->acceptBudget) {
+        PeerAddress peerAddress;
+        socklen_t sizeOfAddr = sizeof(peerAddress);
+        int confd = accept4(sockfd, &peerAddress.any, &sizeOfAddr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (confd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // The pending connections stay in the backlog;
+                // try again once some resources are freed.
+                wprintf(L"accept(): out of resources (%s), pausing\n", strerror(errno));
+                *acceptPausedUntil = now + ACCEPT_PAUSE_SECONDS;
+                break;
+            }
+            wprintf(L"error: accept() failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        Client client;
+        if (!initClient(&client, confd, (*nextSenderId)++, config, now)) {
+            wprintf(L"error: out of memory\n");
+            close(confd);
+            return -1;
+        }
+        client.details->peerAddress = peerAddress;
+        if (peerAddress.any.sa_family == AF_UNIX) {
+            client.tlsChecked = false; // it may ask for rings
+        }
+        if (!lkClient_Insert(clientList, NULL, &client)) {
+            wprintf(L"error: out of memory\n");
+            close(confd);
+            freeClient(&client);
+            return -1;
+        }
+        startClientTimer(lkClient_GetNodeData(clientList, lkClient_Tail(clientList)), config, now);
+        PROBE3(accept, confd, client.senderId, peerAddress.any.sa_family);
+        cpRecord(&capture, CP_OPEN, client.senderId, NULL, 0);
+        ++numAccepted;
+    }
+    if (numAccepted > 0) {
+        wprintf(L"Accepted %d new connection(s)\n", numAccepted);
+    }
+    return numAccepted;
+}
+
+/**
+ * Opens links to the peers that are due to be
+ * dialed. Returns the number of links opened, or
+ * -1 on a fatal error.
+ */
+int dialPeers(LkClient_List* clientList, SenderId* nextSenderId, Federation* fed, ServerConfig const* config, double now) {
+    int numDialed = 0;
+    for (size_t i = 0; i < fed->numPeers; ++i) {
+        FedPeer* peer = &fed->peers[i];
+        if (peer->linked || peer->isSelf || peer->nextDialAt > now) continue;
+        int confd = fedDial(peer, now);
+        if (confd < 0) continue;
+
+        Client client;
+        if (!initClient(&client, confd, (*nextSenderId)++, config, now)) {
+            wprintf(L"error: out of memory\n");
+            close(confd);
+            return -1;
+        }
+        if (peer->addressLength <= sizeof(client.details->peerAddress)) {
+            memcpy((void*)&client.details->peerAddress, (void*)&peer->address, peer->addressLength);
+        }
+        client.isPeer = true;
+        client.connecting = true;
+        client.tlsChecked = true; // links between servers are plain
+        client.details->dialedPeer = peer;
+        if (!lkClient_Insert(clientList, NULL, &client)) {
+            wprintf(L"error: out of memory\n");
+            close(confd);
+            freeClient(&client);
+            return -1;
+        }
+        startClientTimer(lkClient_GetNodeData(clientList, lkClient_Tail(clientList)), config, now);
+        ++numDialed;
+    }
+    return numDialed;
+}
+
+void printStats(LkClient_List* clientList, Federation const* fed) {
+    unsigned long timesThrottled = serverStats.timesThrottled;
+    double secondsThrottled = serverStats.secondsThrottled;
+    size_t numThrottledNow = 0;
+
+    wprintf(L"==== Stats ====\n");
+    LkClient_Node* current = lkClient_Head(clientList);
+    for (; current != NULL; lkClient_Next(&current)) {
+        Client* client = lkClient_GetNodeData(clientList, current);
+        RateLimiter const* limiter = &client->limiter;
+        timesThrottled += limiter->timesThrottled;
+        secondsThrottled += limiter->secondsThrottled;
+        if (limiter->throttled) ++numThrottledNow;
+        if (client->isPeer) continue;
+        if (limiter->timesThrottled > 0) {
+            wprintf(L"client %u (%ls <%ls:%hu>): throttled %lu time(s), %.3fs in total%ls\n",
+                client->senderId, clientName(client), clientAddress(client), client->details->port,
+                limiter->timesThrottled, limiter->secondsThrottled,
+                limiter->throttled ? L", throttled now" : L""
+            );
+        }
+    }
+    wprintf(L"clients: %zu, throttled now: %zu, distinct names and addresses: %zu\n",
+        lkClient_Size(clientList), numThrottledNow, ipSize(internedStrings)
+    );
+    wprintf(L"throttled: %lu time(s), %.3fs in total\n", timesThrottled, secondsThrottled);
+    wprintf(L"read budget used up: %lu time(s)\n", serverStats.numReadBudgetsSpent);
+    wprintf(L"text scanning: %s\n", tsKernelName());
+    if (tlsContext != NULL) {
+        wprintf(L"TLS handshakes: %lu handed to the kernel, %lu kept in user space\n",
+            serverStats.numTlsInKernel, serverStats.numTlsInUserSpace
+        );
+    }
+    wprintf(L"sessions resumed: %lu, of which %lu missed messages; kept for them: %zu message(s), %zu bytes\n",
+        serverStats.numResumed, serverStats.numResumedWithGap, replay.size, replay.numBytes
+    );
+    if (serverStats.numRings > 0) {
+        wprintf(L"shared memory rings set up: %lu\n", serverStats.numRings);
+    }
+    if (serverStats.numTransfers > 0) {
+        wprintf(L"transfers: %lu started, %lu piece(s) relayed, spliced to a socket %lu time(s)\n",
+            serverStats.numTransfers, serverStats.numTransferPieces, serverStats.numSpliced
+        );
+    }
+    if (multicast.fd >= 0) {
+        wprintf(L"multicast: %lu message(s) published in %lu datagram(s), %lu datagram(s) dropped, %lu message(s) too big; %lu request(s) for missed messages\n",
+            multicast.numMessages, multicast.numDatagrams, multicast.numDropped, multicast.numTooBig, serverStats.numNacks
+        );
+    }
+    if (search.maxMessages > 0) {
+        SxStats stats = sxGetStats(&search);
+        wprintf(L"search: %zu message(s) kept of %lu indexed in %.6fs, %zu word(s), %zu segment(s) of %zu bytes of postings after %lu merge(s); %lu search(es) in %.6fs\n",
+            stats.numKept, stats.numIndexed, stats.secondsIndexing, stats.numWords, stats.numSegments, stats.numPostingBytes,
+            stats.numMerges, stats.numSearches, stats.secondsSearching
+        );
+    }
+    if (contentFilter.automaton != NULL) {
+        wprintf(L"content filter: %zu term(s), %zu state(s); %lu message(s) of %lu characters filtered in %.6fs, %lu term(s) found, %lu message(s) masked, %lu dropped; reloaded %lu time(s), %lu failed\n",
+            cfNumTerms(contentFilter.automaton), cfNumStates(contentFilter.automaton),
+            contentFilter.numMessages, contentFilter.numChars, contentFilter.secondsFiltering,
+            contentFilter.numMatches, contentFilter.numMasked, contentFilter.numBlocked,
+            contentFilter.numReloads, atomic_load(&contentFilter.numReloadsFailed)
+        );
+    }
+    if (capture.fd >= 0) {
+        CpStats stats = cpGetStats(&capture);
+        wprintf(L"capture: %lu record(s), %llu bytes, %lu dropped%ls\n",
+            stats.numRecords, (unsigned long long)stats.numBytes, stats.numDropped,
+            stats.failed ? L"; could not write the file, stopped" : L""
+        );
+    }
+    if (fed->nodeId != 0) {
+        wprintf(L"node %u: relayed %lu, received %lu, duplicates dropped %lu\n",
+            fed->nodeId, fed->numRelayed, fed->numReceived, fed->numDuplicates
+        );
+    }
+    fflush(stdout);
+}
+
+/**
+ * The state a server hands over to the process
+ * replacing it: the listening socket, then the
+ * socket of each client (including links to
+ * other servers), and everything the server
+ * knows about them, down to the bytes received
+ * but not parsed yet. Nothing is ever waiting
+ * to be sent: sends complete within the
+ * iteration.
+ */
+typedef struct {
+    HoBuffer state;
+    int* fds;
+    size_t numFds;
+} Takeover;
+
+#define HO_CLIENT_LOGGED_IN   (1u << 0)
+#define HO_CLIENT_ANNOUNCED   (1u << 1)
+#define HO_CLIENT_RENAMED     (1u << 2)
+#define HO_CLIENT_THROTTLED   (1u << 3)
+#define HO_CLIENT_PEER        (1u << 4)
+#define HO_CLIENT_CONNECTING  (1u << 5)
+#define HO_CLIENT_NAMED       (1u << 6)
+#define HO_CLIENT_TLS_CHECKED (1u << 7)
+#define HO_CLIENT_MULTICAST   (1u << 8)
+#define HO_CLIENT_TRANSFER_CHAT    (1u << 9)
+#define HO_CLIENT_TRANSFER_BLOCKED (1u << 10)
+#define HO_CLIENT_WANTS_ACKS       (1u << 11)
+
+void saveClient(HoBuffer* buf, Client const* client) {
+    ClientDetails const* details = client->details;
+    uint64_t flags = (client->loggedIn ? HO_CLIENT_LOGGED_IN : 0)
+        | (client->announced ? HO_CLIENT_ANNOUNCED : 0)
+        | (client->nameChanged ? HO_CLIENT_RENAMED : 0)
+        | (client->limiter.throttled ? HO_CLIENT_THROTTLED : 0)
+        | (client->isPeer ? HO_CLIENT_PEER : 0)
+        | (client->connecting ? HO_CLIENT_CONNECTING : 0)
+        | (client->name ? HO_CLIENT_NAMED : 0)
+        | (client->tlsChecked ? HO_CLIENT_TLS_CHECKED : 0)
+        | (client->multicast ? HO_CLIENT_MULTICAST : 0)
+        | (details->transferIsChat ? HO_CLIENT_TRANSFER_CHAT : 0)
+        | (details->transferBlocked ? HO_CLIENT_TRANSFER_BLOCKED : 0)
+        | (client->wantsAcks ? HO_CLIENT_WANTS_ACKS : 0);
+    hoPutU64(buf, flags);
+    hoPutU64(buf, client->senderId);
+    hoPut(buf, &details->peerAddress, sizeof(details->peerAddress));
+    hoPutString(buf, clientName(client));
+
+    RateLimiter const* limiter = &client->limiter;
+    hoPutDouble(buf, limiter->messageTokens);
+    hoPutDouble(buf, limiter->byteTokens);
+    hoPutDouble(buf, limiter->lastRefill); // CLOCK_MONOTONIC is the same in every process
+    hoPutDouble(buf, limiter->throttledSince);
+    hoPutDouble(buf, limiter->secondsThrottled);
+    hoPutU64(buf, limiter->timesThrottled);
+
+    hoPutU64(buf, details->peerNodeId);
+    // The new process may have been given other peers; match them by address.
+    hoPutU64(buf, details->dialedPeer ? strlen(details->dialedPeer->spec) : 0);
+    if (details->dialedPeer) hoPut(buf, details->dialedPeer->spec, strlen(details->dialedPeer->spec));
+    hoPutU64(buf, details->transferLeft); // the rest of it goes to the new process
+
+    size_t numBytesBuffered = client->reader.end - client->reader.begin;
+    hoPutU64(buf, numBytesBuffered);
+    hoPut(buf, client->reader.data + client->reader.begin, numBytesBuffered);
+}
+
+/** Returns false if the record is malformed or if out of memory. */
+bool restoreClient(HoBuffer* buf, Client* client, int confd, Federation* fed, ServerConfig const* config) {
+    uint64_t flags = hoGetU64(buf);
+    if (!initClient(client, confd, (SenderId)hoGetU64(buf), config, 0)) return false;
+    ClientDetails* details = client->details;
+    client->loggedIn = (flags & HO_CLIENT_LOGGED_IN) != 0;
+    client->announced = (flags & HO_CLIENT_ANNOUNCED) != 0;
+    client->nameChanged = (flags & HO_CLIENT_RENAMED) != 0;
+    client->isPeer = (flags & HO_CLIENT_PEER) != 0;
+    client->connecting = (flags & HO_CLIENT_CONNECTING) != 0;
+    client->tlsChecked = (flags & HO_CLIENT_TLS_CHECKED) != 0 || tlsContext == NULL;
+    client->multicast = (flags & HO_CLIENT_MULTICAST) != 0; // see withdrawMulticast()
+    client->wantsAcks = (flags & HO_CLIENT_WANTS_ACKS) != 0;
+    details->transferIsChat = (flags & HO_CLIENT_TRANSFER_CHAT) != 0;
+    details->transferBlocked = (flags & HO_CLIENT_TRANSFER_BLOCKED) != 0;
+    hoGet(buf, &details->peerAddress, sizeof(details->peerAddress));
+    wchar_t name[MAX_NAME_LENGTH + 1];
+    hoGetString(buf, name, MAX_NAME_LENGTH);
+    if ((flags & HO_CLIENT_NAMED) != 0 && !setClientName(client, name)) goto FAIL;
+
+    RateLimiter* limiter = &client->limiter;
+    limiter->throttled = (flags & HO_CLIENT_THROTTLED) != 0;
+    limiter->messageTokens = hoGetDouble(buf);
+    limiter->byteTokens = hoGetDouble(buf);
+    limiter->lastRefill = hoGetDouble(buf);
+    limiter->throttledSince = hoGetDouble(buf);
+    limiter->secondsThrottled = hoGetDouble(buf);
+    limiter->timesThrottled = hoGetU64(buf);
+
+    details->peerNodeId = (NodeId)hoGetU64(buf);
+    char spec[256];
+    uint64_t specLength = hoGetU64(buf);
+    if (specLength >= sizeof(spec) || !hoGet(buf, spec, specLength)) goto FAIL;
+    spec[specLength] = '\0';
+    for (size_t i = 0; i < fed->numPeers && specLength > 0; ++i) {
+        if (strcmp(fed->peers[i].spec, spec) == 0) {
+            details->dialedPeer = &fed->peers[i];
+            details->dialedPeer->linked = true;
+            break;
+        }
+    }
+    details->transferLeft = hoGetU64(buf);
+
+    uint64_t numBytesBuffered = hoGetU64(buf);
+    if (buf->failed || numBytesBuffered > buf->length - buf->readPos) goto FAIL;
+    if (!frameReader_restore(&client->reader, buf->data + buf->readPos, numBytesBuffered)) goto FAIL;
+    buf->readPos += numBytesBuffered;
+    return true;
+
+FAIL:
+    freeClient(client);
+    return false;
+}
+
+/**
+ * The secret goes along with the messages kept,
+ * so that the clients can resume their sessions
+ * with the new process.
+ */
+void saveReplay(HoBuffer* buf) {
+    hoPut(buf, replay.secret, RP_SECRET_LENGTH);
+    hoPutU64(buf, replay.lastSequence);
+    hoPutU64(buf, replay.size);
+    for (uint64_t sequence = rpOldestSequence(&replay); sequence <= replay.lastSequence; ++sequence) {
+        RpEntry const* entry = rpFind(&replay, sequence);
+        hoPutU64(buf, entry->sender->originNode);
+        hoPutU64(buf, entry->sender->sequence);
+        hoPutString(buf, entry->sender->name);
+        hoPutString(buf, entry->sender->address);
+        hoPutU64(buf, entry->sender->port);
+        size_t length = wcslen(entry->text);
+        hoPutU64(buf, length);
+        hoPut(buf, entry->text, length * sizeof(wchar_t));
+    }
+}
+
+/** Returns false if the state is malformed or if out of memory. */
+bool restoreReplay(HoBuffer* buf) {
+    hoGet(buf, replay.secret, RP_SECRET_LENGTH);
+    uint64_t lastSequence = hoGetU64(buf);
+    uint64_t numEntries = hoGetU64(buf);
+    if (buf->failed || numEntries > lastSequence) return false;
+    replay.lastSequence = lastSequence - numEntries;
+    for (uint64_t i = 0; i < numEntries; ++i) {
+        NodeId originNode = (NodeId)hoGetU64(buf);
+        uint64_t sequence = hoGetU64(buf);
+        wchar_t name[MAX_NAME_LENGTH + 1];
+        wchar_t address[MAX_ADDRESS_LENGTH + 1];
+        hoGetString(buf, name, MAX_NAME_LENGTH);
+        hoGetString(buf, address, MAX_ADDRESS_LENGTH);
+        unsigned short port = (unsigned short)hoGetU64(buf);
+        uint64_t length = hoGetU64(buf);
+        if (buf->failed || length > (buf->length - buf->readPos) / sizeof(wchar_t)) return false;
+
+        server_RelayInfo* sender = server_newRelayInfo(originNode, sequence, name, wcslen(name), address, wcslen(address), port);
+        wchar_t* text = (wchar_t*)malloc((length + 1) * sizeof(wchar_t));
+        if (sender == NULL || text == NULL) {
+            free((void*)sender);
+            free((void*)text);
+            return false;
+        }
+        hoGet(buf, text, length * sizeof(wchar_t));
+        text[length] = L'\0';
+        rpAppend(&replay, sender, text);
+    }
+    replay.lastSequence = lastSequence; // in case some were not kept here
+    return !buf->failed;
+}
+
+/**
+ * An OpenSSL session cannot be handed over, nor
+ * can shared memory rings (they are mapped in
+ * this process), so the clients with either are
+ * left behind; the new process tells the others
+ * they have left, and they may resume their
+ * sessions with it.
+ */
+bool canBeHandedOver(Client const* client) {
+    return !ktInUserSpace(client->confd) && !srAttached(client->confd);
+}
+
+/**
+ * Hands everything over to the process that has
+ * connected to the hot restart socket. Returns
+ * whether it has taken over; if not, this
+ * process goes on serving.
+ */
+bool handOff(int handoffSockFd, int sockfd, int unixSockFd, LkClient_List* clientList, Presence const* presence, SenderId nextSenderId, Federation const* fed) {
+    int channel = hoAcceptSuccessor(handoffSockFd);
+    if (channel < 0) return false;
+
+    size_t numClients = lkClient_Size(clientList);
+    int* fds = (int*)malloc((2 + numClients) * sizeof(int));
+    HoBuffer buf;
+    hoBufferInit(&buf);
+    bool ok = (fds != NULL);
+    if (ok) {
+        fds[0] = sockfd;
+        hoPutU64(&buf, nextSenderId);
+        hoPutU64(&buf, presence->version);
+        hoPutU64(&buf, serverStats.timesThrottled);
+        hoPutDouble(&buf, serverStats.secondsThrottled);
+        hoPutU64(&buf, fed->nextSequence);
+        hoPutU64(&buf, fed->numRelayed);
+        hoPutU64(&buf, fed->numReceived);
+        hoPutU64(&buf, fed->numDuplicates);
+        hoPutU64(&buf, fed->numOrigins);
+        for (size_t i = 0; i < fed->numOrigins; ++i) {
+            hoPutU64(&buf, fed->origins[i].origin);
+            hoPutU64(&buf, fed->origins[i].lastSequence);
+        }
+
+        size_t numHandedOver = 0;
+        size_t numLeftBehind = 0;
+        LkClient_Node* current = lkClient_Head(clientList);
+        for (; current != NULL; lkClient_Next(&current)) {
+            Client const* client = lkClient_GetNodeData(clientList, current);
+            if (canBeHandedOver(client)) {
+                ++numHandedOver;
+            } else if (client->announced) {
+                ++numLeftBehind;
+            }
+        }
+        hoPutU64(&buf, numHandedOver);
+        size_t i = 1;
+        for (current = lkClient_Head(clientList); current != NULL; lkClient_Next(&current)) {
+            Client const* client = lkClient_GetNodeData(clientList, current);
+            if (!canBeHandedOver(client)) continue;
+            saveClient(&buf, client);
+            fds[i++] = client->confd;
+        }
+        hoPutU64(&buf, numLeftBehind);
+        for (current = lkClient_Head(clientList); current != NULL; lkClient_Next(&current)) {
+            Client const* client = lkClient_GetNodeData(clientList, current);
+            if (!canBeHandedOver(client) && client->announced) hoPutU64(&buf, client->senderId);
+        }
+        saveReplay(&buf);
+        // The Unix socket, if any, goes after the clients'.
+        hoPutU64(&buf, unixSockFd >= 0);
+        if (unixSockFd >= 0) fds[i++] = unixSockFd;
+        ok = !buf.failed && hoSend(channel, &buf, fds, i);
+    }
+
+    close(channel);
+    hoBufferFree(&buf);
+    free((void*)fds);
+    return ok;
+}
+
+bool restoreState(Takeover* takeover, LkClient_List* clientList, Presence* presence, SenderId* nextSenderId, int* unixSockFd, Federation* fed, ServerConfig const* config) {
+    HoBuffer* buf = &takeover->state;
+    *nextSenderId = (SenderId)hoGetU64(buf);
+    presence->version = hoGetU64(buf);
+    serverStats.timesThrottled = hoGetU64(buf);
+    serverStats.secondsThrottled = hoGetDouble(buf);
+    uint64_t nextSequence = hoGetU64(buf);
+    if (nextSequence > fed->nextSequence) fed->nextSequence = nextSequence;
+    fed->numRelayed = hoGetU64(buf);
+    fed->numReceived = hoGetU64(buf);
+    fed->numDuplicates = hoGetU64(buf);
+    uint64_t numOrigins = hoGetU64(buf);
+    for (uint64_t i = 0; i < numOrigins && !buf->failed; ++i) {
+        NodeId origin = (NodeId)hoGetU64(buf);
+        fedIsNew(fed, origin, hoGetU64(buf));
+    }
+
+    // Sockets that end up not being used are closed by the caller.
+    uint64_t numClients = hoGetU64(buf);
+    if (buf->failed || numClients > takeover->numFds - 1) return false;
+    for (size_t i = 1; i <= numClients; ++i) {
+        Client client;
+        if (!restoreClient(buf, &client, takeover->fds[i], fed, config)) return false;
+        if (client.connecting && client.details->dialedPeer == NULL) {
+            // A link this process would not open; it is not
+            // even established yet, so it can just be dropped.
+            close(client.confd);
+            freeClient(&client);
+        } else if (!lkClient_Insert(clientList, NULL, &client)) {
+            freeClient(&client);
+            return false;
+        } else {
+            // Deadlines are not handed over; they start over.
+            startClientTimer(lkClient_GetNodeData(clientList, lkClient_Tail(clientList)), config, monotonicSeconds());
+        }
+        takeover->fds[i] = -1;
+    }
+
+    uint64_t numLeftBehind = hoGetU64(buf);
+    for (uint64_t i = 0; i < numLeftBehind && !buf->failed; ++i) {
+        SenderId id = (SenderId)hoGetU64(buf);
+        if (!lkSenderId_Append(&presence->departedIds, &id)) return false;
+    }
+    if (!restoreReplay(buf)) return false;
+
+    bool hasUnixSocket = (hoGetU64(buf) != 0);
+    if (buf->failed || numClients + 1 + hasUnixSocket != takeover->numFds) return false;
+    if (hasUnixSocket) {
+        *unixSockFd = takeover->fds[takeover->numFds - 1];
+        takeover->fds[takeover->numFds - 1] = -1;
+    }
+    return !buf->failed && buf->readPos == buf->length; // nothing cut short, nothing left over
+}
+
+/**
+ * Makes the chat messages handed over
+ * searchable again. Returns false if out of
+ * memory.
+ */
+bool indexReplayedMessages() {
+    if (search.maxMessages == 0) return true;
+    for (uint64_t sequence = rpOldestSequence(&replay); sequence <= replay.lastSequence; ++sequence) {
+        RpEntry const* entry = rpFind(&replay, sequence);
+        if (entry != NULL && !sxAdd(&search, sequence, entry->sender->name, entry->text)) return false;
+    }
+    return true;
+}
+
+/**
+ * Tells the clients handed over that got the
+ * chat messages by multicast, if this process
+ * does not publish them, to get them over their
+ * connections again. They answer with a G,
+ * which says what they missed.
+ */
+void withdrawMulticast(LkClient_List* clientList) {
+    if (multicast.fd >= 0) return;
+    LkClient_Node* current = lkClient_Head(clientList);
+    for (; current != NULL; lkClient_Next(&current)) {
+        Client* client = lkClient_GetNodeData(clientList, current);
+        if (!client->multicast) continue;
+        client->multicast = false;
+        if (server_tellMulticast(client->confd, L"", 0) != SEND_SUCCESS) client->broken = true;
+    }
+    fanout.audienceChanged = true;
+}
+
+/**
+ * Listens for clients on this host. A file left
+ * at that path by a previous server is replaced;
+ * the socket is never removed, since a process
+ * taking over from this one goes on using it.
+ * Returns -1 on failure.
+ */
+int listenOnUnixSocket(char const* path, int backlog) {
+    struct sockaddr_un addr;
+    memset((void*)&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, backlog) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * `takeover` is the state handed over by the
+ * previous server process, or NULL.
+ */
+int eventLoop(int sockfd, int handoffSockFd, Takeover* takeover, Federation* fed, ServerConfig const* config) {
     LkClient_List* clientList = lkClient_Init();
-    LkMessage_List* messages = lkMessage_Init();
+    LkMessage_Vector messageQueue;
+    LkMessage_Vector* messages = &messageQueue;
+    lkMessage_Init(messages);
+    SenderId nextSenderId = 1;
+    Presence presence = { .version = 0, .hasPendingJoinsOrRenames = false };
+    lkSenderId_Init(&presence.departedIds);
+    double acceptPausedUntil = 0;
 
     struct pollfd* fds = NULL;
     size_t nfds = 0;
+    int unixSockFd = -1;
     int retval = 0;
+    twInit(&timers, TIMER_TICK_SECONDS, monotonicSeconds());
+
+    if (takeover != NULL) {
+        bool ok = restoreState(takeover, clientList, &presence, &nextSenderId, &unixSockFd, fed, config);
+        hoBufferFree(&takeover->state);
+        if (!ok) {
+            wprintf(L"error: the state handed over is invalid\n");
+            retval = 1; goto FINALIZE;
+        }
+        withdrawMulticast(clientList);
+        if (!indexReplayedMessages()) {
+            wprintf(L"error: out of memory\n");
+            retval = 1; goto FINALIZE;
+        }
+    }
+    if (unixSockFd >= 0 && config->unixSocketPath == NULL) {
+        close(unixSockFd); // not wanted any more
+        unixSockFd = -1;
+    } else if (unixSockFd >= 0) {
+        listen(unixSockFd, config->backlog); // in case it has changed
+    } else if (config->unixSocketPath != NULL) {
+        unixSockFd = listenOnUnixSocket(config->unixSocketPath, config->backlog);
+        if (unixSockFd < 0) {
+            wprintf(L"error: can not listen on %s\n", config->unixSocketPath);
+            retval = 1; goto FINALIZE;
+        }
+        wprintf(L"Server listening at %s\n", config->unixSocketPath);
+    }
 
     for (;;) {
         free((void*)fds);
-        fds = allocateAndListPollFds(clientList, sockfd, &nfds);
-        wprintf(L"Current number of clients: %d\n", nfds - 1);
+        fds = allocateAndListPollFds(clientList, sockfd, handoffSockFd, unixSockFd, &nfds);
+        wprintf(L"Current number of clients: %d\n", nfds - FIRST_CLIENT_FD_INDEX);
 
         bool needToUpdateFds = false;
         do {
-            int numEvents = poll(fds, nfds, -1);
-            if (numEvents == 0) continue;
-            if (numEvents < 0) {
+            int timeout = prepareToPoll(clientList, fds, fed, config, acceptPausedUntil, monotonicSeconds());
+            int numEvents = poll(fds, nfds, timeout);
+            if (numEvents < 0 && errno != EINTR) {
                 wprintf(L"poll(): unexpected error\n");
                 retval = 1; goto FINALIZE;
             }
+            if (stopRequested) {
+                wprintf(L"Stopping\n");
+                goto FINALIZE;
+            }
+            if (statsRequested) {
+                statsRequested = 0;
+                printStats(clientList, fed);
+            }
+            if (filterReloadRequested) {
+                filterReloadRequested = 0;
+                if (contentFilter.automaton == NULL) {
+                    wprintf(L"warning: no content filter to reload\n");
+                } else if (!cfReload(&contentFilter)) {
+                    wprintf(L"warning: the content filter is being reloaded already\n");
+                }
+            }
+            if (numEvents < 0) continue;
+            double now = monotonicSeconds();
+
+            // Everything of the previous iteration has been
+            // sent, so the state is easy to hand over here.
+            if ((fds[HANDOFF_FD_INDEX].revents & POLLIN) == POLLIN) {
+                fds[HANDOFF_FD_INDEX].revents = 0;
+                if (handOff(handoffSockFd, sockfd, unixSockFd, clientList, &presence, nextSenderId, fed)) {
+                    wprintf(L"Handed over to the new server process, exiting\n");
+                    goto FINALIZE;
+                }
+                wprintf(L"warning: hot restart failed, still serving\n");
+            }
 
             {
                 /////// READING MESSAGES FROM ALL CLIENTS /////////
                 LkClient_Node* current = lkClient_Head(clientList);
-                for (int i = 1; i < nfds; ++i) {
+                for (int i = FIRST_CLIENT_FD_INDEX; i < nfds; ++i) {
                     if (current == NULL) {
                         wprintf(L"error: client list and fds mismatch\n");
                         retval = 1; goto FINALIZE;
@@ -113,31 +1997,40 @@ int eventLoop(int sockfd) {
                     int revents = fds[i].revents;
                     fds[i].revents = 0;
 
-                    if ((revents & POLLIN) == POLLIN) {
-                        Message msg;
-                        msg.sender = thisClient;
-                        MessageReadStatus readStatus = server_readMessageFromClient(fds[i].fd, &msg.message);
-                        if (readStatus != READ_SUCCESS) {
-                            wprintf(L"read error: %d\n", readStatus);
+                    if (thisClient->connecting) {
+                        if (revents != 0 && !finishDialing(thisClient, fed)) {
                             disconnectThisClient = true;
-                        } else {
-                            if (!lkMessage_Insert(messages, NULL, &msg)) {
-                                wprintf(L"error: out of memory\n");
-                                retval = 1; goto FINALIZE;
-                            }
                         }
+                        revents = 0;
+                    }
+
+                    bool hadBufferedInput = (thisClient->reader.end > thisClient->reader.begin);
+                    rlRefill(&thisClient->limiter, clientRateLimit(thisClient, config), now);
+                    MessageReadStatus readStatus = readMessagesFromClient(thisClient, (revents & POLLIN) == POLLIN, &presence, messages, fed, config, now);
+                    if (readStatus == READ_ERR_NOT_ENOUGH_MEMORY) {
+                        wprintf(L"error: out of memory\n");
+                        retval = 1; goto FINALIZE;
+                    }
+                    if (readStatus != READ_INCOMPLETE) {
+                        wprintf(L"read error: %d\n", readStatus);
+                        disconnectThisClient = true;
+                    }
+                    if (!disconnectThisClient && ((revents & POLLIN) == POLLIN || hadBufferedInput)) {
+                        watchPartialFrame(thisClient, config, now);
                     }
+                    frameReader_trim(&thisClient->reader);
                     if (((revents & POLLERR) == POLLERR) || ((revents & POLLHUP) == POLLHUP)) {
                         wprintf(L"POLLERR or POLLHUP occurred\n");
                         disconnectThisClient = true;
                     }
 
                     if (disconnectThisClient) {
-                        wprintf(L"info: a client disconnected\n");
                         LkClient_Node* clientToRemove = current;
                         lkClient_Next(&current);
-                        close(lkClient_GetNodeData(clientList, clientToRemove)->confd);
-                        lkClient_Remove(clientList, clientToRemove);
+                        if (!disconnectClient(clientList, clientToRemove, &presence, messages)) {
+                            wprintf(L"error: out of memory\n");
+                            retval = 1; goto FINALIZE;
+                        }
                         needToUpdateFds = true;
                     } else {
                         lkClient_Next(&current);
@@ -145,93 +2038,477 @@ int eventLoop(int sockfd) {
                 }
             }
 
+            expireTimers(config, now);
+
+            if (!flushJoinsAndRenames(clientList, &presence)) {
+                wprintf(L"error: out of memory\n");
+                retval = 1; goto FINALIZE;
+            }
+
             {
                 //////////// DELIVERING MESSAGES TO ALL CLIENTS ////////////
-                LkMessage_Node* current = lkMessage_Head(messages);
-                if (current != NULL) {
-                    do {
-                        Message* msg = lkMessage_GetNodeData(messages, current);
-                        SenderIdentity senderIdentity;
-                        wcscpy(senderIdentity.address, msg->sender->address);
-                        wcscpy(senderIdentity.name, msg->message.name);
-                        senderIdentity.port = msg->sender->port;
-
-                        if (!forwardMessageToAllClients(clientList, msg, &senderIdentity)) {
-                            wprintf(L"error: could not forward a message to all clients\n");
+                LkMessage_Iter it = lkMessage_Begin(messages);
+                for (Message* msg; (msg = lkMessage_Next(&it)) != NULL; ) {
+                    if (isTransferFrame(msg->message.type)) {
+                        // Neither numbered nor kept: relayed as it comes.
+                        if (!relayTransfer(clientList, msg)) {
+                            wprintf(L"error: out of memory\n");
+                            retval = 1; goto FINALIZE;
+                        }
+                        server_freeMessageFromClient(&msg->message);
+                        continue;
+                    }
+                    if (msg->message.type == FROM_CLIENT_DIRECT) {
+                        if (!sendDirectMessage(msg->message.recipient, msg->senderId, msg->message.text)) {
+                            wprintf(L"error: out of memory\n");
                             retval = 1; goto FINALIZE;
                         }
-
                         server_freeMessageFromClient(&msg->message);
-                    } while (lkMessage_Next(&current));
-                    lkMessage_Clear(messages);
+                        continue;
+                    }
+                    if (msg->turnedDown) {
+                        if (!ackTurnedDown(clientList, msg->senderId)) {
+                            wprintf(L"error: out of memory\n");
+                            retval = 1; goto FINALIZE;
+                        }
+                        server_freeMessageFromClient(&msg->message);
+                        continue;
+                    }
+
+                    server_RelayInfo const* relay = msg->message.relay;
+                    EncodedFrame frame;
+                    if (fed->nodeId != 0 && relay->originNode == fed->nodeId) {
+                        // Sent by a client of this node: pass it on to the other nodes.
+                        if (!server_encodeRelayedChat(&frame, relay, msg->message.text)) {
+                            wprintf(L"error: out of memory\n");
+                            retval = 1; goto FINALIZE;
+                        }
+                        relayToPeers(clientList, &frame, fed);
+                        freeEncodedFrame(&frame);
+                    }
+
+                    uint64_t sequence = replay.lastSequence + 1; // the number rpAppend() gives it
+                    if (multicast.fd >= 0) {
+                        // Always as an E: the receivers may not know the sender's ID yet.
+                        if (!server_encodeRemoteChatMessage(&frame, sequence, relay, msg->message.text)) {
+                            wprintf(L"error: out of memory\n");
+                            retval = 1; goto FINALIZE;
+                        }
+                        mcPublish(&multicast, sequence, frame.data, frame.length * sizeof(frame.data[0]), now);
+                        freeEncodedFrame(&frame);
+                    }
+                    bool isLocal = (msg->message.type == FROM_CLIENT_CHAT);
+                    EncodedFrame ack;
+                    bool encoded = isLocal
+                        ? server_encodeChatMessage(&frame, sequence, msg->senderId, msg->message.text)
+                            && server_encodeAck(&ack, sequence, msg->masked ? msg->message.text : NULL)
+                        : server_encodeRemoteChatMessage(&frame, sequence, relay, msg->message.text);
+                    if (!encoded) {
+                        wprintf(L"error: out of memory\n");
+                        retval = 1; goto FINALIZE;
+                    }
+                    ChatBroadcast chat = { &frame, isLocal ? &ack : NULL, isLocal ? msg->senderId : 0 };
+                    forwardChatToAllClients(clientList, &chat);
+                    freeEncodedFrame(&frame);
+                    if (isLocal) freeEncodedFrame(&ack);
+                    // Indexed by another thread, once sent.
+                    if (search.maxMessages > 0 && !sxAdd(&search, sequence, relay->name, msg->message.text)) {
+                        wprintf(L"error: out of memory\n");
+                        retval = 1; goto FINALIZE;
+                    }
+
+                    rpAppend(&replay, msg->message.relay, msg->message.text);
+                    msg->message.relay = NULL;
+                    msg->message.text = NULL;
+                    server_freeMessageFromClient(&msg->message);
                 }
+                lkMessage_Clear(messages);
+                mcHeartbeat(&multicast, replay.lastSequence, now);
             }
 
-            // Check for incoming connections
-            if ((fds[0].revents & POLLIN) == POLLIN) {
-                wprintf(L"New client arrived, accepting connection...\n");
-                Client client;
-                struct sockaddr_storage addr;
-                socklen_t sizeOfAddr = sizeof(addr);
-                client.confd = accept(sockfd, (struct sockaddr*)&addr, &sizeOfAddr);
-                if (client.confd >= 0) {
-                    char addressString[MAX_ADDRESS_LENGTH + 1];
-                    if (addr.ss_family == AF_INET) {
-                        // IPv4
-                        struct sockaddr_in* A = (struct sockaddr_in*)&addr;
-                        client.port = ntohs(A->sin_port);
-                        inet_ntop(AF_INET, (void*)(&A->sin_addr), addressString, MAX_ADDRESS_LENGTH);
-                    } else {
-                        // IPv6
-                        struct sockaddr_in6* A = (struct sockaddr_in6*)&addr;
-                        client.port = ntohs(A->sin6_port);
-                        inet_ntop(AF_INET6, (void*)(&A->sin6_addr), addressString, MAX_ADDRESS_LENGTH);
+            {
+                //////////// SENDING LEAVES, DROPPING CLIENTS THAT COULD NOT BE SENT TO ////////////
+                // Dropping a client is a leave to send, which may in turn fail to be sent.
+                for (;;) {
+                    bool outOfMemory = !flushLeaves(clientList, &presence);
+                    if (!outOfMemory && !disconnectBrokenClients(clientList, &presence, messages, &outOfMemory)) break;
+                    if (outOfMemory) {
+                        wprintf(L"error: out of memory\n");
+                        retval = 1; goto FINALIZE;
                     }
-                    mbstowcs(client.address, addressString, MAX_ADDRESS_LENGTH);
-
-                    lkClient_Insert(clientList, NULL, &client);
                     needToUpdateFds = true;
-                } else if (errno != EWOULDBLOCK) {
-                    wprintf(L"error: accept() failed");
-                    retval = 1; goto FINALIZE;
                 }
             }
-            fds[0].revents = 0;
+
+            // Check for incoming connections
+            int const listeningFdIndices[] = { LISTENING_FD_INDEX, UNIX_FD_INDEX };
+            for (size_t j = 0; j < sizeof(listeningFdIndices) / sizeof(listeningFdIndices[0]); ++j) {
+                struct pollfd* listening = &fds[listeningFdIndices[j]];
+                if ((listening->revents & POLLIN) == POLLIN) {
+                    int numAccepted = acceptNewClients(listening->fd, clientList, &nextSenderId, config, now, &acceptPausedUntil);
+                    if (numAccepted < 0) {
+                        retval = 1; goto FINALIZE;
+                    }
+                    if (numAccepted > 0) {
+                        needToUpdateFds = true;
+                    }
+                }
+                listening->revents = 0;
+            }
+
+            int numDialed = dialPeers(clientList, &nextSenderId, fed, config, now);
+            if (numDialed < 0) {
+                retval = 1; goto FINALIZE;
+            }
+            if (numDialed > 0) {
+                needToUpdateFds = true;
+            }
         } while (!needToUpdateFds);
     }
 
 FINALIZE:
     free((void*)fds);
+    if (unixSockFd >= 0) close(unixSockFd);
     lkClient_Destroy(clientList);
+    lkMessage_Destroy(messages);
+    lkSenderId_Destroy(&presence.departedIds);
     return retval;
 }
 
-int main() {
+void handleSigusr1(int sig) {
+    statsRequested = 1;
+}
+
+void handleSighup(int sig) {
+    filterReloadRequested = 1;
+}
+
+void handleStop(int sig) {
+    stopRequested = 1;
+}
+
+void printUsage(char const* programName) {
+    wprintf(L"Usage: %s [OPTION]...\n", programName);
+    wprintf(L"\n");
+    wprintf(L"  --port=PORT                     port to listen on (default: 12345)\n");
+    wprintf(L"  --unix-socket=PATH              also listen on a Unix socket, for clients on this\n");
+    wprintf(L"                                  host; they may ask for shared memory rings\n");
+    wprintf(L"\n");
+    wprintf(L"Per-connection rate limits (0 means no limit; bytes as sent over the wire):\n");
+    wprintf(L"  --max-messages-per-second=RATE  (default: 10)\n");
+    wprintf(L"  --message-burst=COUNT           (default: 20)\n");
+    wprintf(L"  --max-bytes-per-second=RATE     (default: 262144)\n");
+    wprintf(L"  --byte-burst=COUNT              (default: 1048576)\n");
+    wprintf(L"  --read-budget=COUNT             bytes read from a connection before the next one's\n");
+    wprintf(L"                                  turn, in each round (default: 65536)\n");
+    wprintf(L"\n");
+    wprintf(L"Accepting connections:\n");
+    wprintf(L"  --backlog=COUNT                 (default: %d)\n", SOMAXCONN);
+    wprintf(L"  --accept-budget=COUNT           max. connections accepted at a time (default: 256)\n");
+    wprintf(L"\n");
+    wprintf(L"Clustering (every server must be given all the others):\n");
+    wprintf(L"  --node-id=ID                    this server's number in the cluster, from 1\n");
+    wprintf(L"  --peer=HOST:PORT                another server of the cluster; may be repeated\n");
+    wprintf(L"\n");
+    wprintf(L"Timeouts, in seconds (0 means none):\n");
+    wprintf(L"  --ping-interval=SECONDS         ping clients silent for that long (default: 30)\n");
+    wprintf(L"  --pong-timeout=SECONDS          then drop them if they do not answer (default: 10)\n");
+    wprintf(L"  --idle-timeout=SECONDS          drop users who have not chatted for that long\n");
+    wprintf(L"                                  (default: 0)\n");
+    wprintf(L"  --frame-timeout=SECONDS         to log in, then to finish sending each message\n");
+    wprintf(L"                                  (default: 10)\n");
+    wprintf(L"\n");
+    wprintf(L"Broadcasting:\n");
+    wprintf(L"  --fanout-threads=COUNT          threads sending broadcasts to %d or more\n", FANOUT_MIN_AUDIENCE);
+    wprintf(L"                                  clients, besides the main one (default: 0)\n");
+    wprintf(L"\n");
+    wprintf(L"Encryption (TLS, offered on the same port as plain text):\n");
+    wprintf(L"  --tls-cert=FILE                 PEM certificate chain of the server\n");
+    wprintf(L"  --tls-key=FILE                  PEM private key of the server\n");
+    wprintf(L"\n");
+    wprintf(L"Session resume (clients that lose their connection get what they missed):\n");
+    wprintf(L"  --replay-messages=COUNT         chat messages kept for them (default: 1024)\n");
+    wprintf(L"  --replay-bytes=COUNT            memory they may take up (default: 4194304)\n");
+    wprintf(L"\n");
+    wprintf(L"Multicast (chat messages published once, for the clients on the LAN that ask):\n");
+    wprintf(L"  --multicast=GROUP:PORT          IPv4 multicast group to publish to\n");
+    wprintf(L"  --multicast-interface=ADDRESS   address of the interface to publish on\n");
+    wprintf(L"                                  (default: as routed)\n");
+    wprintf(L"\n");
+    wprintf(L"Search (users may look for words in the chat messages sent lately):\n");
+    wprintf(L"  --search-messages=COUNT         chat messages that can be searched (default: 0)\n");
+    wprintf(L"\n");
+    wprintf(L"Content filter:\n");
+    wprintf(L"  --filter=FILE                   banned terms, one per line, masked in chat and\n");
+    wprintf(L"                                  direct messages; a line starting with '!' drops\n");
+    wprintf(L"                                  the messages instead; reloaded on SIGHUP\n");
+    wprintf(L"\n");
+    wprintf(L"Benchmarking:\n");
+    wprintf(L"  --capture=FILE                  record every frame clients send, with when and on\n");
+    wprintf(L"                                  which connection, for capreplay to send again;\n");
+    wprintf(L"                                  FILE must not exist yet\n");
+    wprintf(L"\n");
+    wprintf(L"Hot restart:\n");
+    wprintf(L"  --handoff-socket=PATH           Unix socket through which a new server process\n");
+    wprintf(L"                                  takes over from the running one; started with\n");
+    wprintf(L"                                  the same PATH, it takes over instead of listening\n");
+    wprintf(L"\n");
+    wprintf(L"Send SIGUSR1 to print statistics, SIGHUP to reload the content filter,\n");
+    wprintf(L"SIGINT or SIGTERM to stop.\n");
+}
+
+bool parseCommandLine(int argc, char* argv[], ServerConfig* config) {
+    config->port = 12345;
+    config->rateLimit.messagesPerSecond = 10;
+    config->rateLimit.messageBurst = 20;
+    config->rateLimit.bytesPerSecond = 256 * 1024;
+    config->rateLimit.byteBurst = 1024 * 1024;
+    config->backlog = SOMAXCONN;
+    config->acceptBudget = 256;
+    config->readBudget = 64 * 1024;
+    config->nodeId = 0;
+    config->numPeers = 0;
+    config->handoffPath = NULL;
+    config->unixSocketPath = NULL;
+    config->pingInterval = 30;
+    config->pongTimeout = 10;
+    config->idleTimeout = 0;
+    config->frameTimeout = 10;
+    config->fanoutThreads = 0;
+    config->tlsCertFile = NULL;
+    config->tlsKeyFile = NULL;
+    config->replayMessages = 1024;
+    config->replayBytes = 4 * 1024 * 1024;
+    config->multicastGroup = NULL;
+    config->multicastInterface = NULL;
+    config->filterPath = NULL;
+    config->searchMessages = 0;
+    config->capturePath = NULL;
+    config->peerSpecs = (char const**)malloc(argc * sizeof(char const*));
+    if (config->peerSpecs == NULL) return false;
+
+    static struct option const longOptions[] = {
+        { "port",                    required_argument, NULL, 'p' },
+        { "max-messages-per-second", required_argument, NULL, 'r' },
+        { "message-burst",           required_argument, NULL, 'R' },
+        { "max-bytes-per-second",    required_argument, NULL, 'b' },
+        { "byte-burst",              required_argument, NULL, 'B' },
+        { "backlog",                 required_argument, NULL, 'l' },
+        { "accept-budget",           required_argument, NULL, 'a' },
+        { "read-budget",             required_argument, NULL, 'e' },
+        { "node-id",                 required_argument, NULL, 'n' },
+        { "peer",                    required_argument, NULL, 'P' },
+        { "handoff-socket",          required_argument, NULL, 'H' },
+        { "unix-socket",             required_argument, NULL, 'u' },
+        { "ping-interval",           required_argument, NULL, 'i' },
+        { "pong-timeout",            required_argument, NULL, 'o' },
+        { "idle-timeout",            required_argument, NULL, 'I' },
+        { "frame-timeout",           required_argument, NULL, 'f' },
+        { "fanout-threads",          required_argument, NULL, 't' },
+        { "tls-cert",                required_argument, NULL, 'c' },
+        { "tls-key",                 required_argument, NULL, 'k' },
+        { "replay-messages",         required_argument, NULL, 'm' },
+        { "replay-bytes",            required_argument, NULL, 'M' },
+        { "multicast",               required_argument, NULL, 'g' },
+        { "multicast-interface",     required_argument, NULL, 'G' },
+        { "filter",                  required_argument, NULL, 'F' },
+        { "search-messages",         required_argument, NULL, 's' },
+        { "capture",                 required_argument, NULL, 'C' },
+        { "help",                    no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'p': config->port = (unsigned short)atoi(optarg); break;
+            case 'r': config->rateLimit.messagesPerSecond = atof(optarg); break;
+            case 'R': config->rateLimit.messageBurst = atof(optarg); break;
+            case 'b': config->rateLimit.bytesPerSecond = atof(optarg); break;
+            case 'B': config->rateLimit.byteBurst = atof(optarg); break;
+            case 'l': config->backlog = atoi(optarg); break;
+            case 'a': config->acceptBudget = atoi(optarg); break;
+            case 'e': config->readBudget = atoi(optarg); break;
+            case 'n': config->nodeId = (NodeId)strtoul(optarg, NULL, 10); break;
+            case 'P': config->peerSpecs[config->numPeers++] = optarg; break;
+            case 'H': config->handoffPath = optarg; break;
+            case 'u': config->unixSocketPath = optarg; break;
+            case 'i': config->pingInterval = atof(optarg); break;
+            case 'o': config->pongTimeout = atof(optarg); break;
+            case 'I': config->idleTimeout = atof(optarg); break;
+            case 'f': config->frameTimeout = atof(optarg); break;
+            case 't': config->fanoutThreads = atoi(optarg); break;
+            case 'c': config->tlsCertFile = optarg; break;
+            case 'k': config->tlsKeyFile = optarg; break;
+            case 'm': config->replayMessages = (size_t)strtoull(optarg, NULL, 10); break;
+            case 'M': config->replayBytes = (size_t)strtoull(optarg, NULL, 10); break;
+            case 'g': config->multicastGroup = optarg; break;
+            case 'G': config->multicastInterface = optarg; break;
+            case 'F': config->filterPath = optarg; break;
+            case 's': config->searchMessages = (size_t)strtoull(optarg, NULL, 10); break;
+            case 'C': config->capturePath = optarg; break;
+            default:
+                printUsage(argv[0]);
+                return false;
+        }
+    }
+    if (config->numPeers > 0 && config->nodeId == 0) {
+        wprintf(L"error: --peer requires --node-id\n");
+        return false;
+    }
+    if (config->multicastInterface != NULL && config->multicastGroup == NULL) {
+        wprintf(L"error: --multicast-interface requires --multicast\n");
+        return false;
+    }
+    if ((config->tlsCertFile == NULL) != (config->tlsKeyFile == NULL)) {
+        wprintf(L"error: --tls-cert and --tls-key go together\n");
+        return false;
+    }
+    if (config->port == 0 || config->backlog < 1 || config->acceptBudget < 1 || config->readBudget < 0 || config->fanoutThreads < 0
+        || config->pingInterval < 0 || config->pongTimeout < 0 || config->idleTimeout < 0 || config->frameTimeout < 0
+    ) {
+        printUsage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
     setlocale(LC_ALL, "");
+
+    ServerConfig config;
+    if (!parseCommandLine(argc, argv, &config)) {
+        return 1;
+    }
+    internedStrings = ipInit();
+    clientsByName = niInit();
+    if (internedStrings == NULL || clientsByName == NULL) {
+        wprintf(L"error: out of memory\n");
+        return 1;
+    }
+    if (!rpInit(&replay, config.replayMessages, config.replayBytes)) {
+        wprintf(L"error: could not set up session resume\n");
+        return 1;
+    }
+    if (config.tlsCertFile != NULL) {
+        tlsContext = ktServerContext(config.tlsCertFile, config.tlsKeyFile);
+        if (tlsContext == NULL) {
+            wprintf(L"error: could not load the TLS certificate and key\n");
+            return 1;
+        }
+    }
+    if (config.searchMessages > 0 && !sxInit(&search, config.searchMessages)) {
+        wprintf(L"error: could not set up search\n");
+        return 1;
+    }
+    if (config.capturePath != NULL && !cpInit(&capture, config.capturePath)) {
+        wprintf(L"error: can not capture to %s: %s\n", config.capturePath, strerror(errno));
+        return 1;
+    }
+    if (config.filterPath != NULL) {
+        if (!cfInit(&contentFilter, config.filterPath)) {
+            wprintf(L"error: can not load the content filter from %s\n", config.filterPath);
+            return 1;
+        }
+        wprintf(L"Content filter: %zu term(s)\n", cfNumTerms(contentFilter.automaton));
+    }
+    if (config.multicastGroup != NULL && !mcOpenPublisher(&multicast, config.multicastGroup, config.multicastInterface)) {
+        wprintf(L"error: can not publish to multicast group %s\n", config.multicastGroup);
+        return 1;
+    }
+    Federation fed;
+    if (!fedInit(&fed, config.nodeId, config.peerSpecs, config.numPeers)) {
+        return 1;
+    }
+
+    if (config.fanoutThreads > 0) {
+        fanout.pool = foInit((size_t)config.fanoutThreads);
+        if (fanout.pool == NULL) {
+            wprintf(L"warning: could not start the fanout threads; broadcasting from one thread\n");
+        }
+    }
+    if (!zcInit(&zeroCopy)) {
+        wprintf(L"warning: can not splice transfers to the sockets; copying them instead\n");
+    }
+
+    struct sigaction sa;
+    memset((void*)&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = handleSighup;
+    sigaction(SIGHUP, &sa, NULL);
+    // So that what is being captured gets written out.
+    sa.sa_handler = handleStop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
     
-    char const* SERVER_IP = "0.0.0.0";
-    unsigned short SERVER_PORT = 12345;
+    // With a server already running, take over from it.
+    Takeover takeover;
+    int handoffChannel = config.handoffPath ? hoConnect(config.handoffPath) : -1;
+    if (handoffChannel >= 0) {
+        bool ok = hoReceive(handoffChannel, &takeover.state, &takeover.fds, &takeover.numFds);
+        close(handoffChannel);
+        if (!ok || takeover.numFds == 0) {
+            wprintf(L"error: could not take over from the running server\n");
+            return 1;
+        }
+    }
 
-    struct sockaddr_in addr;
-    memset((void*)&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    int sockfd;
+    if (handoffChannel >= 0) {
+        sockfd = takeover.fds[0];
+        listen(sockfd, config.backlog); // in case it has changed
+        wprintf(L"Took over %zu connection(s) from the previous server process\n", takeover.numFds - 1);
+    } else {
+        char const* SERVER_IP = "0.0.0.0";
+        unsigned short SERVER_PORT = config.port;
+
+        struct sockaddr_in addr;
+        memset((void*)&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(SERVER_PORT);
+        inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        int opt = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-    int opt = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    // fcntl(sockfd, F_SETFL, O_NONBLOCK);
-    // ioctl(sockfd, FIONBIO, &opt);
+        bind(sockfd, (struct sockaddr*)&addr, sizeof(addr));
+        listen(sockfd, config.backlog);
 
-    bind(sockfd, (struct sockaddr*)&addr, sizeof(addr));
-    listen(sockfd, 5);
+        wprintf(L"Server listening at %s:%hu\n", SERVER_IP, SERVER_PORT);
+    }
 
-    wprintf(L"Server listening at %s:%hu\n", SERVER_IP, SERVER_PORT);
+    int handoffSockFd = -1;
+    if (config.handoffPath) {
+        handoffSockFd = hoListen(config.handoffPath);
+        if (handoffSockFd < 0) {
+            wprintf(L"warning: can not listen on %s; hot restart disabled\n", config.handoffPath);
+        }
+    }
 
-    int retval = eventLoop(sockfd);
+    int retval = eventLoop(sockfd, handoffSockFd, (handoffChannel >= 0) ? &takeover : NULL, &fed, &config);
 
+    if (handoffChannel >= 0) {
+        for (size_t i = 1; i < takeover.numFds; ++i) {
+            if (takeover.fds[i] >= 0) close(takeover.fds[i]);
+        }
+        free((void*)takeover.fds);
+        hoBufferFree(&takeover.state);
+    }
+    if (handoffSockFd >= 0) close(handoffSockFd);
     close(sockfd);
+    if (fanout.pool != NULL) foDestroy(fanout.pool);
+    free((void*)fanout.audience);
+    zcDestroy(&zeroCopy);
+    ktFreeContext(tlsContext);
+    rpDestroy(&replay);
+    mcClosePublisher(&multicast);
+    if (contentFilter.automaton != NULL) cfDestroy(&contentFilter);
+    sxDestroy(&search);
+    cpDestroy(&capture);
+    fedDestroy(&fed);
+    free((void*)config.peerSpecs);
     return 0;
 }
@@ -0,0 +1,361 @@
+/**
+ * The shared memory holds the control block of
+ * each ring, then the bytes of each. A control
+ * block holds the number of bytes written to
+ * the ring so far (head, moved only by the
+ * writer) and read from it (tail, moved only by
+ * the reader), on cache lines of their own.
+ * Each side keeps its own copy of the index it
+ * moves, and checks the other one: the peer
+ * could write anything there.
+ *
+ * Four eventfds go with the rings: for each
+ * ring, one rung when it gets data, and one
+ * rung when it gets room. The one that tells a
+ * side that data has come is polled through an
+ * epoll fd, together with the socket, so that
+ * a hangup wakes it up too.
+ */
+
+#define _GNU_SOURCE // memfd_create()
+
+#include "shmring.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#define SR_RING_BYTES (256 * 1024) // per direction; a power of 2
+#define SR_NUM_FDS 5 // the memfd, then the eventfds
+
+typedef struct {
+    _Atomic uint64_t head;
+    char padding1[56];
+    _Atomic uint64_t tail;
+    _Atomic uint32_t writerWaiting; // for room
+    _Atomic uint32_t closed;        // by the writer, after its last byte
+    char padding2[48];
+} SrControl;
+
+// The memfd: both control blocks, the bytes to the server, the bytes to the client.
+#define SR_MAP_BYTES (2 * sizeof(SrControl) + 2 * SR_RING_BYTES)
+
+typedef struct {
+    void* map;
+    int fds[SR_NUM_FDS];
+    int epollFd;
+    SrControl* in;
+    SrControl* out;
+    char* inBytes;
+    char* outBytes;
+    uint64_t inTail;
+    uint64_t outHead;
+    int inDataEvent;  // rung by the peer; part of epollFd
+    int inRoomEvent;  // rung by this side when the peer waits for room
+    int outDataEvent; // rung by this side when `out` was empty
+    int outRoomEvent; // rung by the peer; waited on when `out` is full
+} SrSession;
+
+static SrSession** sessions = NULL;
+static size_t numSessionSlots = 0;
+
+static SrSession* srSession(int fd) {
+    return (fd >= 0 && (size_t)fd < numSessionSlots) ? sessions[fd] : NULL;
+}
+
+static void srRing(int eventFd) {
+    uint64_t one = 1;
+    ssize_t unused = write(eventFd, &one, sizeof(one));
+    (void)unused;
+}
+
+static void srQuiet(int eventFd) {
+    uint64_t count;
+    ssize_t unused = read(eventFd, &count, sizeof(count));
+    (void)unused;
+}
+
+static void srFree(SrSession* session) {
+    if (session->map != MAP_FAILED) munmap(session->map, SR_MAP_BYTES);
+    for (size_t i = 0; i < SR_NUM_FDS; ++i) {
+        if (session->fds[i] >= 0) close(session->fds[i]);
+    }
+    if (session->epollFd >= 0) close(session->epollFd);
+    free((void*)session);
+}
+
+/**
+ * Maps the memory and sets the rings up, on the
+ * server's side or on the client's. Takes the
+ * fds over, even if it fails.
+ */
+static bool srAttach(int fd, int const* fds, bool isServer) {
+    SrSession* session = (SrSession*)malloc(sizeof(SrSession));
+    if (session == NULL) {
+        for (size_t i = 0; i < SR_NUM_FDS; ++i) close(fds[i]);
+        return false;
+    }
+    memcpy((void*)session->fds, (void const*)fds, sizeof(session->fds));
+    session->map = mmap(NULL, SR_MAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    session->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if ((size_t)fd >= numSessionSlots) {
+        size_t newNumSlots = (numSessionSlots > 0) ? numSessionSlots : 64;
+        while (newNumSlots <= (size_t)fd) newNumSlots *= 2;
+        SrSession** newSessions = (SrSession**)realloc((void*)sessions, newNumSlots * sizeof(SrSession*));
+        if (newSessions != NULL) {
+            memset((void*)(newSessions + numSessionSlots), 0, (newNumSlots - numSessionSlots) * sizeof(SrSession*));
+            sessions = newSessions;
+            numSessionSlots = newNumSlots;
+        }
+    }
+    if (session->map == MAP_FAILED || session->epollFd < 0 || (size_t)fd >= numSessionSlots) {
+        srFree(session);
+        return false;
+    }
+
+    SrControl* toServer = (SrControl*)session->map;
+    SrControl* toClient = toServer + 1;
+    char* toServerBytes = (char*)(toClient + 1);
+    char* toClientBytes = toServerBytes + SR_RING_BYTES;
+    session->in = isServer ? toServer : toClient;
+    session->out = isServer ? toClient : toServer;
+    session->inBytes = isServer ? toServerBytes : toClientBytes;
+    session->outBytes = isServer ? toClientBytes : toServerBytes;
+    // fds[1..2]: data and room of the ring to the server; fds[3..4]: of the one to the client.
+    session->inDataEvent = isServer ? fds[1] : fds[3];
+    session->inRoomEvent = isServer ? fds[2] : fds[4];
+    session->outDataEvent = isServer ? fds[3] : fds[1];
+    session->outRoomEvent = isServer ? fds[4] : fds[2];
+    session->inTail = atomic_load(&session->in->tail);
+    session->outHead = atomic_load(&session->out->head);
+
+    struct epoll_event event;
+    memset((void*)&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = session->inDataEvent;
+    bool ok = (epoll_ctl(session->epollFd, EPOLL_CTL_ADD, session->inDataEvent, &event) == 0);
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = fd;
+    ok = ok && (epoll_ctl(session->epollFd, EPOLL_CTL_ADD, fd, &event) == 0);
+    if (!ok) {
+        srFree(session);
+        return false;
+    }
+    srEnd(fd);
+    sessions[fd] = session;
+    return true;
+}
+
+/**
+ * Server side, once SR_REQUEST has been seen at
+ * the front of the socket: consumes it, and
+ * hands the client its rings. Returns false if
+ * they could not be made or handed over.
+ */
+bool srAccept(int fd) {
+    char request;
+    if (recv(fd, &request, 1, 0) != 1 || request != SR_REQUEST) return false;
+
+    int fds[SR_NUM_FDS];
+    fds[0] = memfd_create("tcpchat-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    for (size_t i = 1; i < SR_NUM_FDS; ++i) {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < SR_NUM_FDS; ++i) {
+        ok = ok && (fds[i] >= 0);
+    }
+    // Zero-filled, and of a size the client cannot change under the server's feet.
+    ok = ok && ftruncate(fds[0], SR_MAP_BYTES) == 0
+        && fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0;
+
+    if (ok) {
+        char reply = SR_REQUEST;
+        struct iovec iov = { &reply, 1 };
+        union {
+            char buffer[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr align;
+        } control;
+        memset((void*)&control, 0, sizeof(control));
+        struct msghdr msg;
+        memset((void*)&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy((void*)CMSG_DATA(cmsg), (void const*)fds, sizeof(fds));
+        ok = (sendmsg(fd, &msg, MSG_NOSIGNAL) == 1);
+    }
+    if (!ok) {
+        for (size_t i = 0; i < SR_NUM_FDS; ++i) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
+        return false;
+    }
+    return srAttach(fd, fds, true);
+}
+
+/**
+ * Client side, right after connecting to the
+ * server's Unix socket: asks for the rings and
+ * waits for them. Returns false if the server
+ * would not give any.
+ */
+bool srConnect(int fd) {
+    char request = SR_REQUEST;
+    if (send(fd, &request, 1, MSG_NOSIGNAL) != 1) return false;
+
+    char reply;
+    struct iovec iov = { &reply, 1 };
+    union {
+        char buffer[CMSG_SPACE(SR_NUM_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset((void*)&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) return false;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return false;
+    size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[SR_NUM_FDS];
+    memcpy((void*)fds, (void const*)CMSG_DATA(cmsg), ((numFds < SR_NUM_FDS) ? numFds : SR_NUM_FDS) * sizeof(int));
+    struct stat st;
+    if (numFds != SR_NUM_FDS || reply != SR_REQUEST || fstat(fds[0], &st) != 0 || (size_t)st.st_size != SR_MAP_BYTES) {
+        int* received = (int*)CMSG_DATA(cmsg);
+        for (size_t i = 0; i < numFds; ++i) close(received[i]);
+        return false;
+    }
+    return srAttach(fd, fds, false);
+}
+
+bool srAttached(int fd) {
+    return srSession(fd) != NULL;
+}
+
+/**
+ * What to poll for input on the socket: the one
+ * fd that wakes up for data in the rings or a
+ * hangup, if it has rings.
+ */
+int srPollFd(int fd) {
+    SrSession* session = srSession(fd);
+    return (session != NULL) ? session->epollFd : fd;
+}
+
+/** Tells the peer, and frees the rings. Call before closing the socket. */
+void srEnd(int fd) {
+    SrSession* session = srSession(fd);
+    if (session == NULL) return;
+    atomic_store(&session->out->closed, 1);
+    srRing(session->outDataEvent);
+    srFree(session);
+    sessions[fd] = NULL;
+}
+
+static bool srPeerIsGone(int fd) {
+    char byte;
+    return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/** Like send() on a non-blocking socket: EAGAIN when the ring is full. */
+ssize_t srSend(int fd, void const* bytes, size_t numBytes) {
+    SrSession* session = srSession(fd);
+    uint64_t numBytesUsed = session->outHead - atomic_load(&session->out->tail);
+    if (numBytesUsed > SR_RING_BYTES) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (atomic_load(&session->in->closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+    size_t room = SR_RING_BYTES - numBytesUsed;
+    if (room == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t n = (numBytes < room) ? numBytes : room;
+    size_t offset = session->outHead & (SR_RING_BYTES - 1);
+    size_t first = (n < SR_RING_BYTES - offset) ? n : SR_RING_BYTES - offset;
+    memcpy((void*)(session->outBytes + offset), bytes, first);
+    memcpy((void*)session->outBytes, (char const*)bytes + first, n - first);
+
+    uint64_t oldHead = session->outHead;
+    session->outHead += n;
+    atomic_store(&session->out->head, session->outHead);
+    // The reader may be asleep only if it had read everything.
+    if (atomic_load(&session->out->tail) == oldHead) srRing(session->outDataEvent);
+    return (ssize_t)n;
+}
+
+/** Like recv() on a non-blocking socket. */
+ssize_t srRecv(int fd, void* bytes, size_t numBytes) {
+    SrSession* session = srSession(fd);
+    bool closed = atomic_load(&session->in->closed);
+    uint64_t numBytesAvailable = atomic_load(&session->in->head) - session->inTail;
+    if (numBytesAvailable == 0) {
+        if (closed || srPeerIsGone(fd)) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (numBytesAvailable > SR_RING_BYTES) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    size_t n = (numBytes < numBytesAvailable) ? numBytes : numBytesAvailable;
+    size_t offset = session->inTail & (SR_RING_BYTES - 1);
+    size_t first = (n < SR_RING_BYTES - offset) ? n : SR_RING_BYTES - offset;
+    memcpy(bytes, (void const*)(session->inBytes + offset), first);
+    memcpy((char*)bytes + first, (void const*)session->inBytes, n - first);
+
+    session->inTail += n;
+    atomic_store(&session->in->tail, session->inTail);
+    if (atomic_load(&session->in->writerWaiting)) srRing(session->inRoomEvent);
+    if (n == numBytesAvailable) {
+        // Only now may the doorbell be reset: the
+        // writer rings it again when it next writes,
+        // unless it has written in the meantime.
+        srQuiet(session->inDataEvent);
+        if (atomic_load(&session->in->head) != session->inTail) srRing(session->inDataEvent);
+    }
+    return (ssize_t)n;
+}
+
+/**
+ * Waits for the ring to the peer to have room,
+ * for up to `timeoutMs`. Returns false if it
+ * still has none, or if the peer is gone.
+ */
+bool srWaitWritable(int fd, int timeoutMs) {
+    SrSession* session = srSession(fd);
+    atomic_store(&session->out->writerWaiting, 1);
+    if (session->outHead - atomic_load(&session->out->tail) >= SR_RING_BYTES) {
+        struct pollfd pfds[2] = {
+            { session->outRoomEvent, POLLIN, 0 },
+            { fd, POLLRDHUP, 0 }
+        };
+        poll(pfds, 2, timeoutMs);
+    }
+    srQuiet(session->outRoomEvent);
+    atomic_store(&session->out->writerWaiting, 0);
+    return session->outHead - atomic_load(&session->out->tail) < SR_RING_BYTES && !srPeerIsGone(fd);
+}
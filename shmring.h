@@ -0,0 +1,45 @@
+#ifndef ShmRing_INCLUDED
+#define ShmRing_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * A transport for clients on the same host as
+ * the server: two byte rings in shared memory
+ * (a memfd), one each way, that carry the very
+ * same frames a socket would, without a system
+ * call per send or receive.
+ *
+ * A client connected to the server's Unix
+ * socket asks for the rings by sending
+ * SR_REQUEST before anything else. The server
+ * answers with a byte of its own, along with
+ * the memfd and the eventfds (SCM_RIGHTS). From
+ * there on, nothing goes through the socket: it
+ * is only kept open so that either side learns
+ * at once when the other one is gone.
+ *
+ * The writer of a ring rings the reader's
+ * eventfd only when the ring was empty, and the
+ * reader rings the writer's only when the
+ * writer waits for room, so a steady stream of
+ * frames costs no system call at all.
+ *
+ * srSend() and srRecv() only work on a socket
+ * that has rings; see srAttached().
+ */
+#define SR_REQUEST 'S'
+
+bool srAccept(int fd);
+bool srConnect(int fd);
+bool srAttached(int fd);
+int srPollFd(int fd);
+void srEnd(int fd);
+
+ssize_t srSend(int fd, void const* bytes, size_t numBytes);
+ssize_t srRecv(int fd, void* bytes, size_t numBytes);
+bool srWaitWritable(int fd, int timeoutMs);
+
+#endif // ShmRing_INCLUDED
@@ -0,0 +1,146 @@
+/**
+ * The vector kernels go through the bulk of the
+ * text with unaligned loads, then leave the last
+ * few characters to the scalar code. Both kinds
+ * of kernels are compiled in; the AVX2 ones with
+ * a target attribute, so that no compiler flag
+ * is needed, and they are only picked at run
+ * time if the CPU supports them.
+ */
+
+#include "textscan.h"
+#include <stdint.h>
+
+_Static_assert(sizeof(wchar_t) == 4, "the wire format is 4 bytes per character");
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TS_X86
+#include <immintrin.h>
+#endif
+
+#define TS_MAX_CODE_POINT 0x10FFFF
+#define TS_SURROGATE_MASK 0xFFFFF800 // the surrogates are D800..DFFF
+#define TS_SURROGATE 0xD800
+
+static wchar_t const* tsFindCharScalar(wchar_t const* s, size_t n, wchar_t c) {
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] == c) return s + i;
+    }
+    return NULL;
+}
+
+static bool tsIsValidTextScalar(wchar_t const* s, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t c = (uint32_t)s[i];
+        if (c == 0 || c > TS_MAX_CODE_POINT || (c & TS_SURROGATE_MASK) == TS_SURROGATE) return false;
+    }
+    return true;
+}
+
+#ifdef TS_X86
+
+static wchar_t const* tsFindCharSse2(wchar_t const* s, size_t n, wchar_t c) {
+    __m128i needle = _mm_set1_epi32(c);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i chars = _mm_loadu_si128((__m128i const*)(s + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(chars, needle)));
+        if (mask != 0) return s + i + __builtin_ctz(mask);
+    }
+    return tsFindCharScalar(s + i, n - i, c);
+}
+
+/**
+ * SSE2 only compares signed integers: "above
+ * U+10FFFF" is "negative or above U+10FFFF".
+ */
+static bool tsIsValidTextSse2(wchar_t const* s, size_t n) {
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const maxCodePoint = _mm_set1_epi32(TS_MAX_CODE_POINT);
+    __m128i const surrogateMask = _mm_set1_epi32((int)TS_SURROGATE_MASK);
+    __m128i const surrogate = _mm_set1_epi32(TS_SURROGATE);
+    __m128i invalid = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i chars = _mm_loadu_si128((__m128i const*)(s + i));
+        invalid = _mm_or_si128(invalid, _mm_cmpeq_epi32(chars, zero));
+        invalid = _mm_or_si128(invalid, _mm_cmpgt_epi32(chars, maxCodePoint));
+        invalid = _mm_or_si128(invalid, _mm_cmplt_epi32(chars, zero));
+        invalid = _mm_or_si128(invalid, _mm_cmpeq_epi32(_mm_and_si128(chars, surrogateMask), surrogate));
+    }
+    if (_mm_movemask_epi8(invalid) != 0) return false;
+    return tsIsValidTextScalar(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static wchar_t const* tsFindCharAvx2(wchar_t const* s, size_t n, wchar_t c) {
+    __m256i needle = _mm256_set1_epi32(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((__m256i const*)(s + i)), needle);
+        __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((__m256i const*)(s + i + 8)), needle);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(a)) | (_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8);
+        if (mask != 0) return s + i + __builtin_ctz(mask);
+    }
+    return tsFindCharSse2(s + i, n - i, c);
+}
+
+/**
+ * With AVX2, the unsigned comparison is a
+ * maximum: c is at most U+10FFFF if and only if
+ * max(c, U+10FFFF) is U+10FFFF.
+ */
+__attribute__((target("avx2")))
+static bool tsIsValidTextAvx2(wchar_t const* s, size_t n) {
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i const maxCodePoint = _mm256_set1_epi32(TS_MAX_CODE_POINT);
+    __m256i const surrogateMask = _mm256_set1_epi32((int)TS_SURROGATE_MASK);
+    __m256i const surrogate = _mm256_set1_epi32(TS_SURROGATE);
+    __m256i invalid = zero;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i chars = _mm256_loadu_si256((__m256i const*)(s + i));
+        invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi32(chars, zero));
+        invalid = _mm256_or_si256(invalid, _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(chars, maxCodePoint), maxCodePoint), _mm256_set1_epi32(-1)));
+        invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi32(_mm256_and_si256(chars, surrogateMask), surrogate));
+    }
+    if (!_mm256_testz_si256(invalid, invalid)) return false;
+    return tsIsValidTextSse2(s + i, n - i);
+}
+
+#endif // TS_X86
+
+typedef struct {
+    char const* name;
+    wchar_t const* (*findChar)(wchar_t const* s, size_t n, wchar_t c);
+    bool (*isValidText)(wchar_t const* s, size_t n);
+} TsKernels;
+
+static TsKernels const* tsKernels = NULL;
+
+static TsKernels const* tsSelectKernels() {
+    static TsKernels const scalar = { "scalar", tsFindCharScalar, tsIsValidTextScalar };
+#ifdef TS_X86
+    static TsKernels const sse2 = { "sse2", tsFindCharSse2, tsIsValidTextSse2 };
+    static TsKernels const avx2 = { "avx2", tsFindCharAvx2, tsIsValidTextAvx2 };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2;
+    if (__builtin_cpu_supports("sse2")) return &sse2;
+#endif
+    return &scalar;
+}
+
+wchar_t const* tsFindChar(wchar_t const* s, size_t n, wchar_t c) {
+    if (tsKernels == NULL) tsKernels = tsSelectKernels();
+    return tsKernels->findChar(s, n, c);
+}
+
+bool tsIsValidText(wchar_t const* s, size_t n) {
+    if (tsKernels == NULL) tsKernels = tsSelectKernels();
+    return tsKernels->isValidText(s, n);
+}
+
+char const* tsKernelName() {
+    if (tsKernels == NULL) tsKernels = tsSelectKernels();
+    return tsKernels->name;
+}
@@ -0,0 +1,28 @@
+#ifndef TextScan_INCLUDED
+#define TextScan_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <wchar.h>
+
+/**
+ * Scanning of received text, a whole vector of
+ * characters at a time: SSE2 or AVX2, whichever
+ * the CPU running the program has, or one
+ * character at a time elsewhere.
+ */
+
+/** Like wmemchr(). */
+wchar_t const* tsFindChar(wchar_t const* s, size_t n, wchar_t c);
+
+/**
+ * Whether each of the n characters is a Unicode
+ * scalar value other than L'\0', i.e. is not a
+ * surrogate and is at most U+10FFFF.
+ */
+bool tsIsValidText(wchar_t const* s, size_t n);
+
+/** "avx2", "sse2" or "scalar". */
+char const* tsKernelName();
+
+#endif // TextScan_INCLUDED
@@ -0,0 +1,154 @@
+/**
+ * Wheel L (0 being the finest) is indexed by
+ * bits [6L, 6L + 6) of the expiry tick. A timer
+ * is put in the lowest wheel L such that its
+ * expiry and the current tick agree on all the
+ * bits above that range; its slot is then always
+ * ahead of the wheel's current slot. Whenever
+ * the bits below 6L of the current tick wrap to
+ * 0, the current slot of wheel L is emptied and
+ * its timers put back, now in a lower wheel.
+ */
+
+#include "timerwheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+// Keeps the top wheel from wrapping around.
+#define TW_MAX_TICKS_AHEAD ((uint64_t)TW_MASK << (TW_SLOT_BITS * (TW_LEVELS - 1)))
+
+void twInit(TimerWheel* wheel, double tickSeconds, double now) {
+    for (size_t level = 0; level < TW_LEVELS; ++level) {
+        for (size_t slot = 0; slot < TW_SLOTS; ++slot) {
+            wheel->slots[level][slot] = NULL;
+        }
+    }
+    wheel->now = 0;
+    wheel->origin = now;
+    wheel->tickSeconds = tickSeconds;
+    wheel->numTimers = 0;
+}
+
+void twTimerInit(TwTimer* timer) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expiry = 0;
+}
+
+bool twIsStarted(TwTimer const* timer) {
+    return timer->pprev != NULL;
+}
+
+static void twLink(TwTimer** head, TwTimer* timer) {
+    timer->next = *head;
+    if (*head != NULL) (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void twUnlink(TwTimer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/** `timer->expiry` must not be before the current tick. */
+static void twPlace(TimerWheel* wheel, TwTimer* timer) {
+    size_t level = 0;
+    while (level < TW_LEVELS - 1
+        && (timer->expiry >> (TW_SLOT_BITS * (level + 1))) != (wheel->now >> (TW_SLOT_BITS * (level + 1)))
+    ) {
+        ++level;
+    }
+    size_t slot = (timer->expiry >> (TW_SLOT_BITS * level)) & TW_MASK;
+    twLink(&wheel->slots[level][slot], timer);
+}
+
+/**
+ * Starts the timer, or restarts it if it is
+ * already started, to expire at the given time
+ * (in the same clock as twExpire()'s).
+ */
+void twStart(TimerWheel* wheel, TwTimer* timer, double expiresAt) {
+    if (twIsStarted(timer)) twCancel(wheel, timer);
+
+    // The first tick that begins at or after expiresAt, but not before the next one.
+    double ticks = (expiresAt - wheel->origin) / wheel->tickSeconds;
+    uint64_t expiry = wheel->now + 1;
+    if (ticks > (double)(wheel->now + TW_MAX_TICKS_AHEAD)) {
+        expiry = wheel->now + TW_MAX_TICKS_AHEAD;
+    } else if (ticks > (double)expiry) {
+        expiry = (uint64_t)ticks;
+        if ((double)expiry < ticks) ++expiry;
+    }
+    timer->expiry = expiry;
+    twPlace(wheel, timer);
+    ++wheel->numTimers;
+}
+
+void twCancel(TimerWheel* wheel, TwTimer* timer) {
+    if (!twIsStarted(timer)) return;
+    twUnlink(timer);
+    --wheel->numTimers;
+}
+
+static void twCascade(TimerWheel* wheel, size_t level) {
+    size_t slot = (wheel->now >> (TW_SLOT_BITS * level)) & TW_MASK;
+    TwTimer* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (timer != NULL) {
+        TwTimer* next = timer->next;
+        twPlace(wheel, timer);
+        timer = next;
+    }
+}
+
+TwTimer* twExpire(TimerWheel* wheel, double now) {
+    if (now < wheel->origin) return NULL;
+    uint64_t target = (uint64_t)((now - wheel->origin) / wheel->tickSeconds);
+
+    TwTimer* expired = NULL;
+    while (wheel->now < target) {
+        if (wheel->numTimers == 0) {
+            wheel->now = target;
+            break;
+        }
+        ++wheel->now;
+        for (size_t level = 1; level < TW_LEVELS; ++level) {
+            if ((wheel->now & (((uint64_t)1 << (TW_SLOT_BITS * level)) - 1)) != 0) break;
+            twCascade(wheel, level);
+        }
+
+        TwTimer** slot = &wheel->slots[0][wheel->now & TW_MASK];
+        while (*slot != NULL) {
+            TwTimer* timer = *slot;
+            twUnlink(timer);
+            --wheel->numTimers;
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+    return expired;
+}
+
+/**
+ * How long poll() may sleep before twExpire()
+ * has something to do, or -1 if no timer is
+ * started. Timers in the upper wheels are only
+ * looked at when they move down, so this may be
+ * earlier than the next expiry.
+ */
+double twSecondsUntilNext(TimerWheel const* wheel, double now) {
+    if (wheel->numTimers == 0) return -1;
+
+    uint64_t next = ((wheel->now >> TW_SLOT_BITS) + 1) << TW_SLOT_BITS;
+    for (uint64_t tick = wheel->now + 1; tick < next; ++tick) {
+        if (wheel->slots[0][tick & TW_MASK] != NULL) {
+            next = tick;
+            break;
+        }
+    }
+    double seconds = wheel->origin + (double)next * wheel->tickSeconds - now;
+    return (seconds > 0) ? seconds : 0;
+}
@@ -0,0 +1,63 @@
+#ifndef TimerWheel_INCLUDED
+#define TimerWheel_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Hierarchical timer wheel: TW_LEVELS wheels of
+ * TW_SLOTS slots each, the slots of a wheel
+ * being as long as a whole turn of the wheel
+ * below it. A timer sits in the lowest wheel
+ * that can tell its tick apart from the current
+ * one, and moves down a wheel each time the
+ * wheel below it comes round to it.
+ *
+ * Timers are embedded in the structures they
+ * belong to (see twOwner()), and starting or
+ * cancelling one is O(1). A timer never fires
+ * before its time, but up to one tick after it;
+ * only one set further ahead than the wheels
+ * reach (TW_SLOTS^TW_LEVELS ticks) fires early,
+ * when they run out.
+ */
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1u << TW_SLOT_BITS)
+#define TW_LEVELS 4
+
+typedef struct _TwTimer {
+    struct _TwTimer* next;
+    struct _TwTimer** pprev; // NULL when not started
+    uint64_t expiry;         // in ticks
+} TwTimer;
+
+typedef struct {
+    TwTimer* slots[TW_LEVELS][TW_SLOTS];
+    uint64_t now; // current tick
+    double origin; // when tick 0 began
+    double tickSeconds;
+    size_t numTimers;
+} TimerWheel;
+
+/** The structure of type T whose FIELD is the given timer. */
+#define twOwner(timer, T, FIELD) ((T*)((char*)(timer) - offsetof(T, FIELD)))
+
+void twInit(TimerWheel* wheel, double tickSeconds, double now);
+void twTimerInit(TwTimer* timer);
+
+void twStart(TimerWheel* wheel, TwTimer* timer, double expiresAt);
+void twCancel(TimerWheel* wheel, TwTimer* timer);
+bool twIsStarted(TwTimer const* timer);
+
+/**
+ * Advances the wheel to `now` and returns the
+ * timers that have expired, stopped and chained
+ * through their `next` field, which has to be
+ * read before a timer is started again.
+ */
+TwTimer* twExpire(TimerWheel* wheel, double now);
+double twSecondsUntilNext(TimerWheel const* wheel, double now);
+
+#endif // TimerWheel_INCLUDED
@@ -0,0 +1,316 @@
+/**
+ * A file received is written under a name of
+ * its own in the downloads directory, made of
+ * the last part of the name the sender gave,
+ * and never over a file that is there already.
+ */
+
+#include "transfer.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TR_MAX_TRIES 100 // names tried for a file received, "NAME", "NAME.1", ...
+
+static char const trDigits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int trDigitValue(wchar_t c) {
+    if (c >= L'A' && c <= L'Z') return c - L'A';
+    if (c >= L'a' && c <= L'z') return c - L'a' + 26;
+    if (c >= L'0' && c <= L'9') return c - L'0' + 52;
+    if (c == L'+') return 62;
+    if (c == L'/') return 63;
+    return -1;
+}
+
+/** `n` bytes (a multiple of 3, unless the last ones) into 4 characters per 3. */
+static size_t trEncode(unsigned char const* bytes, size_t n, wchar_t* out) {
+    size_t length = 0;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t quantum = (uint32_t)bytes[i] << 16;
+        if (i + 1 < n) quantum |= (uint32_t)bytes[i + 1] << 8;
+        if (i + 2 < n) quantum |= bytes[i + 2];
+        out[length++] = trDigits[(quantum >> 18) & 63];
+        out[length++] = trDigits[(quantum >> 12) & 63];
+        out[length++] = (i + 1 < n) ? trDigits[(quantum >> 6) & 63] : L'=';
+        out[length++] = (i + 2 < n) ? trDigits[quantum & 63] : L'=';
+    }
+    return length;
+}
+
+/** One quantum of 4 characters; returns how many bytes it holds, or -1. */
+static int trDecodeQuantum(wchar_t const* quantum, bool isLast, unsigned char* bytes) {
+    int numPadding = (quantum[3] == L'=') + (quantum[2] == L'=' && quantum[3] == L'=');
+    if (numPadding > 0 && !isLast) return -1;
+    uint32_t value = 0;
+    for (int i = 0; i < 4 - numPadding; ++i) {
+        int digit = trDigitValue(quantum[i]);
+        if (digit < 0) return -1;
+        value |= (uint32_t)digit << (18 - 6 * i);
+    }
+    bytes[0] = (unsigned char)(value >> 16);
+    bytes[1] = (unsigned char)(value >> 8);
+    bytes[2] = (unsigned char)value;
+    return 3 - numPadding;
+}
+
+static bool trWriteAll(int fd, unsigned char const* bytes, size_t n) {
+    while (n > 0) {
+        ssize_t numWritten = write(fd, bytes, n);
+        if (numWritten < 0 && errno == EINTR) continue;
+        if (numWritten <= 0) return false;
+        bytes += numWritten;
+        n -= numWritten;
+    }
+    return true;
+}
+
+/////////////// SENDING ///////////////
+
+/** Returns NULL, or why the file can not be sent. */
+char const* trSendFile(TrOutgoing* out, char const* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return "can not be opened";
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return "is not a file";
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return "is empty";
+    }
+
+    char const* base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    size_t nameLength = mbstowcs(out->name, base, MAX_NAME_LENGTH);
+    if (nameLength == (size_t)-1) nameLength = 0;
+    out->name[nameLength] = L'\0';
+    for (size_t i = 0; i < nameLength; ++i) {
+        if (out->name[i] < L' ') out->name[i] = L'_'; // it travels as one line
+    }
+    out->kind = TRANSFER_FILE;
+    out->fd = fd;
+    out->text = NULL;
+    out->numBytes = (uint64_t)st.st_size;
+    out->length = (out->numBytes + 2) / 3 * 4;
+    out->sent = 0;
+    return NULL;
+}
+
+/** Takes the text over. */
+void trSendText(TrOutgoing* out, wchar_t* text) {
+    out->kind = TRANSFER_CHAT;
+    out->fd = -1;
+    out->text = text;
+    out->length = wcslen(text);
+    out->sent = 0;
+    out->numBytes = 0;
+    out->name[0] = L'\0';
+}
+
+/**
+ * The next piece to send, at most
+ * TRANSFER_CHUNK_LENGTH characters. Returns
+ * false if the file could not be read as far
+ * as announced.
+ */
+bool trNextPiece(TrOutgoing* out, wchar_t* piece, size_t* lengthPtr) {
+    if (out->kind == TRANSFER_CHAT) {
+        size_t length = out->length - out->sent;
+        if (length > TRANSFER_CHUNK_LENGTH) length = TRANSFER_CHUNK_LENGTH;
+        wmemcpy(piece, out->text + out->sent, length);
+        out->sent += length;
+        *lengthPtr = length;
+        return true;
+    }
+
+    unsigned char bytes[TR_FILE_BYTES_PER_PIECE];
+    uint64_t offset = out->sent / 4 * 3;
+    size_t numWanted = (out->numBytes - offset < TR_FILE_BYTES_PER_PIECE) ? (size_t)(out->numBytes - offset) : TR_FILE_BYTES_PER_PIECE;
+    size_t numRead = 0;
+    while (numRead < numWanted) {
+        ssize_t n = read(out->fd, bytes + numRead, numWanted - numRead);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false; // shrunk, or unreadable
+        numRead += n;
+    }
+    *lengthPtr = trEncode(bytes, numRead, piece);
+    out->sent += *lengthPtr;
+    return true;
+}
+
+void trEndOutgoing(TrOutgoing* out) {
+    if (out->kind == TRANSFER_FILE) close(out->fd);
+    free((void*)out->text);
+    out->text = NULL;
+    out->fd = -1;
+    out->kind = 0;
+}
+
+/////////////// RECEIVING ///////////////
+
+/**
+ * The last part of the name, without what could
+ * make it a hidden file or break a line.
+ */
+static void trSafeName(wchar_t const* name, wchar_t* safe) {
+    wchar_t const* base = wcsrchr(name, L'/');
+    base = (base != NULL) ? base + 1 : name;
+    while (*base == L'.') ++base;
+    size_t length = 0;
+    for (; *base != L'\0' && length < MAX_NAME_LENGTH - 8; ++base) {
+        safe[length++] = (*base < L' ' || *base == L'\\' || *base == 0x7F) ? L'_' : *base;
+    }
+    if (length == 0) {
+        wcscpy(safe, L"file");
+        return;
+    }
+    safe[length] = L'\0';
+}
+
+/** Creates the file in `directory`, under a name nothing has yet. */
+static bool trCreateFile(TrIncoming* in, char const* directory) {
+    wchar_t safe[MAX_NAME_LENGTH + 1];
+    trSafeName(in->name, safe);
+    char safeBytes[MAX_NAME_LENGTH * MB_LEN_MAX + 1];
+    if (wcstombs(safeBytes, safe, sizeof(safeBytes)) == (size_t)-1) {
+        strcpy(safeBytes, "file");
+        wcscpy(safe, L"file");
+    }
+
+    size_t pathCapacity = strlen(directory) + strlen(safeBytes) + 16;
+    in->path = (char*)malloc(pathCapacity);
+    if (in->path == NULL) return false;
+    for (int i = 0; i < TR_MAX_TRIES; ++i) {
+        if (i == 0) {
+            snprintf(in->path, pathCapacity, "%s/%s", directory, safeBytes);
+            swprintf(in->savedAs, MAX_NAME_LENGTH + 1, L"%ls", safe);
+        } else {
+            snprintf(in->path, pathCapacity, "%s/%s.%d", directory, safeBytes, i);
+            swprintf(in->savedAs, MAX_NAME_LENGTH + 1, L"%ls.%d", safe, i);
+        }
+        in->fd = open(in->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (in->fd >= 0) return true;
+        if (errno != EEXIST) break;
+    }
+    free((void*)in->path);
+    in->path = NULL;
+    in->savedAs[0] = L'\0';
+    return false;
+}
+
+/**
+ * A file is only written if `directory` is
+ * given. Returns false if the file could not be
+ * created there, or if the message is longer
+ * than any should be.
+ */
+bool trStartIncoming(TrIncoming* in, SenderId senderId, SenderIdentity const* sender, wchar_t kind, uint64_t length, wchar_t const* name, char const* directory) {
+    in->senderId = senderId;
+    in->sender = *sender;
+    in->kind = kind;
+    in->length = length;
+    in->received = 0;
+    in->failed = false;
+    wcsncpy(in->name, name, MAX_NAME_LENGTH);
+    in->name[MAX_NAME_LENGTH] = L'\0';
+    in->savedAs[0] = L'\0';
+    in->fd = -1;
+    in->path = NULL;
+    in->numBytes = 0;
+    in->numCarried = 0;
+    in->text = NULL;
+
+    if (kind == TRANSFER_CHAT) {
+        in->failed = (length > MAX_LONG_MESSAGE_LENGTH);
+    } else if (kind != TRANSFER_FILE) {
+        in->failed = true;
+    } else if (directory != NULL) {
+        in->failed = !trCreateFile(in, directory);
+    }
+    return !in->failed;
+}
+
+/**
+ * Returns false if the piece could not be
+ * taken: more than announced, not base64, or
+ * not written. The transfer has then failed.
+ */
+bool trTakePiece(TrIncoming* in, wchar_t const* data, size_t length) {
+    if (length > in->length - in->received) {
+        in->received = in->length;
+        in->failed = true;
+        return false;
+    }
+    in->received += length; // counted even once failed, to know when it ends
+    if (in->failed) return false;
+
+    if (in->kind == TRANSFER_CHAT) {
+        // Grown as it comes: it may never come whole.
+        wchar_t* text = (wchar_t*)realloc((void*)in->text, (in->received + 1) * sizeof(wchar_t));
+        if (text == NULL) {
+            in->failed = true;
+            return false;
+        }
+        in->text = text;
+        wmemcpy(in->text + in->received - length, data, length);
+        in->text[in->received] = L'\0';
+        return true;
+    }
+    if (in->fd < 0) return true; // not kept
+
+    unsigned char bytes[TR_FILE_BYTES_PER_PIECE + 3];
+    size_t numBytes = 0;
+    for (size_t i = 0; i < length; ++i) {
+        in->carry[in->numCarried++] = data[i];
+        if (in->numCarried < 4) continue;
+        in->numCarried = 0;
+        bool isLast = (in->received == in->length && i == length - 1);
+        int n = trDecodeQuantum(in->carry, isLast, bytes + numBytes);
+        if (n < 0) {
+            in->failed = true;
+            return false;
+        }
+        numBytes += n;
+        if (numBytes > TR_FILE_BYTES_PER_PIECE) {
+            if (!trWriteAll(in->fd, bytes, numBytes)) {
+                in->failed = true;
+                return false;
+            }
+            in->numBytes += numBytes;
+            numBytes = 0;
+        }
+    }
+    if (numBytes > 0 && !trWriteAll(in->fd, bytes, numBytes)) {
+        in->failed = true;
+        return false;
+    }
+    in->numBytes += numBytes;
+    if (in->received == in->length && in->numCarried != 0) {
+        in->failed = true; // cut in the middle of a quantum
+        return false;
+    }
+    return true;
+}
+
+bool trIncomingDone(TrIncoming const* in) {
+    return !in->failed && in->received == in->length;
+}
+
+/** A file that was not received whole is removed, unless kept. */
+void trEndIncoming(TrIncoming* in, bool keep) {
+    if (in->fd >= 0) {
+        close(in->fd);
+        if (!keep) unlink(in->path);
+    }
+    in->fd = -1;
+    free((void*)in->path);
+    in->path = NULL;
+    free((void*)in->text);
+    in->text = NULL;
+}
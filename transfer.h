@@ -0,0 +1,62 @@
+#ifndef Transfer_INCLUDED
+#define Transfer_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "protocol.h"
+
+/**
+ * Long chat messages and files, sent and
+ * received in pieces (H, C and Z frames): what
+ * is sent is read one piece at a time, as the
+ * connection takes it, and what is received is
+ * written out as it comes, so that a file is
+ * never held in memory whole.
+ *
+ * Files travel in base64, 3 bytes in 4
+ * characters, so that they are text like
+ * everything else.
+ */
+#define TR_FILE_BYTES_PER_PIECE (TRANSFER_CHUNK_LENGTH / 4 * 3)
+
+typedef struct {
+    wchar_t kind;    // 0: nothing is being sent
+    int fd;          // TRANSFER_FILE: the file
+    wchar_t* text;   // TRANSFER_CHAT: the message
+    uint64_t length; // characters, in all
+    uint64_t sent;
+    uint64_t numBytes; // of the file
+    wchar_t name[MAX_NAME_LENGTH + 1]; // the file's, without its directory
+} TrOutgoing;
+
+char const* trSendFile(TrOutgoing* out, char const* path);
+void trSendText(TrOutgoing* out, wchar_t* text);
+bool trNextPiece(TrOutgoing* out, wchar_t* piece, size_t* lengthPtr);
+void trEndOutgoing(TrOutgoing* out);
+
+typedef struct {
+    SenderId senderId;
+    SenderIdentity sender; // as it was when the transfer started
+    wchar_t kind;
+    uint64_t length;   // characters, in all
+    uint64_t received;
+    bool failed;       // the rest is ignored
+    wchar_t name[MAX_NAME_LENGTH + 1];    // as the sender gave it
+    wchar_t savedAs[MAX_NAME_LENGTH + 1]; // in the downloads directory; empty if not kept
+    int fd;            // TRANSFER_FILE: being written, or -1
+    char* path;
+    uint64_t numBytes; // written
+    wchar_t carry[4];  // base64 not decoded yet, short of a quantum
+    size_t numCarried;
+    wchar_t* text;     // TRANSFER_CHAT: the message so far
+} TrIncoming;
+
+bool trStartIncoming(TrIncoming* in, SenderId senderId, SenderIdentity const* sender, wchar_t kind, uint64_t length, wchar_t const* name, char const* directory);
+bool trTakePiece(TrIncoming* in, wchar_t const* data, size_t length);
+bool trIncomingDone(TrIncoming const* in);
+void trEndIncoming(TrIncoming* in, bool keep);
+
+#endif // Transfer_INCLUDED
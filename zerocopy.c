@@ -0,0 +1,128 @@
+/**
+ * The bytes are copied into the first pipe with
+ * write(), into pages of the pipe's own, rather
+ * than mapped in with vmsplice(): a socket holds
+ * on to the pages it was handed until they have
+ * been acknowledged, while the caller's buffer
+ * is reused at once.
+ */
+
+#define _GNU_SOURCE // tee(), splice(), pipe2(), F_SETPIPE_SZ
+#include "zerocopy.h"
+#include "ktls.h"
+#include "shmring.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+static bool zcOpenPipe(int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        fds[0] = fds[1] = -1;
+        return false;
+    }
+    if (fcntl(fds[0], F_GETPIPE_SZ) < ZC_MAX_BYTES && fcntl(fds[0], F_SETPIPE_SZ, ZC_MAX_BYTES) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+        return false;
+    }
+    return true;
+}
+
+static void zcClosePipe(int fds[2]) {
+    if (fds[0] >= 0) close(fds[0]);
+    if (fds[1] >= 0) close(fds[1]);
+    fds[0] = fds[1] = -1;
+}
+
+/** Throws away what is in the pipe, or else opens a new one. */
+static void zcEmptyPipe(ZcFanout* fanout, int fds[2]) {
+    for (;;) {
+        ssize_t n = splice(fds[0], NULL, fanout->devNull, NULL, ZC_MAX_BYTES, SPLICE_F_NONBLOCK);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || errno == EAGAIN) return;
+        break;
+    }
+    zcClosePipe(fds);
+    zcOpenPipe(fds);
+}
+
+bool zcInit(ZcFanout* fanout) {
+    fanout->loaded[0] = fanout->loaded[1] = -1;
+    fanout->sending[0] = fanout->sending[1] = -1;
+    fanout->numBytes = 0;
+    fanout->devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fanout->devNull < 0 || !zcOpenPipe(fanout->loaded) || !zcOpenPipe(fanout->sending)) {
+        zcDestroy(fanout);
+        return false;
+    }
+    return true;
+}
+
+void zcDestroy(ZcFanout* fanout) {
+    zcClosePipe(fanout->loaded);
+    zcClosePipe(fanout->sending);
+    if (fanout->devNull >= 0) close(fanout->devNull);
+    fanout->devNull = -1;
+}
+
+bool zcCanSend(int fd) {
+    return !srAttached(fd) && !ktInUserSpace(fd);
+}
+
+/** At most ZC_MAX_BYTES; they stay loaded until zcUnload(). */
+bool zcLoad(ZcFanout* fanout, void const* bytes, size_t numBytes) {
+    if (numBytes > ZC_MAX_BYTES || fanout->loaded[1] < 0) return false;
+    char const* pos = (char const*)bytes;
+    size_t numBytesLeft = numBytes;
+    while (numBytesLeft > 0) {
+        ssize_t numWritten = write(fanout->loaded[1], pos, numBytesLeft);
+        if (numWritten < 0 && errno == EINTR) continue;
+        if (numWritten <= 0) {
+            zcEmptyPipe(fanout, fanout->loaded);
+            return false;
+        }
+        pos += numWritten;
+        numBytesLeft -= numWritten;
+    }
+    fanout->numBytes = numBytes;
+    return true;
+}
+
+ZcStatus zcSend(ZcFanout* fanout, int fd, int timeoutMs) {
+    if (fanout->sending[1] < 0) return ZC_PIPE_FAILED;
+    ssize_t numTeed = tee(fanout->loaded[0], fanout->sending[1], fanout->numBytes, SPLICE_F_NONBLOCK);
+    if (numTeed != (ssize_t)fanout->numBytes) {
+        if (numTeed > 0) zcEmptyPipe(fanout, fanout->sending);
+        return ZC_PIPE_FAILED;
+    }
+
+    size_t numBytesLeft = fanout->numBytes;
+    while (numBytesLeft > 0) {
+        ssize_t numSpliced = splice(fanout->sending[0], NULL, fd, NULL, numBytesLeft, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (numSpliced > 0) {
+            numBytesLeft -= numSpliced;
+            continue;
+        }
+        if (numSpliced < 0 && errno == EINTR) continue;
+        if (numSpliced < 0 && errno == EAGAIN) {
+            // The socket is full; wait for it like a blocking send would.
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLOUT) == POLLOUT) continue;
+        }
+        break;
+    }
+    if (numBytesLeft == 0) return ZC_SENT;
+
+    // Nothing sent yet: the socket may just not take spliced pages.
+    bool untouched = (numBytesLeft == fanout->numBytes && errno == EINVAL);
+    zcEmptyPipe(fanout, fanout->sending);
+    return untouched ? ZC_PIPE_FAILED : ZC_SOCKET_FAILED;
+}
+
+void zcUnload(ZcFanout* fanout) {
+    if (fanout->numBytes > 0) zcEmptyPipe(fanout, fanout->loaded);
+    fanout->numBytes = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef ZeroCopy_INCLUDED
+#define ZeroCopy_INCLUDED
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/**
+ * Sends the same bytes to many sockets, copying
+ * them only once: into a pipe. For each socket,
+ * tee() duplicates the pipe's pages into a
+ * second pipe, and splice() hands those to the
+ * socket, which sends them from there.
+ *
+ * Only for the sockets the kernel writes to on
+ * its own; not for those with TLS in user space
+ * nor for shared memory rings (see zcCanSend()).
+ * zcSend() waits for a full socket like
+ * sendEncodedFrame() does.
+ */
+#define ZC_MAX_BYTES (64 * 1024) // loaded at once: what a pipe holds
+
+typedef struct {
+    int loaded[2];  // the bytes, kept for every socket
+    int sending[2]; // a copy of them, on its way to one socket
+    int devNull;    // where they go once sent to all
+    size_t numBytes;
+} ZcFanout;
+
+typedef enum {
+    ZC_SENT,
+    ZC_SOCKET_FAILED,
+    ZC_PIPE_FAILED // nothing was sent; send the bytes some other way
+} ZcStatus;
+
+bool zcInit(ZcFanout* fanout);
+void zcDestroy(ZcFanout* fanout);
+bool zcCanSend(int fd);
+bool zcLoad(ZcFanout* fanout, void const* bytes, size_t numBytes);
+ZcStatus zcSend(ZcFanout* fanout, int fd, int timeoutMs);
+void zcUnload(ZcFanout* fanout);
+
+#endif // ZeroCopy_INCLUDED